@@ -25,16 +25,488 @@
 #endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size);
+                      QEOffset offset, QEOffset size);
+
+/* Each change of the contents or styles of a buffer gives it a new
+ * generation number, unique across buffers, so that display caches
+ * can be validated by a single comparison.  0 is never used.
+ */
+static unsigned int eb_last_generation;
+
+static void eb_new_generation(EditBuffer *b)
+{
+    if (++eb_last_generation == 0)
+        eb_last_generation++;
+    b->generation = eb_last_generation;
+}
+
+/************************************************************/
+/* page data allocation */
+
+/* Page data is allocated from size classed pools: pages of at most
+ * MAX_PAGE_SIZE bytes use a MAX_PAGE_SIZE slot, so that insertions
+ * and deletions in a page never reallocate, and large pages at least
+ * 3/4 full use a MAX_LARGE_PAGE_SIZE slot.  Freed slots are kept in
+ * a free list for reuse, up to a limit.  Other sizes are allocated
+ * with the general allocator.
+ */
+typedef struct PagePool {
+    PagePoolStats st;
+    int flag;           /* PG_DATA_xxx flag of pages using this pool */
+    int max_free;       /* maximum number of free slots kept for reuse */
+    void *free_list;    /* linked through the first word of free slots */
+} PagePool;
+
+static PagePool page_pools[] = {
+    { { "small", MAX_PAGE_SIZE, 0, 0, 0, 0 }, PG_DATA_SMALL, 1024, NULL },
+    { { "large", MAX_LARGE_PAGE_SIZE, 0, 0, 0, 0 }, PG_DATA_LARGE, 64, NULL },
+};
+
+/* return the PG_DATA_xxx flag for page data of `size` bytes */
+static int page_data_class(int size)
+{
+    if (size <= MAX_PAGE_SIZE)
+        return PG_DATA_SMALL;
+    if (size >= MAX_LARGE_PAGE_SIZE / 4 * 3 && size <= MAX_LARGE_PAGE_SIZE)
+        return PG_DATA_LARGE;
+    return 0;
+}
+
+static PagePool *page_pool(int flags)
+{
+    if (flags & PG_DATA_SMALL)
+        return &page_pools[0];
+    if (flags & PG_DATA_LARGE)
+        return &page_pools[1];
+    return NULL;
+}
+
+/* allocate a block for `size` bytes of page data, store its
+ * PG_DATA_xxx flag in `*flag_ptr`.
+ */
+static u8 *page_data_alloc(int size, int *flag_ptr)
+{
+    int flag = page_data_class(size);
+    PagePool *pp = page_pool(flag);
+    void *data;
+
+    *flag_ptr = flag;
+    if (!pp)
+        return qe_malloc_bytes(size);
+
+    data = pp->free_list;
+    if (data) {
+        pp->free_list = *(void **)data;
+        pp->st.nb_free--;
+        pp->st.nb_reused++;
+    } else {
+        data = qe_malloc_bytes(pp->st.slot_size);
+        if (!data)
+            return NULL;
+        pp->st.nb_allocated++;
+    }
+    pp->st.nb_used++;
+    return data;
+}
+
+/* free page data allocated with page_data_alloc() */
+static void page_data_free(u8 *data, int flags)
+{
+    PagePool *pp = page_pool(flags);
+
+    if (flags & PG_READ_ONLY)
+        return;
+
+    if (pp) {
+        pp->st.nb_used--;
+        if (pp->st.nb_free < pp->max_free) {
+            *(void **)data = pp->free_list;
+            pp->free_list = data;
+            pp->st.nb_free++;
+            return;
+        }
+    }
+    qe_free(&data);
+}
+
+int eb_page_pool_stats(PagePoolStats *stats, int size)
+{
+    int i;
+
+    for (i = 0; i < size && i < countof(page_pools); i++) {
+        stats[i] = page_pools[i].st;
+    }
+    return countof(page_pools);
+}
+
+/************************************************************/
+/* page tree */
+
+/* Pages are stored in a treap: a binary search tree ordered by
+ * buffer offset where each node also carries a random priority
+ * kept in heap order.  This keeps the expected depth logarithmic
+ * without explicit balancing information.  Subtree totals for byte
+ * size, line / column and char counts are stored in each node.
+ * Line and char totals are computed lazily: PG_TREE_POS and
+ * PG_TREE_CHAR are cleared along the path to the root when a page
+ * is modified and recomputed on demand.
+ */
+
+static unsigned int page_random(void)
+{
+    /* xorshift32: priorities only need to be roughly uniform */
+    static unsigned int seed = 2463534242U;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* append position `lines`, `col` to position `*linep`, `*colp` */
+static inline void pos_append(QEOffset *linep, QEOffset *colp,
+                              QEOffset lines, QEOffset col)
+{
+    if (lines) {
+        *linep += lines;
+        *colp = col;
+    } else {
+        *colp += col;
+    }
+}
+
+/* recompute the totals of page `p` from its children */
+static void page_pull(Page *p)
+{
+    Page *l = p->left, *r = p->right;
+    QEOffset lines, col;
+
+    p->tree_size = p->size;
+    if (l)
+        p->tree_size += l->tree_size;
+    if (r)
+        p->tree_size += r->tree_size;
+
+    if ((p->flags & PG_VALID_POS)
+    &&  (!l || (l->flags & PG_TREE_POS))
+    &&  (!r || (r->flags & PG_TREE_POS))) {
+        lines = col = 0;
+        if (l)
+            pos_append(&lines, &col, l->tree_lines, l->tree_col);
+        pos_append(&lines, &col, p->nb_lines, p->col);
+        if (r)
+            pos_append(&lines, &col, r->tree_lines, r->tree_col);
+        p->tree_lines = lines;
+        p->tree_col = col;
+        p->flags |= PG_TREE_POS;
+    } else {
+        p->flags &= ~PG_TREE_POS;
+    }
+
+    if ((p->flags & PG_VALID_CHAR)
+    &&  (!l || (l->flags & PG_TREE_CHAR))
+    &&  (!r || (r->flags & PG_TREE_CHAR))) {
+        p->tree_chars = p->nb_chars;
+        if (l)
+            p->tree_chars += l->tree_chars;
+        if (r)
+            p->tree_chars += r->tree_chars;
+        p->flags |= PG_TREE_CHAR;
+    } else {
+        p->flags &= ~PG_TREE_CHAR;
+    }
+}
+
+/* recompute subtree totals from page `p` up to the root */
+static void page_update_totals(Page *p)
+{
+    for (; p != NULL; p = p->parent) {
+        page_pull(p);
+    }
+}
+
+/* clear cached line / char totals for page `p` and its ancestors */
+static void page_invalidate(EditBuffer *b, Page *p)
+{
+    if (b->pos_page == p)
+        b->pos_page = NULL;
+    p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    /* if a page has stale totals, so do all of its ancestors */
+    for (; p != NULL && (p->flags & (PG_TREE_POS | PG_TREE_CHAR)); p = p->parent) {
+        p->flags &= ~(PG_TREE_POS | PG_TREE_CHAR);
+    }
+}
+
+/* make sure line / column totals are valid for the subtree at `p` */
+static void page_validate_pos(EditBuffer *b, Page *p)
+{
+    if (p->flags & PG_TREE_POS)
+        return;
+    if (!(p->flags & PG_VALID_POS)) {
+        p->flags |= PG_VALID_POS;
+        b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
+                                      &p->nb_lines, &p->col);
+    }
+    if (p->left)
+        page_validate_pos(b, p->left);
+    if (p->right)
+        page_validate_pos(b, p->right);
+    page_pull(p);
+}
+
+/* make sure char totals are valid for the subtree at `p` */
+static void page_validate_chars(EditBuffer *b, Page *p)
+{
+    if (p->flags & PG_TREE_CHAR)
+        return;
+    if (!(p->flags & PG_VALID_CHAR)) {
+        p->flags |= PG_VALID_CHAR;
+        p->nb_chars = b->charset->get_chars_func(&b->charset_state,
+                                                 p->data, p->size);
+    }
+    if (p->left)
+        page_validate_chars(b, p->left);
+    if (p->right)
+        page_validate_chars(b, p->right);
+    page_pull(p);
+}
+
+Page *eb_first_page(EditBuffer *b)
+{
+    Page *p = b->page_root;
+
+    if (p) {
+        while (p->left)
+            p = p->left;
+    }
+    return p;
+}
+
+static Page *eb_last_page(EditBuffer *b)
+{
+    Page *p = b->page_root;
+
+    if (p) {
+        while (p->right)
+            p = p->right;
+    }
+    return p;
+}
+
+Page *eb_next_page(const Page *p)
+{
+    if (p->right) {
+        p = p->right;
+        while (p->left)
+            p = p->left;
+        return unconst(Page *)p;
+    }
+    while (p->parent && p->parent->right == p)
+        p = p->parent;
+    return p->parent;
+}
+
+static Page *eb_prev_page(const Page *p)
+{
+    if (p->left) {
+        p = p->left;
+        while (p->right)
+            p = p->right;
+        return unconst(Page *)p;
+    }
+    while (p->parent && p->parent->left == p)
+        p = p->parent;
+    return p->parent;
+}
+
+/* move page `x` above its parent, preserving the page order */
+static void page_rotate_up(EditBuffer *b, Page *x)
+{
+    Page *p = x->parent;
+    Page *g = p->parent;
+
+    if (p->left == x) {
+        p->left = x->right;
+        if (p->left)
+            p->left->parent = p;
+        x->right = p;
+    } else {
+        p->right = x->left;
+        if (p->right)
+            p->right->parent = p;
+        x->left = p;
+    }
+    p->parent = x;
+    x->parent = g;
+    if (!g)
+        b->page_root = x;
+    else
+    if (g->left == p)
+        g->left = x;
+    else
+        g->right = x;
+    page_pull(p);
+    page_pull(x);
+}
+
+/* link page `q` into the tree before page `next`, at the end if
+ * `next` is NULL.
+ */
+static void page_insert(EditBuffer *b, Page *next, Page *q)
+{
+    Page *p;
+
+    q->left = q->right = NULL;
+    q->prio = page_random();
+    if (!b->page_root) {
+        q->parent = NULL;
+        b->page_root = q;
+    } else
+    if (!next) {
+        p = eb_last_page(b);
+        p->right = q;
+        q->parent = p;
+    } else
+    if (!next->left) {
+        next->left = q;
+        q->parent = next;
+    } else {
+        for (p = next->left; p->right; p = p->right)
+            continue;
+        p->right = q;
+        q->parent = p;
+    }
+    b->nb_pages++;
+    page_update_totals(q);
+    while (q->parent && q->parent->prio < q->prio)
+        page_rotate_up(b, q);
+}
+
+/* append page `q` after `last`, the last page of the buffer, without
+ * updating subtree totals.  This builds large trees in linear time,
+ * page_pull_tree() must be called on the root afterwards.
+ */
+static void page_append(EditBuffer *b, Page *last, Page *q)
+{
+    Page *p, *c;
+
+    q->right = NULL;
+    q->prio = page_random();
+    /* climb the right spine to keep the heap order on priorities */
+    for (p = last, c = NULL; p && p->prio < q->prio; p = p->parent)
+        c = p;
+    q->left = c;
+    if (c)
+        c->parent = q;
+    q->parent = p;
+    if (p)
+        p->right = q;
+    else
+        b->page_root = q;
+    b->nb_pages++;
+}
+
+/* recompute the totals of all pages in subtree `p` */
+static void page_pull_tree(Page *p)
+{
+    if (p) {
+        page_pull_tree(p->left);
+        page_pull_tree(p->right);
+        page_pull(p);
+    }
+}
+
+/* unlink page `p` from the tree, free its data and the page itself */
+static void page_delete(EditBuffer *b, Page *p)
+{
+    Page *child, *parent;
+
+    /* rotate the page down until it has at most one child */
+    while (p->left && p->right) {
+        if (p->left->prio > p->right->prio)
+            page_rotate_up(b, p->left);
+        else
+            page_rotate_up(b, p->right);
+    }
+    child = p->left ? p->left : p->right;
+    parent = p->parent;
+    if (child)
+        child->parent = parent;
+    if (!parent)
+        b->page_root = child;
+    else
+    if (parent->left == p)
+        parent->left = child;
+    else
+        parent->right = child;
+    b->nb_pages--;
+    page_update_totals(parent);
+    if (b->pos_page == p)
+        b->pos_page = NULL;
+
+    /* we cannot free if read only */
+    page_data_free(p->data, p->flags);
+    qe_free(&p);
+}
+
+/* allocate a new page for `size` bytes at `data`: read only pages
+ * share the data, other pages get a copy.
+ */
+static Page *page_new(const u8 *data, int size, int flags)
+{
+    Page *p = qe_mallocz(Page);
+    int flag;
+
+    if (p) {
+        if (flags & PG_READ_ONLY) {
+            p->data = unconst(u8 *)data;
+        } else {
+            p->data = page_data_alloc(size, &flag);
+            if (!p->data) {
+                qe_free(&p);
+                return NULL;
+            }
+            memcpy(p->data, data, size);
+            flags |= flag;
+        }
+        p->size = size;
+        p->flags = flags;
+    }
+    return p;
+}
+
+/* reallocate the data of writable page `p` for `size` bytes, keeping
+ * its contents up to `size`.  Pool slots are kept as long as the size
+ * class does not change.
+ */
+static int page_resize(Page *p, int size)
+{
+    int flag = page_data_class(size);
+    u8 *data;
+
+    if (flag == (p->flags & PG_DATA_POOL)) {
+        if (!flag && !qe_realloc(&p->data, size))
+            return -1;
+        return 0;
+    }
+    data = page_data_alloc(size, &flag);
+    if (!data)
+        return -1;
+    memcpy(data, p->data, min(p->size, size));
+    page_data_free(p->data, p->flags);
+    p->data = data;
+    p->flags = (p->flags & ~PG_DATA_POOL) | flag;
+    return 0;
+}
 
 /************************************************************/
 /* basic access to the edit buffer */
 
 /* find a page at a given offset */
-static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
+static inline Page *find_page(EditBuffer *b, QEOffset offset, int *page_offset_ptr)
 {
-    Page *p = b->page_table;
-    int page_offset = offset;
+    Page *p;
+    QEOffset page_offset = offset;
 
     if (b->cur_page && offset >= b->cur_offset) {
         p = b->cur_page;
@@ -43,10 +515,30 @@ static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
             *page_offset_ptr = page_offset;
             return p;
         }
+        /* sequential access: try the next page */
+        page_offset -= p->size;
+        p = eb_next_page(p);
+        if (p && page_offset < p->size) {
+            *page_offset_ptr = page_offset;
+            b->cur_offset = offset - page_offset;
+            b->cur_page = p;
+            return p;
+        }
+        page_offset = offset;
     }
-    while (page_offset >= p->size) {
+    p = b->page_root;
+    for (;;) {
+        if (p->left) {
+            if (page_offset < p->left->tree_size) {
+                p = p->left;
+                continue;
+            }
+            page_offset -= p->left->tree_size;
+        }
+        if (page_offset < p->size || !p->right)
+            break;
         page_offset -= p->size;
-        p++;
+        p = p->right;
     }
     *page_offset_ptr = page_offset;
     b->cur_offset = offset - page_offset;
@@ -55,43 +547,123 @@ static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
 }
 
 /* prepare a page to be written */
-static void update_page(Page *p)
+static void update_page(EditBuffer *b, Page *p)
 {
     u8 *buf;
+    int flag;
 
     /* if the page is read only, copy it */
     if (p->flags & PG_READ_ONLY) {
-        buf = qe_malloc_dup(p->data, p->size);
+        buf = page_data_alloc(p->size, &flag);
         /* XXX: should return an error */
         if (!buf)
             return;
+        memcpy(buf, p->data, p->size);
         p->data = buf;
-        p->flags &= ~PG_READ_ONLY;
+        p->flags = (p->flags & ~PG_READ_ONLY) | flag;
     }
-    p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    page_invalidate(b, p);
+}
+
+/* Split a large page so that offset `*page_offset_ptr` in page `p`
+ * falls in a page of at most MAX_PAGE_SIZE bytes.  Return this page
+ * and update `*page_offset_ptr`.  Only the modified part of a bulk
+ * loaded region is moved to small pages, read only pages are split
+ * without copying.
+ */
+static Page *page_split(EditBuffer *b, Page *p, int *page_offset_ptr)
+{
+    int page_offset = *page_offset_ptr;
+    int start, len, tail;
+    Page *mid, *rest, *next;
+
+    if (p->size <= MAX_PAGE_SIZE)
+        return p;
+
+    start = page_offset - page_offset % MAX_PAGE_SIZE;
+    len = min(p->size - start, MAX_PAGE_SIZE);
+    tail = p->size - start - len;
+    mid = rest = NULL;
+    if (start > 0) {
+        mid = page_new(p->data + start, len, p->flags & PG_READ_ONLY);
+        if (!mid)
+            return p;  /* XXX: should return an error */
+    }
+    if (tail > 0) {
+        rest = page_new(p->data + start + len, tail, p->flags & PG_READ_ONLY);
+        if (!rest) {
+            if (mid) {
+                page_data_free(mid->data, mid->flags);
+                qe_free(&mid);
+            }
+            return p;  /* XXX: should return an error */
+        }
+    }
+    next = eb_next_page(p);
+    page_invalidate(b, p);
+    /* `p` keeps the data before `start`, or the small page itself */
+    if (!(p->flags & PG_READ_ONLY))
+        page_resize(p, start > 0 ? start : len);
+    p->size = start > 0 ? start : len;
+    page_update_totals(p);
+    if (rest) {
+        page_insert(b, next, rest);
+        next = rest;
+    }
+    if (mid) {
+        page_insert(b, next, mid);
+        p = mid;
+    }
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+    *page_offset_ptr = page_offset - start;
+    return p;
+}
+
+/* merge page `p` with the next page if they fit in a small page */
+static void page_merge_next(EditBuffer *b, Page *p)
+{
+    Page *next = eb_next_page(p);
+
+    if (!next || p->size + next->size > MAX_PAGE_SIZE)
+        return;
+
+    update_page(b, p);
+    if (p->flags & PG_READ_ONLY)
+        return;
+    if (page_resize(p, p->size + next->size))
+        return;
+    memcpy(p->data + p->size, next->data, next->size);
+    p->size += next->size;
+    page_update_totals(p);
+    page_delete(b, next);
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
 }
 
 /* Read one raw byte from the buffer:
  * We should have: 0 <= offset < b->total_size
  * Returns the byte or -1 upon failure.
  */
-int eb_read_one_byte(EditBuffer *b, int offset)
+int eb_read_one_byte(EditBuffer *b, QEOffset offset)
 {
     const Page *p;
+    int page_offset;
 
     /* We clip the request for safety */
     if (offset < 0 || offset >= b->total_size)
         return -1;
 
-    p = find_page(b, offset, &offset);
-    return p->data[offset];
+    p = find_page(b, offset, &page_offset);
+    return p->data[page_offset];
 }
 
 /* Read raw data from the buffer:
  * We should have: 0 <= offset < b->total_size, size >= 0
  */
-int eb_read(EditBuffer *b, int offset, void *buf, int size)
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size)
 {
+    int page_offset;
     int len, remain;
     const Page *p;
 
@@ -99,21 +671,20 @@ int eb_read(EditBuffer *b, int offset, void *buf, int size)
     if (offset < 0 || size <= 0 || offset >= b->total_size)
         return 0;
 
-    len = b->total_size - offset;
-    if (size > len)
-        size = len;
+    if (size > b->total_size - offset)
+        size = b->total_size - offset;
 
-    p = find_page(b, offset, &offset);
+    p = find_page(b, offset, &page_offset);
     for (remain = size;;) {
-        len = p->size - offset;
+        len = p->size - page_offset;
         if (len > remain)
             len = remain;
-        memcpy(buf, p->data + offset, len);
+        memcpy(buf, p->data + page_offset, len);
         if ((remain -= len) <= 0)
             break;
         buf = (u8*)buf + len;
-        p++;
-        offset = 0;
+        p = eb_next_page(p);
+        page_offset = 0;
     }
     return size;
 }
@@ -122,9 +693,10 @@ int eb_read(EditBuffer *b, int offset, void *buf, int size)
  * We should have 0 <= offset <= b->total_size, size >= 0.
  * Note: eb_write can be used to append data at the end of the buffer
  */
-int eb_write(EditBuffer *b, int offset, const void *buf, int size)
+int eb_write(EditBuffer *b, QEOffset offset, const void *buf, int size)
 {
-    int len, remain, write_size, page_offset;
+    int page_offset;
+    int len, remain, write_size;
     Page *p;
 
     if (b->flags & BF_READONLY)
@@ -135,24 +707,25 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
         return 0;
 
     write_size = size;
-    len = b->total_size - offset;
-    if (write_size > len)
-        write_size = len;
+    if (write_size > b->total_size - offset)
+        write_size = b->total_size - offset;
 
     if (write_size > 0) {
         eb_addlog(b, LOGOP_WRITE, offset, write_size);
 
         p = find_page(b, offset, &page_offset);
         for (remain = write_size;;) {
+            if (remain < p->size)
+                p = page_split(b, p, &page_offset);
             len = p->size - page_offset;
             if (len > remain)
                 len = remain;
-            update_page(p);
+            update_page(b, p);
             memcpy(p->data + page_offset, buf, len);
             buf = (const u8*)buf + len;
             if ((remain -= len) <= 0)
                 break;
-            p++;
+            p = eb_next_page(p);
             page_offset = 0;
         }
     }
@@ -162,129 +735,144 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
 }
 
 /* internal function for insertion : 'buf' of size 'size' at the
-   beginning of the page at page_index */
-static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
+   beginning of page 'p', or at the end of the buffer if 'p' is NULL */
+static void eb_insert1(EditBuffer *b, Page *p, const u8 *buf, int size)
 {
-    int len, n;
-    Page *p;
+    int len;
+    Page *q;
 
-    if (page_index < b->nb_pages) {
-        p = &b->page_table[page_index];
+    if (p) {
         len = MAX_PAGE_SIZE - p->size;
         if (len > size)
             len = size;
         if (len > 0) {
-            update_page(p);
-            /* CG: probably faster with qe_malloc + qe_free */
-            qe_realloc(&p->data, p->size + len);
+            update_page(b, p);
+            page_resize(p, p->size + len);
             memmove(p->data + len, p->data, p->size);
             memcpy(p->data, buf + size - len, len);
             size -= len;
             p->size += len;
+            page_update_totals(p);
         }
     }
 
-    /* now add new pages if necessary */
-    n = (size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
-    if (n > 0) {
-        b->nb_pages += n;
-        qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
-        p = &b->page_table[page_index];
-        blockmove(p + n, p, b->nb_pages - n - page_index);
-        while (size > 0) {
-            len = size;
-            if (len > MAX_PAGE_SIZE)
-                len = MAX_PAGE_SIZE;
-            p->size = len;
-            p->data = qe_malloc_dup(buf, len);
-            p->flags = 0;
-            buf += len;
-            size -= len;
-            p++;
-        }
+    /* now add new pages before 'p' if necessary */
+    while (size > 0) {
+        len = size;
+        if (len > MAX_LARGE_PAGE_SIZE)
+            len = MAX_LARGE_PAGE_SIZE;
+        q = page_new(buf, len, 0);
+        /* XXX: should return an error */
+        if (!q)
+            return;
+        page_insert(b, p, q);
+        buf += len;
+        size -= len;
     }
 }
 
 /* We must have : 0 <= offset <= b->total_size */
-static void eb_insert_lowlevel(EditBuffer *b, int offset,
+static void eb_insert_lowlevel(EditBuffer *b, QEOffset offset,
                                const u8 *buf, int size)
 {
-    int len, len_out, page_index;
-    Page *p;
+    int page_offset;
+    int len, len_out;
+    Page *p, *prev, *next;
 
     b->total_size += size;
 
     /* find the correct page */
-    p = b->page_table;
     if (offset > 0) {
-        offset--;
-        p = find_page(b, offset, &offset);
-        offset++;
+        p = find_page(b, offset - 1, &page_offset);
+        if (page_offset == p->size - 1 && size >= MAX_PAGE_SIZE) {
+            /* bulk insertion at the end of a page, typically when
+             * loading a file: grow it up to MAX_LARGE_PAGE_SIZE and
+             * store the rest in new large pages.
+             */
+            if (p->size < MAX_LARGE_PAGE_SIZE && !(p->flags & PG_READ_ONLY)) {
+                len = min(size, MAX_LARGE_PAGE_SIZE - p->size);
+                update_page(b, p);
+                page_resize(p, p->size + len);
+                memcpy(p->data + p->size, buf, len);
+                p->size += len;
+                page_update_totals(p);
+                buf += len;
+                size -= len;
+            }
+            next = eb_next_page(p);
+            goto insert_next;
+        }
+        p = page_split(b, p, &page_offset);
+        page_offset++;
     retry:
         /* compute what we can insert in current page */
-        len = MAX_PAGE_SIZE - offset;
+        len = MAX_PAGE_SIZE - page_offset;
         if (len > size)
             len = size;
         /* number of bytes to put in next pages */
         len_out = p->size + len - MAX_PAGE_SIZE;
-        page_index = p - b->page_table;
         if (len_out > 0) {
 #if 1
             /* First try and shift some of these bytes to the previous pages */
-            if (page_index > 0 && p[-1].size < MAX_PAGE_SIZE) {
+            prev = eb_prev_page(p);
+            if (prev && prev->size < MAX_PAGE_SIZE) {
                 int chunk;
-                update_page(p - 1);
-                update_page(p);
-                chunk = min(MAX_PAGE_SIZE - p[-1].size, offset);
-                qe_realloc(&p[-1].data, p[-1].size + chunk);
-                memcpy(p[-1].data + p[-1].size, p->data, chunk);
-                p[-1].size += chunk;
+                update_page(b, prev);
+                update_page(b, p);
+                chunk = min(MAX_PAGE_SIZE - prev->size, page_offset);
+                page_resize(prev, prev->size + chunk);
+                memcpy(prev->data + prev->size, p->data, chunk);
+                prev->size += chunk;
                 p->size -= chunk;
+                page_update_totals(prev);
                 if (p->size == 0) {
                     /* if page was completely fused with previous one */
-                    b->nb_pages -= 1;
-                    qe_free(&p->data);
-                    blockmove(p, p + 1, b->nb_pages - page_index);
-                    qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
-                    p = b->page_table + page_index - 1;
-                    offset = p->size;
+                    page_delete(b, p);
+                    p = prev;
+                    page_offset = p->size;
                     goto retry;
                 }
                 memmove(p->data, p->data + chunk, p->size);
-                qe_realloc(&p->data, p->size);
-                offset -= chunk;
-                if (offset == 0 && p[-1].size < MAX_PAGE_SIZE) {
+                page_resize(p, p->size);
+                page_update_totals(p);
+                page_offset -= chunk;
+                if (page_offset == 0 && prev->size < MAX_PAGE_SIZE) {
                     /* restart from previous page */
-                    p--;
-                    offset = p->size;
+                    p = prev;
+                    page_offset = p->size;
                 }
                 goto retry;
             }
 #endif
-            eb_insert1(b, page_index + 1,
+            /* move up to half of the page out so both pages have room
+             * for further insertions instead of creating a tiny page.
+             */
+            len_out = max(len_out, min(p->size - page_offset, p->size / 2));
+            eb_insert1(b, eb_next_page(p),
                        p->data + p->size - len_out, len_out);
         } else {
             len_out = 0;
         }
         /* now we can insert in current page */
         if (len > 0) {
-            /* reload p because page_table may have been reallocated */
-            p = b->page_table + page_index;
-            update_page(p);
+            update_page(b, p);
+            page_resize(p, p->size + len - len_out);
             p->size += len - len_out;
-            qe_realloc(&p->data, p->size);
-            memmove(p->data + offset + len,
-                    p->data + offset, p->size - (offset + len));
-            memcpy(p->data + offset, buf, len);
+            memmove(p->data + page_offset + len,
+                    p->data + page_offset, p->size - (page_offset + len));
+            memcpy(p->data + page_offset, buf, len);
+            page_update_totals(p);
             buf += len;
             size -= len;
         }
+        next = eb_next_page(p);
     } else {
-        page_index = -1;
+        next = eb_first_page(b);
     }
+ insert_next:
     /* insert the remaining data in the next pages */
     if (size > 0)
-        eb_insert1(b, page_index + 1, buf, size);
+        eb_insert1(b, next, buf, size);
 
     /* the page cache is no longer valid */
     b->cur_page = NULL;
@@ -294,12 +882,14 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Raw insertion performed, encoding is ignored.
  */
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size)
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size)
 {
     Page *p;
-    int len, size0;
+    QEOffset size0;
+    int page_offset;
+    int len;
 
     if (dest->flags & BF_READONLY)
         return 0;
@@ -320,122 +910,46 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
     size0 = size;
 
     eb_addlog(dest, LOGOP_INSERT, dest_offset, size);
-#if 1
-    /* Much simpler algorithm with fewer pathological cases */
-    p = find_page(src, src_offset, &src_offset);
+
+    p = find_page(src, src_offset, &page_offset);
     while (size > 0) {
-        len = p->size - src_offset;
+        len = p->size - page_offset;
         if (len > size)
             len = size;
-        if ((p->flags & PG_READ_ONLY) && src_offset == 0 && len == MAX_PAGE_SIZE) {
-            /* XXX: should share complete read-only pages.  This is
-             * actually a little tricky: the mapping may be removed
-             * upon buffer close. We need a ref count scheme to keep
-             * track of these pages.
-             * A brute force approach may prove best: upon unmapping a
-             * file, scan all buffers for shared pages and delay
-             * unmapping until these get freed.  We may keep a global
-             * and a buffer based count of shared pages and a list of
-             * mappings to accelerate this phase.
+        if ((p->flags & PG_READ_ONLY) && page_offset == 0 && len == p->size
+        &&  dest == src->log_buffer && dest_offset == dest->total_size) {
+            /* Share complete read-only pages appended to the undo log
+             * of the source buffer: the log buffer is freed before the
+             * mapping is removed, see eb_munmap_buffer().
+             * XXX: should share read-only pages with other buffers too.
+             * This is actually a little tricky: the mapping may be
+             * removed upon buffer close. We need a ref count scheme to
+             * keep track of these pages.
              */
+            Page *q = page_new(p->data, len, PG_READ_ONLY);
+            if (q) {
+                page_insert(dest, NULL, q);
+                dest->total_size += len;
+                dest->cur_page = NULL;
+                dest_offset += len;
+                p = eb_next_page(p);
+                size -= len;
+                continue;
+            }
         }
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
+        eb_insert_lowlevel(dest, dest_offset, p->data + page_offset, len);
         dest_offset += len;
-        src_offset = 0;
-        p++;
+        page_offset = 0;
+        p = eb_next_page(p);
         size -= len;
     }
     return size0;
-#else
-    Page *p_start, *q;
-    int n, page_index;
-
-    /* insert the data from the first page if it is not completely
-       selected */
-    p = find_page(src, src_offset, &src_offset);
-    if (src_offset > 0 /* || size <= p->size */ ) {
-        len = p->size - src_offset;
-        if (len > size)
-            len = size;
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
-        dest_offset += len;
-        size -= len;
-        p++;
-    }
-
-    if (size == 0)
-        return size0;
-
-    /* cut the page at dest offset if needed */
-    if (dest_offset < dest->total_size) {
-        q = find_page(dest, dest_offset, &dest_offset);
-        page_index = q - dest->page_table;
-        if (dest_offset > 0) {
-            page_index++;
-            eb_insert1(dest, page_index, q->data + dest_offset,
-                       q->size - dest_offset);
-            /* must reload q because page_table may have been
-               realloced */
-            q = dest->page_table + page_index - 1;
-            update_page(q);
-            qe_realloc(&q->data, dest_offset);
-            q->size = dest_offset;
-        }
-    } else {
-        page_index = dest->nb_pages;
-    }
-
-    /* update total_size */
-    dest->total_size += size;
-
-    /* compute the number of complete pages to insert */
-    p_start = p;
-    while (size > 0 && p->size <= size) {
-        size -= p->size;
-        p++;
-    }
-    n = p - p_start; /* number of pages to insert */
-    p = p_start;
-    if (n > 0) {
-        /* add the pages */
-        dest->nb_pages += n;
-        qe_realloc(&dest->page_table, dest->nb_pages * sizeof(Page));
-        q = dest->page_table + page_index;
-        blockmove(q + n, q, dest->nb_pages - n - page_index);
-        p = p_start;
-        while (n > 0) {
-            len = p->size;
-            q->size = len;
-            if (p->flags & PG_READ_ONLY) {
-                /* simply copy the reference */
-                q->flags = PG_READ_ONLY;
-                q->data = p->data;
-            } else {
-                /* allocate a new page */
-                q->flags = 0;
-                q->data = qe_malloc_dup(p->data, len);
-            }
-            n--;
-            p++;
-            q++;
-        }
-        page_index = q - dest->page_table;
-    }
-
-    /* insert the remaning bytes */
-    if (size > 0) {
-        eb_insert1(dest, page_index, p->data, size);
-    }
-    /* the page cache is no longer valid */
-    dest->cur_page = NULL;
-    return size0;
-#endif
 }
 
 /* Insert 'size' bytes from 'buf' into 'b' at offset 'offset'. We must
    have : 0 <= offset <= b->total_size */
 /* Return number of bytes inserted */
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size)
 {
     if (b->flags & BF_READONLY)
         return 0;
@@ -459,10 +973,12 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
 /* We must have : 0 <= offset <= b->total_size,
  * return actual number of bytes removed.
  */
-int eb_delete(EditBuffer *b, int offset, int size)
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size)
 {
-    int n, len, size0;
-    Page *del_start, *p;
+    QEOffset size0;
+    int page_offset;
+    int len;
+    Page *p, *prev, *next;
 
     if (b->flags & BF_READONLY)
         return 0;
@@ -481,49 +997,56 @@ int eb_delete(EditBuffer *b, int offset, int size)
     b->total_size -= size;
 
     /* find the correct page */
-    p = find_page(b, offset, &offset);
-    n = 0;
-    del_start = NULL;
+    p = find_page(b, offset, &page_offset);
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+
     while (size > 0) {
-        len = p->size - offset;
+        len = p->size - page_offset;
         if (len > size)
             len = size;
         if (len == p->size) {
-            if (!del_start)
-                del_start = p;
-            /* we cannot free if read only */
-            if (!(p->flags & PG_READ_ONLY))
-                qe_free(&p->data);
-            p++;
-            offset = 0;
-            n++;
+            next = eb_next_page(p);
+            page_delete(b, p);
+            p = next;
+            page_offset = 0;
         } else {
-            update_page(p);
-            memmove(p->data + offset, p->data + offset + len,
-                    p->size - offset - len);
+            if (p->size > MAX_PAGE_SIZE) {
+                p = page_split(b, p, &page_offset);
+                len = p->size - page_offset;
+                if (len > size)
+                    len = size;
+                if (len == p->size)
+                    continue;
+            }
+            update_page(b, p);
+            memmove(p->data + page_offset, p->data + page_offset + len,
+                    p->size - page_offset - len);
             p->size -= len;
-            qe_realloc(&p->data, p->size);
-            offset += len;
-            /* XXX: should merge with adjacent pages if size becomes small? */
-            if (offset >= p->size) {
-                p++;
-                offset = 0;
+            page_resize(p, p->size);
+            page_update_totals(p);
+            page_offset += len;
+            if (page_offset >= p->size) {
+                p = eb_next_page(p);
+                page_offset = 0;
             }
         }
         size -= len;
     }
 
-    /* now delete the requested pages */
-    if (n > 0) {
-        b->nb_pages -= n;
-        blockmove(del_start, del_start + n,
-                  b->page_table + b->nb_pages - del_start);
-        qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
+    /* merge small pages around the deleted range */
+    if (b->total_size > 0) {
+        p = find_page(b, offset > 0 ? offset - 1 : 0, &page_offset);
+        if (p->size < MAX_PAGE_SIZE) {
+            prev = eb_prev_page(p);
+            if (prev && prev->size + p->size <= MAX_PAGE_SIZE) {
+                page_merge_next(b, prev);
+                p = prev;
+            }
+            page_merge_next(b, p);
+        }
     }
 
-    /* the page cache is no longer valid */
-    b->cur_page = NULL;
-
     return size0;
 }
 
@@ -645,6 +1168,7 @@ void eb_free_log_buffer(EditBuffer *b)
     eb_free(&b->log_buffer);
     b->log_new_index = 0;
     b->log_current = 0;
+    b->log_trim_index = 0;
     b->nb_logs = 0;
 }
 
@@ -697,6 +1221,7 @@ EditBuffer *eb_new(const char *name, int flags)
     }
 
     b->flags = flags & ~BF_STYLES;
+    eb_new_generation(b);
 
     /* set default data type */
     b->data_type = &raw_data_type;
@@ -800,9 +1325,10 @@ void eb_free(EditBuffer **bp)
             qe_free(&cb);
         }
 
-        eb_delete_properties(b, 0, INT_MAX);
+        eb_delete_properties(b, 0, QE_OFFSET_MAX);
         eb_cache_remove(b);
         eb_clear(b);
+        eb_free_style_buffer(b);
 
         /* suppress from buffer list */
         pb = &qs->first_buffer;
@@ -810,9 +1336,6 @@ void eb_free(EditBuffer **bp)
             if (b1->log_buffer == b) {
                 b1->log_buffer = NULL;
             }
-            if (b1->b_styles == b) {
-                b1->b_styles = NULL;
-            }
             if (b1 == b)
                 *pb = b1->next;
             else
@@ -1007,9 +1530,9 @@ void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
 
 /* standard callback to move offsets */
 void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size)
+                        enum LogOperation op, QEOffset offset, QEOffset size)
 {
-    int *offset_ptr = opaque;
+    QEOffset *offset_ptr = opaque;
 
     switch (op) {
     case LOGOP_INSERT:
@@ -1032,15 +1555,272 @@ void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
     }
 }
 
+/* Edit transactions: the modifications made between eb_begin_edit()
+ * and eb_commit_edit() are undone in a single step, and the buffer
+ * callbacks are called once at commit time for the merged modified
+ * range, except for position tracking and style callbacks which must
+ * follow each modification.  Transactions can be nested.
+ */
+void eb_begin_edit(EditBuffer *b)
+{
+    if (b->edit_level++ == 0) {
+        b->edit_nb_ops = 0;
+        b->edit_nb_logs = 0;
+        /* do not coalesce with records outside the transaction */
+        b->last_log = 0;
+    }
+}
+
+static int eb_callback_deferred(EditBufferCallbackList *l)
+{
+    return l->callback != eb_offset_callback
+        && l->callback != eb_style_callback;
+}
+
+static void eb_call_deferred_callbacks(EditBuffer *b, enum LogOperation op,
+                                       QEOffset offset, QEOffset size)
+{
+    EditBufferCallbackList *l;
+
+    /* lines displayed during the transaction used stale colorizer
+       states */
+    eb_new_generation(b);
+    for (l = b->first_callback; l != NULL; l = l->next) {
+        if (eb_callback_deferred(l))
+            l->callback(b, l->opaque, l->arg, op, offset, size);
+    }
+}
+
+/* merge a modification into the range of the current transaction */
+static void eb_merge_edit(EditBuffer *b, enum LogOperation op,
+                          QEOffset offset, QEOffset size)
+{
+    if (b->edit_nb_ops++ == 0) {
+        b->edit_start = b->edit_end = offset;
+        b->edit_delta = 0;
+    }
+    b->edit_start = min_offset(b->edit_start, offset);
+    switch (op) {
+    case LOGOP_WRITE:
+        b->edit_end = max_offset(b->edit_end, offset + size);
+        break;
+    case LOGOP_INSERT:
+        b->edit_end = max_offset(b->edit_end, offset) + size;
+        b->edit_delta += size;
+        break;
+    case LOGOP_DELETE:
+        b->edit_end = max_offset(b->edit_end, offset + size) - size;
+        b->edit_delta -= size;
+        break;
+    default:
+        break;
+    }
+}
+
+void eb_commit_edit(EditBuffer *b)
+{
+    QEOffset start, old_size, new_size;
+
+    if (b->edit_level <= 0 || --b->edit_level > 0)
+        return;
+
+    b->last_log = 0;
+    if (b->edit_nb_ops == 0)
+        return;
+
+    /* report the merged range as replaced */
+    start = b->edit_start;
+    new_size = b->edit_end - start;
+    old_size = new_size - b->edit_delta;
+    if (old_size > 0)
+        eb_call_deferred_callbacks(b, LOGOP_DELETE, start, old_size);
+    if (new_size > 0)
+        eb_call_deferred_callbacks(b, LOGOP_INSERT, start, new_size);
+}
+
+/* Styles are stored as runs of characters with the same style in a
+ * treap ordered by position, with subtree lengths for O(log n)
+ * lookups.  Memory is proportional to the number of style changes.
+ * Lengths are counted in units of 1 << char_shift bytes.
+ */
+struct QEStyleRun {
+    QEOffset len;       /* number of units in the run */
+    QEOffset tree_len;  /* number of units in the subtree */
+    QETermStyle style;
+    unsigned int prio;  /* heap priority for tree balancing */
+    QEStyleRun *left, *right;
+};
+
+static inline QEOffset run_tree_len(const QEStyleRun *r) {
+    return r ? r->tree_len : 0;
+}
+
+static void run_pull(QEStyleRun *r)
+{
+    r->tree_len = run_tree_len(r->left) + r->len + run_tree_len(r->right);
+}
+
+static QEStyleRun *run_new(QEStyleRuns *sr, QEOffset len, QETermStyle style)
+{
+    QEStyleRun *r = qe_mallocz(QEStyleRun);
+
+    r->len = r->tree_len = len;
+    r->style = style;
+    r->prio = page_random();
+    sr->nb_runs++;
+    return r;
+}
+
+static void run_free_tree(QEStyleRuns *sr, QEStyleRun *r)
+{
+    if (r) {
+        run_free_tree(sr, r->left);
+        run_free_tree(sr, r->right);
+        sr->nb_runs--;
+        qe_free(&r);
+    }
+}
+
+/* concatenate the run trees `a` and `b` */
+static QEStyleRun *run_merge(QEStyleRun *a, QEStyleRun *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio) {
+        a->right = run_merge(a->right, b);
+        run_pull(a);
+        return a;
+    } else {
+        b->left = run_merge(a, b->left);
+        run_pull(b);
+        return b;
+    }
+}
+
+/* split the run tree `r` into the first `pos` units in `*ap` and the
+ * rest in `*bp`, splitting the run at `pos` if needed.
+ */
+static void run_split(QEStyleRuns *sr, QEStyleRun *r, QEOffset pos,
+                      QEStyleRun **ap, QEStyleRun **bp)
+{
+    QEOffset left_len;
+    QEStyleRun *q;
+
+    if (!r) {
+        *ap = *bp = NULL;
+        return;
+    }
+    left_len = run_tree_len(r->left);
+    if (pos <= left_len) {
+        run_split(sr, r->left, pos, ap, &r->left);
+        run_pull(r);
+        *bp = r;
+    } else
+    if (pos >= left_len + r->len) {
+        run_split(sr, r->right, pos - left_len - r->len, &r->right, bp);
+        run_pull(r);
+        *ap = r;
+    } else {
+        /* the right part keeps the priority to preserve the heap order */
+        q = run_new(sr, left_len + r->len - pos, r->style);
+        q->prio = r->prio;
+        q->right = r->right;
+        run_pull(q);
+        r->len = pos - left_len;
+        r->right = NULL;
+        run_pull(r);
+        *ap = r;
+        *bp = q;
+    }
+}
+
+/* return the run containing unit `pos` */
+static QEStyleRun *run_find(QEStyleRun *r, QEOffset pos)
+{
+    while (r) {
+        QEOffset left_len = run_tree_len(r->left);
+        if (pos < left_len) {
+            r = r->left;
+        } else
+        if (pos < left_len + r->len) {
+            break;
+        } else {
+            pos -= left_len + r->len;
+            r = r->right;
+        }
+    }
+    return r;
+}
+
+/* grow the run containing unit `pos` by `len` units */
+static void run_extend(QEStyleRun *r, QEOffset pos, QEOffset len)
+{
+    while (r) {
+        QEOffset left_len = run_tree_len(r->left);
+        r->tree_len += len;
+        if (pos < left_len) {
+            r = r->left;
+        } else
+        if (pos < left_len + r->len) {
+            r->len += len;
+            break;
+        } else {
+            pos -= left_len + r->len;
+            r = r->right;
+        }
+    }
+}
+
+static void style_insert(QEStyleRuns *sr, QEOffset pos, QEOffset len,
+                         QETermStyle style)
+{
+    QEStyleRun *r, *a, *b;
+
+    /* extend an adjacent run with the same style */
+    if (pos > 0 && (r = run_find(sr->root, pos - 1)) && r->style == style) {
+        run_extend(sr->root, pos - 1, len);
+        return;
+    }
+    if ((r = run_find(sr->root, pos)) != NULL && r->style == style) {
+        run_extend(sr->root, pos, len);
+        return;
+    }
+    run_split(sr, sr->root, pos, &a, &b);
+    sr->root = run_merge(run_merge(a, run_new(sr, len, style)), b);
+}
+
+static void style_delete(QEStyleRuns *sr, QEOffset pos, QEOffset len)
+{
+    QEStyleRun *a, *b, *c, *first, *last;
+
+    run_split(sr, sr->root, pos, &a, &b);
+    run_split(sr, b, len, &b, &c);
+    run_free_tree(sr, b);
+
+    /* coalesce the runs around the deleted range */
+    if (a && c) {
+        for (last = a; last->right; last = last->right)
+            continue;
+        for (first = c; first->left; first = first->left)
+            continue;
+        if (last->style == first->style) {
+            run_extend(a, a->tree_len - 1, first->len);
+            run_split(sr, c, first->len, &b, &c);
+            run_free_tree(sr, b);
+        }
+    }
+    sr->root = run_merge(a, c);
+}
+
 int eb_create_style_buffer(EditBuffer *b, int flags)
 {
     if (b->b_styles) {
         /* XXX: should extend style width if needed */
         return 0;
     } else {
-        char name[MAX_BUFFERNAME_SIZE];
-        snprintf(name, sizeof(name), "*S<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
-        b->b_styles = eb_new(name, BF_SYSTEM | BF_IS_STYLE | BF_RAW);
+        b->b_styles = qe_mallocz(QEStyleRuns);
         b->flags |= flags & BF_STYLES;
         b->style_shift = ((unsigned)(flags & BF_STYLES) / BF_STYLE1) - 1;
         b->style_bytes = 1 << b->style_shift;
@@ -1052,64 +1832,42 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
 
 void eb_free_style_buffer(EditBuffer *b)
 {
-    eb_free(&b->b_styles);
+    if (b->b_styles) {
+        run_free_tree(b->b_styles, b->b_styles->root);
+        qe_free(&b->b_styles);
+        eb_new_generation(b);
+    }
     b->style_shift = b->style_bytes = 0;
     eb_free_callback(b, eb_style_callback, NULL);
 }
 
-/* XXX: should compress styles buffer with run length encoding */
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size)
-{
-    union {
-        uint64_t buf8[256 / 8];
-        uint32_t buf4[256 / 4];
-        uint16_t buf2[256 / 2];
-        unsigned char buf[256];
-        QETermStyle align;
-    } s;
-    int i, len;
+                  QEOffset offset, QEOffset size)
+{
+    QEStyleRuns *sr = b->b_styles;
 
-    if (!b->b_styles || !size)
+    if (!sr || !size)
         return;
 
-    offset = (offset >> b->char_shift) << b->style_shift;
-    size = (size >> b->char_shift) << b->style_shift;
+    eb_new_generation(b);
+
+    /* styles are truncated to the style width of the buffer */
+    if ((8 << b->style_shift) < (int)(8 * sizeof(QETermStyle)))
+        style &= ((QETermStyle)1 << (8 << b->style_shift)) - 1;
+
+    offset >>= b->char_shift;
+    size >>= b->char_shift;
 
     switch (op) {
     case LOGOP_WRITE:
+        style_delete(sr, offset, size);
+        style_insert(sr, offset, size, style);
+        break;
     case LOGOP_INSERT:
-        /* XXX: should use a single loop to initialize buf */
-        /* XXX: should initialize buf just once */
-        while (size > 0) {
-            len = min(size, ssizeof(s.buf));
-            if (b->style_shift == 3) {
-                for (i = 0; i < len >> 3; i++) {
-                    s.buf8[i] = style;
-                }
-            } else
-            if (b->style_shift == 2) {
-                for (i = 0; i < len >> 2; i++) {
-                    s.buf4[i] = style;
-                }
-            } else
-            if (b->style_shift == 1) {
-                for (i = 0; i < len >> 1; i++) {
-                    s.buf2[i] = style;
-                }
-            } else {
-                memset(s.buf, style, len);
-            }
-            if (op == LOGOP_WRITE)
-                eb_write(b->b_styles, offset, s.buf, len);
-            else
-                eb_insert(b->b_styles, offset, s.buf, len);
-            size -= len;
-            offset += len;
-        }
+        style_insert(sr, offset, size, style);
         break;
     case LOGOP_DELETE:
-        eb_delete(b->b_styles, offset, size);
+        style_delete(sr, offset, size);
         break;
     default:
         break;
@@ -1117,7 +1875,7 @@ void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
 }
 
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size)
+                       enum LogOperation op, QEOffset offset, QEOffset size)
 {
     eb_set_style(b, b->cur_style, op, offset, size);
 }
@@ -1126,19 +1884,203 @@ void eb_style_callback(EditBuffer *b, void *opaque, int arg,
 /************************************************************/
 /* undo buffer */
 
+/* Undo records are stored in the log buffer as:
+ * - a header: the operation byte with the modified and linked flags,
+ *   the offset and size as varints,
+ * - the deleted or overwritten data for LOGOP_DELETE and LOGOP_WRITE,
+ * - a trailer: the length of the header and data as a varint stored
+ *   in reverse byte order, to walk the log backward.
+ * The records of an edit transaction after the first one are linked:
+ * a single undo or redo command plays them all.
+ * The log is limited to qs->undo_limit bytes: the oldest records are
+ * dropped in batches down to 3/4 of the limit, which only deletes whole
+ * pages from the front of the log buffer and scans the log once every
+ * limit/4 bytes logged.
+ */
+
+#define LOG_VARINT_MAX  10
+#define LOG_HEADER_MAX  (1 + 2 * LOG_VARINT_MAX)
+
+static int log_put_varint(u8 *p, uint64_t v)
+{
+    int len = 0;
+
+    while (v >= 0x80) {
+        p[len++] = (u8)(v | 0x80);
+        v >>= 7;
+    }
+    p[len++] = (u8)v;
+    return len;
+}
+
+/* decode a varint from `p`, return its length or 0 if invalid */
+static int log_get_varint(const u8 *p, int size, QEOffset *vp)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < size && i < LOG_VARINT_MAX; i++) {
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *vp = (QEOffset)v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static int log_put_header(u8 *p, const LogBuffer *lb)
+{
+    int len;
+
+    p[0] = lb->op | (lb->was_modified << 4) | (lb->linked << 5);
+    len = 1;
+    len += log_put_varint(p + len, lb->offset);
+    len += log_put_varint(p + len, lb->size);
+    return len;
+}
+
+static int log_put_trailer(u8 *p, QEOffset record_len)
+{
+    u8 buf[LOG_VARINT_MAX];
+    int i, len;
+
+    len = log_put_varint(buf, record_len);
+    for (i = 0; i < len; i++)
+        p[i] = buf[len - 1 - i];
+    return len;
+}
+
+/* read the header of the undo record at `index`, return its length
+ * or -1 if the record is invalid.
+ */
+static int log_read_header(EditBuffer *log, QEOffset index, LogBuffer *lb)
+{
+    u8 buf[LOG_HEADER_MAX];
+    int size, len, len1;
+
+    size = eb_read(log, index, buf, sizeof(buf));
+    if (size < 3)
+        return -1;
+    lb->op = buf[0] & 15;
+    lb->was_modified = (buf[0] >> 4) & 1;
+    lb->linked = (buf[0] >> 5) & 1;
+    len = 1;
+    len1 = log_get_varint(buf + len, size - len, &lb->offset);
+    if (!len1)
+        return -1;
+    len += len1;
+    len1 = log_get_varint(buf + len, size - len, &lb->size);
+    if (!len1)
+        return -1;
+    return len + len1;
+}
+
+/* return the length of the data stored in an undo record */
+static QEOffset log_data_size(const LogBuffer *lb)
+{
+    return (lb->op == LOGOP_INSERT) ? 0 : lb->size;
+}
+
+/* return the start of the undo record ending at `index` or -1 */
+static QEOffset log_prev_record(EditBuffer *log, QEOffset index)
+{
+    u8 buf[LOG_VARINT_MAX];
+    uint64_t v = 0;
+    int i, size;
+
+    size = eb_read(log, max_offset(index - LOG_VARINT_MAX, 0), buf,
+                   min_offset(index, LOG_VARINT_MAX));
+    for (i = 0; i < size; i++) {
+        int c = buf[size - 1 - i];
+        v |= (uint64_t)(c & 0x7f) << (7 * i);
+        if (!(c & 0x80)) {
+            index -= i + 1 + (QEOffset)v;
+            return index >= 0 ? index : -1;
+        }
+    }
+    return -1;
+}
+
+/* return the end of the undo record at `index` or -1 */
+static QEOffset log_next_record(EditBuffer *log, QEOffset index)
+{
+    u8 buf[LOG_VARINT_MAX];
+    LogBuffer lb;
+    int len;
+
+    len = log_read_header(log, index, &lb);
+    if (len < 0)
+        return -1;
+    return index + len + log_data_size(&lb) +
+        log_put_trailer(buf, len + log_data_size(&lb));
+}
+
+/* drop the oldest undo records down to 3/4 of qs->undo_limit,
+ * keeping at least the most recent transaction.
+ */
+static void eb_trim_log(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    QEOffset limit = qs->undo_limit;
+    QEOffset index, next;
+    LogBuffer lb;
+    int count, n;
+
+    if (limit <= 0 || b->log_new_index <= max_offset(limit, b->log_trim_index))
+        return;
+
+    limit -= limit / 4;
+    for (index = 0, count = 0; b->log_new_index - index > limit; count += n) {
+        /* drop linked records together */
+        next = index;
+        n = 0;
+        do {
+            next = log_next_record(b->log_buffer, next);
+            n++;
+        } while (next > index && next < b->log_new_index
+             &&  log_read_header(b->log_buffer, next, &lb) > 0 && lb.linked);
+        if (next <= index || next >= b->log_new_index)
+            break;
+        /* do not drop the current position of an undo sequence */
+        if (b->log_current && next > b->log_current - 1)
+            break;
+        index = next;
+    }
+    if (index > 0) {
+        eb_delete(b->log_buffer, 0, index);
+        b->log_new_index -= index;
+        b->nb_logs -= count;
+        if (b->log_current)
+            b->log_current -= index;
+    }
+    /* if the records cannot be dropped yet, as in an undo sequence,
+       wait for another quarter of the limit before scanning again */
+    b->log_trim_index = b->log_new_index + qs->undo_limit / 4;
+}
+
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size)
+                      QEOffset offset, QEOffset size)
 {
-    int was_modified, len, size_trailer;
+    int was_modified, linked, len;
+    QEOffset index, data_size;
+    u8 buf[LOG_HEADER_MAX];
     LogBuffer lb;
     EditBufferCallbackList *l;
 
+    eb_new_generation(b);
+
     /* callbacks and logging disabled for composite undo phase */
     if (b->save_log & 2)
         return;
 
-    /* call each callback */
+    if (b->edit_level > 0)
+        eb_merge_edit(b, op, offset, size);
+
+    /* call each callback, some are deferred inside a transaction */
     for (l = b->first_callback; l != NULL; l = l->next) {
+        if (b->edit_level > 0 && eb_callback_deferred(l))
+            continue;
         l->callback(b, l->opaque, l->arg, op, offset, size);
     }
 
@@ -1148,52 +2090,46 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     if (!b->save_log)
         return;
 
+    /* any other modification ends the current undo sequence */
+    if (!(b->save_log & 4))
+        b->log_current = 0;
+
     if (!b->log_buffer) {
-        char buf[MAX_BUFFERNAME_SIZE];
+        char name[MAX_BUFFERNAME_SIZE];
         /* Name should be unique because b->name is, but b->name may
          * later change if buffer is written to a different file.  This
          * should not be a problem since this log buffer is never
          * referenced by name.
          */
-        snprintf(buf, sizeof(buf), "*L<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
-        b->log_buffer = eb_new(buf, BF_SYSTEM | BF_IS_LOG | BF_RAW);
+        snprintf(name, sizeof(name), "*L<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
+        b->log_buffer = eb_new(name, BF_SYSTEM | BF_IS_LOG | BF_RAW);
         if (!b->log_buffer)
             return;
         b->log_new_index = 0;
         b->log_current = 0;
+        b->log_trim_index = 0;
         b->last_log = 0;
         b->last_log_char = 0;
         b->nb_logs = 0;
     }
-    /* XXX: better test to limit size */
-    if (b->nb_logs >= (NB_LOGS_MAX-1)) {
-        /* no free space, delete least recent entry */
-        /* XXX: should check undo record integrity */
-        eb_read(b->log_buffer, 0, &lb, sizeof(lb));
-        len = lb.size;
-        if (lb.op == LOGOP_INSERT)
-            len = 0;
-        len += sizeof(LogBuffer) + sizeof(int);
-        eb_delete(b->log_buffer, 0, len);
-        b->log_new_index -= len;
-        if (b->log_current > 1)
-            b->log_current -= len;
-        b->nb_logs--;
-    }
+
+    /* records of a transaction are undone together */
+    linked = (b->edit_level > 0 && b->edit_nb_logs++ > 0);
 
     /* If inserting, try and coalesce log record with previous */
     if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT
-    &&  (size_t)b->log_new_index >= sizeof(lb) + sizeof(int)
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
-                sizeof(int)) == sizeof(int)
-    &&  size_trailer == 0
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb,
-                sizeof(lb)) == sizeof(lb)
+    &&  (index = log_prev_record(b->log_buffer, b->log_new_index)) >= 0
+    &&  log_read_header(b->log_buffer, index, &lb) > 0
     &&  lb.op == LOGOP_INSERT
     &&  lb.offset + lb.size == offset) {
-        lb.size += size;
-        eb_write(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb, sizeof(lb));
-        return;
+        /* the encoded size may change: replace the previous record */
+        eb_delete(b->log_buffer, index, b->log_new_index - index);
+        b->log_new_index = index;
+        b->nb_logs--;
+        offset = lb.offset;
+        size += lb.size;
+        was_modified = lb.was_modified;
+        linked = lb.linked;
     }
 
     b->last_log = op;
@@ -1201,39 +2137,36 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     /* XXX: should check undo record integrity */
 
     /* header */
-    lb.pad1 = '\n';   /* make log buffer display readable */
-    lb.pad2 = ':';
     lb.op = op;
+    lb.was_modified = was_modified;
+    lb.linked = linked;
     lb.offset = offset;
     lb.size = size;
-    lb.was_modified = was_modified;
-    eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
-    b->log_new_index += sizeof(lb);
+    len = log_put_header(buf, &lb);
+    eb_write(b->log_buffer, b->log_new_index, buf, len);
+    b->log_new_index += len;
 
     /* data */
-    switch (op) {
-    case LOGOP_DELETE:
-    case LOGOP_WRITE:
+    data_size = log_data_size(&lb);
+    if (data_size) {
         eb_insert_buffer(b->log_buffer, b->log_new_index, b, offset, size);
         b->log_new_index += size;
-        size_trailer = size;
-        break;
-    default:
-        size_trailer = 0;
-        break;
     }
     /* trailer */
-    eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(int));
-    b->log_new_index += sizeof(int);
+    len = log_put_trailer(buf, len + data_size);
+    eb_write(b->log_buffer, b->log_new_index, buf, len);
+    b->log_new_index += len;
 
     b->nb_logs++;
+    eb_trim_log(b);
 }
 
 void do_undo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    QEOffset log_index;
     LogBuffer lb;
+    int len;
 
     if (!b->log_buffer) {
         put_status(s, "No undo information");
@@ -1254,63 +2187,84 @@ void do_undo(EditState *s)
     } else {
         log_index = b->log_current - 1;
     }
-    if (log_index == 0) {
+    /* go backward */
+    if (log_index > 0)
+        log_index = log_prev_record(b->log_buffer, log_index);
+    else
+        log_index = -1;
+    if (log_index < 0
+    ||  (len = log_read_header(b->log_buffer, log_index, &lb)) < 0) {
         put_status(s, "No further undo information");
         return;
     } else {
         put_status(s, "Undo!");
     }
-    /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
 
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
+    /* undo a transaction as a transaction, so it is redone at once */
+    eb_begin_edit(b);
+    b->save_log |= 4;  /* keep the undo sequence */
 
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
+    for (;;) {
+        /* log_current is 1 + index to have zero as default value */
+        b->log_current = log_index + 1;
+
+        /* play the log entry */
+        log_index += len;
+
+        b->last_log = 0;  /* prevent log compression */
+
+        switch (lb.op) {
+        case LOGOP_WRITE:
+            /* record the contents about to be overwritten, as eb_write()
+               does, then disable the log because we want to record a
+               single write (we should have the single operation:
+               eb_write_buffer).  The log may have been trimmed. */
+            eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
+            log_index = b->log_current - 1 + len;
+            b->save_log |= 2;
+            eb_delete(b, lb.offset, lb.size);
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log &= ~2;
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_DELETE:
+            /* we must also disable the log there because the log buffer
+               would be modified BEFORE we insert it by the implicit
+               eb_addlog */
+            b->save_log |= 2;
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log &= ~2;
+            eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_INSERT:
+            eb_delete(b, lb.offset, lb.size);
+            s->offset = lb.offset;
+            break;
+        default:
+            abort();
+        }
 
-    b->last_log = 0;  /* prevent log compression */
+        b->modified = lb.was_modified;
 
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        eb_delete(b, lb.offset, lb.size);
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
+        /* undo the whole transaction */
+        if (!lb.linked)
+            break;
+        log_index = log_prev_record(b->log_buffer, b->log_current - 1);
+        if (log_index < 0
+        ||  (len = log_read_header(b->log_buffer, log_index, &lb)) < 0)
+            break;
     }
-
-    b->modified = lb.was_modified;
+    b->save_log &= ~4;
+    eb_commit_edit(b);
 }
 
 void do_redo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    QEOffset log_index;
     LogBuffer lb;
+    int len;
 
     if (!b->log_buffer) {
         put_status(s, "No undo information");
@@ -1330,71 +2284,81 @@ void do_redo(EditState *s)
         put_status(s, "Nothing to redo");
         return;
     }
-    put_status(s, "Redo!");
-
-    /* go forward in undo stack */
-    log_index = b->log_current - 1;
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-    if (lb.op != LOGOP_INSERT)
-        log_index += lb.size;
-    log_index += sizeof(int);
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
-
-    /* go backward from the end and remove undo record */
-    log_index = b->log_new_index;
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        b->save_log &= ~1;
-        eb_delete(b, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
-    }
 
-    b->modified = lb.was_modified;
+    eb_begin_edit(b);
+
+    for (;;) {
+        /* go forward in undo stack */
+        log_index = log_next_record(b->log_buffer, b->log_current - 1);
+        if (log_index < 0) {
+            put_status(s, "Nothing to redo");
+            break;
+        }
+        /* log_current is 1 + index to have zero as default value */
+        b->log_current = log_index + 1;
+
+        /* go backward from the end and remove undo record */
+        log_index = log_prev_record(b->log_buffer, b->log_new_index);
+        if (log_index < 0
+        ||  (len = log_read_header(b->log_buffer, log_index, &lb)) < 0) {
+            put_status(s, "Nothing to redo");
+            break;
+        }
+        put_status(s, "Redo!");
+
+        /* play the log entry */
+        log_index += len;
+
+        switch (lb.op) {
+        case LOGOP_WRITE:
+            /* we must disable the log because we want to record a single
+               write (we should have the single operation: eb_write_buffer) */
+            b->save_log |= 2;
+            eb_delete(b, lb.offset, lb.size);
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log &= ~3;
+            eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
+            b->save_log |= 1;
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_DELETE:
+            /* we must also disable the log there because the log buffer
+               would be modified BEFORE we insert it by the implicit
+               eb_addlog */
+            b->save_log |= 2;
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log &= ~3;
+            eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
+            b->save_log |= 1;
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_INSERT:
+            b->save_log &= ~1;
+            eb_delete(b, lb.offset, lb.size);
+            b->save_log |= 1;
+            s->offset = lb.offset;
+            break;
+        default:
+            abort();
+        }
 
-    log_index -= sizeof(LogBuffer);
-    eb_delete(b->log_buffer, log_index, b->log_new_index - log_index);
-    b->log_new_index = log_index;
+        b->modified = lb.was_modified;
 
-    if (b->log_current >= log_index + 1) {
-        /* redone everything */
-        b->log_current = 0;
+        log_index -= len;
+        eb_delete(b->log_buffer, log_index, b->log_new_index - log_index);
+        b->log_new_index = log_index;
+        b->nb_logs--;
+
+        if (b->log_current >= log_index + 1) {
+            /* redone everything */
+            b->log_current = 0;
+            break;
+        }
+        /* redo the whole transaction */
+        if (!lb.linked)
+            break;
     }
+    eb_commit_edit(b);
 }
 
 /************************************************************/
@@ -1402,13 +2366,14 @@ void do_redo(EditState *s)
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type)
 {
-    int n;
+    Page *p;
 
     if (b->charset) {
         charset_decode_close(&b->charset_state);
     }
     b->eol_type = eol_type;
     b->charset = charset;
+    eb_new_generation(b);
     b->flags &= ~BF_UTF8;
     if (charset == &charset_utf8)
         b->flags |= BF_UTF8;
@@ -1427,14 +2392,15 @@ void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type)
     }
 
     /* Reset page cache flags */
-    for (n = 0; n < b->nb_pages; n++) {
-        Page *p = &b->page_table[n];
-        p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    b->pos_page = NULL;
+    for (p = eb_first_page(b); p != NULL; p = eb_next_page(p)) {
+        p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS |
+                      PG_TREE_POS | PG_TREE_CHAR);
     }
 }
 
 /* XXX: change API to go faster */
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr)
 {
     u8 buf[MAX_CHAR_BYTES];
     int ch;
@@ -1482,28 +2448,12 @@ int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
     return ch;
 }
 
-QETermStyle eb_get_style(EditBuffer *b, int offset)
+QETermStyle eb_get_style(EditBuffer *b, QEOffset offset)
 {
     if (b->b_styles) {
-        if (b->style_shift == 3) {
-            uint64_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 3, &style, 8);
-            return style;
-        } else
-        if (b->style_shift == 2) {
-            uint32_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 2, &style, 4);
-            return style;
-        } else
-        if (b->style_shift == 1) {
-            uint16_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 1, &style, 2);
-            return style;
-        } else {
-            uint8_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 0, &style, 1);
-            return style;
-        }
+        QEStyleRun *r = run_find(b->b_styles->root, offset >> b->char_shift);
+        if (r)
+            return r->style;
     }
     return 0;
 }
@@ -1511,7 +2461,7 @@ QETermStyle eb_get_style(EditBuffer *b, int offset)
 /* compute offset after moving 'n' chars from 'offset'.
  * 'n' can be negative
  */
-int eb_skip_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, int n)
 {
     for (; n < 0 && offset > 0; n++) {
         offset = eb_prev(b, offset);
@@ -1523,20 +2473,20 @@ int eb_skip_chars(EditBuffer *b, int offset, int n)
 }
 
 /* delete one character at offset 'offset', return number of bytes removed */
-int eb_delete_uchar(EditBuffer *b, int offset) {
+int eb_delete_uchar(EditBuffer *b, QEOffset offset) {
     return eb_delete_range(b, offset, eb_next(b, offset));
 }
 
 /* return the offset past any pending combining glyphs */
-int eb_skip_accents(EditBuffer *b, int offset) {
-    int offset1;
+QEOffset eb_skip_accents(EditBuffer *b, QEOffset offset) {
+    QEOffset offset1;
     while (qe_isaccent(eb_nextc(b, offset, &offset1)))
         offset = offset1;
     return offset;
 }
 
 /* return the main character for the next glyph, update offset to next_ptr */
-int eb_next_glyph(EditBuffer *b, int offset, int *next_ptr) {
+int eb_next_glyph(EditBuffer *b, QEOffset offset, QEOffset *next_ptr) {
     int c = eb_nextc(b, offset, &offset);
     if (c >= ' ') {
         offset += eb_skip_accents(b, offset);
@@ -1546,7 +2496,7 @@ int eb_next_glyph(EditBuffer *b, int offset, int *next_ptr) {
 }
 
 /* return the main character for the previous glyph, update offset to next_ptr */
-int eb_prev_glyph(EditBuffer *b, int offset, int *next_ptr) {
+int eb_prev_glyph(EditBuffer *b, QEOffset offset, QEOffset *next_ptr) {
     for (;;) {
         int c = eb_prevc(b, offset, &offset);
         if (!qe_isaccent(c)) {
@@ -1560,8 +2510,9 @@ int eb_prev_glyph(EditBuffer *b, int offset, int *next_ptr) {
  * 'n' can be negative,
  * combining accents are skipped as part of the previous character.
  */
-int eb_skip_glyphs(EditBuffer *b, int offset, int n) {
-    int c, offset1;
+QEOffset eb_skip_glyphs(EditBuffer *b, QEOffset offset, int n) {
+    QEOffset offset1;
+    int c;
     if (n < 0) {
         while (offset > 0) {
             c = eb_prevc(b, offset, &offset);
@@ -1583,7 +2534,7 @@ int eb_skip_glyphs(EditBuffer *b, int offset, int n) {
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, int n)
 {
     return eb_delete_range(b, offset, eb_skip_chars(b, offset, n));
 }
@@ -1591,14 +2542,14 @@ int eb_delete_chars(EditBuffer *b, int offset, int n)
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_glyphs(EditBuffer *b, int offset, int n)
+QEOffset eb_delete_glyphs(EditBuffer *b, QEOffset offset, int n)
 {
     return eb_delete_range(b, offset, eb_skip_glyphs(b, offset, n));
 }
 
 /* XXX: only stateless charsets are supported */
 /* XXX: suppress that? */
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr)
 {
     int ch, char_size;
     u8 buf[MAX_CHAR_BYTES + 1], *q;
@@ -1612,7 +2563,7 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
             offset -= 1;
             ch = eb_read_one_byte(b, offset);
             if (utf8_is_trailing_byte(ch)) {
-                int offset1 = offset;
+                QEOffset offset1 = offset;
                 q = buf + sizeof(buf);
                 *--q = '\0';
                 *--q = ch;
@@ -1664,136 +2615,273 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
     return ch;
 }
 
-int eb_goto_pos(EditBuffer *b, int line1, int col1)
+/* The buffer keeps a resume point for line computations inside a
+ * single page: `pos_page_offset` is either 0 or the offset of the
+ * beginning of a line in `pos_page`, and `pos_lines` is the number of
+ * EOL characters before it in the page.  Successive calls for nearby
+ * positions, such as displaying or colorizing consecutive lines, then
+ * only scan the data between these positions instead of the whole
+ * page prefix.
+ */
+static int page_pos_resume(EditBuffer *b, Page *p, int offset)
+{
+    if (b->pos_page != p || b->pos_page_offset > offset)
+        return 0;
+    /* a \n at the start of the scan is skipped in EOL_DOS mode,
+     * which would be incorrect after a complete \r\n sequence */
+    if (b->eol_type == EOL_DOS && b->pos_page_offset < p->size
+    &&  p->data[b->pos_page_offset] == '\n')
+        return 0;
+    return 1;
+}
+
+/* compute line and column for `offset` relative to the start of page `p` */
+static void page_get_pos(EditBuffer *b, Page *p, int offset,
+                         int *line_ptr, int *col_ptr)
+{
+    int start, lines, line1, col1;
+
+    start = lines = 0;
+    if (page_pos_resume(b, p, offset)) {
+        start = b->pos_page_offset;
+        lines = b->pos_lines;
+    }
+    b->charset_state.get_pos_func(&b->charset_state, p->data + start,
+                                  offset - start, &line1, &col1);
+    if (line1) {
+        /* move the resume point to the beginning of the line */
+        start += b->charset->goto_line_func(&b->charset_state,
+            p->data + start, offset - start, line1);
+        lines += line1;
+    }
+    b->pos_page = p;
+    b->pos_page_offset = start;
+    b->pos_lines = lines;
+    *line_ptr = lines;
+    *col_ptr = col1;
+}
+
+/* return the offset of the beginning of line `n` counted from the start
+ * of page `p`.  The page must contain at least `n` EOL characters.
+ */
+static int page_goto_line(EditBuffer *b, Page *p, int n)
+{
+    int start, lines;
+
+    start = lines = 0;
+    if (page_pos_resume(b, p, p->size) && b->pos_lines <= n) {
+        start = b->pos_page_offset;
+        lines = b->pos_lines;
+    }
+    if (n > lines) {
+        start += b->charset->goto_line_func(&b->charset_state,
+            p->data + start, p->size - start, n - lines);
+    }
+    b->pos_page = p;
+    b->pos_page_offset = start;
+    b->pos_lines = n;
+    return start;
+}
+
+/* Find the first page of subtree `p` that ends at or beyond position
+ * line1, col1, accumulating the position and offset of the pages
+ * before it.  Subtrees with stale totals are scanned in order, so the
+ * cost of a first access to a large mapped file is proportional to
+ * the position reached instead of the file size.  Return NULL if the
+ * whole subtree precedes the position, its totals are then valid.
+ */
+static Page *page_find_pos(EditBuffer *b, Page *p, int line1, int col1,
+                           QEOffset *line_ptr, QEOffset *col_ptr,
+                           QEOffset *offset_ptr)
+{
+    Page *q;
+    QEOffset line2, col2;
+
+    if (!p)
+        return NULL;
+
+    if (p->flags & PG_TREE_POS) {
+        line2 = *line_ptr;
+        col2 = *col_ptr;
+        pos_append(&line2, &col2, p->tree_lines, p->tree_col);
+        if (line2 < line1 || (line2 == line1 && col2 < col1)) {
+            *line_ptr = line2;
+            *col_ptr = col2;
+            *offset_ptr += p->tree_size;
+            return NULL;
+        }
+    }
+    q = page_find_pos(b, p->left, line1, col1, line_ptr, col_ptr, offset_ptr);
+    if (q)
+        return q;
+    if (!(p->flags & PG_VALID_POS)) {
+        p->flags |= PG_VALID_POS;
+        b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
+                                      &p->nb_lines, &p->col);
+    }
+    line2 = *line_ptr;
+    col2 = *col_ptr;
+    pos_append(&line2, &col2, p->nb_lines, p->col);
+    if (line2 > line1 || (line2 == line1 && col2 >= col1))
+        return p;
+    *line_ptr = line2;
+    *col_ptr = col2;
+    *offset_ptr += p->size;
+    q = page_find_pos(b, p->right, line1, col1, line_ptr, col_ptr, offset_ptr);
+    if (q)
+        return q;
+    /* both children are complete now */
+    page_pull(p);
+    return NULL;
+}
+
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1)
 {
-    Page *p, *p_end;
-    int line2, col2, line, col, offset, offset1;
+    Page *p;
+    QEOffset offset, offset1, line, col;
 
     line = 0;
     col = 0;
     offset = 0;
 
-    p = b->page_table;
-    p_end = b->page_table + b->nb_pages;
-    while (p < p_end) {
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
-        }
-        line2 = line + p->nb_lines;
-        if (p->nb_lines)
-            col2 = 0;
-        col2 = col + p->col;
-        if (line2 > line1 || (line2 == line1 && col2 >= col1)) {
-            /* compute offset */
-            if (line < line1) {
-                /* seek to the correct line */
-                offset += b->charset->goto_line_func(&b->charset_state,
-                    p->data, p->size, line1 - line);
-                line = line1;
-                col = 0;
-            }
-            while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
-                col++;
-                offset = offset1;
-            }
-            return offset;
+    /* find the first page that ends at or beyond position line1, col1 */
+    p = page_find_pos(b, b->page_root, line1, col1, &line, &col, &offset);
+    if (!p)
+        return b->total_size;
+
+    /* compute offset */
+    if (line < line1) {
+        /* seek to the correct line */
+        offset += page_goto_line(b, p, line1 - line);
+        line = line1;
+        col = 0;
+    } else
+    if (offset > 0) {
+        /* skip the end of a character that straddles the page
+         * boundary: it was counted in the previous page */
+        if (eb_nextc(b, eb_prev(b, offset), &offset1) != '\n'
+        &&  offset1 > offset) {
+            offset = offset1;
         }
-        line = line2;
-        col = col2;
-        offset += p->size;
-        p++;
     }
-    return b->total_size;
+    while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
+        col++;
+        offset = offset1;
+    }
+    return offset;
 }
 
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset)
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset)
 {
-    Page *p, *p_end;
-    int line, col, line1, col1;
+    Page *p;
+    QEOffset line, col;
+    int line1, col1;
 
     QASSERT(offset >= 0);
 
     line = 0;
     col = 0;
-    p = b->page_table;
-    p_end = p + b->nb_pages;
-    for (;;) {
-        if (p >= p_end)
-            goto the_end;
-        if (offset < p->size)
+    p = b->page_root;
+    while (p) {
+        if (p->left) {
+            if (offset < p->left->tree_size) {
+                p = p->left;
+                continue;
+            }
+            page_validate_pos(b, p->left);
+            pos_append(&line, &col, p->left->tree_lines, p->left->tree_col);
+            offset -= p->left->tree_size;
+        }
+        if (offset < p->size) {
+            page_get_pos(b, p, offset, &line1, &col1);
+            pos_append(&line, &col, line1, col1);
             break;
+        }
         if (!(p->flags & PG_VALID_POS)) {
             p->flags |= PG_VALID_POS;
             b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
                                           &p->nb_lines, &p->col);
         }
-        line += p->nb_lines;
-        if (p->nb_lines)
-            col = 0;
-        col += p->col;
+        pos_append(&line, &col, p->nb_lines, p->col);
         offset -= p->size;
-        p++;
+        p = p->right;
     }
-    b->charset_state.get_pos_func(&b->charset_state, p->data, offset,
-                                  &line1, &col1);
-    line += line1;
-    if (line1)
-        col = 0;
-    col += col1;
-
- the_end:
-    *line_ptr = line;
-    *col_ptr = col;
-    return line;
+    /* positions beyond the int range are reported at its end */
+    *line_ptr = min_offset(line, INT_MAX);
+    *col_ptr = min_offset(col, INT_MAX);
+    return *line_ptr;
 }
 
 /************************************************************/
 /* char offset computation */
 
 /* convert a char number into a byte offset according to buffer charset */
-int eb_goto_char(EditBuffer *b, int pos)
+/* Find the page of subtree `p` containing character number *pos_ptr
+ * and make *pos_ptr relative to it, scanning subtrees with stale
+ * totals in order like page_find_pos().
+ */
+static Page *page_find_char(EditBuffer *b, Page *p,
+                            QEOffset *pos_ptr, QEOffset *offset_ptr)
+{
+    Page *q;
+
+    if (!p)
+        return NULL;
+
+    if ((p->flags & PG_TREE_CHAR) && *pos_ptr >= p->tree_chars) {
+        *pos_ptr -= p->tree_chars;
+        *offset_ptr += p->tree_size;
+        return NULL;
+    }
+    q = page_find_char(b, p->left, pos_ptr, offset_ptr);
+    if (q)
+        return q;
+    if (!(p->flags & PG_VALID_CHAR)) {
+        p->flags |= PG_VALID_CHAR;
+        p->nb_chars = b->charset->get_chars_func(&b->charset_state,
+                                                 p->data, p->size);
+    }
+    if (*pos_ptr < p->nb_chars)
+        return p;
+    *pos_ptr -= p->nb_chars;
+    *offset_ptr += p->size;
+    q = page_find_char(b, p->right, pos_ptr, offset_ptr);
+    if (q)
+        return q;
+    page_pull(p);
+    return NULL;
+}
+
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos)
 {
-    int offset;
-    Page *p, *p_end;
+    QEOffset offset;
+    Page *p;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
-        offset = min(pos * b->charset->char_size, b->total_size);
+        offset = min_offset(pos * b->charset->char_size, b->total_size);
     } else {
         offset = 0;
-        p = b->page_table;
-        p_end = b->page_table + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (pos < p->nb_chars) {
-                offset += b->charset->goto_char_func(&b->charset_state, p->data, p->size, pos);
-                break;
-            } else {
-                pos -= p->nb_chars;
-                offset += p->size;
-                p++;
-            }
+        p = page_find_char(b, b->page_root, &pos, &offset);
+        if (p) {
+            offset += b->charset->goto_char_func(&b->charset_state,
+                                                 p->data, p->size, pos);
         }
     }
     return offset;
 }
 
 /* convert a byte offset into a char number according to buffer charset */
-int eb_get_char_offset(EditBuffer *b, int offset)
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset)
 {
-    int pos;
-    Page *p, *p_end;
+    QEOffset pos;
+    Page *p;
 
     if (offset < 0)
         offset = 0;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
         /* offset is round down to character boundary */
-        pos = min(offset, b->total_size) / b->charset->char_size;
+        pos = min_offset(offset, b->total_size) / b->charset->char_size;
     } else {
         /* XXX: should handle rounding if EOL_DOS */
         /* XXX: should fix buffer offset via charset specific method */
@@ -1810,21 +2898,28 @@ int eb_get_char_offset(EditBuffer *b, int offset)
             /* CG: XXX: offset rounding to character boundary is undefined */
         }
         pos = 0;
-        p = b->page_table;
-        p_end = p + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
+        p = b->page_root;
+        while (p) {
+            if (p->left) {
+                if (offset < p->left->tree_size) {
+                    p = p->left;
+                    continue;
+                }
+                page_validate_chars(b, p->left);
+                pos += p->left->tree_chars;
+                offset -= p->left->tree_size;
             }
             if (offset < p->size) {
                 pos += b->charset->get_chars_func(&b->charset_state, p->data, offset);
                 break;
-            } else {
-                pos += p->nb_chars;
-                offset -= p->size;
-                p++;
             }
+            if (!(p->flags & PG_VALID_CHAR)) {
+                p->flags |= PG_VALID_CHAR;
+                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
+            }
+            pos += p->nb_chars;
+            offset -= p->size;
+            p = p->right;
         }
     }
     return pos;
@@ -1833,10 +2928,10 @@ int eb_get_char_offset(EditBuffer *b, int offset)
 /* delete a range of bytes from the buffer, bounds in any order, return
  * number of bytes removed.
  */
-int eb_delete_range(EditBuffer *b, int p1, int p2)
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     if (p1 > p2) {
-        int tmp = p1;
+        QEOffset tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1846,7 +2941,7 @@ int eb_delete_range(EditBuffer *b, int p1, int p2)
 /* replace 'size' bytes at offset 'offset' with 'size1' bytes from 'buf'
  * return the number of bytes written
  */
-int eb_replace(EditBuffer *b, int offset, int size,
+int eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
                const void *buf, int size1)
 {
     /* CG: behaviour is not exactly identical: mark, point and other
@@ -1874,7 +2969,7 @@ typedef struct BufferIOState {
     void (*progress_cb)(void *opaque, int size);
     void (*completion_cb)(void *opaque, int err);
     void *opaque;
-    int offset;
+    QEOffset offset;
     int saved_flags;
     int saved_log;
     int nolog;
@@ -1889,7 +2984,7 @@ static void eb_io_stop(EditBuffer *b, int err);
    stays in 'loading' state while begin loaded. It is also marked
    readonly. */
 int load_buffer(EditBuffer *b, const char *filename,
-                int offset, int nolog,
+                QEOffset offset, int nolog,
                 void (*progress_cb)(void *opaque, int size),
                 void (*completion_cb)(void *opaque, int err), void *opaque)
 {
@@ -1973,10 +3068,11 @@ static void eb_io_stop(EditBuffer *b, int err)
 #endif
 
 /* CG: returns number of bytes read, or -1 upon read error */
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
+QEOffset eb_raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset)
 {
     unsigned char buf[IOBUF_SIZE];
-    int len, size, inserted;
+    QEOffset size, inserted;
+    int len;
 
     //put_status(NULL, "loading %s", filename);
     size = inserted = 0;
@@ -1999,17 +3095,58 @@ int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
 void eb_munmap_buffer(EditBuffer *b)
 {
     if (b->map_address) {
+        /* the undo log may share pages with the mapping */
+        eb_free_log_buffer(b);
         munmap(b->map_address, b->map_length);
         b->map_address = NULL;
         b->map_length = 0;
     }
 }
 
+/* copy the pages of the buffer and its undo log that point to the
+ * mapping and remove it, return -1 if out of memory.
+ */
+static int eb_unmap_pages(EditBuffer *b)
+{
+    EditBuffer *bufs[2];
+    const u8 *map_start = b->map_address;
+    const u8 *map_end = map_start + b->map_length;
+    u8 *buf;
+    Page *p;
+    int i, flag;
+
+    bufs[0] = b;
+    bufs[1] = b->log_buffer;
+    for (i = 0; i < 2; i++) {
+        if (!bufs[i])
+            continue;
+        for (p = eb_first_page(bufs[i]); p; p = eb_next_page(p)) {
+            if ((p->flags & PG_READ_ONLY)
+            &&  p->data >= map_start && p->data < map_end) {
+                buf = page_data_alloc(p->size, &flag);
+                if (!buf)
+                    return -1;
+                memcpy(buf, p->data, p->size);
+                p->data = buf;
+                p->flags = (p->flags & ~PG_READ_ONLY) | flag;
+            }
+        }
+    }
+    munmap(b->map_address, b->map_length);
+    b->map_address = NULL;
+    b->map_length = 0;
+    close(b->map_handle);
+    b->map_handle = 0;
+    return 0;
+}
+
 int eb_mmap_buffer(EditBuffer *b, const char *filename)
 {
-    int fd, len, file_size, n, size;
+    int fd, len;
+    off_t file_size;
+    QEOffset size, total_size0;
     u8 *file_ptr, *ptr;
-    Page *p;
+    Page *p, *last;
 
     eb_munmap_buffer(b);
 
@@ -2017,6 +3154,10 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
     if (fd < 0)
         return -1;
     file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < 0 || (uint64_t)file_size > SIZE_MAX) {
+        close(fd);
+        return -1;
+    }
     //put_status(NULL, "mapping %s", filename);
     file_ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
     if ((void*)file_ptr == MAP_FAILED) {
@@ -2026,27 +3167,39 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
     b->map_address = file_ptr;
     b->map_length = file_size;
 
-    n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
-    p = qe_malloc_array(Page, n);
-    if (!p) {
-        close(fd);
-        return -1;
-    }
-    b->page_table = p;
-    b->total_size = file_size;
-    b->nb_pages = n;
+    /* The pages point into the mapping: data is only read from the
+     * file when a page is accessed and copied when it is modified.
+     */
     size = file_size;
     ptr = file_ptr;
+    total_size0 = b->total_size;
+    last = eb_last_page(b);
     while (size > 0) {
-        len = size;
-        if (len > MAX_PAGE_SIZE)
-            len = MAX_PAGE_SIZE;
-        p->data = ptr;
-        p->size = len;
-        p->flags = PG_READ_ONLY;
+        len = min_offset(size, MAX_LARGE_PAGE_SIZE);
+        p = page_new(ptr, len, PG_READ_ONLY);
+        if (!p)
+            break;
+        page_append(b, last, p);
+        b->total_size += len;
         ptr += len;
         size -= len;
-        p++;
+        last = p;
+    }
+    page_pull_tree(b->page_root);
+    b->cur_page = NULL;
+    if (size > 0) {
+        /* out of memory: remove the pages appended so far, they
+         * would point to freed memory once the file is unmapped.
+         */
+        while (b->total_size > total_size0) {
+            p = eb_last_page(b);
+            b->total_size -= p->size;
+            page_delete(b, p);
+        }
+        b->cur_page = NULL;
+        eb_munmap_buffer(b);
+        close(fd);
+        return -1;
     }
     // XXX: not needed
     b->map_handle = fd;
@@ -2080,19 +3233,48 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
 /* Write bytes between <start> and <end> to file filename,
  * return bytes written or -1 if error
  */
-static int raw_buffer_save(EditBuffer *b, int start, int end,
-                           const char *filename)
+static QEOffset raw_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                const char *filename)
 {
-    int fd, len, size, written;
+    int fd, len;
+    QEOffset size, written;
     unsigned char buf[IOBUF_SIZE];
-
+    const char *dest = filename;
+#ifdef CONFIG_MMAP
+    char tmpname[MAX_FILENAME_SIZE];
+    struct stat st1, st2;
+
+    fd = -1;
+    if (b->map_address && b->map_handle > 0
+    &&  !fstat(b->map_handle, &st1) && !stat(filename, &st2)
+    &&  st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+        /* Rewriting the mapped file in place would change the data
+         * of the unmodified pages under us and truncating it would
+         * make them invalid: write a new file and rename it over the
+         * old one, the mapping keeps the old inode alive. If the
+         * directory is not writable, copy the mapped pages first.
+         */
+        if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename)
+            < ssizeof(tmpname)) {
+            fd = mkstemp(tmpname);
+        }
+        if (fd >= 0) {
+            fchmod(fd, st2.st_mode & 07777);
+            filename = tmpname;
+        } else
+        if (eb_unmap_pages(b)) {
+            return -1;
+        }
+    }
+    if (fd < 0)
+#endif
     fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0)
         return -1;
 
     //put_status(NULL, "writing %s", filename);
     if (end < start) {
-        int tmp = start;
+        QEOffset tmp = start;
         start = end;
         end = tmp;
     }
@@ -2103,22 +3285,28 @@ static int raw_buffer_save(EditBuffer *b, int start, int end,
     written = 0;
     size = end - start;
     while (size > 0) {
-        len = size;
-        if (len > IOBUF_SIZE)
-            len = IOBUF_SIZE;
+        len = min_offset(size, IOBUF_SIZE);
         eb_read(b, start, buf, len);
         len = write(fd, buf, len);
         if (len < 0) {
             close(fd);
-            return -1;
+            goto fail;
         }
         written += len;
         start += len;
         size -= len;
     }
-    close(fd);
+    if (close(fd))
+        goto fail;
+    if (filename != dest && rename(filename, dest))
+        goto fail;
     //put_status(NULL, "");
     return written;
+
+ fail:
+    if (filename != dest)
+        unlink(filename);
+    return -1;
 }
 
 static void raw_buffer_close(qe__unused__ EditBuffer *b)
@@ -2162,7 +3350,7 @@ int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c)
 
 /* Insert unicode character according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_uchar(EditBuffer *b, int offset, int c)
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
@@ -2174,18 +3362,18 @@ int eb_insert_uchar(EditBuffer *b, int offset, int c)
 /* Replace the character at `offset` with `c`,
  * return number of bytes to move past `c`.
  */
-int eb_replace_uchar(EditBuffer *b, int offset, int c)
+int eb_replace_uchar(EditBuffer *b, QEOffset offset, int c)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
-    int offset1;
+    QEOffset offset1;
 
     len = eb_encode_uchar(b, buf, c);
     eb_nextc(b, offset, &offset1);
     return eb_replace(b, offset, offset1 - offset, buf, len);
 }
 
-int eb_insert_uchars(EditBuffer *b, int offset, int c, int n) {
+int eb_insert_uchars(EditBuffer *b, QEOffset offset, int c, int n) {
     char buf[1024];
     int size, pos;
 
@@ -2202,7 +3390,7 @@ int eb_insert_uchars(EditBuffer *b, int offset, int c, int n) {
 
 /* Insert buffer with utf8 chars according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset, const char *buf, int len)
 {
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return eb_insert(b, offset, buf, len);
@@ -2227,7 +3415,7 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
 
 /* Insert chars from u32 array according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int len)
+int eb_insert_u32_buf(EditBuffer *b, QEOffset offset, const unsigned int *buf, int len)
 {
     char buf1[1024];
     int pos, size, pos1;
@@ -2245,12 +3433,12 @@ int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int le
     return size;
 }
 
-int eb_insert_str(EditBuffer *b, int offset, const char *str)
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str)
 {
     return eb_insert_utf8_buf(b, offset, str, strlen(str));
 }
 
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp)
 {
     if (eb_nextc(b, offset, &offset) != c)
         return 0;
@@ -2259,7 +3447,7 @@ int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
     return 1;
 }
 
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str, QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -2273,7 +3461,7 @@ int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
     return 1;
 }
 
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str, QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -2346,7 +3534,7 @@ int eb_printf(EditBuffer *b, const char *fmt, ...) {
 
 #if 0
 /* pad current line with spaces so that it reaches column n */
-void eb_line_pad(EditBuffer *b, int offset, int n) {
+void eb_line_pad(EditBuffer *b, QEOffset offset, int n) {
     /* Compute visual column visual column */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
     int col = text_screen_width(b, eb_goto_bol(b, offset), offset, tw);
@@ -2356,13 +3544,13 @@ void eb_line_pad(EditBuffer *b, int offset, int n) {
 #endif
 
 /* Read the contents of a buffer region encoded in a utf8 string */
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size)
 {
-    int size;
+    QEOffset size;
 
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
     size = stop - start;
 
     /* do not use eb_read if overflow to avoid partial characters */
@@ -2373,7 +3561,8 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
         return size;
     } else {
         buf_t outbuf, *out;
-        int c, offset;
+        QEOffset offset;
+        int c;
 
         out = buf_init(&outbuf, buf, buf_size);
         for (offset = start; offset < stop;) {
@@ -2385,17 +3574,18 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
 }
 
 /* Compute the size of the contents of a buffer region encoded in utf8 */
-int eb_get_region_content_size(EditBuffer *b, int start, int stop)
+QEOffset eb_get_region_content_size(EditBuffer *b, QEOffset start, QEOffset stop)
 {
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
 
     /* assuming start and stop fall on character boundaries */
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return stop - start;
     } else {
-        int c, offset, size;
+        QEOffset offset, size;
         char buf[MAX_CHAR_BYTES];
+        int c;
 
         for (size = 0, offset = start; offset < stop;) {
             c = eb_nextc(b, offset, &offset);
@@ -2411,9 +3601,9 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
  * performed.
  * Return the number of bytes inserted.
  */
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size)
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size)
 {
     int styles_flags = min((dest->flags & BF_STYLES), (src->flags & BF_STYLES));
 
@@ -2423,7 +3613,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
         return eb_insert_buffer(dest, dest_offset, src, src_offset, size);
     } else {
         EditBuffer *b;
-        int offset, offset_max, offset1 = dest_offset;
+        QEOffset offset, offset_max, offset1 = dest_offset;
 
         b = dest;
         if (!styles_flags
@@ -2436,7 +3626,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
         /* well, not very fast, but simple */
         /* XXX: should optimize save_log system for insert sequences */
         // XXX: should optimize styles transfer
-        offset_max = min(src->total_size, src_offset + size);
+        offset_max = min_offset(src->total_size, src_offset + size);
         size = 0;
         for (offset = src_offset; offset < offset_max;) {
             char buf[MAX_CHAR_BYTES];
@@ -2462,7 +3652,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_get_line(EditBuffer *b, unsigned int *buf, int size,
-                int offset, int *offset_ptr)
+                QEOffset offset, QEOffset *offset_ptr)
 {
     int c, len = 0;
 
@@ -2494,13 +3684,13 @@ int eb_get_line(EditBuffer *b, unsigned int *buf, int size,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_fgets(EditBuffer *b, char *buf, int buf_size,
-             int offset, int *offset_ptr)
+             QEOffset offset, QEOffset *offset_ptr)
 {
     buf_t outbuf, *out;
 
     out = buf_init(&outbuf, buf, buf_size);
     for (;;) {
-        int next;
+        QEOffset next;
         int c = eb_nextc(b, offset, &next);
         if (!buf_putc_utf8(out, c)) {
             /* truncation: offset points to the first unread character */
@@ -2518,9 +3708,10 @@ int eb_fgets(EditBuffer *b, char *buf, int buf_size,
     return out->len;
 }
 
-int eb_prev_line(EditBuffer *b, int offset)
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset)
 {
-    int offset1, seen_nl;
+    QEOffset offset1;
+    int seen_nl;
 
     for (seen_nl = 0;;) {
         if (eb_prevc(b, offset, &offset1) == '\n') {
@@ -2533,9 +3724,9 @@ int eb_prev_line(EditBuffer *b, int offset)
 }
 
 /* return offset of the beginning of the line containing offset */
-int eb_goto_bol(EditBuffer *b, int offset)
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset)
 {
-    int offset1;
+    QEOffset offset1;
 
     for (;;) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2548,9 +3739,10 @@ int eb_goto_bol(EditBuffer *b, int offset)
 /* move to the beginning of the line containing offset */
 /* return offset of the beginning of the line containing offset */
 /* store count of characters skipped at *countp */
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp)
 {
-    int count, offset1;
+    QEOffset offset1;
+    int count;
 
     for (count = 0;; count++) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2565,7 +3757,7 @@ int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
  * return 0 if not blank.
  * return 1 if blank and store start of next line in <*offset1>.
  */
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1) {
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1) {
     int c;
 
     while ((c = eb_nextc(b, offset, &offset)) != '\n') {
@@ -2578,7 +3770,7 @@ int eb_is_blank_line(EditBuffer *b, int offset, int *offset1) {
 }
 
 /* check if <offset> is within indentation. */
-int eb_is_in_indentation(EditBuffer *b, int offset)
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2590,9 +3782,10 @@ int eb_is_in_indentation(EditBuffer *b, int offset)
 }
 
 /* return offset of the end of the line containing offset */
-int eb_goto_eol(EditBuffer *b, int offset1)
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset1)
 {
-    int c, offset;
+    QEOffset offset;
+    int c;
 
     for (;;) {
         offset = offset1;
@@ -2603,7 +3796,7 @@ int eb_goto_eol(EditBuffer *b, int offset1)
     return offset;
 }
 
-int eb_next_line(EditBuffer *b, int offset)
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2617,102 +3810,273 @@ int eb_next_line(EditBuffer *b, int offset)
 
 /* buffer property handling */
 
-static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
-                              enum LogOperation op, int offset, int size)
+/* Properties are kept in a treap ordered by offset.  The offset of a
+ * property is stored relative to its parent in the tree, so shifting
+ * all properties after an edit point only updates O(log n) nodes.
+ */
+
+/* return the first property, store its offset in `*offsetp` */
+QEProperty *eb_first_property(EditBuffer *b, QEOffset *offsetp)
+{
+    QEProperty *p = b->property_tree;
+    QEOffset offset = 0;
+
+    if (p) {
+        offset = p->rel_offset;
+        while (p->left) {
+            p = p->left;
+            offset += p->rel_offset;
+        }
+    }
+    *offsetp = offset;
+    return p;
+}
+
+/* return the property following `p`, update its offset in `*offsetp` */
+QEProperty *eb_next_property(const QEProperty *p, QEOffset *offsetp)
+{
+    if (p->right) {
+        p = p->right;
+        *offsetp += p->rel_offset;
+        while (p->left) {
+            p = p->left;
+            *offsetp += p->rel_offset;
+        }
+        return unconst(QEProperty *)p;
+    }
+    while (p->parent && p->parent->right == p) {
+        *offsetp -= p->rel_offset;
+        p = p->parent;
+    }
+    *offsetp -= p->rel_offset;
+    return p->parent;
+}
+
+static QEProperty *eb_prev_property(const QEProperty *p, QEOffset *offsetp)
+{
+    if (p->left) {
+        p = p->left;
+        *offsetp += p->rel_offset;
+        while (p->right) {
+            p = p->right;
+            *offsetp += p->rel_offset;
+        }
+        return unconst(QEProperty *)p;
+    }
+    while (p->parent && p->parent->left == p) {
+        *offsetp -= p->rel_offset;
+        p = p->parent;
+    }
+    *offsetp -= p->rel_offset;
+    return p->parent;
+}
+
+/* return the first property at or after `offset` if `after` is true,
+ * the last one before `offset` otherwise.
+ */
+static QEProperty *prop_lookup(EditBuffer *b, QEOffset offset, int after,
+                               QEOffset *offsetp)
+{
+    QEProperty *p, *found = NULL;
+    QEOffset pos = 0, found_pos = 0;
+
+    for (p = b->property_tree; p;) {
+        pos += p->rel_offset;
+        if ((pos >= offset) == after) {
+            found = p;
+            found_pos = pos;
+            p = after ? p->left : p->right;
+        } else {
+            p = after ? p->right : p->left;
+        }
+    }
+    *offsetp = found_pos;
+    return found;
+}
+
+/* move property `x` above its parent, preserving the offset order */
+static void prop_rotate_up(EditBuffer *b, QEProperty *x)
+{
+    QEProperty *p = x->parent;
+    QEProperty *g = p->parent;
+    QEProperty *c;
+    QEOffset x_rel = x->rel_offset;
+
+    if (p->left == x) {
+        c = p->left = x->right;
+        x->right = p;
+    } else {
+        c = p->right = x->left;
+        x->left = p;
+    }
+    if (c) {
+        c->parent = p;
+        c->rel_offset += x_rel;
+    }
+    x->rel_offset = x_rel + p->rel_offset;
+    p->rel_offset = -x_rel;
+    p->parent = x;
+    x->parent = g;
+    if (!g)
+        b->property_tree = x;
+    else
+    if (g->left == p)
+        g->left = x;
+    else
+        g->right = x;
+}
+
+/* unlink property `p` from the tree and free it */
+static void prop_delete(EditBuffer *b, QEProperty *p)
+{
+    QEProperty *child;
+
+    /* rotate the property down until it has at most one child */
+    while (p->left && p->right) {
+        if (p->left->prio > p->right->prio)
+            prop_rotate_up(b, p->left);
+        else
+            prop_rotate_up(b, p->right);
+    }
+    child = p->left ? p->left : p->right;
+    if (child) {
+        child->parent = p->parent;
+        child->rel_offset += p->rel_offset;
+    }
+    if (!p->parent)
+        b->property_tree = child;
+    else
+    if (p->parent->left == p)
+        p->parent->left = child;
+    else
+        p->parent->right = child;
+
+    if (p->type & QE_PROP_FREE) {
+        qe_free(&p->data);
+    }
+    qe_free(&p);
+}
+
+/* remove the properties between `offset` and `offset2` */
+static void prop_delete_range(EditBuffer *b, QEOffset offset, QEOffset offset2)
+{
+    QEProperty *p;
+    QEOffset pos;
+
+    while ((p = prop_lookup(b, offset, 1, &pos)) != NULL && pos < offset2) {
+        prop_delete(b, p);
+    }
+}
+
+/* add `delta` to the offsets of the properties at or after `offset` */
+static void prop_shift(EditBuffer *b, QEOffset offset, QEOffset delta)
 {
-    QEProperty **pp;
     QEProperty *p;
+    QEOffset base, pos;
+
+    for (p = b->property_tree, base = 0; p;) {
+        pos = base + p->rel_offset;
+        if (pos >= offset) {
+            /* shift the subtree, except its left part */
+            p->rel_offset += delta;
+            base = pos + delta;
+            p = p->left;
+            if (p)
+                p->rel_offset -= delta;
+        } else {
+            base = pos;
+            p = p->right;
+        }
+    }
+}
 
+static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
+                              enum LogOperation op, QEOffset offset, QEOffset size)
+{
     /* update properties */
     if (op == LOGOP_INSERT) {
-        for (p = b->property_list; p; p = p->next) {
-            if (p->offset >= offset)
-                p->offset += size;
-        }
+        prop_shift(b, offset, size);
     } else
     if (op == LOGOP_DELETE) {
-        for (pp = &b->property_list; (p = *pp) != NULL;) {
-            if (p->offset >= offset) {
-                if (p->offset < offset + size) {
-                    /* property is anchored inside block: remove it */
-                    *pp = (*pp)->next;
-                    if (p->type & QE_PROP_FREE) {
-                        qe_free(&p->data);
-                    }
-                    qe_free(&p);
-                    continue;
-                }
-                p->offset -= size;
-            }
-            pp = &(*pp)->next;
-        }
+        /* properties anchored inside block are removed */
+        prop_delete_range(b, offset, offset + size);
+        prop_shift(b, offset + size, -size);
     }
 }
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data) {
-    QEProperty *p;
-    QEProperty **pp;
+void eb_add_property(EditBuffer *b, QEOffset offset, int type, void *data) {
+    QEProperty *p, *q;
+    QEOffset pos;
 
-    if (!b->property_list) {
+    if (!b->property_tree) {
+        /* the callback is still registered if the last property was
+           removed by a deletion */
+        eb_free_callback(b, eb_plist_callback, NULL);
         eb_add_callback(b, eb_plist_callback, NULL, 0);
     }
 
-    for (pp = &b->property_list; (p = *pp) != NULL; pp = &(*pp)->next) {
-        if (p->offset >= offset) {
-            if (p->offset == offset) {
-                if (p->type == type && type == QE_PROP_TAG) {
-                    /* prevent tag duplicates */
-                    if (strequal(p->data, data)) {
-                        if (type & QE_PROP_FREE)
-                            qe_free(&data);
-                        return;
-                    }
-                }
-                continue;
+    if (type == QE_PROP_TAG) {
+        /* prevent tag duplicates */
+        for (p = prop_lookup(b, offset, 1, &pos); p && pos == offset;
+             p = eb_next_property(p, &pos)) {
+            if (p->type == type && strequal(p->data, data)) {
+                if (type & QE_PROP_FREE)
+                    qe_free(&data);
+                return;
             }
-            break;
         }
     }
 
-    p = qe_mallocz(QEProperty);
-    p->offset = offset;
-    p->type = type;
-    p->data = data;
-    p->next = *pp;
-    *pp = p;
-}
-
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type) {
-    QEProperty *found = NULL;
-    QEProperty *p;
-    for (p = b->property_list; p && p->offset < offset2; p = p->next) {
-        if (p->offset >= offset && p->type == type) {
-            /* return the last property between offset and offset2 */
-            found = p;
+    q = qe_mallocz(QEProperty);
+    q->type = type;
+    q->data = data;
+    q->prio = page_random();
+
+    /* insert after the properties at the same offset */
+    pos = 0;
+    for (p = b->property_tree; p;) {
+        pos += p->rel_offset;
+        if (offset < pos) {
+            if (!p->left) {
+                p->left = q;
+                break;
+            }
+            p = p->left;
+        } else {
+            if (!p->right) {
+                p->right = q;
+                break;
+            }
+            p = p->right;
         }
     }
-    return found;
+    q->parent = p;
+    q->rel_offset = offset - pos;
+    if (!p)
+        b->property_tree = q;
+    while (q->parent && q->parent->prio < q->prio)
+        prop_rotate_up(b, q);
 }
 
-void eb_delete_properties(EditBuffer *b, int offset, int offset2) {
+QEProperty *eb_find_property(EditBuffer *b, QEOffset offset, QEOffset offset2, int type) {
     QEProperty *p;
-    QEProperty **pp;
+    QEOffset pos;
+
+    /* return the last property between offset and offset2 */
+    for (p = prop_lookup(b, offset2, 0, &pos); p && pos >= offset;
+         p = eb_prev_property(p, &pos)) {
+        if (p->type == type)
+            return p;
+    }
+    return NULL;
+}
 
-    if (!b->property_list)
+void eb_delete_properties(EditBuffer *b, QEOffset offset, QEOffset offset2) {
+    if (!b->property_tree)
         return;
 
-    for (pp = &b->property_list; (p = *pp) != NULL && p->offset < offset2;) {
-        if (p->offset >= offset && p->offset < offset2) {
-            *pp = (*pp)->next;
-            if (p->type & QE_PROP_FREE) {
-                qe_free(&p->data);
-            }
-            qe_free(&p);
-        } else {
-            pp = &(*pp)->next;
-        }
-    }
-    if (!b->property_list) {
+    prop_delete_range(b, offset, offset2);
+    if (!b->property_tree) {
         eb_free_callback(b, eb_plist_callback, NULL);
     }
 }
@@ -2734,7 +4098,8 @@ void eb_register_data_type(EditBufferDataType *bdt)
 /* Write buffer contents between <start> and <end> to file <filename>,
  * return bytes written or -1 if error
  */
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename)
 {
     if (!b->data_type->buffer_save)
         return -1;
@@ -2745,10 +4110,11 @@ int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
 /* Save buffer contents to buffer associated file, handle backups,
  * return bytes written or -1 if error
  */
-int eb_save_buffer(EditBuffer *b)
+QEOffset eb_save_buffer(EditBuffer *b)
 {
     QEmacsState *qs = &qe_state;
-    int ret, st_mode;
+    QEOffset ret;
+    int st_mode;
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
     struct stat st;
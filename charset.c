@@ -19,6 +19,12 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__TINYC__)
+/* vectorized scanning, see count_units() */
+#define CONFIG_SIMD_SCAN  1
+#include <immintrin.h>  /* before qe.h that poisons malloc and free */
+#endif
+
 #include "qe.h"
 
 /* XXX: Should move this to QEmacsState, and find a way for html2png */
@@ -90,6 +96,183 @@ static unsigned char const utf8_first_code_mask[7] = {
     0, 0, 0x1f, 0xf, 0x7, 0x3, 0x1,
 };
 
+/********************************************************/
+/* Fast scanning primitives.
+ * The get_pos and get_chars charset functions are run over every
+ * modified page, so end of lines and character boundaries are counted
+ * 16 or 32 bytes at a time on x86_64.  The AVX2 kernels are selected
+ * at run time by charset_init() if the CPU supports them.
+ */
+
+/* count the units of `width` bytes equal to `c` in `size` bytes */
+static int count_units_c(const u8 *buf, int size, int width, uint32_t c)
+{
+    int count = 0;
+
+    if (width == 1) {
+        const u8 *p = buf, *p1 = buf + size;
+        while (p < p1)
+            count += (*p++ == c);
+    } else
+    if (width == 2) {
+        const uint16_t *p = (const uint16_t *)(const void *)buf;
+        const uint16_t *p1 = p + (size >> 1);
+        while (p < p1)
+            count += (*p++ == c);
+    } else {
+        const uint32_t *p = (const uint32_t *)(const void *)buf;
+        const uint32_t *p1 = p + (size >> 2);
+        while (p < p1)
+            count += (*p++ == c);
+    }
+    return count;
+}
+
+/* count the UTF-8 character boundaries, ie: the non trailing bytes */
+static int count_utf8_chars_c(const u8 *buf, int size)
+{
+    const u8 *p = buf, *p1 = buf + size;
+    int count = 0;
+
+    while (p < p1) {
+        int c = *p++;
+        count += (c < 0x80 || c >= 0xc0);
+    }
+    return count;
+}
+
+#ifdef CONFIG_SIMD_SCAN
+/* Matching lanes are accumulated as bytes by subtracting the 0xFF
+ * comparison masks and flushed to 64-bit sums every 255 blocks with
+ * psadbw.  Matches on wider units set all their bytes, hence the
+ * division by `width` in the callers.
+ */
+#define SSE2_COUNT(cmp)  do {                                           \
+        __m128i zero = _mm_setzero_si128(), sum = zero;                 \
+        while (size - i >= 16) {                                        \
+            int n = min((size - i) >> 4, 255);                          \
+            __m128i acc = zero;                                         \
+            for (; n-- > 0; i += 16) {                                  \
+                __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(buf + i)); \
+                acc = _mm_sub_epi8(acc, cmp);                           \
+            }                                                           \
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));          \
+        }                                                               \
+        total = (uint64_t)_mm_cvtsi128_si64(sum) +                      \
+                (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)); \
+    } while (0)
+
+#define AVX2_COUNT(cmp)  do {                                           \
+        __m256i zero = _mm256_setzero_si256(), sum = zero;              \
+        __m128i sum2;                                                   \
+        while (size - i >= 32) {                                        \
+            int n = min((size - i) >> 5, 255);                          \
+            __m256i acc = zero;                                         \
+            for (; n-- > 0; i += 32) {                                  \
+                __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(buf + i)); \
+                acc = _mm256_sub_epi8(acc, cmp);                        \
+            }                                                           \
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));    \
+        }                                                               \
+        sum2 = _mm_add_epi64(_mm256_castsi256_si128(sum),               \
+                             _mm256_extracti128_si256(sum, 1));         \
+        total = (uint64_t)_mm_cvtsi128_si64(sum2) +                     \
+                (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum2, sum2)); \
+    } while (0)
+
+static int count_units_sse2(const u8 *buf, int size, int width, uint32_t c)
+{
+    uint64_t total;
+    int i = 0;
+
+    if (width == 1) {
+        __m128i vc = _mm_set1_epi8(c);
+        SSE2_COUNT(_mm_cmpeq_epi8(v, vc));
+    } else
+    if (width == 2) {
+        __m128i vc = _mm_set1_epi16(c);
+        SSE2_COUNT(_mm_cmpeq_epi16(v, vc));
+    } else {
+        __m128i vc = _mm_set1_epi32(c);
+        SSE2_COUNT(_mm_cmpeq_epi32(v, vc));
+    }
+    return (int)(total / width) + count_units_c(buf + i, size - i, width, c);
+}
+
+static int count_utf8_chars_sse2(const u8 *buf, int size)
+{
+    __m128i vmin = _mm_set1_epi8(-65);  /* 0xBF: last trailing byte */
+    uint64_t total;
+    int i = 0;
+
+    SSE2_COUNT(_mm_cmpgt_epi8(v, vmin));
+    return (int)total + count_utf8_chars_c(buf + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int count_units_avx2(const u8 *buf, int size, int width, uint32_t c)
+{
+    uint64_t total;
+    int i = 0;
+
+    if (width == 1) {
+        __m256i vc = _mm256_set1_epi8(c);
+        AVX2_COUNT(_mm256_cmpeq_epi8(v, vc));
+    } else
+    if (width == 2) {
+        __m256i vc = _mm256_set1_epi16(c);
+        AVX2_COUNT(_mm256_cmpeq_epi16(v, vc));
+    } else {
+        __m256i vc = _mm256_set1_epi32(c);
+        AVX2_COUNT(_mm256_cmpeq_epi32(v, vc));
+    }
+    return (int)(total / width) + count_units_c(buf + i, size - i, width, c);
+}
+
+__attribute__((target("avx2")))
+static int count_utf8_chars_avx2(const u8 *buf, int size)
+{
+    __m256i vmin = _mm256_set1_epi8(-65);  /* 0xBF: last trailing byte */
+    uint64_t total;
+    int i = 0;
+
+    AVX2_COUNT(_mm256_cmpgt_epi8(v, vmin));
+    return (int)total + count_utf8_chars_c(buf + i, size - i);
+}
+
+#undef SSE2_COUNT
+#undef AVX2_COUNT
+
+static int (*count_units)(const u8 *buf, int size, int width,
+                          uint32_t c) = count_units_sse2;
+static int (*count_utf8_chars)(const u8 *buf, int size) = count_utf8_chars_sse2;
+#else
+#define count_units       count_units_c
+#define count_utf8_chars  count_utf8_chars_c
+#endif
+
+/* return the start of the last line in the `size` bytes of buf,
+ * which must contain at least one `nl` unit of `width` bytes.
+ */
+static const u8 *last_line_start(const u8 *buf, int size, int width,
+                                 uint32_t nl)
+{
+    const u8 *p = buf + size;
+
+    if (width == 1) {
+        while (p[-1] != nl)
+            p--;
+    } else
+    if (width == 2) {
+        while (((const uint16_t *)(const void *)p)[-1] != nl)
+            p -= 2;
+    } else {
+        while (((const uint32_t *)(const void *)p)[-1] != nl)
+            p -= 4;
+    }
+    return p;
+}
+
 /********************************************************/
 /* raw */
 
@@ -435,60 +618,39 @@ static u8 *encode_utf8(qe__unused__ QECharset *charset, u8 *q, int c)
 static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const u8 *p, *p1, *lp;
-    int nl, line, col;
+    const u8 *lp;
+    int line;
 
     QASSERT(size >= 0);
 
-    line = 0;
-    lp = p = buf;
-    p1 = p + size;
-    nl = s->eol_char;
-
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        lp = p;
-        line++;
-    }
-    /* now compute number of chars (XXX: potential problem if out of
-     * block, but for UTF8 it works) */
-    col = 0;
-    while (lp < p1) {
-        col++;
-        lp += utf8_length[*lp];
-    }
+    lp = buf;
+    line = count_units(buf, size, 1, s->eol_char);
+    if (line)
+        lp = last_line_start(buf, size, 1, s->eol_char);
+    /* now compute number of chars: count character boundaries like
+     * charset_get_chars_utf8 so a UTF-8 sequence split across pages
+     * is counted once. */
     *line_ptr = line;
-    *col_ptr = col;
+    *col_ptr = count_utf8_chars(lp, buf + size - lp);
 }
 
 static int charset_get_chars_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
-    int nb_chars, c;
-    const u8 *buf_end, *buf_ptr;
+    int nb_chars;
 
-    nb_chars = 0;
-    buf_ptr = buf;
-    buf_end = buf_ptr + size;
-    while (buf_ptr < buf_end) {
-        c = *buf_ptr++;
-        if (c == '\n' && s->eol_type == EOL_DOS) {
-            /* ignore \n in EOL_DOS scan, but count \r.
-             * XXX: potentially incorrect if buffer contains
-             * \n not preceded by \r and requires special state
-             * data to handle \r\n sequence at page boundary.
-             */
-            continue;
-        }
-        /* ignoring trailing bytes: will produce incorrect
-         * count on isolated and trailing bytes and overlong
-         * sequences.
+    /* ignoring trailing bytes: will produce incorrect
+     * count on isolated and trailing bytes and overlong
+     * sequences.
+     */
+    nb_chars = count_utf8_chars(buf, size);
+    if (s->eol_type == EOL_DOS) {
+        /* ignore \n in EOL_DOS scan, but count \r.
+         * XXX: potentially incorrect if buffer contains
+         * \n not preceded by \r and requires special state
+         * data to handle \r\n sequence at page boundary.
          */
-        if (c < 0x80 || c >= 0xc0)
-            nb_chars++;
+        nb_chars -= count_units(buf, size, 1, '\n');
     }
     /* CG: nb_chars is the number of character boundaries, trailing
      * UTF-8 sequence at start of buffer is ignored in count while
@@ -607,35 +769,32 @@ static u8 *encode_ucs2le(qe__unused__ QECharset *charset, u8 *p, int c)
 static void charset_get_pos_ucs2(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const uint16_t *p, *p1, *lp;
+    const uint16_t *p1, *lp;
     uint16_t nl, lf;
     union { uint16_t n; char c[2]; } u;
     int line, col;
 
-    line = 0;
-    lp = p = (const uint16_t *)(const void *)buf;
-    p1 = p + (size >> 1);
+    lp = (const uint16_t *)(const void *)buf;
+    p1 = lp + (size >> 1);
+    size = (const u8 *)p1 - buf;
     u.n = 0;
     u.c[s->charset == &charset_ucs2be] = s->eol_char;
     nl = u.n;
     u.c[s->charset == &charset_ucs2be] = '\n';
     lf = u.n;
 
-    if (s->eol_type == EOL_DOS && p < p1 && *p == lf) {
+    if (s->eol_type == EOL_DOS && lp < p1 && *lp == lf) {
         /* Skip \n at start of buffer.
          * Should check for pending skip state */
-        p++;
         lp++;
     }
 
     /* XXX: should handle surrogates */
-    while (p < p1) {
-        if (*p++ == nl) {
-            if (s->eol_type == EOL_DOS && p < p1 && *p == lf)
-                p++;
-            lp = p;
-            line++;
-        }
+    line = count_units(buf, size, 2, nl);
+    if (line) {
+        lp = (const uint16_t *)(const void *)last_line_start(buf, size, 2, nl);
+        if (s->eol_type == EOL_DOS && lp < p1 && *lp == lf)
+            lp++;
     }
     col = p1 - lp;
     *line_ptr = line;
@@ -740,27 +899,19 @@ static int charset_get_chars_ucs2(CharsetDecodeState *s,
 {
     /* XXX: should handle surrogates */
     int count = size >> 1;  /* convert byte count to char16 count */
-    const uint16_t *buf_end, *buf_ptr;
     uint16_t nl;
     union { uint16_t n; char c[2]; } u;
 
     if (s->eol_type != EOL_DOS)
         return count;
 
-    buf_ptr = (const uint16_t *)(const void *)buf;
-    buf_end = buf_ptr + count;
     // XXX: undefined behavior
     u.n = 0;
     u.c[s->charset == &charset_ucs2be] = '\n';
     nl = u.n;
 
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == nl) {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return count - count_units(buf, count * 2, 2, nl);
 }
 
 static int charset_goto_char_ucs2(CharsetDecodeState *s,
@@ -884,34 +1035,31 @@ static u8 *encode_ucs4le(qe__unused__ QECharset *charset, u8 *p, int c)
 static void charset_get_pos_ucs4(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const uint32_t *p, *p1, *lp;
+    const uint32_t *p1, *lp;
     uint32_t nl, lf;
     union { uint32_t n; char c[4]; } u;
     int line, col;
 
-    line = 0;
-    lp = p = (const uint32_t *)(const void *)buf;
-    p1 = p + (size >> 2);
+    lp = (const uint32_t *)(const void *)buf;
+    p1 = lp + (size >> 2);
+    size = (const u8 *)p1 - buf;
     u.n = 0;
     u.c[(s->charset == &charset_ucs4be) * 3] = s->eol_char;
     nl = u.n;
     u.c[(s->charset == &charset_ucs4be) * 3] = '\n';
     lf = u.n;
 
-    if (s->eol_type == EOL_DOS && p < p1 && *p == lf) {
+    if (s->eol_type == EOL_DOS && lp < p1 && *lp == lf) {
         /* Skip \n at start of buffer.
          * Should check for pending skip state */
-        p++;
         lp++;
     }
 
-    while (p < p1) {
-        if (*p++ == nl) {
-            if (s->eol_type == EOL_DOS && p < p1 && *p == lf)
-                p++;
-            lp = p;
-            line++;
-        }
+    line = count_units(buf, size, 4, nl);
+    if (line) {
+        lp = (const uint32_t *)(const void *)last_line_start(buf, size, 4, nl);
+        if (s->eol_type == EOL_DOS && lp < p1 && *lp == lf)
+            lp++;
     }
     col = p1 - lp;
     *line_ptr = line;
@@ -1015,27 +1163,19 @@ static int charset_get_chars_ucs4(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
     int count = size >> 2;  /* convert byte count to char32 count */
-    const uint32_t *buf_end, *buf_ptr;
     uint32_t nl;
     union { uint32_t n; char c[4]; } u;
 
     if (s->eol_type != EOL_DOS)
         return count;
 
-    buf_ptr = (const uint32_t *)(const void *)buf;
-    buf_end = buf_ptr + count;
     // XXX: undefined behavior
     u.n = 0;
     u.c[(s->charset == &charset_ucs4be) * 3] = '\n';
     nl = u.n;
 
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == nl) {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return count - count_units(buf, count * 4, 4, nl);
 }
 
 static int charset_goto_char_ucs4(CharsetDecodeState *s,
@@ -1582,32 +1722,26 @@ u8 *encode_8bit(QECharset *charset, u8 *q, int c)
 void charset_get_pos_8bit(CharsetDecodeState *s, const u8 *buf, int size,
                           int *line_ptr, int *col_ptr)
 {
-    const u8 *p, *p1, *lp;
+    const u8 *p1, *lp;
     int nl, line, col;
 
     QASSERT(size >= 0);
 
-    line = 0;
-    lp = p = buf;
-    p1 = p + size;
+    lp = buf;
+    p1 = buf + size;
     nl = s->eol_char;
 
-    if (s->eol_type == EOL_DOS && p < p1 && *p == '\n') {
+    if (s->eol_type == EOL_DOS && lp < p1 && *lp == '\n') {
         /* Skip \n at start of buffer.
          * Should check for pending skip state */
-        p++;
         lp++;
     }
 
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        if (s->eol_type == EOL_DOS && p < p1 && *p == '\n')
-            p++;
-        lp = p;
-        line++;
+    line = count_units(buf, size, 1, nl);
+    if (line) {
+        lp = last_line_start(buf, size, 1, nl);
+        if (s->eol_type == EOL_DOS && lp < p1 && *lp == '\n')
+            lp++;
     }
     col = p1 - lp;
     *line_ptr = line;
@@ -1647,21 +1781,11 @@ int charset_goto_line_8bit(CharsetDecodeState *s,
 int charset_get_chars_8bit(CharsetDecodeState *s,
                            const u8 *buf, int size)
 {
-    int count = size;
-    const u8 *buf_end, *buf_ptr;
-
     if (s->eol_type != EOL_DOS)
-        return count;
+        return size;
 
-    buf_ptr = buf;
-    buf_end = buf_ptr + count;
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == '\n') {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return size - count_units(buf, size, 1, '\n');
 }
 
 int charset_goto_char_8bit(CharsetDecodeState *s,
@@ -1691,6 +1815,13 @@ int charset_goto_char_8bit(CharsetDecodeState *s,
 /********************************************************/
 
 void charset_init(void) {
+#ifdef CONFIG_SIMD_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        count_units = count_units_avx2;
+        count_utf8_chars = count_utf8_chars_avx2;
+    }
+#endif
     qe_register_charset(&charset_raw);
     qe_register_charset(&charset_8859_1);
     qe_register_charset(&charset_vt100);
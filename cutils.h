@@ -251,8 +251,8 @@ static inline int min_uint(unsigned int a, unsigned int b) {
         return b;
 }
 
-static inline int compute_percent(int a, int b) {
-    return b <= 0 ? 0 : (int)((long long)a * 100 / b);
+static inline int compute_percent(long long a, long long b) {
+    return b <= 0 ? 0 : (int)(a * 100 / b);
 }
 
 static inline int align(int a, int n) {
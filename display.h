@@ -135,6 +135,10 @@ struct QEditScreen {
     int clip_x1, clip_y1;
     int clip_x2, clip_y2;
     void *priv_data;
+    /* statistics, see describe-performance */
+    int64_t flush_usec;     /* total time spent in dpy_flush() */
+    int64_t output_bytes;   /* total bytes written to the terminal */
+    int64_t output_writes;  /* total write() calls to the terminal */
 };
 
 int qe_register_display(QEDisplay *dpy);
@@ -149,7 +153,9 @@ static inline void dpy_close(QEditScreen *s)
 
 static inline void dpy_flush(QEditScreen *s)
 {
+    int start_time = get_clock_usec();
     s->dpy.dpy_flush(s);
+    s->flush_usec += get_clock_usec() - start_time;
 }
 
 static inline QEFont *open_font(QEditScreen *s,
@@ -23,12 +23,12 @@
 #include "qe.h"
 #include "variables.h"
 
-static int qe_skip_comments(EditState *s, int offset, int *offsetp)
+static int qe_skip_comments(EditState *s, QEOffset offset, QEOffset *offsetp)
 {
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, len, pos;
-    int offset0, offset1;
+    QEOffset offset0, offset1;
 
     if (!s->colorize_func && !s->b->b_styles)
         return 0;
@@ -51,9 +51,9 @@ static int qe_skip_comments(EditState *s, int offset, int *offsetp)
     return 1;
 }
 
-static int eb_skip_spaces(EditBuffer *b, int offset, int *offsetp)
+static int eb_skip_spaces(EditBuffer *b, QEOffset offset, QEOffset *offsetp)
 {
-    int offset0 = offset, offset1;
+    QEOffset offset0 = offset, offset1;
 
     while (offset < b->total_size
         && qe_isspace(eb_nextc(b, offset, &offset1))) {
@@ -67,10 +67,10 @@ static int eb_skip_spaces(EditBuffer *b, int offset, int *offsetp)
 }
 
 static void compare_resync(EditState *s1, EditState *s2,
-                           int save1, int save2,
-                           int *offset1_ptr, int *offset2_ptr)
+                           QEOffset save1, QEOffset save2,
+                           QEOffset *offset1_ptr, QEOffset *offset2_ptr)
 {
-    int pos1, off1, pos2, off2;
+    QEOffset pos1, off1, pos2, off2;
     int ch1, ch2;
 
     off1 = save1;
@@ -114,7 +114,8 @@ void do_compare_windows(EditState *s, int argval)
     QEmacsState *qs = s->qe_state;
     EditState *s1;
     EditState *s2;
-    int offset1, offset2, size1, size2, ch1, ch2;
+    QEOffset offset1, offset2, size1, size2;
+    int ch1, ch2;
     int tries, resync = 0;
     char buf1[MAX_CHAR_BYTES + 2], buf2[MAX_CHAR_BYTES + 2];
     const char *comment = "";
@@ -197,10 +198,11 @@ void do_compare_windows(EditState *s, int argval)
                 }
             }
             if (resync) {
-                int save1 = s1->offset, save2 = s2->offset;
+                QEOffset save1 = s1->offset, save2 = s2->offset;
                 compare_resync(s1, s2, save1, save2, &s1->offset, &s2->offset);
-                put_status(s, "Skipped %d and %d bytes",
-                           s1->offset - save1, s2->offset - save2);
+                put_status(s, "Skipped %lld and %lld bytes",
+                           (long long)(s1->offset - save1),
+                           (long long)(s2->offset - save2));
                 break;
             }
             put_status(s, "%sDifference: '%s' [0x%02X] <-> '%s' [0x%02X]", comment,
@@ -272,7 +274,7 @@ void do_compare_files(EditState *s, const char *filename, int bflags)
 
 void do_delete_horizontal_space(EditState *s)
 {
-    int from, to, offset;
+    QEOffset offset, from, to;
 
     /* boundary check unnecessary because eb_prevc returns '\n'
      * at bof and eof and qe_isblank return true only on SPC and TAB.
@@ -293,13 +295,13 @@ static void do_delete_blank_lines(EditState *s) {
      * On isolated blank line, delete that one.
      * On nonblank line, delete any immediately following blank lines.
      */
-    int p0, p1, p2, p3;
+    QEOffset p0, p1, p2, p3;
     EditBuffer *b = s->b;
 
     p0 = p1 = eb_goto_bol(b, s->offset);
     if (eb_is_blank_line(b, p1, &p2)) {
         while (p0 > 0) {
-            int offset0 = eb_prev_line(b, p0);
+            QEOffset offset0 = eb_prev_line(b, p0);
             if (!eb_is_blank_line(b, offset0, NULL))
                 break;
             p0 = offset0;
@@ -338,14 +340,16 @@ static void do_tabify(EditState *s, int p1, int p2)
      */
     EditBuffer *b = s->b;
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max(0, min(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max(p1, p2));
+    QEOffset offset, offset1, offset2, delta;
     int col;
-    int offset, offset1, offset2, delta;
 
     /* deactivate region hilite */
     s->region_style = 0;
 
+    eb_begin_edit(b);
+
     col = 0;
     offset = eb_goto_bol(b, start);
 
@@ -385,6 +389,7 @@ static void do_tabify(EditState *s, int p1, int p2)
             break;
         }
     }
+    eb_commit_edit(b);
 }
 #if 0
 static void do_tabify_buffer(EditState *s)
@@ -411,14 +416,16 @@ static void do_untabify(EditState *s, int p1, int p2)
      */
     EditBuffer *b = s->b;
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max(0, min(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max(p1, p2));
+    QEOffset offset, offset1, offset2, delta;
     int col, col0;
-    int offset, offset1, offset2, delta;
 
     /* deactivate region hilite */
     s->region_style = 0;
 
+    eb_begin_edit(b);
+
     col = 0;
     offset = eb_goto_bol(b, start);
 
@@ -445,6 +452,7 @@ static void do_untabify(EditState *s, int p1, int p2)
         offset1 += delta;
         stop += delta;
     }
+    eb_commit_edit(b);
 }
 #if 0
 static void do_untabify_buffer(EditState *s)
@@ -530,9 +538,9 @@ static void forward_block(EditState *s, int dir)
     int line_num, col_num, style, style0, c, level;
     int pos;      /* position of the current character on line */
     int len;      /* number of colorized positions */
-    int offset;   /* offset of the current character */
-    int offset0;  /* offset of the beginning of line */
-    int offset1;  /* offset of the beginning of the next line */
+    QEOffset offset;   /* offset of the current character */
+    QEOffset offset0;  /* offset of the beginning of line */
+    QEOffset offset1;  /* offset of the beginning of the next line */
 
     offset = s->offset;
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -597,7 +605,8 @@ static void forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int c1, off;
+                    QEOffset off;
+                    int c1;
                     while ((c1 = eb_prevc(s->b, offset, &off)) != '\n') {
                         offset = off;
                         pos--;
@@ -674,7 +683,8 @@ static void forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int c1, off;
+                    QEOffset off;
+                    int c1;
                     while ((c1 = eb_nextc(s->b, offset, &off)) != '\n') {
                         offset = off;
                         pos++;
@@ -739,7 +749,7 @@ static void do_forward_block(EditState *s, int n)
 
 static void do_kill_block(EditState *s, int n)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (n != 0) {
         do_forward_block(s, n);
@@ -750,8 +760,8 @@ static void do_kill_block(EditState *s, int n)
 void do_transpose(EditState *s, int cmd)
 {
     QEmacsState *qs = s->qe_state;
-    int offset0, offset1, offset2, offset3, end_offset;
-    int size0, size1, size2;
+    QEOffset offset0, offset1, offset2, offset3, end_offset;
+    QEOffset size0, size1, size2;
     EditBuffer *b = s->b;
 
     if (check_read_only(s))
@@ -925,14 +935,16 @@ static void do_describe_function(EditState *s, const char *cmd_name) {
 #define SF_BASENAME   0x40
 #define SF_PARAGRAPH  0x80
 #define SF_SILENT     0x100
-static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags);
+static int eb_sort_span(EditBuffer *b, QEOffset *pp1, QEOffset *pp2,
+                        QEOffset cur_offset, int flags);
 
 static void print_bindings(EditBuffer *b, ModeDef *mode)
 {
     struct QEmacsState *qs = &qe_state;
     char buf[256];
     const CmdDef *d;
-    int gfound, start, stop, i, j;
+    QEOffset start, stop;
+    int gfound, i, j;
 
     start = 0;
     gfound = 0;
@@ -979,7 +991,8 @@ void do_apropos(EditState *s, const char *str)
     EditBuffer *b;
     const CmdDef *d;
     VarDef *vp;
-    int found_command, found_variable, start, stop, i, j;
+    QEOffset start, stop;
+    int found_command, found_variable, i, j;
 
     b = new_help_buffer();
     if (!b)
@@ -1048,7 +1061,8 @@ static void do_about_qemacs(EditState *s)
     EditBuffer *b;
     ModeDef *m;
     const CmdDef *d;
-    int start, stop, i, j;
+    QEOffset start, stop;
+    int i, j;
 
     b = eb_scratch("*About QEmacs*", BF_UTF8);
     eb_printf(b, "\n  %s\n\n%s\n", str_version, str_credits);
@@ -1183,7 +1197,7 @@ static int qe_term_get_style(const char *str, QETermStyle *style)
 
 static void do_set_region_color(EditState *s, const char *str)
 {
-    int offset, size;
+    QEOffset offset, size;
     QETermStyle style;
 
     /* deactivate region hilite */
@@ -1209,7 +1223,7 @@ static void do_set_region_color(EditState *s, const char *str)
 
 static void do_set_region_style(EditState *s, const char *str)
 {
-    int offset, size;
+    QEOffset offset, size;
     QETermStyle style;
     QEStyleDef *st;
 
@@ -1263,10 +1277,10 @@ static void do_describe_buffer(EditState *s, int argval)
     eb_printf(b1, "        name: %s\n", b->name);
     eb_printf(b1, "    filename: %s\n", b->filename);
     eb_printf(b1, "    modified: %d\n", b->modified);
-    eb_printf(b1, "  total_size: %d\n", b->total_size);
-    eb_printf(b1, "        mark: %d\n", b->mark);
-    eb_printf(b1, "   s->offset: %d\n", s->offset);
-    eb_printf(b1, "   b->offset: %d\n", b->offset);
+    eb_printf(b1, "  total_size: %lld\n", (long long)b->total_size);
+    eb_printf(b1, "        mark: %lld\n", (long long)b->mark);
+    eb_printf(b1, "   s->offset: %lld\n", (long long)s->offset);
+    eb_printf(b1, "   b->offset: %lld\n", (long long)b->offset);
 
     eb_printf(b1, "   tab_width: %d\n", b->tab_width);
     eb_printf(b1, " fill_column: %d\n", b->fill_column);
@@ -1328,24 +1342,54 @@ static void do_describe_buffer(EditState *s, int argval)
 
     eb_printf(b1, "   data_type: %s\n", b->data_type->name);
     eb_printf(b1, "       pages: %d\n", b->nb_pages);
+    if (b->nb_pages) {
+        PagePoolStats stats[4];
+        int i, n, nb_small = 0, nb_large = 0, nb_mapped = 0, nb_other = 0;
+        Page *p;
+
+        for (p = eb_first_page(b); p; p = eb_next_page(p)) {
+            if (p->flags & PG_READ_ONLY)
+                nb_mapped++;
+            else
+            if (p->flags & PG_DATA_SMALL)
+                nb_small++;
+            else
+            if (p->flags & PG_DATA_LARGE)
+                nb_large++;
+            else
+                nb_other++;
+        }
+        eb_printf(b1, "  page_slots: small=%d, large=%d, mapped=%d, other=%d\n",
+                  nb_small, nb_large, nb_mapped, nb_other);
+        n = min(eb_page_pool_stats(stats, countof(stats)), countof(stats));
+        for (i = 0; i < n; i++) {
+            eb_printf(b1, "%7s_pool: %d bytes  (used=%d, free=%d, reused=%lld, allocated=%lld)\n",
+                      stats[i].name, stats[i].slot_size,
+                      stats[i].nb_used, stats[i].nb_free,
+                      stats[i].nb_reused, stats[i].nb_allocated);
+        }
+    }
 
     if (b->map_address) {
-        eb_printf(b1, " map_address: %p  (length=%d, handle=%d)\n",
-                  b->map_address, b->map_length, b->map_handle);
+        eb_printf(b1, " map_address: %p  (length=%lld, handle=%d)\n",
+                  b->map_address, (long long)b->map_length, b->map_handle);
     }
 
-    eb_printf(b1, "    save_log: %d  (new_index=%d, current=%d, nb_logs=%d)\n",
-              b->save_log, b->log_new_index, b->log_current, b->nb_logs);
-    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d)\n",
+    eb_printf(b1, "    save_log: %d  (new_index=%lld, current=%lld, nb_logs=%d)\n",
+              b->save_log, (long long)b->log_new_index,
+              (long long)b->log_current, b->nb_logs);
+    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d, runs=%d)\n",
               !!b->b_styles, (long long)b->cur_style,
-              b->style_bytes, b->style_shift);
+              b->style_bytes, b->style_shift,
+              b->b_styles ? b->b_styles->nb_runs : 0);
 
     if (b->total_size > 0) {
         u8 iobuf[4096];
-        int count[256];
-        int total_size = b->total_size;
-        int offset, c, i, col, max_count, count_width;
-        int word_char, word_count, nb_chars, line, column;
+        QEOffset count[256];
+        QEOffset total_size = b->total_size;
+        QEOffset offset, max_count, word_count, nb_chars;
+        int c, i, col, count_width;
+        int word_char, line, column;
 
         eb_get_pos(b, &line, &column, total_size);
         nb_chars = eb_get_char_offset(b, total_size);
@@ -1371,12 +1415,12 @@ static void do_describe_buffer(EditState *s, int argval)
         }
         max_count = 0;
         for (i = 0; i < 256; i++) {
-            max_count = max(max_count, count[i]);
+            max_count = max_offset(max_count, count[i]);
         }
-        count_width = snprintf(NULL, 0, "%d", max_count);
+        count_width = snprintf(NULL, 0, "%lld", (long long)max_count);
 
-        eb_printf(b1, "       chars: %d\n", nb_chars);
-        eb_printf(b1, "       words: %d\n", word_count);
+        eb_printf(b1, "       chars: %lld\n", (long long)nb_chars);
+        eb_printf(b1, "       words: %lld\n", (long long)word_count);
         eb_printf(b1, "       lines: %d\n", line + (column > 0));
 
         eb_printf(b1, "\nByte stats:\n");
@@ -1385,7 +1429,7 @@ static void do_describe_buffer(EditState *s, int argval)
             if (count[i] == 0)
                 continue;
 
-            col += eb_printf(b1, "   %*d  ", count_width, count[i]);
+            col += eb_printf(b1, "   %*lld  ", count_width, (long long)count[i]);
             if (i > 0 && i < 0x7f) {
                 char cbuf[8];
                 byte_quote(cbuf, sizeof cbuf, i);
@@ -1410,7 +1454,7 @@ static void do_describe_buffer(EditState *s, int argval)
         eb_printf(b1, "\nBuffer page layout:\n");
 
         eb_printf(b1, "    page  size  flags  lines   col  chars  addr\n");
-        for (i = 0, p = b->page_table; i < b->nb_pages && i < 100; i++, p++) {
+        for (i = 0, p = eb_first_page(b); p && i < 100; i++, p = eb_next_page(p)) {
             eb_printf(b1, "    %4d  %4d  %5x  %5d  %4d  %5d  %p  |",
                       i, p->size, p->flags, p->nb_lines, p->col, p->nb_chars,
                       (void *)p->data);
@@ -1452,9 +1496,9 @@ static void do_describe_window(EditState *s, int argval)
               (s->flags & WF_MINIBUF) ? " MINIBUF" : "",
               (s->flags & WF_HIDDEN) ? " HIDDEN" : "",
               (s->flags & WF_FILELIST) ? " FILELIST" : "");
-    eb_printf(b1, "%*s: %d\n", w, "offset", s->offset);
-    eb_printf(b1, "%*s: %d\n", w, "offset_top", s->offset_top);
-    eb_printf(b1, "%*s: %d\n", w, "offset_bottom", s->offset_bottom);
+    eb_printf(b1, "%*s: %lld\n", w, "offset", (long long)s->offset);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_top", (long long)s->offset_top);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_bottom", (long long)s->offset_bottom);
     eb_printf(b1, "%*s: %d\n", w, "y_disp", s->y_disp);
     eb_printf(b1, "%*s: %d, %d\n", w, "x_disp[]", s->x_disp[0], s->x_disp[1]);
     eb_printf(b1, "%*s: %d\n", w, "dump_width", s->dump_width);
@@ -1481,9 +1525,19 @@ static void do_describe_window(EditState *s, int argval)
     if (s->last_buffer)
         eb_printf(b1, "%*s: %s\n", w, "last_buffer", s->last_buffer->name);
     eb_printf(b1, "%*s: %s\n", w, "mode", s->mode->name);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_nb_lines", s->colorize_nb_lines);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_nb_valid_lines", s->colorize_nb_valid_lines);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_max_valid_offset", s->colorize_max_valid_offset);
+    if (s->colorizer) {
+        QEColorizeStates *cs = &s->colorizer->states;
+        eb_printf(b1, "%*s: %d\n", w, "colorizer_ref_count",
+                  s->colorizer->ref_count);
+        eb_printf(b1, "%*s: %d\n", w, "colorize_checkpoints",
+                  cs->nb_checkpoints);
+        eb_printf(b1, "%*s: %d\n", w, "colorize_nb_valid_lines",
+                  cs->nb_valid_lines);
+        eb_printf(b1, "%*s: %d\n", w, "colorize_resync_end",
+                  cs->resync_end);
+        eb_printf(b1, "%*s: %lld\n", w, "colorize_max_valid_offset",
+                  (long long)cs->max_valid_offset);
+    }
     eb_printf(b1, "%*s: %d\n", w, "busy", s->busy);
     eb_printf(b1, "%*s: %d\n", w, "display_invalid", s->display_invalid);
     eb_printf(b1, "%*s: %d\n", w, "borders_invalid", s->borders_invalid);
@@ -1528,6 +1582,87 @@ static void do_describe_screen(EditState *e, int argval)
     show_popup(e, b1, "Screen Description");
 }
 
+static void do_describe_performance(EditState *s, int argval)
+{
+    static const char * const stage_names[DSTAT_NB] = {
+        "edit_display", "display_hooks", "windows", "colorize",
+        "bidi", "glyphs", "flush_line", "dpy_flush",
+    };
+    QEmacsState *qs = s->qe_state;
+    QEDisplayStats *st = &qs->display_stats;
+    EditBuffer *b1;
+    EditState *e;
+    int i, n, w;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    n = max(st->nb_frames, 1);
+    w = 16;
+    eb_printf(b1, "\n%*s: %d\n", w, "frames", st->nb_frames);
+    if (qs->display_trace)
+        eb_printf(b1, "%*s: on\n", w, "display trace");
+    eb_printf(b1, "\n%*s  %10s %10s %10s %12s\n", w, "usec",
+              "last", "max", "average", "total");
+    for (i = 0; i < DSTAT_NB; i++) {
+        eb_printf(b1, "%*s: %10lld %10lld %10lld %12lld\n", w, stage_names[i],
+                  (long long)st->last.usec[i], (long long)st->max.usec[i],
+                  (long long)(st->total.usec[i] / n),
+                  (long long)st->total.usec[i]);
+    }
+    eb_printf(b1, "\n%*s  %10s %10s %10s %12s\n", w, "count",
+              "last", "max", "average", "total");
+#define DESCRIBE_COUNT(name, field) \
+    eb_printf(b1, "%*s: %10lld %10lld %10lld %12lld\n", w, name, \
+              (long long)st->last.field, (long long)st->max.field, \
+              (long long)(st->total.field / n), (long long)st->total.field)
+    DESCRIBE_COUNT("lines drawn", lines_drawn);
+    DESCRIBE_COUNT("lines skipped", lines_skipped);
+    DESCRIBE_COUNT("lines colorized", lines_colorized);
+    DESCRIBE_COUNT("lines cached", lines_cached);
+    DESCRIBE_COUNT("lines replayed", lines_replayed);
+    DESCRIBE_COUNT("output bytes", output_bytes);
+    DESCRIBE_COUNT("output writes", output_writes);
+#undef DESCRIBE_COUNT
+
+    eb_printf(b1, "\n%*s  %10s %10s %10s\n", w, "window",
+              "usec", "drawn", "skipped");
+    for (e = qs->first_window; e != NULL; e = e->next_window) {
+        eb_printf(b1, "%*.*s: %10d %10d %10d\n", w, w, e->b->name,
+                  e->display_time, e->display_lines_drawn,
+                  e->display_lines_skipped);
+    }
+    eb_putc(b1, '\n');
+
+    show_popup(s, b1, "Performance");
+}
+
+/* write the redisplay timings of each frame to a file, stop if empty */
+static void do_display_trace(EditState *s, const char *filename)
+{
+    QEmacsState *qs = s->qe_state;
+    char path[MAX_FILENAME_SIZE];
+
+    if (qs->display_trace) {
+        fclose(qs->display_trace);
+        qs->display_trace = NULL;
+        put_status(s, "Display trace stopped");
+    }
+    if (!filename || !*filename)
+        return;
+
+    canonicalize_absolute_path(s, path, sizeof(path), filename);
+    qs->display_trace = fopen(path, "w");
+    if (!qs->display_trace) {
+        put_error(s, "Cannot open %s", path);
+        return;
+    }
+    fprintf(qs->display_trace,
+            "# frame time(ms) then per stage timings in usec and counts\n");
+    put_status(s, "Tracing display timings to %s", path);
+}
+
 /*---------------- buffer contents sorting ----------------*/
 
 struct chunk_ctx {
@@ -1540,12 +1675,13 @@ struct chunk_ctx {
 };
 
 struct chunk {
-    int start, end, offset;
+    QEOffset offset;
+    QEOffset start, end;
     unsigned short c[2];
 };
 
-static int eb_skip_to_basename(EditBuffer *b, int pos) {
-    int base = pos;
+static QEOffset eb_skip_to_basename(EditBuffer *b, QEOffset pos) {
+    QEOffset base = pos;
     int c;
     while ((c = eb_nextc(b, pos, &pos)) != EOF && c != '\n') {
         if (c == '/' || c == '\\')
@@ -1558,7 +1694,7 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     struct chunk_ctx *cp = vp0;
     const struct chunk *p1 = vp1;
     const struct chunk *p2 = vp2;
-    int pos1, pos2;
+    QEOffset pos1, pos2;
 
     if ((++cp->ncmp & 8191) == 8191) {
         QEmacsState *qs = &qe_state;
@@ -1634,15 +1770,17 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     return (p1->start > p2->start) - (p1->start < p2->start);
 }
 
-static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags) {
+static int eb_sort_span(EditBuffer *b, QEOffset *pp1, QEOffset *pp2,
+                        QEOffset cur_offset, int flags) {
     struct chunk_ctx ctx;
     EditBuffer *b1;
-    int p1 = *pp1, p2 = *pp2;
-    int i, j, c, offset, line1, line2, col1, col2, line, col, lines;
+    QEOffset p1 = *pp1, p2 = *pp2;
+    QEOffset offset;
+    int i, j, c, line1, line2, col1, col2, line, col, lines;
     struct chunk *chunk_array;
 
     if (p1 > p2) {
-        int tmp = p1;
+        QEOffset tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1676,7 +1814,7 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
     }
     offset = p1;
     for (i = 0; i < lines && offset < p2; i++) {
-        int pos, pos1;
+        QEOffset pos, pos1;
         pos = offset;
         if (flags & SF_COLUMN) {
             for (col = ctx.col; col-- > 0;) {
@@ -1723,7 +1861,7 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
         chunk_array[i].end = offset = eb_goto_eol(b, pos);
         offset = eb_next(b, offset);
         if (flags & SF_PARAGRAPH) {
-            int offset1;
+            QEOffset offset1;
             /* paragraph sorting: skip continuation lines */
             // XXX: Should ignore initial indent
             while (offset < p2 && qe_isspace(eb_nextc(b, offset, &offset1))) {
@@ -1756,9 +1894,11 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
             dpy_flush(qs->screen);
         }
     }
+    eb_begin_edit(b);
     eb_delete_range(b, p1, p2);
     *pp1 = p1;
     *pp2 = p1 + eb_insert_buffer_convert(b, p1, b1, 0, b1->total_size);
+    eb_commit_edit(b);
     eb_free(&b1);
     qe_free(&chunk_array);
 done:
@@ -1767,7 +1907,8 @@ done:
     return 0;
 }
 
-static void do_sort_span(EditState *s, int p1, int p2, int argval, int flags) {
+static void do_sort_span(EditState *s, QEOffset p1, QEOffset p2,
+                         int argval, int flags) {
     s->region_style = 0;
     if (eb_sort_span(s->b, &p1, &p2, s->offset, flags | argval) < 0) {
         put_status(s, "Out of memory");
@@ -1790,24 +1931,27 @@ static void do_sort_buffer(EditState *s, int argval, int flags) {
 static void tag_buffer(EditState *s) {
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
-    int offset, line_num, col_num;
+    QEOffset offset;
+    int line_num, col_num;
 
     if (s->colorize_func || s->b->b_styles) {
-        /* force complete buffer colorization */
+        /* complete the background colorization of the buffer */
         eb_get_pos(s->b, &line_num, &col_num, s->b->total_size);
         get_colorized_line(s, buf, countof(buf), sbuf,
-                           s->b->total_size, &offset, line_num);
+                           eb_goto_pos(s->b, line_num, 0), &offset, line_num);
     }
 }
 
 static void tag_complete(CompleteState *cp, CompleteFunc enumerate) {
     /* XXX: only support current buffer */
     QEProperty *p;
+    QEOffset pos;
 
     if (cp->target) {
         tag_buffer(cp->target);
 
-        for (p = cp->target->b->property_list; p; p = p->next) {
+        for (p = eb_first_property(cp->target->b, &pos); p;
+             p = eb_next_property(p, &pos)) {
             if (p->type == QE_PROP_TAG) {
                 enumerate(cp, p->data, CT_TEST);
             }
@@ -1819,13 +1963,14 @@ static int tag_print_entry(CompleteState *cp, EditState *s, const char *name) {
     if (cp->target) {
         EditBuffer *b = cp->target->b;
         QEProperty *p;
+        QEOffset pos;
         if (!s->colorize_func && cp->target->colorize_func) {
             set_colorize_func(s, cp->target->colorize_func, cp->target->colorize_mode);
         }
-        for (p = b->property_list; p; p = p->next) {
+        for (p = eb_first_property(b, &pos); p; p = eb_next_property(p, &pos)) {
             if (p->type == QE_PROP_TAG && strequal(p->data, name)) {
-                int offset = eb_goto_bol(b, p->offset);
-                int offset1 = eb_goto_eol(b, p->offset);
+                QEOffset offset = eb_goto_bol(b, pos);
+                QEOffset offset1 = eb_goto_eol(b, pos);
                 return eb_insert_buffer_convert(s->b, s->b->total_size,
                                                 b, offset, offset1 - offset);
             }
@@ -1834,7 +1979,7 @@ static int tag_print_entry(CompleteState *cp, EditState *s, const char *name) {
     return eb_puts(s->b, name);
 }
 
-static int tag_get_entry(EditState *s, char *dest, int size, int offset)
+static int tag_get_entry(EditState *s, char *dest, int size, QEOffset offset)
 {
     int len = eb_fgets(s->b, dest, size, offset, &offset);
     int p2 = strcspn(dest, "=[{(,;");
@@ -1851,12 +1996,13 @@ static int tag_get_entry(EditState *s, char *dest, int size, int offset)
 
 static void do_find_tag(EditState *s, const char *str) {
     QEProperty *p;
+    QEOffset pos;
 
     tag_buffer(s);
 
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = eb_first_property(s->b, &pos); p; p = eb_next_property(p, &pos)) {
         if (p->type == QE_PROP_TAG && strequal(p->data, str)) {
-            s->offset = p->offset;
+            s->offset = pos;
             return;
         }
     }
@@ -1886,6 +2032,7 @@ static void do_list_tags(EditState *s, int argval) {
     char buf[256];
     EditBuffer *b;
     QEProperty *p;
+    QEOffset pos;
     EditState *e1;
 
     b = new_help_buffer();
@@ -1895,11 +2042,11 @@ static void do_list_tags(EditState *s, int argval) {
     tag_buffer(s);
 
     snprintf(buf, sizeof buf, "Tags in file %.*s", 242, s->b->filename);
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = eb_first_property(s->b, &pos); p; p = eb_next_property(p, &pos)) {
         if (p->type == QE_PROP_TAG) {
-            //eb_printf(b, "%12d  %s\n", p->offset, (char*)p->data);
-            int offset = eb_goto_bol(s->b, p->offset);
-            int offset1 = eb_goto_eol(s->b, p->offset);
+            //eb_printf(b, "%12d  %s\n", pos, (char*)p->data);
+            QEOffset offset = eb_goto_bol(s->b, pos);
+            QEOffset offset1 = eb_goto_eol(s->b, pos);
             eb_insert_buffer_convert(b, b->offset, s->b, offset, offset1 - offset);
             eb_putc(b, '\n');
         }
@@ -1917,7 +2064,7 @@ static CompletionDef tag_completion = {
 
 /*---------------- paragraph handling ----------------*/
 
-int eb_next_paragraph(EditBuffer *b, int offset) {
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset) {
     /* find end of paragraph around or after point:
        skip blank lines, if any, then skip non blank lines
        and return start of blank line before text.
@@ -1954,8 +2101,8 @@ void do_mark_paragraph(EditState *s, int n) {
        Interactively if the current region is highlighted, it marks
        the next ARG paragraphs after the ones already marked.
      */
-    int start = s->offset;
-    int end = s->region_style ? s->b->mark : s->offset;
+    QEOffset start = s->offset;
+    QEOffset end = s->region_style ? s->b->mark : s->offset;
     if (n < 0) {
         end = eb_prev_paragraph(s->b, end);
         if (!s->region_style)
@@ -1975,7 +2122,7 @@ void do_mark_paragraph(EditState *s, int n) {
     do_mark_region(s, end, start);
 }
 
-int eb_prev_paragraph(EditBuffer *b, int offset) {
+QEOffset eb_prev_paragraph(EditBuffer *b, QEOffset offset) {
     /* find start of paragraph around or before point:
        skip blank lines, if any, then skip non blank lines
        and return start of blank line after end of text.
@@ -2012,7 +2159,7 @@ void do_kill_paragraph(EditState *s, int n) {
        negative arg -N means kill backward to Nth start of paragraph.
      */
     if (n != 0) {
-        int start = s->offset;
+        QEOffset start = s->offset;
         do_forward_paragraph(s, n);
         do_kill(s, start, s->offset, n, 0);
     }
@@ -2020,8 +2167,10 @@ void do_kill_paragraph(EditState *s, int n) {
 
 /* replace the contents between p1 and p2 with a specified number
    of newlines and spaces */
-static int eb_respace(EditBuffer *b, int p1, int p2, int newlines, int spaces) {
-    int adjust = 0, nb, offset1, c;
+static QEOffset eb_respace(EditBuffer *b, QEOffset p1, QEOffset p2,
+                           int newlines, int spaces) {
+    QEOffset offset1, adjust = 0, nb;
+    int c;
     while (newlines > 0 && p1 < p2) {
         c = eb_nextc(b, p1, &offset1);
         if (c != '\n')
@@ -2060,7 +2209,7 @@ static int eb_respace(EditBuffer *b, int p1, int p2, int newlines, int spaces) {
     return adjust;
 }
 
-static int get_indent_size(EditState *s, int p1, int p2) {
+static int get_indent_size(EditState *s, QEOffset p1, QEOffset p2) {
     int indent_size = 0;
     while (p1 < p2) {
         int c = eb_nextc(s->b, p1, &p1);
@@ -2079,7 +2228,8 @@ static int get_indent_size(EditState *s, int p1, int p2) {
 void do_fill_paragraph(EditState *s)
 {
     /* buffer offsets, byte counts */
-    int par_start, par_end, offset, offset1, chunk_start, word_start;
+    QEOffset offset, offset1;
+    QEOffset par_start, par_end, chunk_start, word_start;
     /* number of characters / screen positions */
     int col, indent0_size, indent_size, word_size;
 
@@ -2095,6 +2245,7 @@ void do_fill_paragraph(EditState *s)
     indent_size = get_indent_size(s, offset, par_end);
 
     /* reflow words to fill lines */
+    eb_begin_edit(s->b);
     col = 0;
     offset = par_start;
     while (offset < par_end) {
@@ -2129,19 +2280,20 @@ void do_fill_paragraph(EditState *s)
             }
             if (col + 1 + word_size > s->b->fill_column) {
                 /* insert newline and indentation */
-                int nb = eb_respace(s->b, chunk_start, word_start, 1, indent_size);
+                QEOffset nb = eb_respace(s->b, chunk_start, word_start, 1, indent_size);
                 offset += nb;
                 par_end += nb;
                 col = indent_size + word_size;
             } else {
                 /* single space the word */
-                int nb = eb_respace(s->b, chunk_start, word_start, 0, 1);
+                QEOffset nb = eb_respace(s->b, chunk_start, word_start, 0, 1);
                 offset += nb;
                 par_end += nb;
                 col += 1 + word_size;
             }
         }
     }
+    eb_commit_edit(s->b);
 }
 
 /*---------------- command and binding definitions ----------------*/
@@ -2255,6 +2407,13 @@ static const CmdDef extra_commands[] = {
     CMD2( "describe-window", "C-h w, C-h C-w",
           "Show information about the current window",
           do_describe_window, ESi, "p")
+    CMD2( "describe-performance", "C-h p",
+          "Show redisplay timings and counters",
+          do_describe_performance, ESi, "p")
+    CMD2( "display-trace", "",
+          "Write redisplay timings for each frame to a file, stop if empty",
+          do_display_trace, ESs,
+          "s{Display trace file: }[file]|file|")
 
     /* XXX: should take region as argument, implicit from keyboard */
     CMD2( "set-region-color", "C-c c",
@@ -91,7 +91,7 @@ void put_error(qe__unused__ EditState *s, const char *fmt, ...)
 
 /* dummy functions */
 int eb_nextc(qe__unused__ EditBuffer *b,
-             qe__unused__ int offset, qe__unused__ int *next_ptr)
+             qe__unused__ QEOffset offset, qe__unused__ QEOffset *next_ptr)
 {
     return 0;
 }
@@ -678,9 +678,10 @@ enum {
 };
 
 /* Normalize indentation at <offset>, return offset past indentation */
-static int normalize_indent(EditState *s, int offset, int indent)
+static QEOffset normalize_indent(EditState *s, QEOffset offset, int indent)
 {
-    int ntabs, nspaces, update, offset0, offset1;
+    QEOffset offset0, offset1;
+    int ntabs, nspaces, update;
 
     if (indent < 0)
         indent = 0;
@@ -765,9 +766,10 @@ static int c_line_has_label(EditState *s, const unsigned int *buf, int len,
    - if the previous line starts with a label, increment the previous indent by one level - c_label_offset
    - by default, indent the line like the previous code line,
 */
-void c_indent_line(EditState *s, int offset0)
+void c_indent_line(EditState *s, QEOffset offset0)
 {
-    int offset, offset1, offsetl, c, pos, line_num, col_num;
+    QEOffset offset, offset1, offsetl;
+    int c, pos, line_num, col_num;
     int i, eoi_found, len, pos1, lpos, style, line_num1, state;
     int off, found_comma, has_else;
     //int found_semi = 0;
@@ -1111,7 +1113,7 @@ static void do_c_indent(EditState *s)
 
 static void do_c_electric_key(EditState *s, int key)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     do_char(s, key, 1);
@@ -1124,7 +1126,7 @@ static void do_c_electric_key(EditState *s, int key)
 
 static void do_c_newline(EditState *s)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     /* XXX: should also remove trailing spaces on current line */
@@ -1136,7 +1138,7 @@ static void do_c_newline(EditState *s)
     if (s->mode->auto_indent && s->mode->indent_func) {
         /* delete blanks at end of line (necessary for non blank lines) */
         /* XXX: should factorize with do_delete_horizontal_space() */
-        int from = offset, to = offset;
+        QEOffset from = offset, to = offset;
         while (qe_isblank(eb_prevc(s->b, from, &offset)))
             from = offset;
         eb_delete_range(s->b, from, to);
@@ -1153,7 +1155,7 @@ static void c_forward_conditional(EditState *s, int dir)
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset0, offset1;
+    QEOffset offset, offset0, offset1;
 
     offset = offset0 = eb_goto_bol(s->b, s->offset);
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -1221,7 +1223,7 @@ static void do_c_list_conditionals(EditState *s)
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset1;
+    QEOffset offset, offset1;
     EditBuffer *b;
 
     b = eb_scratch("Preprocessor conditionals", BF_UTF8);
@@ -84,6 +84,6 @@ enum {
 };
 
 int get_c_identifier(char *buf, int buf_size, const unsigned int *p, int flavor);
-void c_indent_line(EditState *s, int offset0);
+void c_indent_line(EditState *s, QEOffset offset0);
 
 #endif /* CLANG_H */
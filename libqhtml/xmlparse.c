@@ -1074,7 +1074,8 @@ static int xml_tagcmp(const char *s1, const char *s2)
 static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                               EditBuffer *b, int offset_start)
 {
-    int ch, offset, offset0, text_offset_start, ret, offset_end;
+    QEOffset offset;
+    int ch, offset0, text_offset_start, ret, offset_end;
     const char *buf_end, *buf;
 
     buf = buf_start;
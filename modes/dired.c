@@ -104,7 +104,7 @@ struct DiredItem {
     dev_t   rdev;   /* device type, for special file inode */
     time_t  mtime;
     off_t   size;
-    int     offset;
+    QEOffset offset;
     char    hidden;
     char    mark;
     char    name[1];
@@ -1230,7 +1230,7 @@ static void dired_display_hook(EditState *s)
     }
 }
 
-static char *dired_get_default_path(EditBuffer *b, int offset,
+static char *dired_get_default_path(EditBuffer *b, QEOffset offset,
                                     char *buf, int buf_size)
 {
     if (is_directory(b->filename)) {
@@ -1499,8 +1499,9 @@ static int dired_buffer_load(EditBuffer *b, FILE *f)
     return -1;
 }
 
-static int dired_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset dired_buffer_save(EditBuffer *b,
+                                  QEOffset start, QEOffset end,
+                                  const char *filename)
 {
     /* XXX: prevent saving parsed contents to dired file */
     return -1;
@@ -1589,7 +1590,8 @@ static void filelist_display_hook(EditState *s)
     char filename[MAX_FILENAME_SIZE];
     QEmacsState *qs = s->qe_state;
     EditState *e;
-    int i, len, offset, target_line;
+    QEOffset offset;
+    int i, len, target_line;
 
     offset = eb_goto_bol(s->b, s->offset);
     len = eb_fgets(s->b, buf, sizeof(buf), offset, &offset);
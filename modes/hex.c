@@ -41,21 +41,21 @@ static int to_disp(int c)
     return c;
 }
 
-static int hex_backward_offset(EditState *s, int offset)
+static QEOffset hex_backward_offset(EditState *s, QEOffset offset)
 {
-    return align(offset, s->dump_width);
+    return align_offset(offset, s->dump_width);
 }
 
-static int hex_display_line(EditState *s, DisplayState *ds, int offset)
+static QEOffset hex_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int j, len, ateof;
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     unsigned char b;
 
     display_bol(ds);
 
     ds->style = HEX_STYLE_OFFSET;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", (long long)offset);
 
     ateof = 0;
     len = s->b->total_size - offset;
@@ -226,30 +226,30 @@ static int hex_mode_probe(ModeDef *mode, ModeProbeData *p)
 
 static void hex_move_bol(EditState *s)
 {
-    s->offset = align(s->offset, s->dump_width);
+    s->offset = align_offset(s->offset, s->dump_width);
 }
 
 static void hex_move_eol(EditState *s)
 {
-    s->offset = min(align(s->offset, s->dump_width) + s->dump_width - 1,
-                    s->b->total_size);
+    s->offset = min_offset(align_offset(s->offset, s->dump_width) +
+                           s->dump_width - 1, s->b->total_size);
 }
 
 static void hex_move_left_right(EditState *s, int dir)
 {
-    s->offset = clamp(s->offset + dir, 0, s->b->total_size);
+    s->offset = clamp_offset(s->offset + dir, 0, s->b->total_size);
 }
 
 static void hex_move_up_down(EditState *s, int dir)
 {
-    s->offset = clamp(s->offset + dir * s->dump_width, 0, s->b->total_size);
+    s->offset = clamp_offset(s->offset + dir * s->dump_width, 0, s->b->total_size);
 }
 
 void hex_write_char(EditState *s, int key)
 {
     unsigned int cur_ch, ch;
     int hsize, shift, cur_len, len, h;
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     char buf[10];
 
     if (s->hex_mode) {
@@ -271,8 +271,9 @@ void hex_write_char(EditState *s, int key)
             eb_insert(s->b, offset, buf, len);
         } else {
             if (s->unihex_mode) {
-                cur_ch = eb_nextc(s->b, offset, &cur_len);
-                cur_len -= offset;
+                QEOffset offset1;
+                cur_ch = eb_nextc(s->b, offset, &offset1);
+                cur_len = offset1 - offset;
             } else {
                 eb_read(s->b, offset, buf, 1);
                 cur_ch = buf[0];
@@ -315,7 +316,8 @@ void hex_write_char(EditState *s, int key)
 static void hex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "--0x%x--0x%x", s->offset, s->b->total_size);
+    buf_printf(out, "--0x%llx--0x%llx",
+               (long long)s->offset, (long long)s->b->total_size);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
@@ -49,8 +49,8 @@ typedef struct HTMLState {
 /* recompute cursor offset so that it is visible (find closest box) */
 typedef struct {
     CSSContext *ctx;
-    int wanted_offset;
-    int closest_offset;
+    QEOffset wanted_offset;
+    QEOffset closest_offset;
     int dmin;
 } RecomputeOffsetData;
 
@@ -62,7 +62,8 @@ static int recompute_offset_func(void *opaque, CSSBox *box,
     RecomputeOffsetData *data = opaque;
     int offsets[MAX_LINE_SIZE+1];
     unsigned int line_buf[MAX_LINE_SIZE];
-    int len, d, i, offset;
+    QEOffset offset;
+    int len, d, i;
 
     /* XXX: we do not accept empty boxes with spaces. need further
        fixes */
@@ -355,9 +356,9 @@ typedef struct {
     int y_found;
     int y_disp;
     int height;
-    int offset_found;
+    QEOffset offset_found;
     int dir; /* -1: cursor up, 1: cursor bottom */
-    int offsetc;
+    QEOffset offsetc;
 } ScrollContext;
 
 static int scroll_func(void *opaque, CSSBox *box, qe__unused__ int x, int y)
@@ -442,7 +443,7 @@ typedef struct {
     int ydmin;
     int y1;
     int y2;
-    int offsetd;
+    QEOffset offsetd;
     CSSBox *box;
 } MoveContext;
 
@@ -509,7 +510,8 @@ static void html_move_up_down1(EditState *s, int dir, int xtarget)
     HTMLState *hs;
     MoveContext m1, *m = &m1;
     CSSRect cursor_pos;
-    int dirc, offset;
+    QEOffset offset;
+    int dirc;
 
     if (!(hs = html_get_state(s, 1)))
         return;
@@ -610,7 +612,8 @@ static void html_move_left_right_visual(EditState *s, int dir)
     HTMLState *hs;
     LeftRightMoveContext m1, *m = &m1;
     CSSRect cursor_pos;
-    int dirc, offset, x0;
+    QEOffset offset;
+    int dirc, x0;
     CSSBox *box;
 
     if (!(hs = html_get_state(s, 1)))
@@ -662,7 +665,8 @@ static void html_move_bol_eol(EditState *s, int dir)
     HTMLState *hs;
     LeftRightMoveContext m1, *m = &m1;
     CSSRect cursor_pos;
-    int dirc, offset, x0, xtarget;
+    QEOffset offset;
+    int dirc, x0, xtarget;
     CSSBox *box;
 
     if (!(hs = html_get_state(s, 1)))
@@ -698,7 +702,7 @@ static void html_move_bol_eol(EditState *s, int dir)
 
 static void html_move_bol(EditState *s)
 {
-    int offset;
+    QEOffset offset;
     offset = s->offset;
     html_move_bol_eol(s, 1);
     /* XXX: hack to allow to go back on left side */
@@ -755,7 +759,7 @@ static void html_mouse_goto(EditState *s, int x, int y)
 {
     HTMLState *hs;
     MouseGotoContext m1, *m = &m1;
-    int offset;
+    QEOffset offset;
 
     if (!(hs = html_get_state(s, 1)))
         return;
@@ -783,8 +787,8 @@ static void html_mouse_goto(EditState *s, int x, int y)
 static void html_callback(qe__unused__ EditBuffer *b,
                           void *opaque, qe__unused__ int arg,
                           qe__unused__ enum LogOperation op,
-                          qe__unused__ int offset,
-                          qe__unused__ int size)
+                          qe__unused__ QEOffset offset,
+                          qe__unused__ QEOffset size)
 {
     HTMLState *hs = opaque;
 
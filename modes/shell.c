@@ -56,14 +56,18 @@ typedef struct ShellState {
     /* buffer state */
     int cols, rows;
     int use_alternate_screen;
-    int screen_top, alternate_screen_top;
+    QEOffset screen_top, alternate_screen_top;
     int scroll_top, scroll_bottom;  /* scroll region (top included, bottom excluded) */
     int pty_fd;
     int pid; /* -1 if not launched */
     unsigned int attr, fgcolor, bgcolor, reverse;
-    int cur_offset; /* current offset at position x, y */
-    int cur_offset_hack; /* the target position is in the middle of a wide glyph */
-    int cur_prompt; /* offset of end of prompt on current line */
+    QEOffset cur_offset; /* current offset at position x, y */
+    QEOffset cur_offset_hack; /* the target position is in the middle of a wide glyph */
+    QEOffset cur_prompt; /* offset of end of prompt on current line */
+    QEOffset pos_offset; /* last position computed by qe_term_get_pos() */
+    QEOffset pos_row;    /* start of the screen row of pos_offset */
+    QEOffset pos_top;    /* screen top for the positions, -1 if invalid */
+    int pos_x, pos_y, pos_cols;
     int save_x, save_y;
     int nb_params;
     int params[MAX_CSI_PARAMS + 1];
@@ -94,7 +98,7 @@ typedef struct ShellState {
 
 /* CG: these variables should be encapsulated in a global structure */
 static char error_buffer[MAX_BUFFERNAME_SIZE];
-static int error_offset = -1;
+static QEOffset error_offset = -1;
 static int error_line_num = -1;
 static int error_col_num = -1;
 static char error_filename[MAX_FILENAME_SIZE];
@@ -103,10 +107,10 @@ static char error_filename[MAX_FILENAME_SIZE];
 #define SR_REFRESH      2
 #define SR_SILENT       4
 static void do_shell_refresh(EditState *e, int flags);
-static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size);
+static char *shell_get_curpath(EditBuffer *b, QEOffset offset,
+                               QEOffset min_offset, char *buf, int buf_size);
 
-static void set_error_offset(EditBuffer *b, int offset)
+static void set_error_offset(EditBuffer *b, QEOffset offset)
 {
     pstrcpy(error_buffer, sizeof(error_buffer), b ? b->name : "");
     error_offset = offset - 1;
@@ -502,8 +506,9 @@ static inline void qe_term_set_style(ShellState *s) {
 }
 
 /* return offset of the n-th terminal line from a given offset */
-static int qe_term_skip_lines(ShellState *s, int offset, int n) {
-    int x, y, w, offset1, offset2;
+static QEOffset qe_term_skip_lines(ShellState *s, QEOffset offset, int n) {
+    QEOffset offset1, offset2;
+    int x, y, w;
     x = y = 0;
     while (y < n && offset < s->b->total_size) {
         int c = eb_nextc(s->b, offset, &offset1);
@@ -544,10 +549,10 @@ static int qe_term_skip_lines(ShellState *s, int offset, int n) {
 }
 
 typedef struct ShellPos {
-    int screen_start; /* offset of the start of row 0 */
-    int line_start; /* offset of the start of current row */
-    int offset;     /* offset of the glyph */
-    int line_end;   /* offset of the newline or the first character that wraps */
+    QEOffset screen_start; /* offset of the start of row 0 */
+    QEOffset line_start; /* offset of the start of current row */
+    QEOffset offset;     /* offset of the glyph */
+    QEOffset line_end;   /* offset of the newline or the first character that wraps */
     int row;        /* row of the target offset */
     int col;        /* column of the target (0 based, newline may have col == s->cols) */
     int end_col;    /* column of the end of line_end */
@@ -562,18 +567,20 @@ typedef struct ShellPos {
 } ShellPos;
 
 #define SP_NO_UPDATE  1
-static int qe_term_get_pos2(ShellState *s, int destoffset, ShellPos *spp, int flags) {
-    int offset, offset0, offset1, start_offset, line_offset;
+static QEOffset qe_term_get_pos2(ShellState *s, QEOffset destoffset, ShellPos *spp, int flags) {
+    QEOffset offset, offset0, offset1, start_offset, line_offset;
     int c, x, y, w, gpflags;
 
     if (s->use_alternate_screen) {
-        start_offset = minp(&s->alternate_screen_top, s->b->total_size);
+        start_offset = s->alternate_screen_top =
+            min_offset(s->alternate_screen_top, s->b->total_size);
     } else {
-        start_offset = minp(&s->screen_top, s->b->total_size);
+        start_offset = s->screen_top =
+            min_offset(s->screen_top, s->b->total_size);
     }
     if (spp) {
         gpflags = 0;
-        destoffset = clamp(destoffset, 0, s->b->total_size);
+        destoffset = clamp_offset(destoffset, 0, s->b->total_size);
         offset = offset0 = line_offset = start_offset;
         for (x = y = 0; offset < destoffset;) {
             offset0 = offset;
@@ -681,23 +688,61 @@ static int qe_term_get_pos2(ShellState *s, int destoffset, ShellPos *spp, int fl
     return start_offset;
 }
 
-static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
-    int offset, offset1, c;
-    int x, y, w, start_offset;
+/* invalidate the qe_term_get_pos() cache if text changes before it */
+static void qe_term_pos_callback(qe__unused__ EditBuffer *b, void *opaque,
+                                 qe__unused__ int arg, enum LogOperation op,
+                                 QEOffset offset, qe__unused__ QEOffset size)
+{
+    ShellState *s = opaque;
+
+    if (offset < s->pos_row || op == LOGOP_FREE) {
+        s->pos_top = -1;
+    } else
+    if (offset < s->pos_offset) {
+        /* fall back to the start of the row */
+        s->pos_offset = s->pos_row;
+        s->pos_x = 0;
+    }
+}
+
+static QEOffset qe_term_get_pos(ShellState *s, QEOffset destoffset, int *px, int *py) {
+    QEOffset offset, offset0, offset1, row;
+    int c;
+    QEOffset start_offset;
+    int x, y, w;
 
     if (s->use_alternate_screen) {
-        start_offset = minp(&s->alternate_screen_top, s->b->total_size);
+        start_offset = s->alternate_screen_top =
+            min_offset(s->alternate_screen_top, s->b->total_size);
     } else {
-        start_offset = minp(&s->screen_top, s->b->total_size);
+        start_offset = s->screen_top =
+            min_offset(s->screen_top, s->b->total_size);
     }
     if (px || py) {
-        destoffset = clamp(destoffset, 0, s->b->total_size);
+        destoffset = clamp_offset(destoffset, 0, s->b->total_size);
         offset = start_offset;
-        for (x = y = 0; offset < destoffset;) {
+        row = offset;
+        x = y = 0;
+        if (s->pos_top == start_offset && s->pos_cols == s->cols
+        &&  s->pos_row <= destoffset) {
+            /* resume from the previous position or the start of its row
+               instead of scanning the whole screen for each output line */
+            row = s->pos_row;
+            y = s->pos_y;
+            if (s->pos_offset <= destoffset) {
+                offset = s->pos_offset;
+                x = s->pos_x;
+            } else {
+                offset = row;
+            }
+        }
+        for (; offset < destoffset;) {
+            offset0 = offset;
             c = eb_nextc(s->b, offset, &offset);
             if (c == '\n') {
                 y++;
                 x = 0;
+                row = offset;
             } else
             if (c == '\t') {
                 w = (x + 8) & ~7;
@@ -712,6 +757,7 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
                         /* wide character at EOL actually wraps to next line */
                         y++;
                         x = w;
+                        row = offset0;
                     } else {
                         /* aggregate all accents */
                         while (qe_isaccent(c = eb_nextc(s->b, offset, &offset1)))
@@ -719,11 +765,21 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
                         if (c != '\n') {
                             y++;
                             x = 0;
+                            row = offset;
                         }
                     }
                 }
             }
         }
+        s->pos_top = -1;
+        if (offset == destoffset) {
+            s->pos_offset = offset;
+            s->pos_row = row;
+            s->pos_top = start_offset;
+            s->pos_x = x;
+            s->pos_y = y;
+            s->pos_cols = s->cols;
+        }
         if (x >= s->cols - 1 && offset == destoffset) {
             /* check if current glyph causes line wrap */
             c = eb_nextc(s->b, offset, &offset1);
@@ -736,6 +792,10 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
             // XXX: should take a flag to make this optional
             /* adjust start if row is too far */
             start_offset = qe_term_skip_lines(s, start_offset, y - s->rows + 1);
+            if (s->pos_top >= 0) {
+                s->pos_top = start_offset;
+                s->pos_y -= y - (s->rows - 1);
+            }
             y = s->rows - 1;
             /* update screen_top */
             if (s->use_alternate_screen)
@@ -764,17 +824,18 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
 #define TG_RELATIVE      0x03
 #define TG_NOCLIP        0x04
 #define TG_NOEXTEND      0x08
-static int qe_term_goto_pos(ShellState *s, int offset, int destx, int desty, int flags) {
-    int x, y, w, x1, y1, start_offset, offset1, offset2, c;
+static QEOffset qe_term_goto_pos(ShellState *s, QEOffset offset, int destx, int desty, int flags) {
+    QEOffset start_offset, offset1, offset2;
+    int x, y, w, x1, y1, c, x0 = 0, y0 = 0;
 
     s->cur_offset_hack = 0;
 
     if (flags & TG_RELATIVE) {
-        start_offset = qe_term_get_pos(s, offset, &x, &y);
+        start_offset = qe_term_get_pos(s, offset, &x0, &y0);
         if (flags & TG_RELATIVE_COL)
-            destx += x;
+            destx += x0;
         if (flags & TG_RELATIVE_ROW)
-            desty += y;
+            desty += y0;
     } else {
         start_offset = qe_term_get_pos(s, offset, NULL, NULL);
     }
@@ -792,7 +853,19 @@ static int qe_term_goto_pos(ShellState *s, int offset, int destx, int desty, int
     //TRACE_PRINTF(s, "goto col=%d row=%d flags=%d\n", destx, desty, flags);
 
     x = y = 0;
-    offset = start_offset;
+    if ((flags & TG_RELATIVE) && s->pos_top == start_offset
+    &&  s->pos_offset == offset && s->pos_x == x0 && s->pos_y == y0
+    &&  y0 <= desty) {
+        /* the destination is after the current position or the start
+           of its row */
+        y = y0;
+        if (y0 < desty || x0 <= destx)
+            x = x0;
+        else
+            offset = s->pos_row;
+    } else {
+        offset = start_offset;
+    }
     while (y < desty || x < destx) {
         if (offset >= s->b->total_size) {
             // XXX: inefficient: should only test if '\n'
@@ -908,10 +981,10 @@ static void qe_term_goto_tab(ShellState *s, int n) {
  * of width w.
  * Must replace overwritten wide glyphs with spaces
  */
-static int qe_term_overwrite(ShellState *s, int offset, int w,
-                             const char *buf, int len)
+static QEOffset qe_term_overwrite(ShellState *s, QEOffset offset, int w,
+                                  const char *buf, int len)
 {
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     int c1, c2, w1, x, y, x1;
 
     // XXX: bypass all these tests if at end of buffer?
@@ -995,9 +1068,10 @@ static int qe_term_overwrite(ShellState *s, int offset, int w,
     return offset + len;
 }
 
-static int qe_term_delete_lines(ShellState *s, int offset, int n)
+static QEOffset qe_term_delete_lines(ShellState *s, QEOffset offset, int n)
 {
-    int i, offset1, offset2;
+    QEOffset offset1, offset2;
+    int i;
 
     // XXX: should scan buffer contents to handle line wrapping
     // XXX: should insert a newline if offset is inside a wrapping line
@@ -1013,7 +1087,7 @@ static int qe_term_delete_lines(ShellState *s, int offset, int n)
     return offset;
 }
 
-static int qe_term_insert_lines(ShellState *s, int offset, int n)
+static QEOffset qe_term_insert_lines(ShellState *s, QEOffset offset, int n)
 {
     if (n > 0) {
         // XXX: tricky if offset is in the middle of a wrapping line
@@ -1363,11 +1437,12 @@ static unsigned char const sco_color[16] = {
 
 static void qe_term_emulate(ShellState *s, int c)
 {
-    int i, param1, param2, len, offset, offset1, offset2;
+    QEOffset offset, offset1, offset2;
+    int i, param1, param2, len;
     ShellPos pos;
     char buf1[10];
 
-    offset = clampp(&s->cur_offset, 0, s->b->total_size);
+    offset = s->cur_offset = clamp_offset(s->cur_offset, 0, s->b->total_size);
 
     if (s->state == QE_TERM_STATE_NORM) {
         s->term_pos = 0;
@@ -1624,7 +1699,8 @@ static void qe_term_emulate(ShellState *s, int c)
         case 'M':   // Reverse Index (RI  is 0x8d). [ri]
                     // move cursor up, scroll if at top line
             {
-                int start, offset3, col, row;
+                QEOffset start, offset3;
+                int col, row;
                 start = qe_term_get_pos(s, offset, &col, &row);
                 if (--row < 0) {
                     /* if (start == 0) */ {
@@ -1801,7 +1877,8 @@ static void qe_term_emulate(ShellState *s, int c)
         switch (ESC2(s->esc1,c)) {
         case '@':  /* ICH: Insert Ps (Blank) Character(s) (default = 1) */
             {
-                int x, y, x1, y1, c2, offset3;
+                QEOffset offset3;
+                int x, y, x1, y1, c2;
                 // XXX: should simplify this mess
                 offset1 = offset;
                 while (param1-- > 0) {
@@ -1863,7 +1940,8 @@ static void qe_term_emulate(ShellState *s, int c)
             /* XXX: should just force top of window to in infinite scroll mode */
             {   /*     0: Below (default), 1: Above, 2: All, 3: Saved Lines (xterm) */
                 /* XXX: should handle eol style */
-                int offset0, bos, eos, col, row;
+                QEOffset offset0;
+                int bos, eos, col, row;
 
                 bos = eos = 0;
                 // default param is 0
@@ -1905,7 +1983,8 @@ static void qe_term_emulate(ShellState *s, int c)
         case ESC2('?','K'):  /* DECSEL: Selective Erase in Line. */
             {   /*     0: to Right (default), 1: to Left, 2: All */
                 /* XXX: should handle eol style */
-                int col, row, col2, row2, n1, n2, offset3;
+                QEOffset offset3;
+                int col, row, col2, row2, n1, n2;
 
                 // XXX: should use qe_term_get_pos2()
                 qe_term_get_pos(s, offset, &col, &row);
@@ -2314,79 +2393,100 @@ static void qe_term_emulate(ShellState *s, int c)
 
 /* buffer related functions */
 
-/* called when characters are available from the process */
+/* called when characters are available from the process.
+ * The pty is drained for at most SHELL_READ_SLICE milliseconds and the
+ * redisplay is left to the frame scheduler, so that a fast producer
+ * fills the buffer in large chunks instead of triggering a redisplay
+ * for each read().
+ */
+#define SHELL_READ_SLICE  20  /* milliseconds */
+
 static void shell_read_cb(void *opaque)
 {
     ShellState *s = opaque;
     QEmacsState *qs;
     EditBuffer *b;
     unsigned char buf[16 * 1024];
-    int len, i, save_readonly;
+    int len, i, save_readonly, start_time;
 
     if (!s || s->base.mode != &shell_mode)
         return;
 
-    len = read(s->pty_fd, buf, sizeof(buf));
-    if (len <= 0)
-        return;
-
     b = s->b;
     qs = s->qe_state;
-    if (qs->trace_buffer)
-        eb_trace_bytes(buf, len, EB_TRACE_SHELL);
+    start_time = get_clock_ms();
 
     /* Suspend BF_READONLY flag to allow shell output to readonly buffer */
     save_readonly = b->flags & BF_READONLY;
     b->flags &= ~BF_READONLY;
     b->last_log = 0;
 
-    if (s->shell_flags & SF_COLOR) {
-        /* optional terminal emulation (shell, ssh, make, latex, man modes) */
-        for (i = 0; i < len; i++) {
-            qe_term_emulate(s, buf[i]);
-        }
-        if (s->last_char == '\000' || s->last_char == '\001'
-        ||  s->last_char == '\003'
-        ||  s->last_char == '\r' || s->last_char == '\n') {
-            /* if the last char sent to the process was the enter key, C-C
-             * to kill the process, C-A to go to beginning of line, or if
-             * nothing was sent to the process yet, assume the process is
-             * prompting for input and save the current input position as
-             * the start of input.
-             */
-            s->cur_prompt = s->cur_offset;
-            if (qs->active_window
-            &&  qs->active_window->b == b
-            &&  qs->active_window->interactive) {
-                /* Set mark to potential tentative position (useful?) */
-                b->mark = s->cur_prompt;
+    for (;;) {
+        len = read(s->pty_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+
+        if (qs->trace_buffer)
+            eb_trace_bytes(buf, len, EB_TRACE_SHELL);
+
+        if (s->shell_flags & SF_COLOR) {
+            QEOffset start = s->cur_offset;
+
+            /* optional terminal emulation (shell, ssh, make, latex, man modes) */
+            for (i = 0; i < len; i++) {
+                qe_term_emulate(s, buf[i]);
             }
-        }
-        shell_get_curpath(b, s->cur_offset, s->curpath, sizeof(s->curpath));
-    } else {
-        int pos = b->total_size;
-        int threshold = 3 << 20;    /* 3MB for large pictures */
-        eb_write(b, b->total_size, buf, len);
-        if (pos < threshold && pos + len >= threshold) {
-            EditState *e;
-            for (e = qs->first_window; e != NULL; e = e->next_window) {
-                if (e->b == b) {
-                    if (s->shell_flags & SF_AUTO_CODING)
-                        do_set_auto_coding(e, 0);
-                    if (s->shell_flags & SF_AUTO_MODE)
-                        qe_set_next_mode(e, 0, 0);
+            if (s->last_char == '\000' || s->last_char == '\001'
+            ||  s->last_char == '\003'
+            ||  s->last_char == '\r' || s->last_char == '\n') {
+                /* if the last char sent to the process was the enter key, C-C
+                 * to kill the process, C-A to go to beginning of line, or if
+                 * nothing was sent to the process yet, assume the process is
+                 * prompting for input and save the current input position as
+                 * the start of input.
+                 */
+                s->cur_prompt = s->cur_offset;
+                if (qs->active_window
+                &&  qs->active_window->b == b
+                &&  qs->active_window->interactive) {
+                    /* Set mark to potential tentative position (useful?) */
+                    b->mark = s->cur_prompt;
+                }
+            }
+            /* only look for a prompt in the new output, the previous
+               one was found already */
+            shell_get_curpath(b, s->cur_offset,
+                              min_offset(start, s->cur_offset),
+                              s->curpath, sizeof(s->curpath));
+        } else {
+            QEOffset pos = b->total_size;
+            int threshold = 3 << 20;    /* 3MB for large pictures */
+            eb_write(b, b->total_size, buf, len);
+            if (pos < threshold && pos + len >= threshold) {
+                EditState *e;
+                for (e = qs->first_window; e != NULL; e = e->next_window) {
+                    if (e->b == b) {
+                        if (s->shell_flags & SF_AUTO_CODING)
+                            do_set_auto_coding(e, 0);
+                        if (s->shell_flags & SF_AUTO_MODE)
+                            qe_set_next_mode(e, 0, 0);
+                    }
                 }
+                /* the modes may have changed */
+                break;
             }
         }
+        /* yield to the event loop and user input */
+        if (s->pty_fd < 0
+        ||  get_clock_ms() - start_time >= SHELL_READ_SLICE
+        ||  is_user_input_pending())
+            break;
     }
     if (save_readonly) {
         b->modified = 0;
         b->flags |= save_readonly;
     }
-
-    /* now we do some refresh (should just invalidate?) */
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    edit_display_request(qs);
 }
 
 static void shell_mode_free(EditBuffer *b, void *state)
@@ -2398,6 +2498,7 @@ static void shell_mode_free(EditBuffer *b, void *state)
     eb_free_callback(b, eb_offset_callback, &s->cur_prompt);
     eb_free_callback(b, eb_offset_callback, &s->alternate_screen_top);
     eb_free_callback(b, eb_offset_callback, &s->screen_top);
+    eb_free_callback(b, qe_term_pos_callback, s);
 
     if (s->pid != -1) {
         sig = SIGINT;
@@ -2552,6 +2653,8 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
         eb_add_callback(b, eb_offset_callback, &s->cur_prompt, 0);
         eb_add_callback(b, eb_offset_callback, &s->alternate_screen_top, 0);
         eb_add_callback(b, eb_offset_callback, &s->screen_top, 0);
+        eb_add_callback(b, qe_term_pos_callback, s, 0);
+        s->pos_top = -1;
     }
     s->b = b;
     s->pty_fd = -1;
@@ -2890,16 +2993,16 @@ static void shell_write_char(EditState *e, int c)
     }
 }
 
-static void shell_delete_bytes(EditState *e, int offset, int size)
+static void shell_delete_bytes(EditState *e, QEOffset offset, QEOffset size)
 {
     ShellState *s = shell_get_state(e, 1);
-    int start = offset;
-    int end = offset + size;
+    QEOffset start = offset;
+    QEOffset end = offset + size;
 
     // XXX: should deal with regions spanning current input line and
     // previous buffer contents
     if (s && !s->grab_keys && end > s->cur_prompt) {
-        int start_char, cur_char, end_char, size1;
+        QEOffset start_char, cur_char, end_char, size1;
         if (start < s->cur_prompt) {
             /* delete part before the interactive input */
             size1 = eb_delete_range(e->b, start, s->cur_prompt);
@@ -2949,7 +3052,7 @@ static void do_shell_newline(EditState *e)
         ShellState *s = shell_get_state(e, 1);
 
         if (s) {
-            shell_get_curpath(e->b, e->offset, s->curpath, sizeof(s->curpath));
+            shell_get_curpath(e->b, e->offset, 0, s->curpath, sizeof(s->curpath));
         }
         shell_write_char(e, '\r');
         /* give the process a chance to handle the input */
@@ -3005,7 +3108,7 @@ static void do_shell_kill_word(EditState *e, int dir)
 
     if (s && e->interactive) {
         /* copy word to the kill ring */
-        int start = e->offset;
+        QEOffset start = e->offset;
 
         // XXX: word pattern is different for shell line editor?
         text_move_word_left_right(e, dir);
@@ -3024,13 +3127,13 @@ static void do_shell_kill_line(EditState *e, int argval)
 {
     ShellState *s = shell_get_state(e, 1);
     int dir = (argval == NO_ARG || argval > 0) ? 1 : -1;
-    int offset, p1 = e->offset, p2 = p1;
+    QEOffset offset, p1 = e->offset, p2 = p1;
 
     if (s && e->interactive) {
         /* ignore count argument in interactive mode */
         if (dir < 0) {
             /* kill backwards upto prompt position */
-            p2 = max(eb_goto_bol(e->b, p1), s->cur_prompt);
+            p2 = max_offset(eb_goto_bol(e->b, p1), s->cur_prompt);
             do_kill(e, p1, p2, dir, 0);
             //shell_write_char(e, KEY_META('k'));
         } else {
@@ -3090,7 +3193,7 @@ static void do_shell_yank(EditState *e)
          * large. Hard coded limit can be removed if shell input is
          * made asynchronous via an auxiliary buffer.
          */
-        int offset;
+        QEOffset offset;
         QEmacsState *qs = e->qe_state;
         EditBuffer *b = qs->yank_buffers[qs->yank_current];
 
@@ -3210,12 +3313,15 @@ static void do_shell_toggle_input(EditState *e)
 
 /* get current directory from prompt on current line */
 /* XXX: should extend behavior to handle more subtile cases */
-static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size)
+/* find the current directory from the last prompt before offset,
+   looking back no further than the line containing min_offset */
+static char *shell_get_curpath(EditBuffer *b, QEOffset offset,
+                               QEOffset min_offset, char *buf, int buf_size)
 {
     char line[1024];
     char curpath[MAX_FILENAME_SIZE];
-    int start, stop0, stop, i, len, offset1;
+    QEOffset offset1;
+    int start, stop0, stop, i, len;
 
     offset = eb_goto_bol(b, offset);
 again:
@@ -3249,25 +3355,24 @@ again:
             return pstrcpy(buf, buf_size, curpath);
         }
     }
-    /* XXX: limit backlook? */
-    if (offset > 0) {
+    if (offset > min_offset) {
         offset = eb_prev_line(b, offset);
         goto again;
     }
     return NULL;
 }
 
-static char *shell_get_default_path(EditBuffer *b, int offset,
+static char *shell_get_default_path(EditBuffer *b, QEOffset offset,
                                     char *buf, int buf_size)
 {
 #if 0
     ShellState *s = qe_get_buffer_mode_data(b, &shell_mode, NULL);
 
-    if (s && (s->curpath[0] || shell_get_curpath(b, offset, s->curpath, sizeof(s->curpath)))) {
+    if (s && (s->curpath[0] || shell_get_curpath(b, offset, 0, s->curpath, sizeof(s->curpath)))) {
         return pstrcpy(buf, buf_size, s->curpath);
     }
 #endif
-    return shell_get_curpath(b, offset, buf, buf_size);
+    return shell_get_curpath(b, offset, 0, buf, buf_size);
 }
 
 static void do_shell_command(EditState *e, const char *cmd)
@@ -3337,7 +3442,7 @@ static void do_next_error(EditState *s, int arg, int dir)
     QEmacsState *qs = s->qe_state;
     EditState *e;
     EditBuffer *b;
-    int offset, found_offset;
+    QEOffset offset, found_offset;
     char filename[MAX_FILENAME_SIZE];
     char fullpath[MAX_FILENAME_SIZE];
     buf_t fnamebuf, *fname;
@@ -3413,7 +3518,7 @@ static void do_next_error(EditState *s, int arg, int dir)
             line_num = line_num * 10 + c - '0';
         }
         if (c == ':' || c == ',' || c == '.') {
-            int offset0 = offset;
+            QEOffset offset0 = offset;
             int c0 = c;
             for (;;) {
                 c = eb_nextc(b, offset, &offset);
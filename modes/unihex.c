@@ -29,15 +29,16 @@ enum {
 static int unihex_mode_init(EditState *s, EditBuffer *b, int flags)
 {
     if (s) {
-        int c, maxc, offset, max_offset, w;
+        QEOffset offset, offset_max;
+        int c, maxc, w;
 
         /* unihex mode is incompatible with EOL_DOS eol type */
         eb_set_charset(s->b, s->b->charset, EOL_UNIX);
 
         /* Compute max width of character in hex dump (limit to first 64K) */
         maxc = 0xFFFF;
-        max_offset = min(65536, s->b->total_size);
-        for (offset = 0; offset < max_offset;) {
+        offset_max = min_offset(65536, s->b->total_size);
+        for (offset = 0; offset < offset_max;) {
             c = eb_nextc(s->b, offset, &offset);
             maxc = max(maxc, c);
         }
@@ -62,20 +63,20 @@ static int unihex_to_disp(int c)
     return c;
 }
 
-static int unihex_backward_offset(EditState *s, int offset)
+static QEOffset unihex_backward_offset(EditState *s, QEOffset offset)
 {
-    int pos;
+    QEOffset pos;
 
     /* CG: beware: offset may fall inside a character */
     pos = eb_get_char_offset(s->b, offset);
-    pos = align(pos, s->dump_width);
+    pos = align_offset(pos, s->dump_width);
     return eb_goto_char(s->b, pos);
 }
 
-static int unihex_display_line(EditState *s, DisplayState *ds, int offset)
+static QEOffset unihex_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int j, len, ateof, dump_width;
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     int c, w, maxc;
     unsigned int b;
     /* CG: array size is incorrect, should be smaller */
@@ -85,7 +86,7 @@ static int unihex_display_line(EditState *s, DisplayState *ds, int offset)
     display_bol(ds);
 
     ds->style = UNIHEX_STYLE_OFFSET;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", (long long)offset);
     //int charpos = eb_get_char_offset(s->b, offset);
     //display_printf(ds, -1, -1, "%08x ", charpos);
     //display_printf(ds, -1, -1, "%08x %08x ", charpos, offset);
@@ -177,21 +178,21 @@ static int unihex_display_line(EditState *s, DisplayState *ds, int offset)
 
 static void unihex_move_bol(EditState *s)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
-    pos = align(pos, s->dump_width);
+    pos = align_offset(pos, s->dump_width);
     s->offset = eb_goto_char(s->b, pos);
 }
 
 static void unihex_move_eol(EditState *s)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
     /* CG: should include the last character! */
-    pos = align(pos, s->dump_width) + s->dump_width - 1;
+    pos = align_offset(pos, s->dump_width) + s->dump_width - 1;
 
     s->offset = eb_goto_char(s->b, pos);
 }
@@ -207,7 +208,7 @@ static void unihex_move_left_right(EditState *s, int dir)
 
 static void unihex_move_up_down(EditState *s, int dir)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
@@ -219,9 +220,9 @@ static void unihex_move_up_down(EditState *s, int dir)
 static void unihex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "--0x%x--0x%x--%s",
-               eb_get_char_offset(s->b, s->offset),
-               s->offset, s->b->charset->name);
+    buf_printf(out, "--0x%llx--0x%llx--%s",
+               (long long)eb_get_char_offset(s->b, s->offset),
+               (long long)s->offset, s->b->charset->name);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
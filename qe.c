@@ -291,7 +291,7 @@ int command_print_entry(CompleteState *cp, EditState *s, const char *name) {
     }
 }
 
-int command_get_entry(EditState *s, char *dest, int size, int offset)
+int command_get_entry(EditState *s, char *dest, int size, QEOffset offset)
 {
     int len;
     eb_fgets(s->b, dest, size, offset, &offset);
@@ -758,9 +758,10 @@ void text_move_eol(EditState *s)
     s->offset = eb_goto_eol(s->b, s->offset);
 }
 
-static int eb_word_right(EditBuffer *b, int w, int offset)
+static QEOffset eb_word_right(EditBuffer *b, int w, QEOffset offset)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     while (offset < b->total_size) {
         c = eb_nextc(b, offset, &offset1);
@@ -771,9 +772,10 @@ static int eb_word_right(EditBuffer *b, int w, int offset)
     return offset;
 }
 
-static int eb_word_left(EditBuffer *b, int w, int offset)
+static QEOffset eb_word_left(EditBuffer *b, int w, QEOffset offset)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     while (offset > 0) {
         c = eb_prevc(b, offset, &offset1);
@@ -784,11 +786,11 @@ static int eb_word_left(EditBuffer *b, int w, int offset)
     return offset;
 }
 
-int word_right(EditState *s, int w) {
+QEOffset word_right(EditState *s, int w) {
     return s->offset = eb_word_right(s->b, w, s->offset);
 }
 
-int word_left(EditState *s, int w) {
+QEOffset word_left(EditState *s, int w) {
     return s->offset = eb_word_left(s->b, w, s->offset);
 }
 
@@ -804,11 +806,11 @@ void text_move_word_left_right(EditState *s, int dir)
 }
 
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr)
+                QEOffset offset, QEOffset *offset_ptr)
 {
     EditBuffer *b = s->b;
     buf_t outbuf, *out;
-    int offset1;
+    QEOffset offset1;
     int c;
 
     out = buf_init(&outbuf, buf, buf_size);
@@ -836,11 +838,11 @@ int qe_get_word(EditState *s, char *buf, int buf_size,
     return out->len;
 }
 
-void do_mark_region(EditState *s, int mark, int offset)
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset)
 {
     /* CG: Should have local and global mark rings */
-    s->b->mark = clamp(mark, 0, s->b->total_size);
-    s->offset = clamp(offset, 0, s->b->total_size);
+    s->b->mark = clamp_offset(mark, 0, s->b->total_size);
+    s->offset = clamp_offset(offset, 0, s->b->total_size);
     /* activate region hilite */
     if (s->qe_state->hilite_region)
         s->region_style = QE_STYLE_REGION_HILITE;
@@ -850,7 +852,7 @@ void do_mark_region(EditState *s, int mark, int offset)
 
 /* Upper / lower / capital case functions. Update offset, return isword */
 /* arg: -1=lower-case, +1=upper-case, +2=capital-case */
-static int eb_changecase(EditBuffer *b, int offset, int *offsetp, int arg)
+static int eb_changecase(EditBuffer *b, QEOffset offset, QEOffset *offsetp, int arg)
 {
     int ch, ch1, len;
     char buf[MAX_CHAR_BYTES];
@@ -877,7 +879,7 @@ static int eb_changecase(EditBuffer *b, int offset, int *offsetp, int arg)
 
 void do_changecase_word(EditState *s, int arg)
 {
-    int offset, offset1;
+    QEOffset offset, offset1;
 
     offset = word_right(s, 1);
     while (offset < s->b->total_size) {
@@ -892,7 +894,7 @@ void do_changecase_word(EditState *s, int arg)
 
 void do_changecase_region(EditState *s, int arg)
 {
-    int offset;
+    QEOffset offset;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -900,9 +902,9 @@ void do_changecase_region(EditState *s, int arg)
     /* WARNING: during case change, the region offsets can change, so
        it is not so simple ! */
     /* XXX: if last char of region changes width, offset will move */
-    offset = min(s->offset, s->b->mark);
+    offset = min_offset(s->offset, s->b->mark);
     for (;;) {
-        if (offset >= max(s->offset, s->b->mark))
+        if (offset >= max_offset(s->offset, s->b->mark))
               break;
         if (eb_changecase(s->b, offset, &offset, arg)) {
             if (arg == 2)
@@ -916,7 +918,7 @@ void do_changecase_region(EditState *s, int arg)
 
 void do_delete_char(EditState *s, int argval)
 {
-    int endpos;
+    QEOffset endpos;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -943,7 +945,7 @@ void do_delete_char(EditState *s, int argval)
 
 void do_backspace(EditState *s, int argval)
 {
-    int endpos;
+    QEOffset endpos;
 
 #ifndef CONFIG_TINY
     if (s->b->flags & BF_PREVIEW) {
@@ -971,7 +973,7 @@ void do_backspace(EditState *s, int argval)
            Characters at the end of a line are removed, not replaced
            with spaces.
          */
-        int offset1;
+        QEOffset offset1;
         int spaces = 0;
         int newlines = 0;
         int count = (argval == NO_ARG) ? 1 : argval;
@@ -1046,7 +1048,7 @@ typedef struct {
     int linec;
     int yc;
     int xc;
-    int offsetc;
+    QEOffset offsetc;
     DirType basec; /* direction of the line */
     DirType dirc; /* direction of the char under the cursor */
     int cursor_width;
@@ -1054,7 +1056,7 @@ typedef struct {
 } CursorContext;
 
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, qe__unused__ int hex_mode)
 {
     CursorContext *m = ds->cursor_opaque;
@@ -1101,12 +1103,12 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
 } MoveContext;
 
 /* called each time the cursor could be displayed */
 static int down_cursor_func(DisplayState *ds,
-                            int offset1, qe__unused__ int offset2, int line_num,
+                            QEOffset offset1, qe__unused__ QEOffset offset2, int line_num,
                             int x, qe__unused__ int y,
                             int w, qe__unused__ int h,
                             qe__unused__ int hex_mode)
@@ -1196,7 +1198,7 @@ void text_move_up_down(EditState *s, int dir)
     if (dir < 0) {
         /* difficult case: we need to go backward on displayed text */
         while (cm.linec <= 0) {
-            int offset_top = s->offset_top;
+            QEOffset offset_top = s->offset_top;
 
             if (offset_top <= 0)
                 return;
@@ -1229,14 +1231,14 @@ void text_move_up_down(EditState *s, int dir)
 
 typedef struct {
     int y_found;
-    int offset_found;
+    QEOffset offset_found;
     int dir;
-    int offsetc;
+    QEOffset offsetc;
 } ScrollContext;
 
 /* called each time the cursor could be displayed */
 static int scroll_cursor_func(DisplayState *ds,
-                              int offset1, int offset2,
+                              QEOffset offset1, QEOffset offset2,
                               qe__unused__ int line_num,
                               qe__unused__ int x, int y,
                               qe__unused__ int w, int h,
@@ -1335,7 +1337,7 @@ void perform_scroll_up_down(EditState *s, int h)
                    exit loop */
                 s->y_disp = 0;
             } else {
-                int offset = eb_prev(s->b, s->offset_top);
+                QEOffset offset = eb_prev(s->b, s->offset_top);
                 s->offset_top = s->mode->backward_offset(s, offset);
                 ds->y = 0;
                 s->mode->display_line(s, ds, s->offset_top);
@@ -1393,7 +1395,7 @@ void do_center_cursor(EditState *s, int force)
          * speeds up get_cursor_pos() on large files, except for the
          * pathological case of huge lines.
          */
-        int offset = eb_prev(s->b, s->offset);
+        QEOffset offset = eb_prev(s->b, s->offset);
         s->offset_top = s->mode->backward_offset(s, offset);
     } else {
         if (!force)
@@ -1413,13 +1415,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
     int dir;
     int after_found;
 } LeftRightMoveContext;
 
 static int left_right_cursor_func(DisplayState *ds,
-                                  int offset1, qe__unused__ int offset2,
+                                  QEOffset offset1, qe__unused__ QEOffset offset2,
                                   int line_num,
                                   int x, qe__unused__ int y,
                                   int w, qe__unused__ int h,
@@ -1482,8 +1484,8 @@ void text_move_left_right_visual(EditState *s, int dir)
         if (m->offsetd >= 0) {
             /* position found : update and exit */
             /* adjust for accents */
-            int offset = m->offsetd;
-            int offset1, offset2;
+            QEOffset offset = m->offsetd;
+            QEOffset offset1, offset2;
             while (qe_isaccent(eb_nextc(s->b, offset, &offset1)) &&
                    eb_prevc(s->b, offset, &offset2) != '\n') {
                 offset = offset1;
@@ -1499,7 +1501,7 @@ void text_move_left_right_visual(EditState *s, int dir)
             } else {
                 /* no suitable position found: go to previous line */
                 if (yc <= 0) {
-                    int offset = s->offset_top;
+                    QEOffset offset = s->offset_top;
 
                     if (offset <= 0)
                         break;
@@ -1527,7 +1529,7 @@ typedef struct {
     int xd;
     int dy_min;
     int dx_min;
-    int offset_found;
+    QEOffset offset_found;
     int hex_mode;
 } MouseGotoContext;
 
@@ -1545,7 +1547,7 @@ static int seg_dist(int x, int x1, int x2)
 /* XXX: would need two passes in the general case (first search line,
    then colunm */
 static int mouse_goto_func(DisplayState *ds,
-                           int offset1, qe__unused__ int offset2,
+                           QEOffset offset1, qe__unused__ QEOffset offset2,
                            qe__unused__ int line_num,
                            int x, int y, int w, int h, int hex_mode)
 {
@@ -1606,9 +1608,9 @@ void text_mouse_goto(EditState *s, int x, int y)
 }
 #endif
 
-int do_delete_selection(EditState *s)
+QEOffset do_delete_selection(EditState *s)
 {
-    int res = 0;
+    QEOffset res = 0;
 
     if (s->region_style && s->b->mark != s->offset) {
         /* Delete hilighted region */
@@ -1649,7 +1651,8 @@ void do_char(EditState *s, int key, int argval) {
 
 #ifdef CONFIG_UNICODE_JOIN
 void do_combine_accent(EditState *s, int accent) {
-    int offset0, len, c;
+    QEOffset offset0;
+    int len, c;
     unsigned int g[2];
     char buf[MAX_CHAR_BYTES];
 
@@ -1683,8 +1686,9 @@ void do_combine_accent(EditState *s, int accent) {
    assuming a TAB width of tw and a fixed fitch font with single or
    double width glyphs and zero width accents.
  */
-int text_screen_width(EditBuffer *b, int start, int stop, int tw) {
-    int col = 0, offset = start;
+int text_screen_width(EditBuffer *b, QEOffset start, QEOffset stop, int tw) {
+    QEOffset offset = start;
+    int col = 0;
 
     while (offset < stop) {
         int c = eb_nextc(b, offset, &offset);
@@ -1702,7 +1706,8 @@ int text_screen_width(EditBuffer *b, int start, int stop, int tw) {
 
 void text_write_char(EditState *s, int key)
 {
-    int cur_ch, len, endpos, ret, insert;
+    QEOffset endpos;
+    int cur_ch, len, ret, insert;
     char buf[MAX_CHAR_BYTES];
 
     if (check_read_only(s))
@@ -1719,7 +1724,8 @@ void text_write_char(EditState *s, int key)
 
     if (insert) {
         const InputMethod *m;
-        int match_buf[20], match_len, offset, i;
+        QEOffset offset;
+        int match_buf[20], match_len, i;
 
         /* use compose system only if insert mode */
         if (s->compose_len == 0)
@@ -1774,7 +1780,8 @@ void text_write_char(EditState *s, int key)
             }
         }
     } else {
-        int w, w1, c2, offset2;
+        QEOffset offset2;
+        int w, w1, c2;
 
         w = qe_wcwidth(key);
         if (cur_ch == '\t') {
@@ -1896,8 +1903,8 @@ void do_tab(EditState *s, int argval)
     if (s->indent_tabs_mode) {
         do_char(s, 9, argval);
     } else {
-        int offset = s->offset;
-        int offset0 = eb_goto_bol(s->b, offset);
+        QEOffset offset = s->offset;
+        QEOffset offset0 = eb_goto_bol(s->b, offset);
         int col = 0;
         int tw = s->b->tab_width > 0 ? s->b->tab_width : DEFAULT_TAB_WIDTH;
         int indent = s->indent_size > 0 ? s->indent_size : tw;
@@ -2045,10 +2052,10 @@ void do_append_next_kill(qe__unused__ EditState *s)
     /* do nothing! */
 }
 
-void do_kill(EditState *s, int p1, int p2, int dir, int keep)
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir, int keep)
 {
     QEmacsState *qs = s->qe_state;
-    int len, tmp;
+    QEOffset len, tmp;
     EditBuffer *b;
 
     /* deactivate region hilite */
@@ -2093,7 +2100,8 @@ void do_kill_region(EditState *s, int keep)
 
 void do_kill_line(EditState *s, int argval)
 {
-    int p1, p2, offset1, dir = 1;
+    QEOffset offset1, p1, p2;
+    int dir = 1;
 
     // XXX: should handle kill_whole_line variable
     // XXX: can there be a variable and a function with the same name?
@@ -2148,7 +2156,8 @@ void do_kill_whole_line(EditState *s, int n)
 {
     // XXX: should not modify s->offset
     // XXX: should fix behavior for binary and hex modes
-    int p1 = 0, p2 = 0, dir = n;
+    QEOffset p1 = 0, p2 = 0;
+    int dir = n;
     if (n < 0) {
         do_eol(s);
         p1 = s->offset;
@@ -2173,7 +2182,7 @@ void do_kill_whole_line(EditState *s, int n)
 
 void do_kill_word(EditState *s, int n)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (n != 0) {
         do_word_left_right(s, n);
@@ -2188,7 +2197,7 @@ void do_yank(EditState *s) {
          the n-th element of the kill-ring
        qemacs: with a C-u prefix, yank n copies of the last killed block
      */
-    int size;
+    QEOffset size;
     QEmacsState *qs = s->qe_state;
     EditBuffer *b;
 
@@ -2235,7 +2244,7 @@ void do_yank_pop(EditState *s)
 
 void do_exchange_point_and_mark(EditState *s)
 {
-    int tmp;
+    QEOffset tmp;
 
     tmp = s->b->mark;
     s->b->mark = s->offset;
@@ -2625,9 +2634,11 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, len, i;
+    QEStyleRuns *styles;
+    QEOffset offset;
+    int len, i;
     EditBufferCallbackList *cb;
-    int pos[32];
+    QEOffset pos[32];
     char buf[MAX_CHAR_BYTES];
 
     eol_type = s->b->eol_type;
@@ -2644,7 +2655,7 @@ void do_convert_buffer_file_coding_system(EditState *s,
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            pos[i] = eb_get_char_offset(b, *(int*)cb->opaque);
+            pos[i] = eb_get_char_offset(b, *(QEOffset *)cb->opaque);
             i++;
         }
     }
@@ -2660,29 +2671,29 @@ void do_convert_buffer_file_coding_system(EditState *s,
     }
 
     /* replace current buffer with conversion */
-    /* quick hack to transfer styles from tmp buffer to b */
-    eb_free(&b->b_styles);
     eb_delete(b, 0, b->total_size);
     eb_set_charset(b, charset, eol_type);
     // XXX: this does not transfer styles
     //      should use eb_insert_buffer_convert()
     eb_insert_buffer(b, 0, b1, 0, b1->total_size);
+    /* quick hack to transfer styles from tmp buffer to b */
+    styles = b->b_styles;
     b->b_styles = b1->b_styles;
-    b1->b_styles = NULL;
+    b1->b_styles = styles;
 
     /* restore positions */
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            *(int*)cb->opaque = eb_goto_char(b, pos[i]);
+            *(QEOffset *)cb->opaque = eb_goto_char(b, pos[i]);
             i++;
         }
     }
 
     eb_free(&b1);
 
-    put_status(s, "Buffer charset is now %s, %d bytes",
-               s->b->charset->name, b->total_size);
+    put_status(s, "Buffer charset is now %s, %lld bytes",
+               s->b->charset->name, (long long)b->total_size);
 }
 
 void do_toggle_bidir(EditState *s)
@@ -2757,7 +2768,8 @@ void do_word_wrap(EditState *s)
 void do_goto(EditState *s, const char *str, int unit)
 {
     const char *p;
-    int pos, line, col, rel;
+    QEOffset pos;
+    int line, col, rel;
 
     /* Update s->offset from str specification:
      * optional +- for relative moves
@@ -2769,7 +2781,7 @@ void do_goto(EditState *s, const char *str, int unit)
      * CG: XXX: resulting offset may fall inside a character.
      */
     rel = (*str == '+' || *str == '-');
-    pos = strtol_c(str, &p, 0);
+    pos = strtoll_c(str, &p, 0);
 
     /* skip space required to separate hex offset from b or c suffix */
     if (*p == ' ')
@@ -2811,21 +2823,20 @@ void do_goto(EditState *s, const char *str, int unit)
         /* XXX: should realign on character boundary?
          *      realignment probably better addressed in display module
          */
-        s->offset = clamp(pos, 0, s->b->total_size);
+        s->offset = clamp_offset(pos, 0, s->b->total_size);
         return;
     case 'c':
         if (*p)
             goto error;
         if (rel)
             pos += eb_get_char_offset(s->b, s->offset);
-        s->offset = eb_goto_char(s->b, max(0, pos));
+        s->offset = eb_goto_char(s->b, max_offset(0, pos));
         return;
     case '%':
-        /* CG: should not require long long for this */
-        pos = pos * (long long)s->b->total_size / 100;
+        pos = pos * s->b->total_size / 100;
         if (rel)
             pos += s->offset;
-        eb_get_pos(s->b, &line, &col, clamp(pos, 0, s->b->total_size));
+        eb_get_pos(s->b, &line, &col, clamp_offset(pos, 0, s->b->total_size));
         line += (col > 0);
         goto getcol;
 
@@ -2873,7 +2884,7 @@ void do_what_cursor_position(EditState *s)
     int accents[6];
     buf_t outbuf, *out;
     int line_num, col_num;
-    int offset1, off;
+    QEOffset offset1, off;
     int c, cc, w, v;
     int i, n;
 
@@ -2946,9 +2957,10 @@ void do_what_cursor_position(EditState *s)
         }
     }
     eb_get_pos(s->b, &line_num, &col_num, s->offset);
-    put_status(s, "%s  point=%d mark=%d size=%d region=%d col=%d",
-               out->buf, s->offset, s->b->mark, s->b->total_size,
-               abs(s->offset - s->b->mark), col_num);
+    put_status(s, "%s  point=%lld mark=%lld size=%lld region=%lld col=%d",
+               out->buf, (long long)s->offset, (long long)s->b->mark,
+               (long long)s->b->total_size,
+               (long long)llabs(s->offset - s->b->mark), col_num);
 }
 
 void do_set_tab_width(EditState *s, int tab_width)
@@ -3485,7 +3497,7 @@ void display_close(DisplayState *ds)
 
 void display_init(DisplayState *ds, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *ds,
-                                     int offset1, int offset2, int line_num,
+                                     QEOffset offset1, QEOffset offset2, int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque)
 {
@@ -3591,20 +3603,148 @@ static uint64_t compute_crc(const void *p, int size, uint64_t sum)
     return sum;
 }
 
+/* mark `n` lines of the shadow from `line` as unknown so that they
+   get redrawn */
+static void invalidate_line_shadow(EditState *s, int line, int n)
+{
+    QELineShadow *ls;
+
+    for (ls = s->line_shadow + line; n-- > 0; ls++) {
+        /* put impossible values */
+        ls->crc = ~(uint64_t)0;
+        ls->x = -1;
+        ls->y = -1;
+        ls->height = -1;
+    }
+}
+
+void free_line_shadow(EditState *s)
+{
+    int i;
+
+    for (i = 0; i < s->shadow_nb_lines; i++) {
+        qe_free(&s->line_shadow[i].data);
+    }
+    qe_free(&s->line_shadow);
+    s->shadow_nb_lines = 0;
+}
+
+/* Compare the contents of a line with its shadow, store them if they
+   differ.  Return 1 if the line was already displayed as is. */
+static int update_line_shadow(QELineShadow *ls,
+                              const void *frags, int frags_size,
+                              const void *chars, int chars_size)
+{
+    int size = frags_size + chars_size;
+
+    if (ls->data && ls->size == size
+    &&  !memcmp(ls->data, frags, frags_size)
+    &&  !memcmp(ls->data + frags_size, chars, chars_size)) {
+        return 1;
+    }
+    if (!ls->data || ls->size != size) {
+        if (!qe_realloc(&ls->data, max(size, 1))) {
+            /* force a redraw next time */
+            qe_free(&ls->data);
+            ls->size = 0;
+            return 0;
+        }
+        ls->size = size;
+    }
+    memcpy(ls->data, frags, frags_size);
+    memcpy(ls->data + frags_size, chars, chars_size);
+    return 0;
+}
+
+/* a row passed to flush_line(), followed by its glyph offsets, glyphs,
+   fragments, glyph widths and hex modes, see text_display_line() */
+typedef struct QELayoutRow {
+    QEOffset offset1, offset2;
+    int last;
+    int x_line;
+    int left_gutter;
+    int nb_fragments;
+    int line_index;
+    int size;                   /* size of the row and its contents */
+} QELayoutRow;
+
+static int layout_row_size(int nb_fragments, int n)
+{
+    int size = sizeof(QELayoutRow) + n * sizeof(QEOffset[2]) +
+        n * sizeof(unsigned int) + nb_fragments * sizeof(TextFragment) +
+        n * sizeof(short) + n;
+
+    return (size + 7) & ~7;
+}
+
+/* append the row to the layout being recorded */
+static void layout_record_row(DisplayState *ds,
+                              TextFragment *fragments, int nb_fragments,
+                              QEOffset offset1, QEOffset offset2, int last)
+{
+    QELayoutLine *ll = ds->layout;
+    QELayoutRow *row;
+    u8 *p;
+    int n = ds->line_index;
+    int size = layout_row_size(nb_fragments, n);
+
+    /* continued rows depend on the cursor callback, reordered rows
+       are modified by flush_line() */
+    if (last == -1 || ds->embedding_level_max > 0
+    ||  ll->size + size > LAYOUT_CACHE_MAX_SIZE) {
+        ds->layout = NULL;
+        return;
+    }
+    if (ll->size + size > ll->allocated) {
+        int allocated = max(ll->allocated * 2, 1024);
+        allocated = min(max(allocated, ll->size + size), LAYOUT_CACHE_MAX_SIZE);
+        if (!qe_realloc(&ll->data, allocated)) {
+            ll->allocated = 0;
+            ds->layout = NULL;
+            return;
+        }
+        ll->allocated = allocated;
+    }
+    row = (QELayoutRow *)(void *)(ll->data + ll->size);
+    row->offset1 = offset1;
+    row->offset2 = offset2;
+    row->last = last;
+    row->x_line = ds->x_line;
+    row->left_gutter = ds->left_gutter;
+    row->nb_fragments = nb_fragments;
+    row->line_index = n;
+    row->size = size;
+    p = (u8 *)(row + 1);
+    memcpy(p, ds->line_offsets, n * sizeof(ds->line_offsets[0]));
+    p += n * sizeof(ds->line_offsets[0]);
+    memcpy(p, ds->line_chars, n * sizeof(ds->line_chars[0]));
+    p += n * sizeof(ds->line_chars[0]);
+    memcpy(p, fragments, nb_fragments * sizeof(*fragments));
+    p += nb_fragments * sizeof(*fragments);
+    memcpy(p, ds->line_char_widths, n * sizeof(ds->line_char_widths[0]));
+    p += n * sizeof(ds->line_char_widths[0]);
+    memcpy(p, ds->line_hex_mode, n);
+    ll->size += size;
+}
+
 /* flush the line fragments to the screen.
    `offset1..offset2` is the range of offsets for cursor management
    `last` is 0 for a line wrap, 1 for end of line, -1 for continuation
 */
 static void flush_line(DisplayState *ds,
                        TextFragment *fragments, int nb_fragments,
-                       int offset1, int offset2, int last)
+                       QEOffset offset1, QEOffset offset2, int last)
 {
     EditState *e = ds->edit_state;
     QEditScreen *screen = e->screen;
+    QEDisplayStats *st = &e->qe_state->display_stats;
     int level, pos, p, i, x, x1, y, baseline, line_height, max_descent;
     TextFragment *frag;
     QEFont *font;
 
+    if (ds->layout)
+        layout_record_row(ds, fragments, nb_fragments, offset1, offset2, last);
+
     /* compute baseline and lineheight (incorrect for very long lines) */
     baseline = 0;
     max_descent = 0;
@@ -3655,19 +3795,25 @@ static void flush_line(DisplayState *ds,
                 /* reallocate shadow */
                 int n = ds->line_num + LINE_SHADOW_INCR;
                 if (qe_realloc(&e->line_shadow, n * sizeof(QELineShadow))) {
-                    /* put an impossible value so that we redraw */
-                    memset(&e->line_shadow[e->shadow_nb_lines], 0xff,
+                    memset(&e->line_shadow[e->shadow_nb_lines], 0,
                            (n - e->shadow_nb_lines) * sizeof(QELineShadow));
+                    /* put an impossible value so that we redraw */
+                    invalidate_line_shadow(e, e->shadow_nb_lines,
+                                           n - e->shadow_nb_lines);
                     e->shadow_nb_lines = n;
                 }
             }
             if (ds->line_num < e->shadow_nb_lines && !disable_crc) {
                 QELineShadow *ls;
                 uint64_t crc;
+                int frags_size = sizeof(*fragments) * nb_fragments;
+                int chars_size = sizeof(*ds->line_chars) * ds->line_index;
 
-                crc = compute_crc(fragments, sizeof(*fragments) * nb_fragments, 0);
-                crc = compute_crc(ds->line_chars, sizeof(*ds->line_chars) * ds->line_index, crc);
+                crc = compute_crc(fragments, frags_size, 0);
+                crc = compute_crc(ds->line_chars, chars_size, crc);
                 ls = &e->line_shadow[ds->line_num];
+                /* the CRC is a quick test, the line contents are
+                   compared too because of possible collisions */
                 if (ls->y != ds->y || ls->x != ds->x_line
                 ||  ls->height != line_height || ls->crc != crc) {
                     /* update values for the line cache */
@@ -3675,12 +3821,22 @@ static void flush_line(DisplayState *ds,
                     ls->x = ds->x_line;
                     ls->height = line_height;
                     ls->crc = crc;
+                    update_line_shadow(ls, fragments, frags_size,
+                                       ds->line_chars, chars_size);
                 } else {
-                    no_display = 1;
+                    no_display = update_line_shadow(ls, fragments, frags_size,
+                                                    ds->line_chars, chars_size);
                 }
             }
         }
-        if (!no_display) {
+        if (no_display) {
+            e->display_lines_skipped++;
+            st->frame.lines_skipped++;
+        } else {
+            int start_time = get_clock_usec();
+
+            e->display_lines_drawn++;
+            st->frame.lines_drawn++;
             /* display */
             get_style(e, &default_style, QE_STYLE_DEFAULT);
             x = ds->x_start;
@@ -3751,6 +3907,7 @@ static void flush_line(DisplayState *ds,
                           markbuf, 1, default_style.fg_color);
                 release_font(screen, font);
             }
+            st->frame.usec[DSTAT_FLUSH_LINE] += get_clock_usec() - start_time;
         }
     }
 
@@ -3773,8 +3930,8 @@ static void flush_line(DisplayState *ds,
             frag = &fragments[i];
 
             for (j = frag->line_index, k = 0; k < frag->len; k++, j++) {
-                int _offset1 = ds->line_offsets[j][0];
-                int _offset2 = ds->line_offsets[j][1];
+                QEOffset _offset1 = ds->line_offsets[j][0];
+                QEOffset _offset2 = ds->line_offsets[j][1];
                 int hex_mode = ds->line_hex_mode[j];
                 int w = ds->line_char_widths[j];
                 x += w;
@@ -3862,7 +4019,7 @@ static void flush_fragment(DisplayState *ds)
     QEStyleDef styledef;
     QEFont *font;
     unsigned int char_to_glyph_pos[MAX_WORD_SIZE];
-    int nb_glyphs, dst_max_size, ascent, descent;
+    int nb_glyphs, dst_max_size, ascent, descent, start_time;
 
     if (ds->fragment_index == 0)
         return;
@@ -3887,6 +4044,7 @@ static void flush_fragment(DisplayState *ds)
     //dst_max_size = MAX_SCREEN_WIDTH - ds->line_index;
     //if (dst_max_size <= 0)
     //    goto the_end;
+    start_time = get_clock_usec();
     dst_max_size = MAX_WORD_SIZE; // assuming ds->fragment_index MAX_WORD_SIZE
     nb_glyphs = unicode_to_glyphs(ds->line_chars + ds->line_index,
                                   char_to_glyph_pos, dst_max_size,
@@ -3901,7 +4059,7 @@ static void flush_fragment(DisplayState *ds)
         j++;
     }
     for (i = 0; i < ds->fragment_index; i++) {
-        int offset1, offset2;
+        QEOffset offset1, offset2;
         j = ds->line_index + char_to_glyph_pos[i];
         offset1 = ds->fragment_offsets[i][0];
         offset2 = ds->fragment_offsets[i][1];
@@ -3947,6 +4105,8 @@ static void flush_fragment(DisplayState *ds)
         }
     }
     release_font(screen, font);
+    ds->edit_state->qe_state->display_stats.frame.usec[DSTAT_GLYPHS] +=
+        get_clock_usec() - start_time;
 
     /* add the fragment */
     frag = &ds->fragments[ds->nb_fragments++];
@@ -4047,7 +4207,7 @@ static void flush_fragment(DisplayState *ds)
     ds->fragment_index = 0;
 }
 
-int display_char_bidir(DisplayState *ds, int offset1, int offset2,
+int display_char_bidir(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch)
 {
     int space, istab, isaccent;
@@ -4059,8 +4219,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     /* special code to colorize block */
     e = ds->edit_state;
     if (e->show_selection || e->region_style) {
-        int mark = e->b->mark;
-        int offset = e->offset;
+        QEOffset mark = e->b->mark;
+        QEOffset offset = e->offset;
 
         if ((offset1 >= offset && offset1 < mark) ||
             (offset1 >= mark && offset1 < offset)) {
@@ -4090,7 +4250,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
             /* flush the current fragment if needed */
             if (isaccent && ds->fragment_chars[ds->fragment_index - 1] == ' ') {
                 /* separate last space to make it part of the next word */
-                int off1, off2, cur_hex;
+                QEOffset off1, off2;
+                int cur_hex;
                 --ds->fragment_index;
                 off1 = ds->fragment_offsets[ds->fragment_index][0];
                 off2 = ds->fragment_offsets[ds->fragment_index][1];
@@ -4133,7 +4294,7 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     return 0;
 }
 
-void display_printhex(DisplayState *ds, int offset1, int offset2,
+void display_printhex(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n)
 {
     int i, v;
@@ -4156,7 +4317,7 @@ void display_printhex(DisplayState *ds, int offset1, int offset2,
     ds->cur_hex_mode = 0;
 }
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...)
 {
     char buf[256], *p;
@@ -4178,7 +4339,7 @@ void display_printf(DisplayState *ds, int offset1, int offset2,
 }
 
 /* end of line */
-void display_eol(DisplayState *ds, int offset1, int offset2)
+void display_eol(DisplayState *ds, QEOffset offset1, QEOffset offset2)
 {
     flush_fragment(ds);
 
@@ -4190,7 +4351,7 @@ void display_eol(DisplayState *ds, int offset1, int offset2)
 static void display1(DisplayState *ds)
 {
     EditState *e = ds->edit_state;
-    int offset;
+    QEOffset offset;
 
     ds->eod = 0;
     offset = e->offset_top;
@@ -4226,7 +4387,7 @@ static void display1(DisplayState *ds)
 }
 
 /******************************************************/
-int text_backward_offset(EditState *s, int offset)
+QEOffset text_backward_offset(EditState *s, QEOffset offset)
 {
     int line, col;
 
@@ -4238,11 +4399,12 @@ int text_backward_offset(EditState *s, int offset)
 #ifdef CONFIG_UNICODE_JOIN
 /* max_size should be >= 2 */
 static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
-                                    EditBuffer *b, int offset)
+                                    EditBuffer *b, QEOffset offset)
 {
     TypeLink *p;
     FriBidiCharType type, ltype;
-    int left, offset1;
+    QEOffset offset1;
+    int left;
     unsigned int c;
 
     p = list_tab;
@@ -4284,6 +4446,77 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 }
 #endif
 
+/************************************************************/
+/* line buffers */
+
+/* Lines are colorized and displayed in buffers that grow to the length
+ * of the line, so that long lines are neither truncated nor rescanned.
+ * The buffers are kept in a pool in qs and used in stack order: the
+ * display of a line holds one while the colorizer states are computed
+ * in another one.  Large buffers are freed when the display is idle.
+ */
+QELineBuffer *line_buffer_get(QEmacsState *qs)
+{
+    QELineBuffer *lb;
+
+    if (qs->nb_line_buffers_used >= LINE_BUFFER_POOL_SIZE)
+        return NULL;
+    lb = &qs->line_buffers[qs->nb_line_buffers_used];
+    if (lb->size < COLORED_MAX_LINE_SIZE) {
+        if (!qe_realloc(&lb->buf, COLORED_MAX_LINE_SIZE * sizeof(*lb->buf))
+        ||  !qe_realloc(&lb->sbuf, COLORED_MAX_LINE_SIZE * sizeof(*lb->sbuf)))
+            return NULL;
+        lb->size = COLORED_MAX_LINE_SIZE;
+    }
+    qs->nb_line_buffers_used++;
+    return lb;
+}
+
+void line_buffer_release(QEmacsState *qs, QELineBuffer *lb)
+{
+    if (lb) {
+        qs->nb_line_buffers_used--;
+    }
+}
+
+/* Grow `lb` to hold the line starting at `offset` with its null
+   terminator.  Return the number of chars available. */
+int line_buffer_fit(QELineBuffer *lb, EditBuffer *b, QEOffset offset)
+{
+    QEOffset end;
+    int line, col, size;
+
+    /* a char takes at least 1 << char_shift bytes */
+    eb_get_pos(b, &line, &col, offset);
+    end = eb_goto_pos(b, line + 1, 0);
+    if (end <= offset)
+        end = b->total_size;
+    size = (int)min_offset((end - offset) >> b->char_shift, 1 << 28) + 4;
+    if (size > lb->size) {
+        size = max(size, lb->size + lb->size / 2);
+        if (!qe_realloc(&lb->buf, size * sizeof(*lb->buf))
+        ||  !qe_realloc(&lb->sbuf, size * sizeof(*lb->sbuf))) {
+            return lb->size;
+        }
+        lb->size = size;
+    }
+    return lb->size;
+}
+
+void line_buffers_trim(QEmacsState *qs)
+{
+    int i;
+
+    for (i = qs->nb_line_buffers_used; i < LINE_BUFFER_POOL_SIZE; i++) {
+        QELineBuffer *lb = &qs->line_buffers[i];
+        if (lb->size > LINE_BUFFER_KEEP_SIZE) {
+            qe_free(&lb->buf);
+            qe_free(&lb->sbuf);
+            lb->size = 0;
+        }
+    }
+}
+
 /************************************************************/
 /* colorization handling */
 /* NOTE: only one colorization mode can be selected at a time for a
@@ -4291,7 +4524,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 
 static int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                                        QETermStyle *sbuf,
-                                       int offset, int *offset_ptr, int line_num)
+                                       QEOffset offset, QEOffset *offset_ptr, int line_num)
 {
     EditBuffer *b = s->b;
     unsigned int *buf_ptr, *buf_end;
@@ -4318,93 +4551,328 @@ static int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_
 
 #ifndef CONFIG_TINY
 
-/* Gets the colorized line beginning at 'offset'. Its length
-   excluding '\n' is returned */
-
 #define COLORIZED_LINE_PREALLOC_SIZE 64
 
-static int syntax_get_colorized_line(EditState *s,
-                                     unsigned int *buf, int buf_size,
-                                     QETermStyle *sbuf,
-                                     int offset, int *offsetp, int line_num)
+/* Colorization states are recorded at checkpoints spaced at most
+   COLORIZE_CHECKPOINT_LINES apart and for a window of consecutive
+   lines, so memory does not grow with the number of lines displayed.
+   The state before other lines is recomputed from the closest
+   checkpoint. */
+
+/* Return the index of the last checkpoint at or before 'line', -1 if none */
+static int cs_find_checkpoint(QEColorizeStates *cs, int line)
 {
-    QEColorizeContext cctx;
-    EditBuffer *b = s->b;
-    int i, len, line, n, col, bom;
+    int lo = 0, hi = cs->nb_checkpoints, mid;
 
-    /* invalidate cache if needed */
-    if (s->colorize_max_valid_offset != INT_MAX) {
-        eb_get_pos(b, &line, &col, s->colorize_max_valid_offset);
-        line++;
-        if (line < s->colorize_nb_valid_lines)
-            s->colorize_nb_valid_lines = line;
-        eb_delete_properties(b, s->colorize_max_valid_offset, INT_MAX);
-        s->colorize_max_valid_offset = INT_MAX;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (cs->checkpoints[mid].line <= line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/* Return the closest line at or before 'line' with a known state */
+static int cs_find_state(QEColorizeStates *cs, int line, int *statep)
+{
+    int i, start = -1;
+
+    i = cs_find_checkpoint(cs, line);
+    if (i >= 0) {
+        start = cs->checkpoints[i].line;
+        *statep = cs->checkpoints[i].state;
+    }
+    if (cs->cache_len > 0 && cs->cache_start <= line) {
+        i = min(line, cs->cache_start + cs->cache_len - 1);
+        if (i > start) {
+            start = i;
+            *statep = cs->cache[i - cs->cache_start];
+        }
     }
+    return start;
+}
+
+/* Record the state before 'line' */
+static void cs_set_state(QEColorizeStates *cs, int line, int state)
+{
+    QEColorizeCheckpoint *cp;
+    int i, n;
 
-    /* realloc state array if needed */
-    if ((line_num + 2) > s->colorize_nb_lines) {
-        /* Reallocate colorization state buffer with pseudo-Fibonacci
+    /* extend, slide or restart the window of consecutive states */
+    n = line - cs->cache_start;
+    if (n < 0 || n > cs->cache_len) {
+        cs->cache_start = line;
+        cs->cache_len = n = 0;
+    }
+    if (n == COLORIZE_CACHE_LINES) {
+        n -= COLORIZE_CACHE_LINES / 2;
+        memmove(cs->cache, cs->cache + COLORIZE_CACHE_LINES / 2,
+                n * sizeof(*cs->cache));
+        cs->cache_start += COLORIZE_CACHE_LINES / 2;
+        cs->cache_len = n;
+    }
+    cs->cache[n] = state;
+    if (n == cs->cache_len)
+        cs->cache_len++;
+
+    /* add a checkpoint if the previous one is too far */
+    i = cs_find_checkpoint(cs, line);
+    if (i >= 0) {
+        if (cs->checkpoints[i].line == line) {
+            cs->checkpoints[i].state = state;
+            return;
+        }
+        if (line - cs->checkpoints[i].line < COLORIZE_CHECKPOINT_LINES)
+            return;
+    }
+    if (cs->nb_checkpoints >= cs->checkpoints_size) {
+        /* Reallocate checkpoint array with pseudo-Fibonacci
          * geometric progression (ratio of 1.625)
          */
-        n = max(s->colorize_nb_lines, COLORIZED_LINE_PREALLOC_SIZE);
-        while (n < (line_num + 2))
+        n = max(cs->checkpoints_size, COLORIZED_LINE_PREALLOC_SIZE);
+        if (cs->checkpoints_size)
             n += (n >> 1) + (n >> 3);
-        if (!qe_realloc(&s->colorize_states,
-                        n * sizeof(*s->colorize_states))) {
-            return 0;
+        if (!qe_realloc(&cs->checkpoints, n * sizeof(*cs->checkpoints)))
+            return;
+        cs->checkpoints_size = n;
+    }
+    cp = cs->checkpoints + i + 1;
+    memmove(cp + 1, cp, (cs->nb_checkpoints - i - 1) * sizeof(*cp));
+    cp->line = line;
+    cp->state = state;
+    cs->nb_checkpoints++;
+}
+
+/* Check if the state computed before 'line' matches the resync
+   candidate: if so, the following states are still valid. */
+static int cs_resync(QEColorizeStates *cs, int line, int state)
+{
+    int i, found = 0, old_state = 0;
+
+    if (line < cs->nb_valid_lines || line < cs->resync_start
+    ||  line >= cs->resync_end)
+        return 0;
+
+    if (line >= cs->cache_start && line < cs->cache_start + cs->cache_len) {
+        found = 1;
+        old_state = cs->cache[line - cs->cache_start];
+    } else {
+        i = cs_find_checkpoint(cs, line);
+        if (i >= 0 && cs->checkpoints[i].line == line) {
+            found = 1;
+            old_state = cs->checkpoints[i].state;
         }
-        s->colorize_nb_lines = n;
+    }
+    if (found && old_state == state) {
+        cs->nb_valid_lines = cs->resync_end;
+        cs->resync_start = cs->resync_end = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Compute the state before 'line_num', colorizing the lines from the
+   closest known state */
+static int syntax_get_state(EditState *s, int line_num)
+{
+    QEColorizeStates *cs = &s->colorizer->states;
+    QEColorizeContext cctx;
+    EditBuffer *b = s->b;
+    QELineBuffer *lb = NULL;
+    unsigned int *buf;
+    QEOffset offset;
+    int line, len, bom, buf_size, state = 0;
+
+    if (cs->nb_valid_lines == 0) {
+        cs_set_state(cs, 0, 0); /* initial state : zero */
+        cs->nb_valid_lines = 1;
     }
 
     memset(&cctx, 0, sizeof(cctx));
     cctx.s = s;
     cctx.b = b;
+    cctx.state_only = 1;
+
+ again:
+    line = cs_find_state(cs, min(line_num, cs->nb_valid_lines - 1), &state);
+    if (line == line_num) {
+        line_buffer_release(s->qe_state, lb);
+        return state;
+    }
+    if (!lb) {
+        lb = line_buffer_get(s->qe_state);
+        if (!lb)
+            return state;
+    }
+
+    cs_set_state(cs, line, state);
+    cctx.colorize_state = state;
+    offset = eb_goto_pos(b, line, 0);
+    while (line < line_num) {
+        cctx.offset = offset;
+        buf_size = line_buffer_fit(lb, b, offset);
+        buf = lb->buf;
+        len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
+        if (buf[len] != '\n') {
+            /* line was truncated, the buffer could not grow */
+            offset = eb_next_line(b, offset);
+        }
+        buf[len] = '\0';
+        if (line + 1 >= cs->nb_valid_lines) {
+            /* the tags of this line will be recomputed */
+            eb_delete_properties(b, cctx.offset, offset);
+        }
 
-    /* propagate state if needed */
-    if (line_num >= s->colorize_nb_valid_lines) {
-        if (s->colorize_nb_valid_lines == 0) {
-            s->colorize_states[0] = 0; /* initial state : zero */
-            s->colorize_nb_valid_lines = 1;
-        }
-        offset = eb_goto_pos(b, s->colorize_nb_valid_lines - 1, 0);
-        cctx.colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
-        cctx.state_only = 1;
-
-        for (line = s->colorize_nb_valid_lines; line <= line_num; line++) {
-            cctx.offset = offset;
-            len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
-            if (buf[len] != '\n') {
-                /* line was truncated */
-                /* XXX: should use reallocatable buffer */
-                offset = eb_goto_pos(b, line, 0);
-            }
-            buf[len] = '\0';
+        /* skip byte order mark if present */
+        bom = (buf[0] == 0xFEFF);
+        if (bom) {
+            cctx.offset = eb_next(b, cctx.offset);
+        }
+        s->colorize_func(&cctx, buf + bom, len - bom, s->colorize_mode);
+        line++;
+        if (cs_resync(cs, line, cctx.colorize_state)) {
+            /* states converged: skip the lines still valid */
+            goto again;
+        }
+        cs_set_state(cs, line, cctx.colorize_state);
+        if (line == cs->nb_valid_lines)
+            cs->nb_valid_lines++;
+    }
+    line_buffer_release(s->qe_state, lb);
+    return cctx.colorize_state;
+}
 
-            /* skip byte order mark if present */
-            bom = (buf[0] == 0xFEFF);
-            if (bom) {
-                cctx.offset = eb_next(b, cctx.offset);
-            }
-            s->colorize_func(&cctx, buf + bom, len - bom, s->colorize_mode);
-            s->colorize_states[line] = cctx.colorize_state;
+/* Invalidate the colorization states after a buffer modification.
+   Only the state before the first modified line is known to be valid,
+   but the checkpoints following the modified region were computed on
+   the same contents: they are kept as resync candidates, shifted by
+   the number of lines inserted or deleted. When the colorizer reaches
+   one of these lines with the same state as before, the remaining
+   states are still valid and colorization stops there. */
+static void syntax_invalidate_states(EditState *s)
+{
+    QEColorizeStates *cs = &s->colorizer->states;
+    QEColorizeCheckpoint *cp;
+    EditBuffer *b = s->b;
+    int line0, line1, nb_lines, col, delta, start, end, cache_end;
+    int i, i0, i1, i2;
+
+    eb_get_pos(b, &line0, &col, cs->max_valid_offset);
+    eb_get_pos(b, &line1, &col, cs->modified_end);
+    eb_get_pos(b, &nb_lines, &col, b->total_size);
+    delta = nb_lines - cs->nb_buffer_lines;
+
+    if (cs->nb_valid_lines < line0 && cs->resync_start < line0
+    &&  cs->nb_valid_lines < cs->resync_end) {
+        /* candidates before the modified region would be lost: try
+           to converge on the next checkpoint first */
+        syntax_get_state(s, min(line0, cs->nb_valid_lines +
+                                2 * COLORIZE_CHECKPOINT_LINES));
+    }
+
+    /* old index of the first line after the modified region */
+    start = max(line1 + 1 - delta, line0 + 1);
+    if (start < cs->nb_valid_lines) {
+        end = cs->nb_valid_lines;
+    } else {
+        start = max(start, cs->resync_start);
+        end = cs->resync_end;
+    }
+    if (start + delta <= line1)
+        end = start;
+
+    /* keep the checkpoints up to line0 and the candidates */
+    cp = cs->checkpoints;
+    i0 = cs_find_checkpoint(cs, line0) + 1;
+    i1 = cs_find_checkpoint(cs, start - 1) + 1;
+    i2 = max(i1, cs_find_checkpoint(cs, end - 1) + 1);
+    memmove(cp + i0, cp + i1, (i2 - i1) * sizeof(*cp));
+    cs->nb_checkpoints = i0 + i2 - i1;
+    for (i = i0; i < cs->nb_checkpoints; i++)
+        cp[i].line += delta;
+
+    /* same for the window of consecutive states, the lines in between
+       are overwritten when colorized again */
+    cache_end = cs->cache_start + cs->cache_len;
+    i1 = max(start, cs->cache_start);
+    i2 = min(end, cache_end);
+    if (cs->cache_start > line0) {
+        cs->cache_len = 0;
+        if (i1 < i2) {
+            memmove(cs->cache, cs->cache + i1 - cs->cache_start,
+                    (i2 - i1) * sizeof(*cs->cache));
+            cs->cache_start = i1 + delta;
+            cs->cache_len = i2 - i1;
+        }
+    } else {
+        cs->cache_len = min(cs->cache_len, line0 + 1 - cs->cache_start);
+        i2 = min(i2, COLORIZE_CACHE_LINES + cs->cache_start - delta);
+        if (i1 < i2) {
+            memmove(cs->cache + i1 + delta - cs->cache_start,
+                    cs->cache + i1 - cs->cache_start,
+                    (i2 - i1) * sizeof(*cs->cache));
+            cs->cache_len = i2 + delta - cs->cache_start;
         }
     }
 
+    if (start < end) {
+        cs->resync_start = start + delta;
+        cs->resync_end = end + delta;
+    } else {
+        cs->resync_start = cs->resync_end = 0;
+    }
+    if (cs->nb_valid_lines > line0 + 1)
+        cs->nb_valid_lines = line0 + 1;
+    cs->nb_buffer_lines = nb_lines;
+
+    /* the tags of the modified lines will be recomputed */
+    eb_delete_properties(b, eb_goto_pos(b, line0, 0),
+                         eb_goto_pos(b, line1 + 1, 0));
+    cs->max_valid_offset = QE_OFFSET_MAX;
+    cs->modified_end = 0;
+}
+
+/* Gets the colorized line beginning at 'offset'. Its length
+   excluding '\n' is returned */
+
+static int syntax_get_colorized_line(EditState *s,
+                                     unsigned int *buf, int buf_size,
+                                     QETermStyle *sbuf,
+                                     QEOffset offset, QEOffset *offsetp, int line_num)
+{
+    QEColorizeStates *cs = &s->colorizer->states;
+    QEColorizeContext cctx;
+    EditBuffer *b = s->b;
+    int i, len, bom;
+
+    /* invalidate cache if needed */
+    if (cs->max_valid_offset != QE_OFFSET_MAX)
+        syntax_invalidate_states(s);
+
+    memset(&cctx, 0, sizeof(cctx));
+    cctx.s = s;
+    cctx.b = b;
+
     /* compute line color */
-    cctx.colorize_state = s->colorize_states[line_num];
+    cctx.colorize_state = syntax_get_state(s, line_num);
     cctx.state_only = 0;
     cctx.offset = offset;
     len = eb_get_line(b, buf, buf_size - 1, offset, offsetp);
     if (buf[len] != '\n') {
-        /* line was truncated */
-        /* XXX: should use reallocatable buffer */
-        *offsetp = eb_next_line(b, offset);
+        /* line was truncated, use a buffer from line_buffer_fit() to
+           get the whole line */
+        *offsetp = eb_next_line(b, *offsetp);
     }
     buf[len] = '\0';
+    if (line_num + 1 >= cs->nb_valid_lines) {
+        /* the tags of this line will be recomputed */
+        eb_delete_properties(b, offset, *offsetp);
+    }
     if (s->offset >= offset && s->offset < *offsetp + (s->offset == s->b->total_size)) {
         /* compute cursor position */
-        int offset1 = offset;
+        QEOffset offset1 = offset;
         for (cctx.cur_pos = 0; offset1 < s->offset; cctx.cur_pos++)
             offset1 = eb_next(b, offset1);
     }
@@ -4421,12 +4889,12 @@ static int syntax_get_colorized_line(EditState *s,
     /* buf[len] has char '\0' but may hold style, force buf ending */
     buf[len + 1] = 0;
 
-    /* XXX: if state is same as previous, minimize invalid region? */
-    s->colorize_states[line_num + 1] = cctx.colorize_state;
-
-    /* Extend valid area */
-    if (s->colorize_nb_valid_lines < line_num + 2)
-        s->colorize_nb_valid_lines = line_num + 2;
+    if (!cs_resync(cs, line_num + 1, cctx.colorize_state)) {
+        cs_set_state(cs, line_num + 1, cctx.colorize_state);
+        /* Extend valid area */
+        if (line_num + 1 == cs->nb_valid_lines)
+            cs->nb_valid_lines++;
+    }
 
     /* Extract styles from colored codepoint array */
     for (i = 0; i <= len + 1; i++) {
@@ -4458,14 +4926,95 @@ static int syntax_get_colorized_line(EditState *s,
 /* invalidate the colorize data */
 static void colorize_callback(qe__unused__ EditBuffer *b,
                               void *opaque, qe__unused__ int arg,
-                              qe__unused__ enum LogOperation op,
-                              int offset,
-                              qe__unused__ int size)
+                              enum LogOperation op,
+                              QEOffset offset, QEOffset size)
+{
+    QEColorizer *cz = opaque;
+    QEColorizeStates *cs = &cz->states;
+    QEOffset end = offset + (op == LOGOP_DELETE ? 0 : size);
+
+    /* keep track of the modified region in current offsets */
+    if (cs->max_valid_offset == QE_OFFSET_MAX) {
+        cs->max_valid_offset = offset;
+        cs->modified_end = end;
+        return;
+    }
+    if (op == LOGOP_INSERT && cs->modified_end >= offset)
+        cs->modified_end += size;
+    else
+    if (op == LOGOP_DELETE && cs->modified_end > offset)
+        cs->modified_end = max(offset, cs->modified_end - size);
+    if (offset < cs->max_valid_offset)
+        cs->max_valid_offset = offset;
+    if (end > cs->modified_end)
+        cs->modified_end = end;
+}
+
+/* Background colorization: when the display is idle, the states and
+   tags of the windows are computed ahead in short time slices so that
+   jumping around or looking up tags does not have to wait. */
+
+#define COLORIZE_IDLE_DELAY  200  /* milliseconds after the last display */
+#define COLORIZE_IDLE_SLICE  20   /* milliseconds per time slice */
+#define COLORIZE_IDLE_LINES  256  /* lines colorized between input checks */
+
+/* Colorize up to 'nb_lines' lines past the valid states.
+   Return true if more lines remain to be colorized. */
+static int colorize_ahead(EditState *s, int nb_lines)
+{
+    QEColorizeStates *cs = &s->colorizer->states;
+    EditBuffer *b = s->b;
+    QELineBuffer *lb;
+    QEOffset offset, offset1;
+    int line_num, last_line, col;
+
+    if (cs->max_valid_offset != QE_OFFSET_MAX)
+        syntax_invalidate_states(s);
+
+    eb_get_pos(b, &last_line, &col, b->total_size);
+    if (cs->nb_valid_lines > last_line + 1)
+        return 0;
+
+    line_num = min(last_line, cs->nb_valid_lines - 1 + nb_lines);
+    lb = line_buffer_get(s->qe_state);
+    if (!lb)
+        return 0;
+    offset = eb_goto_pos(b, line_num, 0);
+    syntax_get_colorized_line(s, lb->buf, line_buffer_fit(lb, b, offset),
+                              lb->sbuf, offset, &offset1, line_num);
+    line_buffer_release(s->qe_state, lb);
+    return cs->nb_valid_lines <= last_line + 1;
+}
+
+static void colorize_idle_timer(void *opaque)
 {
-    EditState *e = opaque;
+    QEmacsState *qs = opaque;
+    EditState *s;
+    int start_time = get_clock_ms();
+
+    qs->colorize_timer = NULL;
+    for (s = qs->first_window; s != NULL; s = s->next_window) {
+        if (!s->colorize_func || s->busy)
+            continue;
+        while (colorize_ahead(s, COLORIZE_IDLE_LINES)) {
+            if (is_user_input_pending()
+            ||  get_clock_ms() - start_time >= COLORIZE_IDLE_SLICE) {
+                /* yield to the event loop and resume in the next slice */
+                qs->colorize_timer = qe_add_timer(0, qs, colorize_idle_timer);
+                return;
+            }
+        }
+    }
+    line_buffers_trim(qs);
+}
 
-    if (offset < e->colorize_max_valid_offset)
-        e->colorize_max_valid_offset = offset;
+/* restart the background colorization after the display settles */
+static void colorize_idle_restart(QEmacsState *qs)
+{
+    qe_kill_timer(&qs->colorize_timer);
+    qs->colorize_timer = qe_add_timer_slack(COLORIZE_IDLE_DELAY,
+                                            COLORIZE_IDLE_DELAY / 4, qs,
+                                            colorize_idle_timer);
 }
 
 #endif /* CONFIG_TINY */
@@ -4473,24 +5022,62 @@ static void colorize_callback(qe__unused__ EditBuffer *b,
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func, ModeDef *colorize_mode)
 {
     s->colorize_func = NULL;
+    invalidate_line_cache(s);
 
 #ifndef CONFIG_TINY
-    /* invalidate the previous states & free previous colorizer */
-    eb_free_callback(s->b, colorize_callback, s);
-    qe_free(&s->colorize_states);
-    s->colorize_nb_lines = 0;
-    s->colorize_nb_valid_lines = 0;
-    s->colorize_max_valid_offset = INT_MAX;
-    s->colorize_func = colorize_func;
+    QEColorizer *cz, **pcz;
+    int col;
+
+    /* release the previous colorizer, free it if no longer used */
+    cz = s->colorizer;
+    s->colorizer = NULL;
+    if (cz && --cz->ref_count == 0) {
+        for (pcz = &cz->b->colorizers; *pcz; pcz = &(*pcz)->next) {
+            if (*pcz == cz) {
+                *pcz = cz->next;
+                break;
+            }
+        }
+        eb_free_callback(cz->b, colorize_callback, cz);
+        qe_free(&cz->states.checkpoints);
+        qe_free(&cz);
+    }
     s->colorize_mode = colorize_mode;
-    if (colorize_func)
-        eb_add_callback(s->b, colorize_callback, s, 0);
+    if (!colorize_func)
+        return;
+
+    /* windows showing the buffer with the same colorizer share
+       the colorization states */
+    for (cz = s->b->colorizers; cz; cz = cz->next) {
+        if (cz->colorize_func == colorize_func
+        &&  cz->colorize_mode == colorize_mode)
+            break;
+    }
+    if (!cz) {
+        cz = qe_mallocz(QEColorizer);
+        if (!cz)
+            return;
+        cz->b = s->b;
+        cz->colorize_func = colorize_func;
+        cz->colorize_mode = colorize_mode;
+        cz->states.max_valid_offset = QE_OFFSET_MAX;
+        eb_get_pos(s->b, &cz->states.nb_buffer_lines, &col,
+                   s->b->total_size);
+        cz->next = s->b->colorizers;
+        s->b->colorizers = cz;
+        eb_add_callback(s->b, colorize_callback, cz, 0);
+    }
+    cz->ref_count++;
+    s->colorizer = cz;
+    s->colorize_func = colorize_func;
 #endif
 }
 
-int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                       QETermStyle *sbuf,
-                       int offset, int *offsetp, int line_num)
+static int compute_colorized_line(EditState *s,
+                                  unsigned int *buf, int buf_size,
+                                  QETermStyle *sbuf,
+                                  QEOffset offset, QEOffset *offsetp,
+                                  int line_num)
 {
 #ifndef CONFIG_TINY
     if (s->colorize_func) {
@@ -4504,9 +5091,9 @@ int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
     } else {
         int len = eb_get_line(s->b, buf, buf_size, offset, offsetp);
         if (buf[len] != '\n') {
-            /* line was truncated */
-            /* XXX: should use reallocatable buffer */
-            *offsetp = eb_goto_pos(s->b, line_num + 1, 0);
+            /* line was truncated, use a buffer from line_buffer_fit() to
+               get the whole line */
+            *offsetp = eb_next_line(s->b, *offsetp);
         }
         buf[len] = '\0';
         if (sbuf) {
@@ -4517,19 +5104,442 @@ int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
     }
 }
 
+/* Colorized lines are cached per window, keyed by their offset and
+ * the buffer generation: redisplays that do not modify the buffer,
+ * such as cursor motion, scrolling and the cursor search pass of
+ * generic_text_display(), do not colorize the same lines again.
+ * The line of the cursor is not cached because the colorization of
+ * trailing blanks depends on the cursor position.
+ */
+static QELineCacheEntry *line_cache_entry(EditState *s, QEOffset offset)
+{
+    if (!s->line_cache) {
+        s->line_cache = qe_mallocz_array(QELineCacheEntry, LINE_CACHE_SIZE);
+        if (!s->line_cache)
+            return NULL;
+    }
+    /* Fibonacci hashing spreads the line offsets */
+    return &s->line_cache[((uint64_t)offset * 0x9E3779B97F4A7C15ULL) >> 56
+                          & (LINE_CACHE_SIZE - 1)];
+}
+
+/* forget the colorized lines of the window */
+void invalidate_line_cache(EditState *s)
+{
+    int i;
+
+    if (s->line_cache) {
+        for (i = 0; i < LINE_CACHE_SIZE; i++)
+            s->line_cache[i].generation = 0;
+    }
+    if (s->layout_cache) {
+        for (i = 0; i < LAYOUT_CACHE_SIZE; i++)
+            s->layout_cache[i].generation = 0;
+    }
+}
+
+void free_line_cache(EditState *s)
+{
+    int i;
+
+    if (s->line_cache) {
+        for (i = 0; i < LINE_CACHE_SIZE; i++) {
+            qe_free(&s->line_cache[i].buf);
+            qe_free(&s->line_cache[i].sbuf);
+        }
+        qe_free(&s->line_cache);
+    }
+    if (s->layout_cache) {
+        for (i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+            qe_free(&s->layout_cache[i].data);
+        }
+        qe_free(&s->layout_cache);
+    }
+    if (s->long_lines) {
+        for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+            qe_free(&s->long_lines[i].points);
+        }
+        qe_free(&s->long_lines);
+    }
+}
+
+int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
+                       QETermStyle *sbuf,
+                       QEOffset offset, QEOffset *offsetp, int line_num)
+{
+    QELineCacheEntry *ce;
+    int len;
+
+    ce = line_cache_entry(s, offset);
+    if (ce && ce->generation == s->b->generation && ce->offset == offset
+    &&  ce->len + 2 <= buf_size && sbuf
+    &&  !(s->offset >= offset && s->offset <= ce->offset_end)) {
+        memcpy(buf, ce->buf, (ce->len + 2) * sizeof(*buf));
+        memcpy(sbuf, ce->sbuf, (ce->len + 2) * sizeof(*sbuf));
+        *offsetp = ce->offset_end;
+        s->qe_state->display_stats.frame.lines_cached++;
+        return ce->len;
+    }
+    s->qe_state->display_stats.frame.lines_colorized++;
+    len = compute_colorized_line(s, buf, buf_size, sbuf,
+                                 offset, offsetp, line_num);
+    /* only cache complete lines of reasonable length */
+    if (ce && sbuf && len + 2 < buf_size && len < LINE_CACHE_MAX_LEN
+    &&  !(s->offset >= offset && s->offset <= *offsetp)) {
+        if (ce->size < len + 2) {
+            int size = max(len + 2, 64);
+            if (!qe_realloc(&ce->buf, size * sizeof(*ce->buf))
+            ||  !qe_realloc(&ce->sbuf, size * sizeof(*ce->sbuf))) {
+                ce->generation = 0;
+                return len;
+            }
+            ce->size = size;
+        }
+        memcpy(ce->buf, buf, (len + 2) * sizeof(*buf));
+        memcpy(ce->sbuf, sbuf, (len + 2) * sizeof(*sbuf));
+        ce->offset = offset;
+        ce->offset_end = *offsetp;
+        ce->len = len;
+        ce->generation = s->b->generation;
+    }
+    return len;
+}
+
+/* Long lines are not laid out from their start on every redisplay:
+ * text_display_line() records checkpoints at the first char of screen
+ * rows (or of truncated line segments) every LONG_LINE_STEP chars and
+ * resumes the layout from the last checkpoint before the visible part,
+ * then stops as soon as the rest of the line cannot be seen. Displaying
+ * row 5000 of a wrapped line or column 1M of a truncated one thus only
+ * costs the visible part, plus the colorization of the line if any.
+ * Glyph widths do not depend on the style on terminals, so checkpoints
+ * stay valid as long as the layout parameters do not change, and
+ * long_line_callback() keeps those before a modification.
+ * Word wrapping, bidir text and graphical screens, where the layout of
+ * a row depends on what follows, always use the full layout.
+ */
+static QELongLine *long_line_find(EditState *s, DisplayState *ds,
+                                  QEOffset offset, int create)
+{
+    QELongLine *ll;
+    int i;
+
+    if (!s->long_lines) {
+        if (!create)
+            return NULL;
+        s->long_lines = qe_mallocz_array(QELongLine, LONG_LINE_CACHE_SIZE);
+        if (!s->long_lines)
+            return NULL;
+    }
+    for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+        ll = &s->long_lines[i];
+        if (ll->generation && ll->offset == offset)
+            goto found;
+    }
+    if (!create)
+        return NULL;
+    ll = &s->long_lines[s->long_line_next];
+    s->long_line_next = (s->long_line_next + 1) % LONG_LINE_CACHE_SIZE;
+    ll->generation = 0;
+
+ found:
+    if (ll->edited) {
+        /* the checkpoints were adjusted by long_line_callback() */
+        ll->edited = 0;
+        ll->generation = s->b->generation;
+    }
+    if (ll->generation != s->b->generation
+    ||  ll->charset != s->b->charset
+    ||  ll->eol_type != s->b->eol_type
+    ||  ll->wrap != ds->wrap
+    ||  ll->width != ds->width
+    ||  ll->line_numbers != ds->line_numbers
+    ||  ll->tab_width != ds->tab_width
+    ||  ll->show_unicode != s->qe_state->show_unicode) {
+        /* stale checkpoints */
+        ll->offset = offset;
+        ll->generation = s->b->generation;
+        ll->charset = s->b->charset;
+        ll->eol_type = s->b->eol_type;
+        ll->wrap = ds->wrap;
+        ll->width = ds->width;
+        ll->line_numbers = ds->line_numbers;
+        ll->tab_width = ds->tab_width;
+        ll->show_unicode = s->qe_state->show_unicode;
+        ll->nb_points = 0;
+    }
+    return ll;
+}
+
+/* keep the long line checkpoints before a modification */
+static void long_line_callback(qe__unused__ EditBuffer *b,
+                               void *opaque, qe__unused__ int arg,
+                               enum LogOperation op,
+                               QEOffset offset, QEOffset size)
+{
+    EditState *s = opaque;
+    QELongLine *ll;
+    int i, j;
+
+    if (!s->long_lines || (op != LOGOP_INSERT && op != LOGOP_DELETE))
+        return;
+
+    for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+        ll = &s->long_lines[i];
+        if (!ll->generation)
+            continue;
+        if (offset > ll->offset) {
+            /* drop the checkpoints at or after the modification */
+            while (ll->nb_points > 0
+               &&  ll->points[ll->nb_points - 1].offset >= offset) {
+                ll->nb_points--;
+            }
+        } else
+        if (offset < ll->offset
+        &&  (op == LOGOP_INSERT || offset + size < ll->offset)) {
+            /* the line moved but its start is unchanged */
+            if (op == LOGOP_DELETE)
+                size = -size;
+            ll->offset += size;
+            for (j = 0; j < ll->nb_points; j++)
+                ll->points[j].offset += size;
+        } else {
+            /* the line start was modified */
+            ll->generation = 0;
+            ll->edited = 0;
+            continue;
+        }
+        ll->edited = 1;
+    }
+}
+
+/* record a checkpoint at the start of the current screen row or line
+   segment, return the char index for the next checkpoint */
+static int long_line_record(EditState *s, DisplayState *ds,
+                            QELongLine **llp, QEOffset line_start,
+                            QEOffset offset, int char_index,
+                            int y0, int row0)
+{
+    QELongLine *ll;
+    QELayoutPoint *pt;
+    QEOffset start, offset1;
+    int i, x, min_index;
+
+    /* find the first char of the segment */
+    if (ds->line_index > 0) {
+        start = ds->line_offsets[0][0];
+    } else
+    if (ds->fragment_index > 0) {
+        start = ds->fragment_offsets[0][0];
+    } else {
+        start = offset;
+    }
+    /* skip glyphs that do not start a char and TABs whose width
+       was computed on the previous row */
+    if (start < line_start || start > offset
+    ||  eb_nextc(s->b, start, &offset1) == '\t')
+        return char_index;
+
+    for (x = ds->x, i = 0; i < ds->nb_fragments; i++)
+        x -= ds->fragments[i].width;
+    for (offset1 = start; offset1 < offset; char_index--)
+        eb_nextc(s->b, offset1, &offset1);
+
+    ll = *llp;
+    if (!ll && !(ll = *llp = long_line_find(s, ds, line_start, 1)))
+        return INT_MAX;
+    min_index = LONG_LINE_STEP;
+    if (ll->nb_points > 0)
+        min_index += ll->points[ll->nb_points - 1].char_index;
+    if (char_index < min_index)
+        return min_index;
+
+    if (ll->nb_points >= ll->size) {
+        int size = max(16, ll->size + (ll->size >> 1));
+        if (!qe_realloc(&ll->points, size * sizeof(*ll->points)))
+            return INT_MAX;
+        ll->size = size;
+    }
+    pt = &ll->points[ll->nb_points++];
+    pt->offset = start;
+    pt->char_index = char_index;
+    pt->x = x - ds->x_start;
+    pt->y = ds->y - y0;
+    pt->rows = ds->line_num - row0;
+    pt->left_gutter = ds->left_gutter;
+    return char_index + LONG_LINE_STEP;
+}
+
+/* return the offset of the line after the one starting at line_start
+   without decoding it, or -1 for the last line */
+static QEOffset text_next_line_offset(EditState *s, QEOffset line_start)
+{
+    int line, last_line, col;
+
+    eb_get_pos(s->b, &line, &col, line_start);
+    eb_get_pos(s->b, &last_line, &col, s->b->total_size);
+    if (line >= last_line)
+        return -1;
+    return eb_goto_pos(s->b, line + 1, 0);
+}
+
+/* check if the layout of a long line can stop before its end */
+static int long_line_done(EditState *s, DisplayState *ds,
+                          QEOffset line_start, QEOffset *next_linep)
+{
+    int truncated = (ds->wrap == WRAP_TRUNCATE || ds->wrap == WRAP_AUTO);
+
+    if (ds->do_disp == DISP_PRINT) {
+        /* nothing more to draw right of or below the window */
+        if (truncated)
+            return ds->x > ds->width + ds->eol_width;
+        else
+            return ds->y >= ds->height;
+    }
+    /* DISP_CURSOR_SCREEN: only the cursor position matters */
+    if (ds->eod)
+        return 1;
+    if (!truncated && ds->y < ds->height)
+        return 0;
+    if (*next_linep == -2)
+        *next_linep = text_next_line_offset(s, line_start);
+    return !(s->offset >= line_start
+             && (*next_linep < 0 || s->offset < *next_linep));
+}
+
+/* Lines are also cached once laid out: the rows passed to flush_line()
+ * are recorded with their fragments and glyphs, keyed by the line
+ * offset, the buffer generation and the layout parameters. The next
+ * redisplays replay them through flush_line() instead of colorizing
+ * the line, computing its embedding levels and converting it to
+ * glyphs: the line shadow and the cursor callbacks get the same rows
+ * as from a new layout. Scrolling by one line thus lays out one line.
+ * The line of the cursor, regions, selections and isearch matches
+ * depend on the cursor position and are not cached, nor are bidir
+ * text, long lines and graphical screens, where fonts and styles
+ * change the metrics.
+ */
+static QELayoutLine *layout_cache_entry(EditState *s, DisplayState *ds,
+                                        QEOffset offset)
+{
+    if (!(s->screen->media & CSS_MEDIA_TTY)
+    ||  (s->flags & WF_MINIBUF) || s->prompt || s->isearch_state
+    ||  s->show_selection || s->region_style || s->curline_style
+    ||  s->mode == &list_mode || ds->hex_mode) {
+        return NULL;
+    }
+    if (!s->layout_cache) {
+        s->layout_cache = qe_mallocz_array(QELayoutLine, LAYOUT_CACHE_SIZE);
+        if (!s->layout_cache)
+            return NULL;
+    }
+    return &s->layout_cache[((uint64_t)offset * 0x9E3779B97F4A7C15ULL) >> 57
+                            & (LAYOUT_CACHE_SIZE - 1)];
+}
+
+static int layout_line_match(EditState *s, DisplayState *ds,
+                             QELayoutLine *ll, QEOffset offset)
+{
+    return ll->generation == s->b->generation
+        && ll->offset == offset
+        && ll->mode == s->mode
+        && ll->eol_type == s->b->eol_type
+        && ll->wrap == ds->wrap
+        && ll->width == ds->width
+        && ll->line_numbers == ds->line_numbers
+        && ll->tab_width == ds->tab_width
+        && ll->show_unicode == s->qe_state->show_unicode
+        && ll->bidir == s->bidir
+        && ll->x_disp == s->x_disp[DIR_LTR]
+        && ll->hex_mode == ds->hex_mode;
+}
+
+static void layout_line_set(EditState *s, DisplayState *ds,
+                            QELayoutLine *ll, QEOffset offset, QEOffset next)
+{
+    ll->offset = offset;
+    ll->next = next;
+    ll->offset_end = next < 0 ? s->b->total_size : next;
+    ll->mode = s->mode;
+    ll->eol_type = s->b->eol_type;
+    ll->wrap = ds->wrap;
+    ll->width = ds->width;
+    ll->line_numbers = ds->line_numbers;
+    ll->tab_width = ds->tab_width;
+    ll->show_unicode = s->qe_state->show_unicode;
+    ll->bidir = s->bidir;
+    ll->x_disp = s->x_disp[DIR_LTR];
+    ll->hex_mode = ds->hex_mode;
+    ll->generation = s->b->generation;
+}
+
+/* display the rows of a cached line */
+static QEOffset layout_line_replay(DisplayState *ds, QELayoutLine *ll)
+{
+    const QELayoutRow *row;
+    const u8 *p;
+    int pos, n;
+
+    display_bol_bidir(ds, DIR_LTR, 0);
+    for (pos = 0; pos < ll->size; pos += row->size) {
+        row = (const QELayoutRow *)(const void *)(ll->data + pos);
+        n = row->line_index;
+        p = (const u8 *)(row + 1);
+        memcpy(ds->line_offsets, p, n * sizeof(ds->line_offsets[0]));
+        p += n * sizeof(ds->line_offsets[0]);
+        memcpy(ds->line_chars, p, n * sizeof(ds->line_chars[0]));
+        p += n * sizeof(ds->line_chars[0]);
+        memcpy(ds->fragments, p, row->nb_fragments * sizeof(ds->fragments[0]));
+        p += row->nb_fragments * sizeof(ds->fragments[0]);
+        memcpy(ds->line_char_widths, p, n * sizeof(ds->line_char_widths[0]));
+        p += n * sizeof(ds->line_char_widths[0]);
+        memcpy(ds->line_hex_mode, p, n);
+        ds->line_index = n;
+        ds->nb_fragments = row->nb_fragments;
+        ds->x_line = row->x_line;
+        ds->left_gutter = row->left_gutter;
+        flush_line(ds, ds->fragments, row->nb_fragments,
+                   row->offset1, row->offset2, row->last);
+    }
+    return ll->next;
+}
+
 #define RLE_EMBEDDINGS_SIZE    128
 
 /* Display one line in the window */
-int text_display_line(EditState *s, DisplayState *ds, int offset)
+QEOffset text_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int c;
-    int offset0, offset1, line_num, col_num;
+    QEOffset offset0, offset1;
+    int line_num, col_num;
     TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
-    unsigned int buf[COLORED_MAX_LINE_SIZE];
-    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
-    int char_index, colored_nb_chars;
+    QELineBuffer *lb = NULL;
+    unsigned int *buf;
+    QETermStyle *sbuf = NULL;
+    int char_index, colored_nb_chars, start_time;
+    QEFrameStats *frame = &s->qe_state->display_stats.frame;
+    QELongLine *ll = NULL;
+    QEOffset next_line = -2;
+    int long_line, next_index, last_row, last_index, y0, row0;
+    QELayoutLine *layout;
+
+    layout = layout_cache_entry(s, ds, offset);
+    if (layout && layout_line_match(s, ds, layout, offset)) {
+        if (!(s->offset >= offset && s->offset <= layout->offset_end)) {
+            s->qe_state->display_stats.frame.lines_replayed++;
+            return layout_line_replay(ds, layout);
+        }
+        /* keep the entry for when the cursor leaves the line */
+        layout = NULL;
+    }
+    if (layout) {
+        /* record the rows of the line */
+        layout->generation = 0;
+        layout->size = 0;
+        ds->layout = layout;
+    }
 
     line_num = 0;
     /* XXX: should test a flag, to avoid this call in hex/binary */
@@ -4539,6 +5549,7 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
 
     offset1 = offset;
 
+    start_time = get_clock_usec();
 #ifdef CONFIG_UNICODE_JOIN
     /* compute the embedding levels and rle encode them */
     if (s->bidir
@@ -4559,6 +5570,7 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
         embeds[2].pos = 0x7fffffff;
         base = FRIBIDI_TYPE_LTR;
     }
+    frame->usec[DSTAT_BIDI] += get_clock_usec() - start_time;
 
     display_bol_bidir(ds, base, embedding_max_level);
 
@@ -4585,9 +5597,17 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     if (s->colorize_func || s->b->b_styles
     ||  s->curline_style || s->region_style
     ||  s->isearch_state) {
-        /* XXX: deal with truncation */
-        colored_nb_chars = get_colorized_line(s, buf, countof(buf), sbuf,
+        lb = line_buffer_get(s->qe_state);
+    }
+    if (lb) {
+        int buf_size = line_buffer_fit(lb, s->b, offset);
+
+        start_time = get_clock_usec();
+        buf = lb->buf;
+        sbuf = lb->sbuf;
+        colored_nb_chars = get_colorized_line(s, buf, buf_size, sbuf,
                                               offset, &offset0, line_num);
+        frame->usec[DSTAT_COLORIZE] += get_clock_usec() - start_time;
         if (s->mode == &list_mode) {
             QEmacsState *qs = s->qe_state;
             int i;
@@ -4617,15 +5637,16 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     if (s->curline_style || s->region_style) {
         /* CG: Should combine styles instead of replacing */
         if (s->region_style && !s->curline_style) {
-            int line, start_offset, end_offset;
+            QEOffset start_offset, end_offset;
+            int line;
             int i, start_char, end_char;
 
             if (s->b->mark < s->offset) {
-                start_offset = max(offset, s->b->mark);
-                end_offset = min(offset0, s->offset);
+                start_offset = max_offset(offset, s->b->mark);
+                end_offset = min_offset(offset0, s->offset);
             } else {
-                start_offset = max(offset, s->offset);
-                end_offset = min(offset0, s->b->mark);
+                start_offset = max_offset(offset, s->offset);
+                end_offset = min_offset(offset0, s->b->mark);
             }
             if (start_offset < end_offset) {
                 /* Compute character positions */
@@ -4651,7 +5672,73 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
 
     bd = embeds + 1;
     char_index = 0;
+
+    /* resume the layout of a long line from a checkpoint */
+    long_line = ((ds->do_disp == DISP_PRINT ||
+                  ds->do_disp == DISP_CURSOR_SCREEN)
+                 && ds->wrap != WRAP_WORD
+                 && embedding_max_level == 0 && ds->base == DIR_LTR
+                 && !(s->flags & WF_MINIBUF)
+                 && (s->screen->media & CSS_MEDIA_TTY));
+    y0 = ds->y;
+    row0 = ds->line_num;
+    if (long_line && (ll = long_line_find(s, ds, offset1, 0)) != NULL) {
+        QELayoutPoint *pt;
+        int i;
+
+        for (i = ll->nb_points; i-- > 0;) {
+            pt = &ll->points[i];
+            /* do not skip the cursor */
+            if (s->offset >= offset1 && s->offset < pt->offset)
+                continue;
+            /* do not skip visible parts */
+            if (ds->do_disp == DISP_PRINT) {
+                if (ds->wrap == WRAP_TRUNCATE || ds->wrap == WRAP_AUTO) {
+                    if (ds->x_start + pt->x > 0)
+                        continue;
+                } else {
+                    if (ds->y + pt->y > 0)
+                        continue;
+                }
+            }
+            /* the rows before the checkpoint are not recorded */
+            ds->layout = NULL;
+            /* discard the line number and prompt */
+            ds->fragment_index = 0;
+            ds->nb_fragments = 0;
+            ds->line_index = 0;
+            ds->word_index = 0;
+            ds->x = ds->x_line = ds->x_start + pt->x;
+            ds->left_gutter = pt->left_gutter;
+            ds->y += pt->y;
+            ds->line_num += pt->rows;
+            offset = pt->offset;
+            char_index = pt->char_index;
+            break;
+        }
+    }
+    next_index = LONG_LINE_STEP;
+    last_row = ds->line_num;
+    last_index = ds->line_index;
+
     for (;;) {
+        if (long_line && char_index >= LONG_LINE_STEP) {
+            if (long_line_done(s, ds, offset1, &next_line)) {
+                if (ds->wrap == WRAP_TRUNCATE || ds->wrap == WRAP_AUTO)
+                    display_eol(ds, -1, -1);
+                if (next_line == -2)
+                    next_line = text_next_line_offset(s, offset1);
+                offset = next_line;
+                break;
+            }
+            if (char_index >= next_index
+            &&  (ds->line_num != last_row || ds->line_index < last_index)) {
+                next_index = long_line_record(s, ds, &ll, offset1, offset,
+                                              char_index, y0, row0);
+            }
+            last_row = ds->line_num;
+            last_index = ds->line_index;
+        }
         offset0 = offset;
         if (offset >= s->b->total_size) {
             /* the offset passed here is for cursor positioning
@@ -4699,8 +5786,15 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
                 display_char_bidir(ds, offset0, offset, embedding_level, c);
             }
             char_index++;
-            //if (ds->y >= s->height && ds->eod)  //@@@ causes bug
-            //    break;
+        }
+    }
+    line_buffer_release(s->qe_state, lb);
+    if (ds->layout) {
+        ds->layout = NULL;
+        if (char_index < LONG_LINE_STEP && ds->base == DIR_LTR
+        &&  !(s->offset >= offset1
+              && (offset < 0 || s->offset <= offset))) {
+            layout_line_set(s, ds, layout, offset1, offset);
         }
     }
     return offset;
@@ -4711,7 +5805,8 @@ static void generic_text_display(EditState *s)
 {
     CursorContext m1, *m = &m1;
     DisplayState ds1, *ds = &ds1;
-    int x1, xc, yc, offset, bottom = -1;
+    QEOffset offset, bottom = -1;
+    int x1, xc, yc;
 
     if (s->offset == 0) {
         s->offset_top = s->y_disp = s->x_disp[0] = s->x_disp[1] = 0;
@@ -4727,8 +5822,7 @@ static void generic_text_display(EditState *s)
 
     if (s->display_invalid) {
         /* invalidate the line shadow buffer */
-        qe_free(&s->line_shadow);
-        s->shadow_nb_lines = 0;
+        free_line_shadow(s);
         s->display_invalid = 0;
     }
 
@@ -4852,8 +5946,8 @@ static void generic_text_display(EditState *s)
                        default_style.bg_color);
         if (ds->line_num >= 0 && ds->line_num < s->shadow_nb_lines) {
             /* erase the line shadow for the rest of the window */
-            memset(&s->line_shadow[ds->line_num], 0xff,
-                   (s->shadow_nb_lines - ds->line_num) * sizeof(QELineShadow));
+            invalidate_line_shadow(s, ds->line_num,
+                                   s->shadow_nb_lines - ds->line_num);
         }
     }
     display_close(ds);
@@ -4880,7 +5974,7 @@ static void generic_text_display(EditState *s)
             xor_rectangle(s->screen, x, y, w, h, QERGB(0xFF, 0xFF, 0xFF));
             if (m->linec >= 0 && m->linec < s->shadow_nb_lines) {
                 /* invalidate line so that the cursor will be erased next time */
-                memset(&s->line_shadow[m->linec], 0xff, sizeof(QELineShadow));
+                invalidate_line_shadow(s, m->linec, 1);
             }
         }
     }
@@ -5368,6 +6462,10 @@ void window_display(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
     CSSRect rect;
+    int start_time = get_clock_usec();
+
+    s->display_lines_drawn = 0;
+    s->display_lines_skipped = 0;
 
     /* set the clipping rectangle to the whole window */
     /* XXX: should clip out popup windows */
@@ -5386,6 +6484,93 @@ void window_display(EditState *s)
 
     display_mode_line(s);
     display_window_borders(s);
+    s->display_time = get_clock_usec() - start_time;
+    qs->display_stats.frame.usec[DSTAT_WINDOWS] += s->display_time;
+}
+
+/* Account the frame displayed by the previous edit_display() call:
+   its terminal output is done by the dpy_flush() calls that follow
+   it, so it is complete when the next frame starts. */
+static void display_stats_end_frame(QEmacsState *qs)
+{
+    QEDisplayStats *st = &qs->display_stats;
+    QEFrameStats *f = &st->frame;
+    int64_t *v, *vmax, *vtotal;
+    int i, n;
+
+    f->usec[DSTAT_DPY_FLUSH] = qs->screen->flush_usec - st->flush_usec;
+    f->output_bytes = qs->screen->output_bytes - st->output_bytes;
+    st->flush_usec = qs->screen->flush_usec;
+    st->output_bytes = qs->screen->output_bytes;
+    f->output_writes = qs->screen->output_writes - st->output_writes;
+    st->output_writes = qs->screen->output_writes;
+    if (f->usec[DSTAT_DISPLAY] == 0 && f->lines_drawn == 0
+    &&  f->output_bytes == 0) {
+        /* nothing was displayed */
+        return;
+    }
+    if (st->nb_frames++ == 0)
+        st->start_time = get_clock_ms();
+
+    /* accumulate all the fields as an array of int64_t */
+    v = (int64_t *)(void *)f;
+    vmax = (int64_t *)(void *)&st->max;
+    vtotal = (int64_t *)(void *)&st->total;
+    n = sizeof(*f) / sizeof(*v);
+    for (i = 0; i < n; i++) {
+        if (vmax[i] < v[i])
+            vmax[i] = v[i];
+        vtotal[i] += v[i];
+    }
+    if (qs->display_trace) {
+        fprintf(qs->display_trace,
+                "%d %d display=%lld hooks=%lld windows=%lld colorize=%lld"
+                " bidi=%lld glyphs=%lld flush_line=%lld dpy_flush=%lld"
+                " drawn=%lld skipped=%lld colorized=%lld cached=%lld"
+                " replayed=%lld bytes=%lld writes=%lld\n",
+                st->nb_frames, get_clock_ms() - st->start_time,
+                (long long)f->usec[DSTAT_DISPLAY],
+                (long long)f->usec[DSTAT_HOOKS],
+                (long long)f->usec[DSTAT_WINDOWS],
+                (long long)f->usec[DSTAT_COLORIZE],
+                (long long)f->usec[DSTAT_BIDI],
+                (long long)f->usec[DSTAT_GLYPHS],
+                (long long)f->usec[DSTAT_FLUSH_LINE],
+                (long long)f->usec[DSTAT_DPY_FLUSH],
+                (long long)f->lines_drawn, (long long)f->lines_skipped,
+                (long long)f->lines_colorized, (long long)f->lines_cached,
+                (long long)f->lines_replayed,
+                (long long)f->output_bytes, (long long)f->output_writes);
+        fflush(qs->display_trace);
+    }
+    st->last = *f;
+    memset(f, 0, sizeof(*f));
+}
+
+/* Asynchronous events such as process output request a redisplay
+   instead of performing it: bursts of output are coalesced into at
+   most one frame every qs->frame_delay milliseconds. */
+
+#define DISPLAY_FRAME_DELAY  20  /* milliseconds, at most 50 frames/s */
+
+static void display_frame_timer(void *opaque)
+{
+    QEmacsState *qs = opaque;
+
+    qs->display_timer = NULL;
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
+void edit_display_request(QEmacsState *qs)
+{
+    int delay;
+
+    if (qs->display_timer)
+        return;
+    delay = qs->last_frame_time + qs->frame_delay - get_clock_ms();
+    delay = clamp(delay, 0, qs->frame_delay);
+    qs->display_timer = qe_add_timer(delay, qs, display_frame_timer);
 }
 
 /* display all windows */
@@ -5396,13 +6581,16 @@ void edit_display(QEmacsState *qs)
     int has_popups, has_minibuf;
     int start_time, elapsed_time;
 
-    start_time = get_clock_ms();
+    display_stats_end_frame(qs);
+    start_time = get_clock_usec();
 
     /* first call hooks for mode specific fixups */
     for (s = qs->first_window; s != NULL; s = s->next_window) {
         if (s->mode->display_hook)
             s->mode->display_hook(s);
     }
+    qs->display_stats.frame.usec[DSTAT_HOOKS] +=
+        get_clock_usec() - start_time;
 
     /* count popups */
     /* CG: maybe a separate list for popups? */
@@ -5453,11 +6641,22 @@ void edit_display(QEmacsState *qs)
         }
     }
 
-    elapsed_time = get_clock_ms() - start_time;
-    if (elapsed_time >= 100)
-        put_status(s, "|edit_display: %dms", elapsed_time);
+    elapsed_time = get_clock_usec() - start_time;
+    qs->display_stats.frame.usec[DSTAT_DISPLAY] += elapsed_time;
+    if (elapsed_time >= 100000)
+        put_status(s, "|edit_display: %dms", elapsed_time / 1000);
+
+    /* a pending asynchronous redisplay is satisfied by this one */
+    qe_kill_timer(&qs->display_timer);
+    qs->last_frame_time = get_clock_ms();
+    /* do not spend more than a third of the time redisplaying
+       asynchronous output */
+    qs->frame_delay = max(DISPLAY_FRAME_DELAY, 2 * elapsed_time / 1000);
 
     qs->complete_refresh = 0;
+#ifndef CONFIG_TINY
+    colorize_idle_restart(qs);
+#endif
 }
 
 /* macros */
@@ -5859,7 +7058,7 @@ static void qe_key_process(int key)
             out = buf_init(&outbuf, buf1, sizeof(buf1));
             buf_put_keys(out, c->keys, c->nb_keys);
             if (c->describe_key > 1) {
-                int save_offset = s->b->offset;
+                QEOffset save_offset = s->b->offset;
                 s->b->offset = s->offset;
                 s->offset += eb_printf(s->b, "%s runs the command %s", buf1, d->name);
                 s->b->offset = save_offset;
@@ -5925,6 +7124,47 @@ static void qe_key_process(int key)
     dpy_flush(&global_screen);
 }
 
+/* Handle text pasted in the terminal (bracketed paste): the display
+ * driver stored it in a new yank buffer. If typed characters would be
+ * self-inserted, yank the text with a single insertion, otherwise
+ * replay it as keys for the mode or the key grabber.
+ */
+static void qe_paste_event(void)
+{
+    QEmacsState *qs = &qe_state;
+    QEKeyContext *c = &key_ctx;
+    EditState *s;
+    EditBuffer *b;
+    KeyDef *kd;
+    unsigned int key_default = KEY_DEFAULT;
+    QEOffset offset;
+    int ch;
+
+    b = qs->yank_buffers[qs->yank_current];
+    s = qs->active_window;
+    if (s == NULL) {
+        s = qs->active_window = qs->first_window;
+        if (s == NULL || b == NULL)
+            return;
+    }
+    if (b == NULL)
+        return;
+
+    kd = qe_find_current_binding(&key_default, 1, s->mode, 1);
+    if (kd && kd->cmd->action.ESii == do_char
+    &&  !c->grab_key_cb && !c->nb_keys && !c->has_arg && !c->describe_key
+    &&  !qs->defining_macro) {
+        exec_command(s, qe_find_cmd("yank"), NO_ARG, 0);
+        edit_display(qs);
+        dpy_flush(&global_screen);
+        return;
+    }
+    for (offset = 0; offset < b->total_size && check_buffer(&b);) {
+        ch = eb_nextc(b, offset, &offset);
+        qe_key_process(ch == '\n' ? KEY_RET : ch);
+    }
+}
+
 /* Print a UTF-8 encoded buffer as unicode */
 void print_at_byte(QEditScreen *screen,
                    int x, int y, int width, int height,
@@ -6105,8 +7345,8 @@ void switch_to_buffer(EditState *s, EditBuffer *b)
         if (b->saved_data) {
             /* Restore window mode and data from buffer saved data */
             memcpy(s, b->saved_data, SAVED_DATA_SIZE);
-            s->offset = min(s->offset, b->total_size);
-            s->offset_top = min(s->offset_top, b->total_size);
+            s->offset = min_offset(s->offset, b->total_size);
+            s->offset_top = min_offset(s->offset_top, b->total_size);
             mode = b->saved_mode;
         } else {
             /* Try to get window mode and data from another window */
@@ -6278,8 +7518,8 @@ void edit_close(EditState **sp)
         qe_free_mode_data(s->mode_data);
         qe_free(&s->prompt);
         qe_free(&s->caption);
-        qe_free(&s->line_shadow);
-        s->shadow_nb_lines = 0;
+        free_line_shadow(s);
+        free_line_cache(s);
         qe_free(sp);
     }
 }
@@ -6422,7 +7662,7 @@ static int default_completion_window_print_entry(CompleteState *cp, EditState *s
     return eb_puts(s->b, name);
 }
 
-static int default_completion_window_get_entry(EditState *s, char *dest, int size, int offset) {
+static int default_completion_window_get_entry(EditState *s, char *dest, int size, QEOffset offset) {
     int len = eb_fgets(s->b, dest, size, offset, &offset);
     char *p = strchr(dest, '\t');
     if (p != NULL)
@@ -6538,7 +7778,7 @@ typedef struct MinibufState {
 
     StringArray *history;
     int history_index;
-    int history_saved_offset;
+    QEOffset history_saved_offset;
 } MinibufState;
 
 static ModeDef minibuffer_mode;
@@ -6597,7 +7837,7 @@ void do_minibuffer_complete(EditState *s, int type)
     end = s->offset;
     if (mb->completion_flags) {
         /* XXX: completion select? */
-        int offset = end;
+        QEOffset offset = end;
         while ((start = offset) > 0) {
             int c = eb_prevc(s->b, offset, &offset);
             if (!qe_isalnum_(c) && c != '-')
@@ -6703,8 +7943,8 @@ void do_minibuffer_complete(EditState *s, int type)
     complete_end(&cs);
 }
 
-static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
-                                   int *offsetp)
+static int eb_match_string_reverse(EditBuffer *b, QEOffset offset, const char *str,
+                                   QEOffset *offsetp)
 {
     int len = strlen(str);
 
@@ -6718,7 +7958,8 @@ static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
 
 static void do_minibuffer_electric_key(EditState *s, int key)
 {
-    int c, offset, stop;
+    QEOffset offset, stop;
+    int c;
     MinibufState *mb = minibuffer_get_state(s, 0);
 
     /* erase beginning of line if typing / or ~ in certain places */
@@ -7084,14 +8325,14 @@ int list_get_pos(EditState *s)
 }
 
 /* get current offset of the line in list */
-int list_get_offset(EditState *s)
+QEOffset list_get_offset(EditState *s)
 {
     return eb_goto_bol(s->b, s->offset);
 }
 
 void list_toggle_selection(EditState *s, int dir)
 {
-    int offset, offset1;
+    QEOffset offset, offset1;
     int ch, flags;
 
     if (dir < 0)
@@ -7449,7 +8690,7 @@ void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const cha
     canonicalize_absolute_buffer_path(s ? s->b : NULL, s ? s->offset : 0, buf, buf_size, path1);
 }
 
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int buf_size, const char *path1)
+void canonicalize_absolute_buffer_path(EditBuffer *b, QEOffset offset, char *buf, int buf_size, const char *path1)
 {
     char cwd[MAX_FILENAME_SIZE];
     char path[MAX_FILENAME_SIZE];
@@ -7495,7 +8736,7 @@ void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int
 }
 
 /* compute default path for find/save buffer */
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size)
+char *get_default_path(EditBuffer *b, QEOffset offset, char *buf, int buf_size)
 {
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
@@ -7567,7 +8808,7 @@ static int probe_mode(EditState *s, EditBuffer *b,
         probe_data.buf = rawbuf;
         probe_data.buf_size = len;
     } else {
-        int offset = 0;
+        QEOffset offset = 0;
         u8 *bufp = buf;
 
         while (offset < len) {
@@ -7970,7 +9211,7 @@ void do_load_file_from_path(EditState *s, const char *filename, int bflags)
 void do_insert_file(EditState *s, const char *filename)
 {
     FILE *f;
-    int size, lastsize = s->b->total_size;
+    QEOffset size, lastsize = s->b->total_size;
 
     f = fopen(filename, "r");
     if (!f) {
@@ -8024,10 +9265,11 @@ void do_set_visited_file_name(EditState *s, const char *filename,
     eb_set_filename(s->b, path);
 }
 
-static void put_save_message(EditState *s, const char *filename, int nb)
+static void put_save_message(EditState *s, const char *filename,
+                             QEOffset nb)
 {
     if (nb >= 0) {
-        put_status(s, "Wrote %d bytes to %s", nb, filename);
+        put_status(s, "Wrote %lld bytes to %s", (long long)nb, filename);
     } else {
         put_status(s, "Could not write %s", filename);
     }
@@ -8617,9 +9859,9 @@ void do_create_window(EditState *s, const char *filename, const char *layout)
     if (m)
         edit_set_mode(s, m);
     s->wrap = wrap;
-    s->offset = clamp(eb_goto_pos(b1, args[6], args[7]), 0, b1->total_size);
-    s->b->mark = clamp(eb_goto_pos(b1, args[8], args[9]), 0, b1->total_size);
-    s->offset_top = clamp(eb_goto_pos(b1, args[10], args[11]), 0, b1->total_size);
+    s->offset = clamp_offset(eb_goto_pos(b1, args[6], args[7]), 0, b1->total_size);
+    s->b->mark = clamp_offset(eb_goto_pos(b1, args[8], args[9]), 0, b1->total_size);
+    s->offset_top = clamp_offset(eb_goto_pos(b1, args[10], args[11]), 0, b1->total_size);
     if (args[12])
         qs->active_window = s;
 
@@ -9139,6 +10381,9 @@ void qe_handle_event(QEEvent *ev)
         save_selection();
         goto redraw;
 #endif
+    case QE_PASTE_EVENT:
+        qe_paste_event();
+        break;
     default:
         break;
     }
@@ -9187,11 +10432,12 @@ static int text_mode_probe(ModeDef *mode, ModeProbeData *p)
 
 static int generic_mode_init(EditState *s)
 {
-    s->offset = min(s->offset, s->b->total_size);
-    s->offset_top = min(s->offset_top, s->b->total_size);
+    s->offset = min_offset(s->offset, s->b->total_size);
+    s->offset_top = min_offset(s->offset_top, s->b->total_size);
     // XXX: should track insertions at s->offset?
     eb_add_callback(s->b, eb_offset_callback, &s->offset, 0);
     eb_add_callback(s->b, eb_offset_callback, &s->offset_top, 0);
+    eb_add_callback(s->b, long_line_callback, s, 0);
     set_colorize_func(s, NULL, NULL);
     return 0;
 }
@@ -9222,10 +10468,10 @@ static void generic_mode_close(EditState *s)
     set_colorize_func(s, NULL, NULL);
     eb_free_callback(s->b, eb_offset_callback, &s->offset);
     eb_free_callback(s->b, eb_offset_callback, &s->offset_top);
+    eb_free_callback(s->b, long_line_callback, s);
 
     /* Free crcs should when switching display modes */
-    qe_free(&s->line_shadow);
-    s->shadow_nb_lines = 0;
+    free_line_shadow(s);
 }
 
 ModeDef text_mode = {
@@ -9670,6 +10916,7 @@ static void qe_init(void *opaque)
     qs->default_fill_column = DEFAULT_FILL_COLUMN;
     qs->mmap_threshold = MIN_MMAP_SIZE;
     qs->max_load_size = MAX_LOAD_SIZE;
+    qs->undo_limit = UNDO_LIMIT;
 
     /* setup resource path */
     set_user_option(NULL);
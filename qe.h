@@ -77,6 +77,25 @@ typedef struct KeyDef KeyDef;
 typedef struct InputMethod InputMethod;
 typedef struct ISearchState ISearchState;
 typedef struct QEProperty QEProperty;
+typedef struct QEColorizer QEColorizer;
+typedef struct QEStyleRun QEStyleRun;
+
+/* buffer offsets and sizes: 64-bit to handle files larger than 2GB */
+typedef int64_t QEOffset;
+#define QE_OFFSET_MAX  INT64_MAX
+
+static inline QEOffset min_offset(QEOffset a, QEOffset b) {
+    return a < b ? a : b;
+}
+static inline QEOffset max_offset(QEOffset a, QEOffset b) {
+    return a > b ? a : b;
+}
+static inline QEOffset clamp_offset(QEOffset a, QEOffset b, QEOffset c) {
+    return a < b ? b : a > c ? c : a;
+}
+static inline QEOffset align_offset(QEOffset a, int n) {
+    return (a / n) * n;
+}
 
 #ifndef INT_MAX
 #define INT_MAX  0x7fffffff
@@ -103,11 +122,16 @@ void set_write_handler(int fd, void (*cb)(void *opaque), void *opaque);
 int set_pid_handler(int pid,
                     void (*cb)(void *opaque, int status), void *opaque);
 void url_exit(void);
+int url_exit_pending(void);
 void url_redisplay(void);
 void register_bottom_half(void (*cb)(void *opaque), void *opaque);
 void unregister_bottom_half(void (*cb)(void *opaque), void *opaque);
 
 QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque));
+QETimer *qe_add_timer_slack(int delay, int slack,
+                            void *opaque, void (*cb)(void *opaque));
+QETimer *qe_add_repeat_timer(int period, int slack,
+                             void *opaque, void (*cb)(void *opaque));
 void qe_kill_timer(QETimer **tip);
 
 /* main loop for Unix programs using liburlio */
@@ -129,7 +153,7 @@ typedef struct CompleteState {
 typedef void (*CompleteFunc)(CompleteState *cp, const char *str, int mode);
 
 void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const char *path1);
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset,
+void canonicalize_absolute_buffer_path(EditBuffer *b, QEOffset offset,
                                        char *buf, int buf_size,
                                        const char *path1);
 
@@ -185,6 +209,7 @@ enum QEEventType {
     QE_BUTTON_RELEASE_EVENT, /* mouse button release event */
     QE_MOTION_EVENT, /* mouse motion event */
     QE_SELECTION_CLEAR_EVENT, /* request selection clear (X11 type selection) */
+    QE_PASTE_EVENT, /* pasted text is in the current yank buffer */
 };
 
 typedef struct QEKeyEvent {
@@ -238,6 +263,16 @@ KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m, int
 
 #define COLORED_MAX_LINE_SIZE  4096
 
+/* growable buffer for a line of any length, see line_buffer_get() */
+typedef struct QELineBuffer {
+    unsigned int *buf;      /* chars of the line */
+    QETermStyle *sbuf;      /* style of each char */
+    int size;               /* allocated number of chars */
+} QELineBuffer;
+
+#define LINE_BUFFER_POOL_SIZE  4
+#define LINE_BUFFER_KEEP_SIZE  65536  /* larger buffers are freed when idle */
+
 /* colorize & transform a line, lower level then ColorizeFunc */
 /* XXX: should return `len`, the number of valid codepoints copied to
  * destination excluding the null terminator and newline if present.
@@ -247,12 +282,12 @@ KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m, int
 typedef int (*GetColorizedLineFunc)(EditState *s,
                                     unsigned int *buf, int buf_size,
                                     QETermStyle *sbuf,
-                                    int offset, int *offsetp, int line_num);
+                                    QEOffset offset, QEOffset *offsetp, int line_num);
 
 struct QEColorizeContext {
     EditState *s;
     EditBuffer *b;
-    int offset;
+    QEOffset offset;
     int colorize_state;
     int state_only;
     int combine_start, combine_stop; /* region for combine_static_colorized_line() */
@@ -265,6 +300,45 @@ struct QEColorizeContext {
 typedef void (*ColorizeFunc)(QEColorizeContext *cp,
                              unsigned int *buf, int n, ModeDef *syn);
 
+#define COLORIZE_CHECKPOINT_LINES  64
+#define COLORIZE_CACHE_LINES       1024
+
+typedef struct QEColorizeCheckpoint {
+    int line;               /* state before this line */
+    unsigned short state;
+} QEColorizeCheckpoint;
+
+/* colorizer states before each line, stored sparsely */
+typedef struct QEColorizeStates {
+    QEColorizeCheckpoint *checkpoints;  /* sorted by line */
+    int nb_checkpoints;
+    int checkpoints_size;
+    int nb_valid_lines;     /* states before these lines are valid */
+    /* states from resync_start to resync_end are candidates for
+       convergence after a modification */
+    int resync_start;
+    int resync_end;
+    int nb_buffer_lines;    /* line count matching the checkpoints */
+    /* maximum valid offset, QE_OFFSET_MAX if not modified. Needed to
+       invalidate the states */
+    QEOffset max_valid_offset;
+    QEOffset modified_end;  /* end of the modified region */
+    /* states of consecutive lines from cache_start */
+    int cache_start;
+    int cache_len;
+    unsigned short cache[COLORIZE_CACHE_LINES];
+} QEColorizeStates;
+
+/* colorization of a buffer by a mode, shared by the windows */
+struct QEColorizer {
+    QEColorizer *next;          /* next colorizer of the buffer */
+    EditBuffer *b;
+    ColorizeFunc colorize_func;
+    ModeDef *colorize_mode;
+    int ref_count;              /* number of windows using it */
+    QEColorizeStates states;
+};
+
 /* buffer.c */
 
 /* begin to mmap files from this size */
@@ -273,15 +347,30 @@ typedef void (*ColorizeFunc)(QEColorizeContext *cp,
 
 #define MAX_PAGE_SIZE  4096
 //#define MAX_PAGE_SIZE 16
+/* bulk inserted and mapped data is stored in large pages, which are
+ * split into MAX_PAGE_SIZE pages where they get modified.
+ */
+#define MAX_LARGE_PAGE_SIZE  (64*1024)
 
-#define NB_LOGS_MAX     100000  /* need better way to limit undo information */
+#define UNDO_LIMIT      (32*1024*1024)  /* default undo log size in bytes */
 
 #define PG_READ_ONLY    0x0001 /* the page is read only */
 #define PG_VALID_POS    0x0002 /* set if the nb_lines / col fields are up to date */
 #define PG_VALID_CHAR   0x0004 /* nb_chars is valid */
 #define PG_VALID_COLORS 0x0008 /* color state is valid (unused) */
-
-typedef struct Page {   /* should pack this */
+#define PG_TREE_POS     0x0010 /* tree_lines / tree_col are up to date */
+#define PG_TREE_CHAR    0x0020 /* tree_chars is up to date */
+#define PG_DATA_SMALL   0x0040 /* data is a MAX_PAGE_SIZE pool slot */
+#define PG_DATA_LARGE   0x0080 /* data is a MAX_LARGE_PAGE_SIZE pool slot */
+#define PG_DATA_POOL    (PG_DATA_SMALL | PG_DATA_LARGE)
+
+/* Buffer pages are kept in a balanced binary tree (a treap) ordered by
+ * buffer offset.  Each page holds the totals for its subtree so that
+ * byte offset, line / column and char offset lookups are logarithmic
+ * in the number of pages.
+ */
+typedef struct Page Page;
+struct Page {   /* should pack this */
     int size;     /* data size */
     int flags;
     u8 *data;
@@ -290,7 +379,31 @@ typedef struct Page {   /* should pack this */
     int col;      /* Number of chars since the last EOL */
     /* the following is needed for char offset computation */
     int nb_chars;
-} Page;
+    /* page tree links */
+    Page *left, *right, *parent;
+    unsigned int prio;  /* heap priority for tree balancing */
+    /* subtree totals, including this page */
+    QEOffset tree_size;
+    QEOffset tree_lines;
+    QEOffset tree_col;
+    QEOffset tree_chars;
+};
+
+/* buffer styles stored as runs, see eb_set_style() */
+typedef struct QEStyleRuns {
+    QEStyleRun *root;
+    int nb_runs;
+} QEStyleRuns;
+
+/* page data pool statistics, see eb_page_pool_stats() */
+typedef struct PagePoolStats {
+    const char *name;
+    int slot_size;
+    int nb_used;            /* slots holding page data */
+    int nb_free;            /* slots kept in the free list */
+    long long nb_reused;    /* allocations served from the free list */
+    long long nb_allocated; /* slots allocated from the system */
+} PagePoolStats;
 
 #define DIR_LTR 0
 #define DIR_RTL 1
@@ -306,7 +419,7 @@ enum LogOperation {
 
 /* Each buffer modification can be caught with this callback */
 typedef void (*EditBufferCallback)(EditBuffer *b, void *opaque, int arg,
-                                   enum LogOperation op, int offset, int size);
+                                   enum LogOperation op, QEOffset offset, QEOffset size);
 
 typedef struct EditBufferCallbackList {
     void *opaque;
@@ -319,7 +432,8 @@ typedef struct EditBufferCallbackList {
 typedef struct EditBufferDataType {
     const char *name; /* name of buffer data type (text, image, ...) */
     int (*buffer_load)(EditBuffer *b, FILE *f);
-    int (*buffer_save)(EditBuffer *b, int start, int end, const char *filename);
+    QEOffset (*buffer_save)(EditBuffer *b, QEOffset start, QEOffset end,
+                            const char *filename);
     void (*buffer_close)(EditBuffer *b);
     struct EditBufferDataType *next;
 } EditBufferDataType;
@@ -345,22 +459,30 @@ typedef struct EditBufferDataType {
 #define BF_SHELL     0x20000  /* buffer is a shell buffer */
 
 struct EditBuffer {
-    OWNED Page *page_table;
+    OWNED Page *page_root;  /* root of the page tree */
     int nb_pages;
-    int mark;       /* current mark (moved with text) */
-    int total_size; /* total size of the buffer */
+    QEOffset mark;       /* current mark (moved with text) */
+    QEOffset total_size; /* total size of the buffer */
     int modified;
+    unsigned int generation; /* changed by each modification of the
+                                contents or the styles, unique across
+                                buffers */
     int linum_mode;   /* display line numbers in left gutter */
     int linum_mode_set;   /* linum_mode was set, ignore global_linum_mode */
 
     /* page cache */
     Page *cur_page;
-    int cur_offset;
+    QEOffset cur_offset;
     int flags;
 
+    /* line start cache inside a page for eb_get_pos / eb_goto_pos */
+    Page *pos_page;
+    int pos_page_offset;
+    int pos_lines;
+
     /* mmap data, including file handle if kept open */
     void *map_address;
-    int map_length;
+    QEOffset map_length;
     int map_handle;
 
     /* buffer data type (default is raw) */
@@ -371,13 +493,7 @@ struct EditBuffer {
 
     /* buffer syntax or major mode */
     ModeDef *syntax_mode;
-    ColorizeFunc colorize_func; /* line colorization function */
-    unsigned short *colorize_states; /* state before line n, one per line */
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to
-     * invalidate 'colorize_states' */
-    int colorize_max_valid_offset;
+    QEColorizer *colorizers; /* colorizers shared by the windows */
 
     /* charset handling */
     CharsetDecodeState charset_state;
@@ -386,21 +502,28 @@ struct EditBuffer {
 
     /* undo system */
     int save_log;    /* if true, each buffer operation is logged */
-    int log_new_index, log_current;
+    QEOffset log_new_index, log_current;
+    QEOffset log_trim_index; /* log size that triggers the next trim */
     enum LogOperation last_log;
     int last_log_char;
     int nb_logs;
     EditBuffer *log_buffer;
 
+    /* edit transaction, see eb_begin_edit() */
+    int edit_level;
+    int edit_nb_ops;    /* number of modifications in the transaction */
+    int edit_nb_logs;   /* number of undo records in the transaction */
+    QEOffset edit_start, edit_end, edit_delta;  /* merged modified range */
+
     /* style system */
-    EditBuffer *b_styles;
+    OWNED QEStyleRuns *b_styles;
     QETermStyle cur_style;  /* current style for buffer writing APIs */
     int style_bytes;  /* 0, 1, 2, 4 or 8 bytes per char */
     int style_shift;  /* 0, 0, 1, 2 or 3 */
 
     /* modification callbacks */
     OWNED EditBufferCallbackList *first_callback;
-    OWNED QEProperty *property_list;
+    OWNED QEProperty *property_tree;
 
 #if 0
     /* asynchronous loading/saving support */
@@ -422,7 +545,7 @@ struct EditBuffer {
     OWNED QEModeData *mode_data_list;
 
     /* default mode stuff when buffer is detached from window */
-    int offset;
+    QEOffset offset;
 
     int tab_width;
     int fill_column;
@@ -441,27 +564,30 @@ struct EditBuffer {
 };
 
 /* the log buffer is used for the undo operation */
-/* header of log operation */
+/* decoded undo record header, see eb_addlog() */
 typedef struct LogBuffer {
-    u8 pad1, pad2;    /* for Log buffer readability */
     u8 op;
     u8 was_modified;
-    int offset;
-    int size;
+    u8 linked;      /* undone together with the previous record */
+    QEOffset offset;
+    QEOffset size;
 } LogBuffer;
 
 void eb_trace_bytes(const void *buf, int size, int state);
 
 void eb_init(void);
-int eb_read_one_byte(EditBuffer *b, int offset);
-int eb_read(EditBuffer *b, int offset, void *buf, int size);
-int eb_write(EditBuffer *b, int offset, const void *buf, int size);
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size);
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
-int eb_delete(EditBuffer *b, int offset, int size);
-int eb_replace(EditBuffer *b, int offset, int size, const void *buf, int size1);
+Page *eb_first_page(EditBuffer *b);
+Page *eb_next_page(const Page *p);
+int eb_read_one_byte(EditBuffer *b, QEOffset offset);
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size);
+int eb_write(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size);
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size);
+int eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
+               const void *buf, int size1);
 void eb_free_log_buffer(EditBuffer *b);
 EditBuffer *eb_new(const char *name, int flags);
 EditBuffer *eb_scratch(const char *name, int flags);
@@ -474,104 +600,108 @@ EditState *eb_find_window(EditBuffer *b, EditState *e);
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type);
 qe__attr_nonnull((3))
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr);
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr);
 qe__attr_nonnull((3))
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr);
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr);
 qe__attr_nonnull((3))
-int eb_next_glyph(EditBuffer *b, int offset, int *next_ptr);
+int eb_next_glyph(EditBuffer *b, QEOffset offset, QEOffset *next_ptr);
 qe__attr_nonnull((3))
-int eb_prev_glyph(EditBuffer *b, int offset, int *prev_ptr);
-int eb_skip_accents(EditBuffer *b, int offset);
-int eb_skip_glyphs(EditBuffer *b, int offset, int n);
-int eb_skip_chars(EditBuffer *b, int offset, int n);
-int eb_delete_chars(EditBuffer *b, int offset, int n);
-int eb_delete_glyphs(EditBuffer *b, int offset, int n);
-int eb_goto_pos(EditBuffer *b, int line1, int col1);
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset);
-int eb_goto_char(EditBuffer *b, int pos);
-int eb_get_char_offset(EditBuffer *b, int offset);
-int eb_delete_range(EditBuffer *b, int p1, int p2);
-static inline int eb_at_bol(EditBuffer *b, int offset) {
+int eb_prev_glyph(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr);
+QEOffset eb_skip_accents(EditBuffer *b, QEOffset offset);
+QEOffset eb_skip_glyphs(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_delete_glyphs(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1);
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset);
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos);
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset);
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2);
+static inline int eb_at_bol(EditBuffer *b, QEOffset offset) {
     return eb_prevc(b, offset, &offset) == '\n';
 }
-static inline int eb_next(EditBuffer *b, int offset) {
+static inline QEOffset eb_next(EditBuffer *b, QEOffset offset) {
     eb_nextc(b, offset, &offset);
     return offset;
 }
-static inline int eb_prev(EditBuffer *b, int offset) {
+static inline QEOffset eb_prev(EditBuffer *b, QEOffset offset) {
     eb_prevc(b, offset, &offset);
     return offset;
 }
 
-//int eb_clip_offset(EditBuffer *b, int offset);
+//int eb_clip_offset(EditBuffer *b, QEOffset offset);
 void do_undo(EditState *s);
 void do_redo(EditState *s);
 
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+int eb_page_pool_stats(PagePoolStats *stats, int size);
+QEOffset eb_raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset);
 int eb_mmap_buffer(EditBuffer *b, const char *filename);
 void eb_munmap_buffer(EditBuffer *b);
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
-int eb_save_buffer(EditBuffer *b);
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename);
+QEOffset eb_save_buffer(EditBuffer *b);
 
 int eb_set_buffer_name(EditBuffer *b, const char *name1);
 void eb_set_filename(EditBuffer *b, const char *filename);
 
 int eb_add_callback(EditBuffer *b, EditBufferCallback cb, void *opaque, int arg);
 void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque);
+void eb_begin_edit(EditBuffer *b);
+void eb_commit_edit(EditBuffer *b);
 void eb_offset_callback(EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size);
+                        enum LogOperation op, QEOffset offset, QEOffset size);
 int eb_create_style_buffer(EditBuffer *b, int flags);
 void eb_free_style_buffer(EditBuffer *b);
-QETermStyle eb_get_style(EditBuffer *b, int offset);
+QETermStyle eb_get_style(EditBuffer *b, QEOffset offset);
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size);
+                  QEOffset offset, QEOffset size);
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size);
-int eb_delete_uchar(EditBuffer *b, int offset);
+                       enum LogOperation op, QEOffset offset, QEOffset size);
+int eb_delete_uchar(EditBuffer *b, QEOffset offset);
 int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c);
-int eb_insert_uchar(EditBuffer *b, int offset, int c);
-int eb_replace_uchar(EditBuffer *b, int offset, int c);
-int eb_insert_uchars(EditBuffer *b, int offset, int c, int n);
-static inline int eb_insert_spaces(EditBuffer *b, int offset, int n) {
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c);
+int eb_replace_uchar(EditBuffer *b, QEOffset offset, int c);
+int eb_insert_uchars(EditBuffer *b, QEOffset offset, int c, int n);
+static inline int eb_insert_spaces(EditBuffer *b, QEOffset offset, int n) {
     return eb_insert_uchars(b, offset, ' ', n);
 }
 
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len);
-int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int len);
-int eb_insert_str(EditBuffer *b, int offset, const char *str);
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp);
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp);
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp);
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset, const char *buf, int len);
+int eb_insert_u32_buf(EditBuffer *b, QEOffset offset, const unsigned int *buf, int len);
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str);
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp);
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str, QEOffset *offsetp);
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str, QEOffset *offsetp);
 /* These functions insert contents at b->offset */
 int eb_vprintf(EditBuffer *b, const char *fmt, va_list ap) qe__attr_printf(2,0);
 int eb_printf(EditBuffer *b, const char *fmt, ...) qe__attr_printf(2,3);
 int eb_puts(EditBuffer *b, const char *s);
 int eb_putc(EditBuffer *b, int c);
 
-void eb_line_pad(EditBuffer *b, int offset, int n);
-int eb_get_region_content_size(EditBuffer *b, int start, int stop);
-static inline int eb_get_content_size(EditBuffer *b) {
+void eb_line_pad(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_get_region_content_size(EditBuffer *b, QEOffset start, QEOffset stop);
+static inline QEOffset eb_get_content_size(EditBuffer *b) {
     return eb_get_region_content_size(b, 0, b->total_size);
 }
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size);
 static inline int eb_get_contents(EditBuffer *b, char *buf, int buf_size) {
     return eb_get_region_contents(b, 0, b->total_size, buf, buf_size);
 }
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size);
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size);
 int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
-                int offset, int *offset_ptr);
+                QEOffset offset, QEOffset *offset_ptr);
 int eb_fgets(EditBuffer *b, char *buf, int buf_size,
-             int offset, int *offset_ptr);
-int eb_prev_line(EditBuffer *b, int offset);
-int eb_goto_bol(EditBuffer *b, int offset);
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp);
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1);
-int eb_is_in_indentation(EditBuffer *b, int offset);
-int eb_goto_eol(EditBuffer *b, int offset);
-int eb_next_line(EditBuffer *b, int offset);
+             QEOffset offset, QEOffset *offset_ptr);
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp);
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1);
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset);
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset);
 
 void eb_register_data_type(EditBufferDataType *bdt);
 EditBufferDataType *eb_probe_data_type(const char *filename, int st_mode,
@@ -581,17 +711,21 @@ void eb_invalidate_raw_data(EditBuffer *b);
 extern EditBufferDataType raw_data_type;
 
 struct QEProperty {
-    int offset;
+    QEOffset rel_offset;    /* relative to the parent in the tree */
 #define QE_PROP_FREE  1
 #define QE_PROP_TAG   3
     int type;
     void *data;
-    QEProperty *next;
+    /* property tree links, see eb_first_property() */
+    QEProperty *left, *right, *parent;
+    unsigned int prio;
 };
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data);
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type);
-void eb_delete_properties(EditBuffer *b, int offset, int offset2);
+void eb_add_property(EditBuffer *b, QEOffset offset, int type, void *data);
+QEProperty *eb_find_property(EditBuffer *b, QEOffset offset, QEOffset offset2, int type);
+QEProperty *eb_first_property(EditBuffer *b, QEOffset *offsetp);
+QEProperty *eb_next_property(const QEProperty *p, QEOffset *offsetp);
+void eb_delete_properties(EditBuffer *b, QEOffset offset, QEOffset offset2);
 
 /* qe module handling */
 
@@ -632,8 +766,105 @@ typedef struct QELineShadow {
     int x;
     short y;
     short height;
+    int size;                   /* size of the line contents */
+    OWNED u8 *data;             /* line contents to rule out CRC collisions */
 } QELineShadow;
 
+/* redisplay profiling: the time spent in each stage is measured in
+   microseconds, see edit_display() and describe-performance */
+enum {
+    DSTAT_DISPLAY,      /* whole edit_display() */
+    DSTAT_HOOKS,        /* mode display hooks */
+    DSTAT_WINDOWS,      /* window contents, mode lines and borders */
+    DSTAT_COLORIZE,     /* get_colorized_line() for displayed lines */
+    DSTAT_BIDI,         /* bidirectional embedding levels */
+    DSTAT_GLYPHS,       /* unicode_to_glyphs() */
+    DSTAT_FLUSH_LINE,   /* drawing lines to the screen */
+    DSTAT_DPY_FLUSH,    /* screen update, i.e. terminal output */
+    DSTAT_NB,
+};
+
+typedef struct QEFrameStats {
+    int64_t usec[DSTAT_NB];
+    int64_t lines_drawn;        /* lines laid out and drawn */
+    int64_t lines_skipped;      /* unchanged lines skipped by the shadow */
+    int64_t lines_colorized;    /* lines colorized by get_colorized_line() */
+    int64_t lines_cached;       /* colorized lines found in the cache */
+    int64_t lines_replayed;     /* laid out lines found in the cache */
+    int64_t output_bytes;       /* bytes written to the terminal */
+    int64_t output_writes;      /* write() calls to the terminal */
+} QEFrameStats;
+
+typedef struct QEDisplayStats {
+    int nb_frames;
+    QEFrameStats frame;         /* frame being displayed */
+    QEFrameStats last;          /* last complete frame */
+    QEFrameStats max;           /* maximum of each value per frame */
+    QEFrameStats total;
+    int64_t flush_usec;         /* screen->flush_usec at start of frame */
+    int64_t output_bytes;       /* screen->output_bytes at start of frame */
+    int64_t output_writes;      /* screen->output_writes at start of frame */
+    int start_time;             /* get_clock_ms() of the first frame */
+} QEDisplayStats;
+
+/* colorized lines cached per window, see get_colorized_line() */
+#define LINE_CACHE_SIZE  256    /* must be a power of 2 */
+#define LINE_CACHE_MAX_LEN  65536  /* longer lines are not cached */
+
+typedef struct QELineCacheEntry {
+    QEOffset offset;            /* start of the line */
+    QEOffset offset_end;        /* start of the next line */
+    unsigned int generation;    /* buffer generation, 0 if unused */
+    int len;                    /* number of chars excluding the newline */
+    int size;                   /* allocated number of chars */
+    OWNED unsigned int *buf;
+    OWNED QETermStyle *sbuf;
+} QELineCacheEntry;
+
+/* layout checkpoints of long lines, see text_display_line() */
+#define LONG_LINE_CACHE_SIZE  4
+#define LONG_LINE_STEP  4096    /* min number of chars between checkpoints */
+
+typedef struct QELayoutPoint {
+    QEOffset offset;            /* first char of a screen row or segment */
+    int char_index;             /* index of this char in the line */
+    int x;                      /* position relative to ds->x_start */
+    int y;                      /* position relative to the line start */
+    int rows;                   /* number of screen rows above */
+    int left_gutter;
+} QELayoutPoint;
+
+typedef struct QELongLine {
+    QEOffset offset;            /* start of the line */
+    unsigned int generation;    /* buffer generation, 0 if unused */
+    int edited;                 /* checkpoints adjusted after a change */
+    QECharset *charset;
+    EOLType eol_type;
+    int wrap, width, line_numbers, tab_width, show_unicode; /* layout */
+    int nb_points;
+    int size;
+    OWNED QELayoutPoint *points;
+} QELongLine;
+
+/* laid out lines cached per window, see text_display_line() */
+#define LAYOUT_CACHE_SIZE      128    /* must be a power of 2 */
+#define LAYOUT_CACHE_MAX_SIZE  32768  /* bytes per line, larger lines are
+                                         not cached */
+
+typedef struct QELayoutLine {
+    QEOffset offset;            /* start of the line */
+    QEOffset offset_end;        /* start of the next line */
+    QEOffset next;              /* offset returned by text_display_line() */
+    unsigned int generation;    /* buffer generation, 0 if unused */
+    ModeDef *mode;
+    EOLType eol_type;
+    int wrap, width, line_numbers, tab_width, show_unicode; /* layout */
+    int bidir, x_disp, hex_mode;
+    int size;                   /* bytes of rows recorded in data */
+    int allocated;
+    OWNED u8 *data;             /* rows passed to flush_line() */
+} QELayoutLine;
+
 enum WrapType {
     WRAP_AUTO = 0,
     WRAP_TRUNCATE,
@@ -646,10 +877,10 @@ enum WrapType {
 #define DIR_RTL 1
 
 struct EditState {
-    int offset;     /* offset of the cursor */
+    QEOffset offset;     /* offset of the cursor */
     /* text display state */
-    int offset_top; /* offset of first character displayed in window */
-    int offset_bottom; /* offset of first character beyond window or -1
+    QEOffset offset_top; /* offset of first character displayed in window */
+    QEOffset offset_bottom; /* offset of first character beyond window or -1
                         * if end of file displayed */
     int y_disp;    /* virtual position of the displayed text */
     int x_disp[2]; /* position for LTR and RTL text resp. */
@@ -692,18 +923,14 @@ struct EditState {
     ModeDef *mode;
     OWNED QEModeData *mode_data; /* mode private window based data */
 
-    /* state before line n, one short per line */
-    /* XXX: move this to buffer based mode_data */
-    unsigned short *colorize_states;
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to invalide
-       'colorize_states' */
-    int colorize_max_valid_offset;
+    QEColorizer *colorizer;  /* colorization states shared by windows */
 
     int busy; /* true if editing cannot be done if the window
                  (e.g. the parser HTML is parsing the buffer to
                  produce the display */
+    int display_time;    /* usec spent in the last window_display() */
+    int display_lines_drawn;   /* lines drawn by the last display */
+    int display_lines_skipped; /* unchanged lines skipped by the shadow */
     int display_invalid; /* true if the display was invalidated. Full
                             redraw should be done */
     int borders_invalid; /* true if window borders should be redrawn */
@@ -740,11 +967,15 @@ struct EditState {
     char modeline_shadow[MAX_SCREEN_WIDTH];
     OWNED QELineShadow *line_shadow; /* per window shadow CRC data */
     int shadow_nb_lines;
+    OWNED QELineCacheEntry *line_cache; /* LINE_CACHE_SIZE colorized lines */
+    OWNED QELayoutLine *layout_cache; /* LAYOUT_CACHE_SIZE laid out lines */
+    OWNED QELongLine *long_lines; /* LONG_LINE_CACHE_SIZE long line layouts */
+    int long_line_next;         /* next long_lines entry to recycle */
     /* compose state for input method */
     InputMethod *input_method; /* current input method */
     InputMethod *selected_input_method; /* selected input method (used to switch) */
     int compose_len;
-    int compose_start_offset;
+    QEOffset compose_start_offset;
     unsigned int compose_buf[20];
     OWNED EditState *next_window;
 };
@@ -760,7 +991,7 @@ struct ModeProbeData {
     int line_len;
     int st_errno;    /* errno from the stat system call */
     int st_mode;     /* unix file mode */
-    long total_size;
+    QEOffset total_size;
     EOLType eol_type;
     CharsetDecodeState charset_state;
     QECharset *charset;
@@ -808,8 +1039,8 @@ struct ModeDef {
     void (*display)(EditState *);
 
     /* text related functions */
-    int (*display_line)(EditState *, DisplayState *, int);
-    int (*backward_offset)(EditState *, int);
+    QEOffset (*display_line)(EditState *, DisplayState *, QEOffset);
+    QEOffset (*backward_offset)(EditState *, QEOffset);
 
     ColorizeFunc colorize_func;
     int colorize_flags;
@@ -831,13 +1062,13 @@ struct ModeDef {
 
     /* Functions to insert and delete contents: */
     void (*write_char)(EditState *s, int c);
-    void (*delete_bytes)(EditState *s, int offset, int size);
+    void (*delete_bytes)(EditState *s, QEOffset offset, QEOffset size);
 
     EditBufferDataType *data_type; /* native buffer data type (NULL = raw) */
     void (*get_mode_line)(EditState *s, buf_t *out);
-    void (*indent_func)(EditState *s, int offset);
+    void (*indent_func)(EditState *s, QEOffset offset);
     /* Get the current directory for the window, return NULL if none */
-    char *(*get_default_path)(EditBuffer *s, int offset,
+    char *(*get_default_path)(EditBuffer *s, QEOffset offset,
                               char *buf, int buf_size);
 
     /* mode specific key bindings */
@@ -963,6 +1194,15 @@ struct QEmacsState {
     CmdFunc last_cmd_func; /* last executed command function call */
     CmdFunc this_cmd_func; /* current executing command */
     int cmd_start_time;
+    QETimer *colorize_timer;  /* background colorization when idle */
+    QETimer *display_timer;   /* pending asynchronous redisplay */
+    int last_frame_time;      /* end of the last edit_display() in ms */
+    int frame_delay;          /* min delay between asynchronous frames */
+    QEDisplayStats display_stats;  /* redisplay profiling */
+    /* pool of line buffers, used in stack order */
+    QELineBuffer line_buffers[LINE_BUFFER_POOL_SIZE];
+    int nb_line_buffers_used;
+    FILE *display_trace;    /* per frame timings, see display-trace */
     /* keyboard macros */
     int defining_macro;
     int executing_macro;
@@ -997,6 +1237,7 @@ struct QEmacsState {
     int hilite_region;  /* hilite the current region when selecting */
     int mmap_threshold; /* minimum file size for mmap */
     int max_load_size;  /* maximum file size for loading in memory */
+    int undo_limit;     /* maximum size of the undo log of a buffer */
     int default_tab_width;      /* DEFAULT_TAB_WIDTH */
     int default_fill_column;    /* DEFAULT_FILL_COLUMN */
     EOLType default_eol_type;  /* EOL_UNIX */
@@ -1178,7 +1419,7 @@ struct DisplayState {
     int line_numbers;   /* display line numbers if enough space */
     void *cursor_opaque;
     int (*cursor_func)(struct DisplayState *,
-                       int offset1, int offset2, int line_num,
+                       QEOffset offset1, QEOffset offset2, int line_num,
                        int x, int y, int w, int h, int hex_mode);
     int eod;            /* end of display requested */
     /* if base == RTL, then all x are equivalent to width - x */
@@ -1188,6 +1429,7 @@ struct DisplayState {
     int eol_reached;
     EditState *edit_state;
     QETermStyle style;   /* current style for display_printf... */
+    QELayoutLine *layout; /* line whose rows are being recorded */
 
 #if 0
     QEFont *font;
@@ -1203,13 +1445,13 @@ struct DisplayState {
     /* line char (in fact glyph) buffer */
     unsigned int line_chars[MAX_SCREEN_WIDTH];
     short line_char_widths[MAX_SCREEN_WIDTH];
-    int line_offsets[MAX_SCREEN_WIDTH][2];
+    QEOffset line_offsets[MAX_SCREEN_WIDTH][2];
     unsigned char line_hex_mode[MAX_SCREEN_WIDTH];
     int line_index;
 
     /* fragment temporary buffer */
     unsigned int fragment_chars[MAX_WORD_SIZE];
-    int fragment_offsets[MAX_WORD_SIZE][2];
+    QEOffset fragment_offsets[MAX_WORD_SIZE][2];
     unsigned char fragment_hex_mode[MAX_WORD_SIZE];
     int fragment_index;
     int last_space;
@@ -1226,22 +1468,22 @@ enum DisplayType {
 
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *,
-                                     int offset1, int offset2, int line_num,
+                                     QEOffset offset1, QEOffset offset2, int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque);
 void display_close(DisplayState *s);
 void display_bol(DisplayState *s);
 void display_setcursor(DisplayState *s, DirType dir);
-int display_char_bidir(DisplayState *s, int offset1, int offset2,
+int display_char_bidir(DisplayState *s, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch);
-void display_eol(DisplayState *s, int offset1, int offset2);
+void display_eol(DisplayState *s, QEOffset offset1, QEOffset offset2);
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...) qe__attr_printf(4,5);
-void display_printhex(DisplayState *s, int offset1, int offset2,
+void display_printhex(DisplayState *s, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n);
 
-static inline int display_char(DisplayState *s, int offset1, int offset2,
+static inline int display_char(DisplayState *s, QEOffset offset1, QEOffset offset2,
                                int ch)
 {
     return display_char_bidir(s, offset1, offset2, 0, ch);
@@ -1301,7 +1543,7 @@ typedef struct CompletionDef {
     const char *name;
     void (*enumerate)(CompleteState *cp, CompleteFunc enumerate);
     int (*print_entry)(CompleteState *cp, EditState *s, const char *name);
-    int (*get_entry)(EditState *s, char *dest, int size, int offset);
+    int (*get_entry)(EditState *s, char *dest, int size, QEOffset offset);
 #define CF_FILENAME        1
 #define CF_NO_FUZZY        2
 #define CF_SPACE_OK        4
@@ -1328,7 +1570,7 @@ void minibuffer_edit(EditState *e, const char *input, const char *prompt,
 void command_complete(CompleteState *cp, CompleteFunc enumerate);
 int eb_command_print_entry(EditBuffer *b, const CmdDef *d, EditState *s);
 int command_print_entry(CompleteState *cp, EditState *s, const char *name);
-int command_get_entry(EditState *s, char *dest, int size, int offset);
+int command_get_entry(EditState *s, char *dest, int size, QEOffset offset);
 void file_complete(CompleteState *cp, CompleteFunc enumerate);
 int file_print_entry(CompleteState *cp, EditState *s, const char *name);
 void buffer_complete(CompleteState *cp, CompleteFunc enumerate);
@@ -1394,6 +1636,7 @@ void do_create_window(EditState *s, const char *filename, const char *layout);
 void qe_save_window_layout(EditState *s, EditBuffer *b);
 
 void edit_display(QEmacsState *qs);
+void edit_display_request(QEmacsState *qs);
 void edit_invalidate(EditState *s, int all);
 void display_mode_line(EditState *s);
 int edit_set_mode(EditState *s, ModeDef *m);
@@ -1402,7 +1645,7 @@ void do_set_next_mode(EditState *s, int n);
 
 /* loading files */
 void do_exit_qemacs(EditState *s, int argval);
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size);
+char *get_default_path(EditBuffer *b, QEOffset offset, char *buf, int buf_size);
 void do_find_file(EditState *s, const char *filename, int bflags);
 void do_load_from_path(EditState *s, const char *filename, int bflags);
 void do_find_file_other_window(EditState *s, const char *filename, int bflags);
@@ -1415,7 +1658,7 @@ void do_save_buffer(EditState *s);
 void do_write_file(EditState *s, const char *filename);
 void do_write_region(EditState *s, const char *filename);
 void isearch_colorize_matches(EditState *s, unsigned int *buf, int len,
-                              QETermStyle *sbuf, int offset);
+                              QETermStyle *sbuf, QEOffset offset);
 void do_isearch(EditState *s, int argval, int dir);
 void do_query_replace(EditState *s, const char *search_str,
                       const char *replace_str, int argval);
@@ -1431,15 +1674,22 @@ void qe_kill_buffer(EditBuffer *b);
 
 extern ModeDef text_mode;
 
-int text_backward_offset(EditState *s, int offset);
-int text_display_line(EditState *s, DisplayState *ds, int offset);
+QEOffset text_backward_offset(EditState *s, QEOffset offset);
+QEOffset text_display_line(EditState *s, DisplayState *ds, QEOffset offset);
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func, ModeDef *mode);
+QELineBuffer *line_buffer_get(QEmacsState *qs);
+void line_buffer_release(QEmacsState *qs, QELineBuffer *lb);
+int line_buffer_fit(QELineBuffer *lb, EditBuffer *b, QEOffset offset);
+void line_buffers_trim(QEmacsState *qs);
+void invalidate_line_cache(EditState *s);
+void free_line_cache(EditState *s);
+void free_line_shadow(EditState *s);
 int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                        QETermStyle *sbuf,
-                       int offset, int *offsetp, int line_num);
+                       QEOffset offset, QEOffset *offsetp, int line_num);
 
-int do_delete_selection(EditState *s);
+QEOffset do_delete_selection(EditState *s);
 void do_char(EditState *s, int key, int argval);
 void do_combine_accent(EditState *s, int accent);
 void do_set_mode(EditState *s, const char *name);
@@ -1447,7 +1697,7 @@ void text_move_left_right_visual(EditState *s, int dir);
 void text_move_word_left_right(EditState *s, int dir);
 void text_move_up_down(EditState *s, int dir);
 void text_scroll_up_down(EditState *s, int dir);
-int text_screen_width(EditBuffer *b, int start, int stop, int tw);
+int text_screen_width(EditBuffer *b, QEOffset start, QEOffset stop, int tw);
 void text_write_char(EditState *s, int key);
 void do_newline(EditState *s);
 void do_open_line(EditState *s);
@@ -1456,7 +1706,7 @@ void do_delete_char(EditState *s, int argval);
 void do_tab(EditState *s, int argval);
 EditBuffer *new_yank_buffer(QEmacsState *qs, EditBuffer *base);
 void do_append_next_kill(EditState *s);
-void do_kill(EditState *s, int p1, int p2, int dir, int keep);
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir, int keep);
 void do_kill_region(EditState *s, int keep);
 void do_kill_line(EditState *s, int argval);
 void do_kill_beginning_of_line(EditState *s, int argval);
@@ -1466,10 +1716,10 @@ void text_move_bol(EditState *s);
 void text_move_eol(EditState *s);
 void text_move_bof(EditState *s);
 void text_move_eof(EditState *s);
-int word_right(EditState *s, int w);
-int word_left(EditState *s, int w);
+QEOffset word_right(EditState *s, int w);
+QEOffset word_left(EditState *s, int w);
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr);
+                QEOffset offset, QEOffset *offset_ptr);
 void do_goto(EditState *s, const char *str, int unit);
 void do_goto_line(EditState *s, int line, int column);
 void do_up_down(EditState *s, int n);
@@ -1495,9 +1745,9 @@ void do_eof(EditState *s);
 void do_bol(EditState *s);
 void do_eol(EditState *s);
 void do_word_left_right(EditState *s, int n);
-void do_mark_region(EditState *s, int mark, int offset);
-int eb_next_paragraph(EditBuffer *b, int offset);
-int eb_prev_paragraph(EditBuffer *b, int offset);
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset);
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset);
+QEOffset eb_prev_paragraph(EditBuffer *b, QEOffset offset);
 void do_mark_paragraph(EditState *s, int n);
 void do_forward_paragraph(EditState *s, int n);
 void do_kill_paragraph(EditState *s, int n);
@@ -1506,7 +1756,7 @@ void do_changecase_word(EditState *s, int up);
 void do_changecase_region(EditState *s, int up);
 void do_delete_word(EditState *s, int dir);
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, int hex_mode);
 // should take argval
 void do_scroll_left_right(EditState *s, int n);
@@ -1735,7 +1985,7 @@ extern ModeDef list_mode;
 
 void list_toggle_selection(EditState *s, int dir);
 int list_get_pos(EditState *s);
-int list_get_offset(EditState *s);
+QEOffset list_get_offset(EditState *s);
 
 /* dired.c */
 
@@ -41,11 +41,11 @@
 struct ISearchState {
     EditState *s;
     int search_flags;
-    int start_offset;
-    int found_offset, found_end;
+    QEOffset start_offset;
+    QEOffset found_offset, found_end;
     int search_u32_len;
     /* isearch */
-    int saved_mark;
+    QEOffset saved_mark;
     int start_dir;
     int quoting;
     int dir;
@@ -66,13 +66,14 @@ static int last_search_u32_len = 0;
 static int last_search_u32_flags = 0;
 
 static int eb_search(EditBuffer *b, int dir, int flags,
-                     int start_offset, int end_offset,
+                     QEOffset start_offset, QEOffset end_offset,
                      const unsigned int *buf, int len,
                      CSSAbortFunc *abort_func, void *abort_opaque,
-                     int *found_offset, int *found_end)
+                     QEOffset *found_offset, QEOffset *found_end)
 {
-    int total_size = b->total_size;
-    int c, c2, offset = start_offset, offset1, offset2, offset3, pos;
+    QEOffset total_size = b->total_size;
+    QEOffset offset = start_offset, offset1, offset2, offset3;
+    int c, c2, pos;
 
     if (len == 0)
         return 0;
@@ -240,7 +241,8 @@ static void isearch_run(ISearchState *is) {
     buf_t outbuf, *out;
     int c, i, len, hex_nibble, max_nibble, h, hc;
     unsigned int v;
-    int search_offset, flags, dir;
+    QEOffset search_offset;
+    int flags, dir;
     int start_time, elapsed_time;
     EditState *s = is->s;
 
@@ -348,9 +350,11 @@ static void isearch_run(ISearchState *is) {
     dpy_flush(s->screen);
 }
 
-static int isearch_grab(ISearchState *is, EditBuffer *b, int from, int to)
+static int isearch_grab(ISearchState *is, EditBuffer *b,
+                        QEOffset from, QEOffset to)
 {
-    int offset, c, last = is->pos;
+    QEOffset offset;
+    int c, last = is->pos;
     if (b) {
         if (to < 0 || to > b->total_size)
             to = b->total_size;
@@ -365,7 +369,7 @@ static int isearch_grab(ISearchState *is, EditBuffer *b, int from, int to)
 static void isearch_yank_word(EditState *s) {
     ISearchState *is = s->isearch_state;
     if (is) {
-        int offset0, offset1;
+        QEOffset offset0, offset1;
         offset0 = s->offset;
         do_word_left_right(s, 1);
         offset1 = s->offset;
@@ -377,7 +381,7 @@ static void isearch_yank_word(EditState *s) {
 static void isearch_yank_line(EditState *s) {
     ISearchState *is = s->isearch_state;
     if (is) {
-        int offset0, offset1;
+        QEOffset offset0, offset1;
         offset0 = s->offset;
         if (eb_nextc(s->b, offset0, &offset1) == '\n')
             offset0 = offset1;
@@ -521,7 +525,7 @@ static void isearch_exit(EditState *s, int key) {
     ISearchState *is = s->isearch_state;
     if (is) {
         /* exit search mode */
-        s->b->mark = min(is->start_offset, s->b->total_size);
+        s->b->mark = min_offset(is->start_offset, s->b->total_size);
         s->region_style = 0;
         put_status(s, "Mark saved where search started");
         /* repost key */
@@ -602,11 +606,11 @@ void do_isearch(EditState *s, int argval, int dir)
 }
 
 void isearch_colorize_matches(EditState *s, unsigned int *buf, int len,
-                              QETermStyle *sbuf, int offset_start)
+                              QETermStyle *sbuf, QEOffset offset_start)
 {
     ISearchState *is = s->isearch_state;
     EditBuffer *b = s->b;
-    int offset, char_offset, found_offset, found_end, offset_end;
+    QEOffset offset, char_offset, found_offset, found_end, offset_end;
 
     if (!is || is->search_u32_len <= 0)
         return;
@@ -687,14 +691,14 @@ typedef struct QueryReplaceState {
     EditState *s;
     EditState *help_window;
     int search_flags;
-    int start_offset;
-    int found_offset, found_end;
+    QEOffset start_offset;
+    QEOffset found_offset, found_end;
     int search_u32_len;
     /* query-replace */
     int replace_all;
     int nb_reps;
     int replace_u32_len;
-    int last_offset;
+    QEOffset last_offset;
     char search_str[SEARCH_LENGTH];     /* may be in hex */
     char replace_str[SEARCH_LENGTH];    /* may be in hex */
     unsigned int search_u32[SEARCH_LENGTH];   /* code points */
@@ -774,11 +778,17 @@ static void query_replace_run(QueryReplaceState *is)
                                         countof(is->replace_u32),
                                         is->replace_str, is->search_flags);
 
+    /* replace all remaining matches as a single modification */
+    if (is->replace_all)
+        eb_begin_edit(s->b);
+
     for (;;) {
         if (eb_search(s->b, 1, is->search_flags,
                       is->found_offset, s->b->total_size,
                       is->search_u32, is->search_u32_len,
                       NULL, NULL, &is->found_offset, &is->found_end) <= 0) {
+            if (is->replace_all)
+                eb_commit_edit(s->b);
             query_replace_abort(is);
             return;
         }
@@ -1012,9 +1022,10 @@ void do_search_string(EditState *s, const char *search_str, int dir)
 {
     unsigned int search_u32[SEARCH_LENGTH];
     int search_u32_len;
-    int found_offset, found_end;
+    QEOffset found_offset, found_end;
     int flags = SEARCH_FLAG_SMARTCASE;
-    int offset, offset1, count = 0;
+    QEOffset offset, offset1;
+    int count = 0;
 
     if (s->hex_mode) {
         if (s->unihex_mode)
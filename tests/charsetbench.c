@@ -0,0 +1,138 @@
+/*
+ * Measure the charset scanning functions
+ *
+ * usage: bin/charsetbench [megabytes]
+ *
+ * The get_pos and get_chars functions of each charset are run over
+ * the pages of a 16 MB text, like after loading or modifying a
+ * buffer, until `megabytes` of text have been scanned (1024 by
+ * default). They count end of lines and character boundaries with
+ * count_units() and count_utf8_chars(), whose SIMD kernels are
+ * selected by charset_init(). The throughput is reported in GB/s of
+ * encoded text. get_chars is run in DOS mode, where it also counts
+ * the \n to merge CR LF pairs: in Unix mode the charsets of fixed width
+ * just divide the size.
+ */
+
+#include <time.h>
+
+#include "qe.h"
+
+#define TEXT_SIZE  (16 << 20)
+#define SCAN_SIZE  (64 << 10)
+
+QEmacsState qe_state;
+
+void put_status(qe__unused__ EditState *s, qe__unused__ const char *fmt, ...)
+{
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* mostly ASCII lines with some accented letters, CJK and emoji */
+static int next_char(unsigned int *seed, int *col)
+{
+    unsigned int r;
+
+    *seed = *seed * 1103515245 + 12345;
+    r = *seed >> 16;
+    if (*col >= 20 + (int)(r % 100)) {
+        *col = 0;
+        return '\n';
+    }
+    *col += 1;
+    switch (r % 64) {
+    case 0:
+        return 0x4e00 + r % 0x5000;
+    case 1:
+        return 0x1f600 + r % 0x40;
+    case 2: case 3:
+        return 0xe0 + r % 0x20;
+    case 4: case 5: case 6: case 7: case 8: case 9: case 10:
+        return ' ';
+    default:
+        return 'a' + r % 26;
+    }
+}
+
+/* encode the same text in `charset`, return its size */
+static int make_text(QECharset *charset, u8 *buf, int size)
+{
+    unsigned int seed = 1;
+    u8 *p = buf, *q;
+    int c, col = 0;
+
+    while (p + MAX_CHAR_BYTES <= buf + size) {
+        c = next_char(&seed, &col);
+        q = charset->encode_func(charset, p, c);
+        if (!q)
+            q = charset->encode_func(charset, p, '?');
+        p = q;
+    }
+    return p - buf;
+}
+
+/* return the throughput of get_pos or get_chars over `total` bytes */
+static double bench(CharsetDecodeState *s, const u8 *buf, int size,
+                    long long total, int chars)
+{
+    long long done;
+    double t0 = get_time();
+    int pos, len, lines, col;
+
+    for (done = 0; done < total; done += size) {
+        for (pos = 0; pos < size; pos += len) {
+            len = min(size - pos, SCAN_SIZE);
+            if (chars) {
+                s->charset->get_chars_func(s, buf + pos, len);
+            } else {
+                s->get_pos_func(s, buf + pos, len, &lines, &col);
+            }
+        }
+    }
+    return done / (get_time() - t0) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static QECharset * const charsets[] = {
+        &charset_8859_1, &charset_utf8, &charset_ucs2le, &charset_ucs2be,
+        &charset_ucs4le, &charset_ucs4be,
+    };
+    long long total = 1024LL << 20;
+    CharsetDecodeState s, s_dos;
+    double pos_rate, chars_rate;
+    int i, size;
+    u8 *buf;
+
+    if (argc > 1)
+        total = strtoll(argv[1], NULL, 0) << 20;
+
+    charset_init();
+    buf = qe_malloc_array(u8, TEXT_SIZE);
+    if (!buf) {
+        fprintf(stderr, "charsetbench: cannot allocate text\n");
+        return 1;
+    }
+    printf("%lld MB scanned in %d KB pages\n\n", total >> 20, SCAN_SIZE >> 10);
+    printf("%-12s %12s %12s\n", "charset", "get_pos", "get_chars");
+    for (i = 0; i < countof(charsets); i++) {
+        size = make_text(charsets[i], buf, TEXT_SIZE);
+        charset_decode_init(&s, charsets[i], EOL_UNIX);
+        charset_decode_init(&s_dos, charsets[i], EOL_DOS);
+        pos_rate = bench(&s, buf, size, total, 0);
+        chars_rate = bench(&s_dos, buf, size, total, 1);
+        charset_decode_close(&s);
+        charset_decode_close(&s_dos);
+        printf("%-12s %7.2f GB/s %7.2f GB/s\n",
+               charsets[i]->name, pos_rate, chars_rate);
+    }
+    qe_free(&buf);
+    return 0;
+}
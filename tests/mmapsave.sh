@@ -0,0 +1,52 @@
+#!/bin/bash
+# Save a memory mapped file and keep editing it.
+#
+# usage: tests/mmapsave.sh [qe binary]
+#
+# Files above mmap-threshold are mapped and their unmodified pages
+# point to the mapping: saving over the file must not change or
+# invalidate them. Each case edits the buffer, saves it, edits it
+# again in parts that were never modified and saves again, then
+# compares the file with the expected contents.
+
+QE=${1:-$(dirname "$0")/../qe}
+QE=$(cd "$(dirname "$QE")" && pwd)/$(basename "$QE")
+
+tmpdir=$(mktemp -d)
+trap 'chmod -R u+w "$tmpdir"; rm -rf "$tmpdir"' EXIT
+failed=0
+
+# first line, save, delete line 100000, last line, save, quit
+keys='\x1b<first\r\x18\x13\x1bg100000\r\x0b\x0b\x1b>last\r\x18\x13\x18\x03'
+
+run() {
+    local name=$1 dir=$2 eval=$3
+
+    seq 1 200000 > "$dir/big.txt"
+    { echo first; seq 1 99998; seq 100000 200000; echo last; } > "$tmpdir/expected"
+    printf "$keys" |
+        (cd "$dir" && env -i HOME="$tmpdir" TERM=xterm COLUMNS=80 LINES=25 \
+             timeout 20 "$QE" -nw -q +eval "mmap_threshold=4096" \
+             ${eval:+ +eval "$eval"} big.txt > /dev/null 2>&1)
+    if ! cmp -s "$dir/big.txt" "$tmpdir/expected"; then
+        echo "$name: FAILED, contents differ"
+        failed=1
+    elif [ -n "$(ls "$dir" | grep -v '^big\.txt~\?$')" ]; then
+        echo "$name: FAILED, left $(ls "$dir" | grep -v '^big\.txt~\?$')"
+        failed=1
+    else
+        echo "$name: ok"
+    fi
+}
+
+mkdir "$tmpdir/a" "$tmpdir/b" "$tmpdir/c"
+run "backup" "$tmpdir/a" ""
+run "no-backup" "$tmpdir/b" "backup_inhibited=1"
+if [ "$(id -u)" != 0 ]; then
+    # the new file cannot be created next to the mapped one
+    seq 1 200000 > "$tmpdir/c/big.txt"
+    chmod a-w "$tmpdir/c"
+    run "read-only-dir" "$tmpdir/c" "backup_inhibited=1"
+fi
+
+exit $failed
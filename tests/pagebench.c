@@ -0,0 +1,132 @@
+/*
+ * Measure the buffer page operations
+ *
+ * usage: bin/pagebench [megabytes]
+ *
+ * A text of `megabytes` (64 by default) is loaded in 1 MB chunks into
+ * large pages, then edited: scattered writes split the large pages
+ * with page_split(), insertions and deletions around a hotspot split
+ * and merge small pages with page_merge_next(), larger deletions merge
+ * the pages around them. The line scan reads a screenful of text at
+ * random lines, as the display does after a scroll. Each step reports
+ * its time per operation and the resulting number of pages.
+ */
+
+#include <time.h>
+#include <sys/resource.h>
+
+#include "qe.h"
+
+#define LOAD_CHUNK  (1 << 20)
+
+QEmacsState qe_state;
+
+void put_status(qe__unused__ EditState *s, qe__unused__ const char *fmt, ...)
+{
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int seed = 1;
+
+static unsigned int next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static QEOffset rand_offset(EditBuffer *b)
+{
+    return ((QEOffset)next_rand() << 24 | next_rand()) % b->total_size;
+}
+
+static void report(const char *name, EditBuffer *b, int n, double t0)
+{
+    printf("%-16s %8d %10.3f %8d\n",
+           name, n, (get_time() - t0) * 1e6 / n, b->nb_pages);
+}
+
+int main(int argc, char **argv)
+{
+    static const char line[] =
+        "The quick brown fox jumps over the lazy dog, 0123456789.\n";
+    long long size = 64LL << 20;
+    EditBuffer *b;
+    struct rusage ru;
+    QEOffset offset, next;
+    double t0;
+    int i, j, n, lines;
+    u8 *buf;
+
+    if (argc > 1)
+        size = strtoll(argv[1], NULL, 0) << 20;
+
+    charset_init();
+    eb_init();
+    buf = qe_malloc_array(u8, LOAD_CHUNK);
+    b = eb_new("*pagebench*", BF_SYSTEM);
+    if (!buf || !b) {
+        fprintf(stderr, "pagebench: cannot allocate buffer\n");
+        return 1;
+    }
+    for (i = 0; i < LOAD_CHUNK; i++)
+        buf[i] = line[i % (sizeof(line) - 1)];
+
+    printf("%lld MB buffer, %d byte small pages, %d byte large pages\n\n",
+           size >> 20, MAX_PAGE_SIZE, MAX_LARGE_PAGE_SIZE);
+    printf("%-16s %8s %10s %8s\n", "step", "ops", "usec/op", "pages");
+
+    t0 = get_time();
+    for (n = 0; b->total_size < size; n++)
+        eb_insert(b, b->total_size, buf, LOAD_CHUNK);
+    report("load 1MB", b, n, t0);
+    getrusage(RUSAGE_SELF, &ru);
+
+    /* each write splits the large page around it */
+    n = 20000;
+    t0 = get_time();
+    for (i = 0; i < n; i++)
+        eb_write(b, rand_offset(b), "x", 1);
+    report("write 1", b, n, t0);
+
+    /* a small page grows, splits and merges back */
+    n = 100000;
+    offset = rand_offset(b);
+    t0 = get_time();
+    for (i = 0; i < n; i++) {
+        eb_insert(b, offset, buf, 3000);
+        eb_delete(b, offset, 3000);
+    }
+    report("insert+delete 3K", b, n, t0);
+
+    /* the pages around each deletion are merged */
+    n = 2000;
+    t0 = get_time();
+    for (i = 0; i < n; i++)
+        eb_delete(b, rand_offset(b), 6000);
+    report("delete 6K", b, n, t0);
+
+    /* read 40 lines at random line numbers */
+    eb_get_pos(b, &lines, &j, b->total_size);
+    n = 20000;
+    t0 = get_time();
+    for (i = 0; i < n; i++) {
+        offset = eb_goto_pos(b, next_rand() % lines, 0);
+        for (j = 0; j < 40 && offset < b->total_size; offset = next) {
+            if (eb_nextc(b, offset, &next) == '\n')
+                j++;
+        }
+    }
+    report("scan 40 lines", b, n, t0);
+
+    printf("\nmax RSS after load: %ld KB\n", ru.ru_maxrss);
+    eb_free(&b);
+    qe_free(&buf);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Measure the terminal output of scripted scroll scenarios.
+#
+# usage: tests/ttybench.sh [qe binaries ...]
+#
+# Each scenario runs qe on a pipe: the keys are read from stdin and the
+# screen updates are written to stdout, then counted. The number of
+# frames is the number of cursor shows at the end of tty_dpy_flush().
+# Pass several binaries to compare them, for example the current
+# build and a build of an older revision.
+
+[ $# -eq 0 ] && set -- "$(dirname "$0")/../qe"
+
+COLS=${COLS:-100}
+ROWS=${ROWS:-40}
+TERM_NAME=${TERM_NAME:-xterm-256color}
+FILE=${FILE:-$(dirname "$0")/../tty.c}
+
+scenarios=(
+    "page-down"       '\x16\x16\x16\x16\x16\x16\x16\x16\x16\x16'
+    "page-up"         '\x1b>\x1bv\x1bv\x1bv\x1bv\x1bv\x1bv\x1bv\x1bv\x1bv\x1bv'
+    "scroll-line-up"  '\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a'
+    "scroll-line-dn"  '\x16\x16\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz\x1bz'
+    "next-line"       '\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e\x0e'
+    "open-line"       '\x16\x0f\x0f\x0f\x0f\x0f\x0f\x0f\x0f\x0f\x0f'
+    "kill-line"       '\x16\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b'
+    "split-scroll"    '\x182\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x18o\x16\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a'
+    "side-by-side"    '\x183\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x18o\x16\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a\x1a'
+)
+
+# work on a copy: the scenarios modify the buffer
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+cp "$FILE" "$tmpdir/" || exit 1
+tmp="$tmpdir/output"
+
+printf "%dx%d %s: output bytes / frames\n\n" $COLS $ROWS $TERM_NAME
+printf "%-16s" "scenario"
+for qe in "$@"; do
+    printf " %20s" "$qe"
+done
+printf "\n"
+
+for ((i = 0; i < ${#scenarios[@]}; i += 2)); do
+    printf "%-16s" "${scenarios[i]}"
+    for qe in "$@"; do
+        # quit without saving the modified buffer
+        printf "${scenarios[i+1]}"'\x18\x03nyes\r' |
+            env -i HOME="$tmpdir" TERM=$TERM_NAME COLUMNS=$COLS LINES=$ROWS \
+                "$qe" -nw -c utf8 "$tmpdir/$(basename "$FILE")" > "$tmp" 2>/dev/null
+        bytes=$(wc -c < "$tmp")
+        frames=$(grep -o $'\033\\[?25h' "$tmp" | wc -l)
+        printf " %13d /%5d" $bytes $frames
+    done
+    printf "\n"
+done
@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -81,30 +83,13 @@ typedef uint32_t TTYChar;
 #define COMB_CACHE_SIZE       1
 #endif
 
-#if defined(CONFIG_UNLOCKIO)
-#  define TTY_PUTC(c,f)         putc_unlocked(c, f)
-#ifdef CONFIG_DARWIN
-#  define TTY_FWRITE(b,s,n,f)   fwrite(b, s, n, f)
-#else
-#  define TTY_FWRITE(b,s,n,f)   fwrite_unlocked(b, s, n, f)
-#endif
-#  define TTY_FPRINTF           fprintf
-static inline void TTY_FPUTS(const char *s, FILE *fp) {
-    TTY_FWRITE(s, 1, strlen(s), fp);
-}
-#else
-#  define TTY_PUTC(c,f)         putc(c, f)
-#  define TTY_FWRITE(b,s,n,f)   fwrite(b, s, n, f)
-#  define TTY_FPRINTF           fprintf
-#  define TTY_FPUTS             fputs
-#endif
-
 enum InputState {
     IS_NORM,
     IS_ESC,
     IS_CSI,
     IS_CSI2,
     IS_ESC2,
+    IS_PASTE,
 };
 
 enum TermCode {
@@ -121,14 +106,23 @@ typedef struct TTYState {
     TTYChar *screen;
     int screen_size;
     unsigned char *line_updated;
+    unsigned int *line_hash;    /* row hashes for scroll detection */
+    int *line_cost;             /* estimated cost of redrawing rows */
     struct termios oldtty;
     int cursor_x, cursor_y;
+    int flushed_cursor_x, flushed_cursor_y;  /* cursor sent by last flush */
+    int out_x, out_y;           /* terminal cursor during flush, -1 if unknown */
     /* input handling */
     enum InputState input_state;
     int has_meta;
     int input_param, input_param2;
     int utf8_index;
     unsigned char buf[8];
+    unsigned char read_buf[4096];  /* terminal input read in one call */
+    int read_pos, read_len;
+    EditBuffer *paste_buf;      /* bracketed paste text */
+    int paste_match;            /* length of end of paste marker seen */
+    int paste_cr;               /* last pasted byte was a CR */
     char *term_name;
     enum TermCode term_code;
     int term_flags;
@@ -138,6 +132,11 @@ typedef struct TTYState {
 #define USE_BLINK_AS_BRIGHT_BG  0x08
 #define USE_256_COLORS          0x10
 #define USE_TRUE_COLORS         0x20
+#define USE_SYNC_UPDATE         0x40
+#define USE_SCROLL_REGION       0x80   /* DECSTBM, IL and DL */
+#define USE_ERASE_CHARS         0x100  /* ECH */
+#define USE_REPEAT_CHAR         0x200  /* REP */
+#define USE_BRACKETED_PASTE     0x400
     /* number of colors supported by the actual terminal */
     const QEColor *term_colors;
     int term_fg_colors_count;
@@ -149,8 +148,100 @@ typedef struct TTYState {
     /* cache for glyph combinations */
     // XXX: should keep track of max_comb and max_max_comb
     unsigned int comb_cache[COMB_CACHE_SIZE];
+    /* terminal output is assembled here and written in one call */
+    unsigned char *out_buf;
+    int out_len, out_size;
 } TTYState;
 
+/* Terminal output is accumulated in ts->out_buf and sent by
+ * tty_flush_output() with a single write() system call: a frame
+ * reaches the terminal in one piece and stdio is bypassed.
+ * Bytes are counted in s->output_bytes, write calls in s->output_writes.
+ */
+static void tty_flush_output(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    int fd = fileno(s->STDOUT);
+    int pos, len;
+
+    fflush(s->STDOUT);
+    for (pos = 0; pos < ts->out_len; pos += len) {
+        len = write(fd, ts->out_buf + pos, ts->out_len - pos);
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                /* stdout may share the non blocking mode of stdin */
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+            } else
+            if (errno != EINTR) {
+                break;
+            }
+            len = 0;
+            continue;
+        }
+        s->output_writes++;
+    }
+    ts->out_len = 0;
+}
+
+/* make room for at least `size` more bytes in the output buffer */
+static int tty_reserve_output(QEditScreen *s, int size)
+{
+    TTYState *ts = s->priv_data;
+    int new_size;
+
+    if (ts->out_len + size <= ts->out_size)
+        return 1;
+    new_size = max(4096, ts->out_size);
+    while (new_size < ts->out_len + size)
+        new_size += new_size / 2;
+    if (qe_realloc(&ts->out_buf, new_size)) {
+        ts->out_size = new_size;
+        return 1;
+    }
+    /* allocation failure: send what we have and retry */
+    tty_flush_output(s);
+    return size <= ts->out_size;
+}
+
+static void TTY_FWRITE(const void *buf, int size, QEditScreen *s) {
+    TTYState *ts = s->priv_data;
+
+    if (tty_reserve_output(s, size)) {
+        memcpy(ts->out_buf + ts->out_len, buf, size);
+        ts->out_len += size;
+        s->output_bytes += size;
+    }
+}
+
+static inline void TTY_PUTC(int c, QEditScreen *s) {
+    TTYState *ts = s->priv_data;
+
+    if (ts->out_len < ts->out_size || tty_reserve_output(s, 1)) {
+        ts->out_buf[ts->out_len++] = c;
+        s->output_bytes++;
+    }
+}
+
+static inline void TTY_FPUTS(const char *str, QEditScreen *s) {
+    TTY_FWRITE(str, strlen(str), s);
+}
+
+static void TTY_FPRINTF(QEditScreen *s, const char *fmt, ...)
+    qe__attr_printf(2,3);
+
+static void TTY_FPRINTF(QEditScreen *s, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (len > 0)
+        TTY_FWRITE(buf, min(len, (int)sizeof(buf) - 1), s);
+}
+
 static QEditScreen *tty_screen;   /* for tty_term_exit and tty_term_resize */
 
 static void tty_dpy_invalidate(QEditScreen *s);
@@ -205,9 +296,20 @@ static int tty_dpy_init(QEditScreen *s,
         } else
         if (strstart(ts->term_name, "xterm", NULL)) {
             ts->term_code = TERM_XTERM;
+            ts->term_flags |= USE_SCROLL_REGION | USE_ERASE_CHARS |
+                              USE_REPEAT_CHAR | USE_BRACKETED_PASTE;
         } else
         if (strstart(ts->term_name, "linux", NULL)) {
             ts->term_code = TERM_LINUX;
+            ts->term_flags |= USE_SCROLL_REGION | USE_ERASE_CHARS;
+        } else
+        if (strstart(ts->term_name, "tmux", NULL)) {
+            ts->term_flags |= USE_SCROLL_REGION | USE_ERASE_CHARS |
+                              USE_REPEAT_CHAR | USE_BRACKETED_PASTE;
+        } else
+        if (strstart(ts->term_name, "screen", NULL)) {
+            ts->term_flags |= USE_SCROLL_REGION | USE_ERASE_CHARS |
+                              USE_BRACKETED_PASTE;
         } else
         if (strstart(ts->term_name, "cygwin", NULL)) {
             ts->term_code = TERM_CYGWIN;
@@ -230,6 +332,17 @@ static int tty_dpy_init(QEditScreen *s,
         /* iTerm and iTerm2 support true colors */
         ts->term_flags |= USE_TRUE_COLORS | USE_256_COLORS;
     }
+    /* Terminals known to support synchronized output (DEC mode 2026).
+     * Other xterm compatible terminals are queried with DECRQM below.
+     */
+    if (((p = getenv("TERM_PROGRAM")) != NULL
+    &&   (strequal(p, "iTerm.app") || strequal(p, "WezTerm")
+    ||    strequal(p, "ghostty") || strequal(p, "vscode")
+    ||    strequal(p, "contour")))
+    ||  (ts->term_name && (strstart(ts->term_name, "xterm-kitty", NULL)
+    ||                     strstart(ts->term_name, "foot", NULL)))) {
+        ts->term_flags |= USE_SYNC_UPDATE;
+    }
     /* actual color mode can be forced via environment variables */
     /* XXX: should have qemacs variables too */
     if ((p = getenv("COLORTERM")) != NULL) {
@@ -303,7 +416,7 @@ static int tty_dpy_init(QEditScreen *s,
            "\033)0\033(B"       /* select character sets in block 0 and 1 */
            "\017");             /* shift out */
 #else
-    TTY_FPRINTF(s->STDOUT,
+    TTY_FPRINTF(s,
                 "\033[?1049h"       /* enter_ca_mode */
                 "\033[m\033(B"      /* exit_attribute_mode */
                 "\033[4l"           /* exit_insert_mode */
@@ -312,6 +425,10 @@ static int tty_dpy_init(QEditScreen *s,
                 "\033[?1h\033="     /* keypad_xmit */
                );
 #endif
+    if (ts->term_flags & USE_BRACKETED_PASTE) {
+        /* pasted text is sent between ^[[200~ and ^[[201~ */
+        TTY_FPUTS("\033[?2004h", s);
+    }
 
     /* Get charset from command line option */
     s->charset = find_charset(qe_state.tty_charset);
@@ -341,15 +458,15 @@ static int tty_dpy_init(QEditScreen *s,
         /*               ^X  ^Z    ^M   \170101  */
         //printf("%s", "\030\032" "\r\xEF\x81\x81" "\033[6n\033D");
         /* Just print UTF-8 encoding for eacute and check cursor position */
-        TTY_FPRINTF(s->STDOUT, "%s",
+        TTY_FPRINTF(s, "%s",
                     "\030\032"
                     "\r\xC3\xA9"
                     "\033[6n"
                     /* "\033D" */);
-        fflush(s->STDOUT);
+        tty_flush_output(s);
         /* XXX: should have a timeout to avoid locking on unsupported terminals */
         n = fscanf(s->STDIN, "\033[%d;%dR", &y, &x);  /* get cursor position */
-        TTY_FPRINTF(s->STDOUT, "\r   \r");        /* go back, erase 3 chars */
+        TTY_FPRINTF(s, "\r   \r");        /* go back, erase 3 chars */
         if (n == 2 && x == 2) {
 #if 0
             /* determine the unicode version supported */
@@ -383,10 +500,10 @@ static int tty_dpy_init(QEditScreen *s,
             };
             int i;
             for (i = countof(wide_by_version); i --> 1;) {
-                TTY_FPRINTF(s->STDOUT, "\r%s\033[6n", wide_by_version[i] + 1);
-                fflush(s->STDOUT);
+                TTY_FPRINTF(s, "\r%s\033[6n", wide_by_version[i] + 1);
+                tty_flush_output(s);
                 n = fscanf(s->STDIN, "\033[%d;%dR", &y, &x);  /* get cursor position */
-                TTY_FPRINTF(s->STDOUT, "\r    \r");          /* go back, erase 4 chars */
+                TTY_FPRINTF(s, "\r    \r");          /* go back, erase 4 chars */
                 if (n != 2)
                     break;
                 if (x == 3) {
@@ -400,6 +517,13 @@ static int tty_dpy_init(QEditScreen *s,
     }
     put_status(NULL, "tty charset: %s", s->charset->name);
 
+    if (ts->term_code == TERM_XTERM
+    ||  (ts->term_name && strstart(ts->term_name, "tmux", NULL))) {
+        /* query synchronized output mode after the cursor position
+         * report: the DECRPM reply is handled by tty_read_handler() */
+        TTY_FPUTS("\033[?2026$p", s);
+    }
+
     atexit(tty_term_exit);
 
     sig.sa_handler = tty_term_resize;
@@ -436,19 +560,24 @@ static void tty_dpy_close(QEditScreen *s)
            s->height, 1);
 #else
     /* go to last line and clear it */
-    TTY_FPRINTF(s->STDOUT, "\033[%d;%dH" "\033[m\033[K", s->height, 1);
-    TTY_FPRINTF(s->STDOUT,
+    TTY_FPRINTF(s, "\033[%d;%dH" "\033[m\033[K", s->height, 1);
+    if (ts->term_flags & USE_BRACKETED_PASTE)
+        TTY_FPUTS("\033[?2004l", s);
+    TTY_FPRINTF(s,
                 "\033[?1049l"       /* exit_ca_mode */
                 "\033[?1l\033>"     /* keypad_local */
                 "\033[?25h"         /* show cursor */
                 "\r\033[m\033[K"    /* return erase eol */
                );
 #endif
-    fflush(s->STDOUT);
+    tty_flush_output(s);
     tcsetattr(fileno(s->STDIN), TCSANOW, &ts->oldtty);
 
+    qe_free(&ts->out_buf);
     qe_free(&ts->screen);
     qe_free(&ts->line_updated);
+    qe_free(&ts->line_hash);
+    qe_free(&ts->line_cost);
     qe_free(&s->priv_data);
 }
 
@@ -516,6 +645,8 @@ static void tty_dpy_invalidate(QEditScreen *s)
     /* screen buffer + shadow buffer + extra slot for loop guard */
     qe_realloc(&ts->screen, size * 2 + sizeof(TTYChar));
     qe_realloc(&ts->line_updated, s->height);
+    qe_realloc(&ts->line_hash, 2 * s->height * sizeof(*ts->line_hash));
+    qe_realloc(&ts->line_cost, s->height * sizeof(*ts->line_cost));
     ts->screen_size = count;
 
     /* Erase shadow buffer to impossible value */
@@ -544,9 +675,13 @@ static void tty_dpy_cursor_at(QEditScreen *s, int x1, int y1,
 
 static int tty_dpy_is_user_input_pending(QEditScreen *s)
 {
+    TTYState *ts = s->priv_data;
     fd_set rfds;
     struct timeval tv;
 
+    if (ts->read_pos < ts->read_len)
+        return 1;
+
     tv.tv_sec = 0;
     tv.tv_usec = 0;
     FD_ZERO(&rfds);
@@ -595,22 +730,89 @@ static int const csi_lookup[] = {
     KEY_F20,      /* 34 */
 };
 
-static void tty_read_handler(void *opaque)
+static const char tty_paste_end[] = "\033[201~";
+
+/* Append pasted bytes to the paste buffer.  Terminals send line breaks
+ * as CR: store them as LF.
+ */
+static void tty_paste_write(TTYState *ts, const u8 *p, int len)
+{
+    EditBuffer *b = ts->paste_buf;
+    const u8 *end = p + len;
+    const u8 *q;
+
+    if (ts->paste_cr && p < end && *p == '\n')
+        p++;
+    ts->paste_cr = 0;
+    while (p < end) {
+        q = memchr(p, '\r', end - p);
+        if (!q) {
+            eb_write(b, b->total_size, p, end - p);
+            break;
+        }
+        eb_write(b, b->total_size, p, q - p);
+        eb_write(b, b->total_size, "\n", 1);
+        p = q + 1;
+        if (p == end) {
+            ts->paste_cr = 1;
+            break;
+        }
+        if (*p == '\n')
+            p++;
+    }
+}
+
+/* Consume pasted bytes up to the end of paste marker, then post the
+ * whole text as a single paste event.
+ */
+static void tty_paste_input(QEditScreen *s)
 {
-    QEditScreen *s = opaque;
-    QEmacsState *qs = &qe_state;
     TTYState *ts = s->priv_data;
     QEEvent ev1, *ev = &ev1;
-    u8 buf[1];
-    int ch, len, n1;
-
-    if (read(fileno(s->STDIN), buf, 1) != 1)
-        return;
+    const u8 *p = ts->read_buf + ts->read_pos;
+    const u8 *end = ts->read_buf + ts->read_len;
+    const u8 *q;
+
+    while (p < end) {
+        if (ts->paste_match) {
+            if (*p == tty_paste_end[ts->paste_match]) {
+                p++;
+                if (++ts->paste_match == countof(tty_paste_end) - 1) {
+                    ts->read_pos = p - ts->read_buf;
+                    ts->input_state = IS_NORM;
+                    ts->paste_match = 0;
+                    ts->paste_buf = NULL;
+                    ev->type = QE_PASTE_EVENT;
+                    qe_handle_event(ev);
+                    return;
+                }
+                continue;
+            }
+            /* not the end marker: keep the bytes matched so far */
+            tty_paste_write(ts, (const u8 *)tty_paste_end, ts->paste_match);
+            ts->paste_match = 0;
+        }
+        if (*p == '\033') {
+            ts->paste_match = 1;
+            p++;
+            continue;
+        }
+        q = memchr(p, '\033', end - p);
+        if (!q)
+            q = end;
+        tty_paste_write(ts, p, q - p);
+        p = q;
+    }
+    ts->read_pos = p - ts->read_buf;
+}
 
-    if (qs->trace_buffer)
-        eb_trace_bytes(buf, 1, EB_TRACE_TTY);
+static void tty_input_char(QEditScreen *s, int ch)
+{
+    QEmacsState *qs = &qe_state;
+    TTYState *ts = s->priv_data;
+    QEEvent ev1, *ev = &ev1;
+    int len, n1;
 
-    ch = buf[0];
     /* keep TTY bytes for error messages */
     if (qs->input_len < countof(qs->input_buf))
         qs->input_buf[qs->input_len++] = ch;
@@ -700,10 +902,33 @@ static void tty_read_handler(void *opaque)
         case '[':
             ts->input_state = IS_CSI2;
             break;
+        case '?':
+        case '$':
+            /* private marker and intermediate byte of mode reports */
+            ts->input_state = IS_CSI;
+            break;
+        case 'y':
+            /* DECRPM mode report: ^[[?2026;1$y or ^[[?2026;2$y
+             * indicate support for synchronized output */
+            if (ts->input_param2 == 2026
+            &&  (ts->input_param == 1 || ts->input_param == 2)) {
+                ts->term_flags |= USE_SYNC_UPDATE;
+            }
+            break;
         case '~':
             /* If there is a second param, it tells the shift state,
              * ex: S-f5 = ^[[15;2~ */
             n1 = ts->input_param;
+            if (n1 == 200 && !ts->input_param2) {
+                /* bracketed paste: collect the text up to ^[[201~ in
+                 * a new yank buffer */
+                ts->paste_buf = new_yank_buffer(qs, NULL);
+                eb_set_charset(ts->paste_buf, s->charset, EOL_UNIX);
+                ts->paste_match = 0;
+                ts->paste_cr = 0;
+                ts->input_state = IS_PASTE;
+                break;
+            }
             if (ts->input_param2) {
                 // XXX: should handle shift function keys
                 ch = KEY_UNKNOWN;
@@ -835,6 +1060,10 @@ static void tty_read_handler(void *opaque)
         ch = KEY_UNKNOWN;
         goto the_end;
 
+    case IS_PASTE:
+        /* pasted bytes are consumed by tty_paste_input() */
+        break;
+
     the_end:
         if (ts->has_meta) {
             ts->has_meta = 0;
@@ -848,6 +1077,35 @@ static void tty_read_handler(void *opaque)
     }
 }
 
+static void tty_read_handler(void *opaque)
+{
+    QEditScreen *s = opaque;
+    QEmacsState *qs = &qe_state;
+    TTYState *ts = s->priv_data;
+    int len;
+
+    /* stdin is non blocking: read all available bytes at once and
+     * decode them from the buffer */
+    do {
+        len = read(fileno(s->STDIN), ts->read_buf, sizeof(ts->read_buf));
+        if (len <= 0)
+            return;
+
+        if (qs->trace_buffer)
+            eb_trace_bytes(ts->read_buf, len, EB_TRACE_TTY);
+
+        ts->read_pos = 0;
+        ts->read_len = len;
+        /* stop at exit like a byte at a time reader would */
+        while (ts->read_pos < ts->read_len && !url_exit_pending()) {
+            if (ts->input_state == IS_PASTE)
+                tty_paste_input(s);
+            else
+                tty_input_char(s, ts->read_buf[ts->read_pos++]);
+        }
+    } while (len == sizeof(ts->read_buf) && !url_exit_pending());
+}
+
 static void tty_dpy_fill_rectangle(QEditScreen *s,
                                    int x1, int y1, int w, int h, QEColor color)
 {
@@ -1023,13 +1281,18 @@ static void comb_cache_describe(QEditScreen *s, EditBuffer *b) {
               ts->term_code == TERM_CYGWIN ? "CYGWIN" :
               ts->term_code == TERM_TW100 ? "TW100" :
               "");
-    eb_printf(b, "%*s: %#x %s%s%s%s%s%s\n", w, "term_flags", ts->term_flags,
+    eb_printf(b, "%*s: %#x %s%s%s%s%s%s%s%s%s%s%s\n", w, "term_flags", ts->term_flags,
               ts->term_flags & KBS_CONTROL_H ? " KBS_CONTROL_H" : "",
               ts->term_flags & USE_ERASE_END_OF_LINE ? " USE_ERASE_END_OF_LINE" : "",
               ts->term_flags & USE_BOLD_AS_BRIGHT_FG ? " USE_BOLD_AS_BRIGHT_FG" : "",
               ts->term_flags & USE_BLINK_AS_BRIGHT_BG ? " USE_BLINK_AS_BRIGHT_BG" : "",
               ts->term_flags & USE_256_COLORS ? " USE_256_COLORS" : "",
-              ts->term_flags & USE_TRUE_COLORS ? " USE_TRUE_COLORS" : "");
+              ts->term_flags & USE_TRUE_COLORS ? " USE_TRUE_COLORS" : "",
+              ts->term_flags & USE_SYNC_UPDATE ? " USE_SYNC_UPDATE" : "",
+              ts->term_flags & USE_SCROLL_REGION ? " USE_SCROLL_REGION" : "",
+              ts->term_flags & USE_ERASE_CHARS ? " USE_ERASE_CHARS" : "",
+              ts->term_flags & USE_REPEAT_CHAR ? " USE_REPEAT_CHAR" : "",
+              ts->term_flags & USE_BRACKETED_PASTE ? " USE_BRACKETED_PASTE" : "");
     eb_printf(b, "%*s: fg:%d, bg:%d\n", w, "terminal colors",
               ts->term_fg_colors_count, ts->term_bg_colors_count);
     eb_printf(b, "%*s: fg:%d, bg:%d\n", w, "virtual tty colors",
@@ -1156,22 +1419,235 @@ static void tty_dpy_set_clip(qe__unused__ QEditScreen *s,
 {
 }
 
+/* Move the terminal cursor to column x of row y with the shortest
+ * sequence: relative moves when the current position is known,
+ * carriage return and line feeds to go to the start of a next row,
+ * an absolute position otherwise.
+ */
+static void tty_goto_xy(QEditScreen *s, int x, int y)
+{
+    TTYState *ts = s->priv_data;
+    char buf[32], rel[32];
+    int len, rlen = -1;
+
+    /* rows and columns are 1 based in escape sequences */
+    len = snprintf(buf, sizeof buf, "\033[%d;%dH", y + 1, x + 1);
+    if (ts->out_y == y && ts->out_x <= x && ts->out_x < s->width) {
+        /* the cursor is not past the right margin */
+        if (x == ts->out_x)
+            rlen = 0;
+        else
+            rlen = snprintf(rel, sizeof rel, "\033[%dC", x - ts->out_x);
+    } else
+    if (ts->out_y >= 0 && x == 0 && y >= ts->out_y && y - ts->out_y < 4) {
+        /* no scroll region is set and y is on the screen:
+         * line feeds cannot scroll */
+        rel[0] = '\r';
+        for (rlen = 1; rlen <= y - ts->out_y; rlen++)
+            rel[rlen] = '\n';
+    }
+    if (rlen >= 0 && rlen < len)
+        TTY_FWRITE(rel, rlen, s);
+    else
+        TTY_FWRITE(buf, len, s);
+    ts->out_x = x;
+    ts->out_y = y;
+}
+
+static unsigned int tty_hash_row(const TTYChar *p, int w)
+{
+    unsigned int h = 0;
+
+    for (; w-- > 0; p++) {
+        h = (h * 31) ^ TTY_CHAR_GET_CH(*p);
+        h = (h * 31) ^ TTY_CHAR_GET_COL(*p);
+    }
+    return h;
+}
+
+/* Estimate the output size for drawing a row on a blank row: the
+ * glyphs up to the trailing spaces, a color change sequence for
+ * each change of attributes and the cursor positioning.
+ */
+static int tty_row_cost(QEditScreen *s, int y)
+{
+    TTYState *ts = s->priv_data;
+    const TTYChar *p = ts->screen + y * s->width;
+    int x, n, cost;
+
+    if (ts->line_cost[y] >= 0)
+        return ts->line_cost[y];
+
+    for (n = s->width; n > 0 && TTY_CHAR_GET_CH(p[n - 1]) == ' '; n--)
+        continue;
+    cost = 8 + n;
+    for (x = 0; x < n; x++) {
+        if (TTY_CHAR_GET_CH(p[x]) >= 128)
+            cost += 2;
+        if (x > 0 && TTY_CHAR_GET_COL(p[x]) != TTY_CHAR_GET_COL(p[x - 1]))
+            cost += 6;
+    }
+    return ts->line_cost[y] = cost;
+}
+
+/* approximate size of the scroll region, cursor and insert or
+ * delete line sequences for a move */
+#define TTY_SCROLL_COST  24
+#define TTY_SCROLL_PASSES  4
+
+/* Detect rows of the new screen that are present in the shadow
+ * buffer at a different position, such as when a window is scrolled,
+ * lines are inserted or deleted. Such rows are moved on the terminal
+ * by setting a scroll region (DECSTBM) and deleting (DL) or inserting
+ * (IL) lines, then the shadow buffer is updated accordingly so the
+ * row loop of tty_dpy_flush() only outputs the remaining differences.
+ * Rows are compared by hash, a move is used if the estimated cost of
+ * redrawing the rows exceeds the cost of the escape sequences.
+ * The last row is never scrolled: the bottom right cell is not drawn.
+ */
+static void tty_dpy_scroll(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    TTYChar *shadow = ts->screen + ts->screen_size;
+    unsigned int *new_hash = ts->line_hash;
+    unsigned int *old_hash = ts->line_hash + s->height;
+    int w = s->width, h = s->height - 1;
+    int y, n, a, b, top, bot, gain, moved, pass, count;
+    int best_gain, best_n, best_a, best_b;
+
+    count = 0;
+    for (y = 0; y < h; y++) {
+        ts->line_cost[y] = -1;
+        old_hash[y] = tty_hash_row(shadow + y * w, w);
+        new_hash[y] = old_hash[y];
+        if (ts->line_updated[y]) {
+            new_hash[y] = tty_hash_row(ts->screen + y * w, w);
+            count += (new_hash[y] != old_hash[y]);
+        }
+    }
+    if (count < 2)
+        return;
+
+    moved = 0;
+    for (pass = 0; pass < TTY_SCROLL_PASSES; pass++) {
+        /* find the best run of rows [a, b] such that new row y
+         * is old row y + n */
+        best_gain = best_n = best_a = best_b = 0;
+        for (n = 1 - h; n < h; n++) {
+            if (n == 0)
+                continue;
+            for (y = max(0, -n); y < min(h, h - n); y = b + 1) {
+                if (new_hash[y] != old_hash[y + n]) {
+                    b = y;
+                    continue;
+                }
+                gain = -TTY_SCROLL_COST;
+                for (a = b = y; b < h && b + n < h
+                     &&  new_hash[b] == old_hash[b + n]; b++) {
+                    if (new_hash[b] != old_hash[b])
+                        gain += tty_row_cost(s, b);
+                }
+                b--;
+                if (gain <= best_gain)
+                    continue;
+                /* the rows that become blank must be redrawn */
+                top = (n > 0) ? b + 1 : a + n;
+                bot = (n > 0) ? b + n : a - 1;
+                for (; top <= bot; top++) {
+                    if (new_hash[top] == old_hash[top])
+                        gain -= tty_row_cost(s, top);
+                }
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best_n = n;
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+        if (best_gain <= 0)
+            break;
+
+        n = best_n;
+        a = best_a;
+        b = best_b;
+        /* check for hash collisions */
+        for (y = a; y <= b; y++) {
+            if (memcmp(ts->screen + y * w, shadow + (y + n) * w,
+                       w * sizeof(TTYChar)))
+                goto done;
+        }
+        if (n > 0) {
+            top = a;
+            bot = b + n;
+        } else {
+            top = a + n;
+            bot = b;
+        }
+        TTY_FPRINTF(s, "\033[%d;%dr\033[%d;1H", top + 1, bot + 1, top + 1);
+        if (n > 0) {
+            TTY_FPRINTF(s, "\033[%dM", n);
+            memmove(shadow + top * w, shadow + (top + n) * w,
+                    (bot - top + 1 - n) * w * sizeof(TTYChar));
+            memmove(old_hash + top, old_hash + top + n,
+                    (bot - top + 1 - n) * sizeof(*old_hash));
+            a = bot - n + 1;
+        } else {
+            TTY_FPRINTF(s, "\033[%dL", -n);
+            memmove(shadow + (top - n) * w, shadow + top * w,
+                    (bot - top + 1 + n) * w * sizeof(TTYChar));
+            memmove(old_hash + top - n, old_hash + top,
+                    (bot - top + 1 + n) * sizeof(*old_hash));
+            a = top;
+        }
+        /* the inserted rows are blank with the default colors
+         * which may not match any TTYChar: force a redraw. */
+        memset(shadow + a * w, 0xFF, abs(n) * w * sizeof(TTYChar));
+        for (y = a; y < a + abs(n); y++)
+            old_hash[y] = tty_hash_row(shadow + y * w, w);
+        memset(ts->line_updated + top, 1, bot - top + 1);
+        moved = 1;
+    }
+ done:
+    if (moved) {
+        /* reset the scroll region, this moves the cursor home */
+        TTY_FPUTS("\033[r", s);
+        ts->out_x = ts->out_y = 0;
+    }
+}
+
 static void tty_dpy_flush(QEditScreen *s)
 {
     TTYState *ts = s->priv_data;
-    TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, cc, blankcc;
+    TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, *ptr5, cc, blankcc;
     int y, shadow, ch, bgcolor, fgcolor, shifted, gotopos, attr;
 
-    /* CG: Should optimize output by computing it in a temporary buffer
-     * and flushing it in one call to fwrite()
+    /* The frame is assembled in ts->out_buf and sent with a single
+     * write() by tty_flush_output(). Terminals supporting synchronized
+     * output hold the display until the end of the frame.
+     * Nothing is sent if neither the screen nor the cursor changed.
      */
+    if (!memchr(ts->line_updated, 1, s->height)
+    &&  ts->cursor_x == ts->flushed_cursor_x
+    &&  ts->cursor_y == ts->flushed_cursor_y) {
+        return;
+    }
+    ts->flushed_cursor_x = ts->cursor_x;
+    ts->flushed_cursor_y = ts->cursor_y;
+
+    if (ts->term_flags & USE_SYNC_UPDATE)
+        TTY_FPUTS("\033[?2026h", s);
 
     /* Hide cursor, goto home, reset attributes */
-    TTY_FPUTS("\033[?25l\033[H\033[0m", s->STDOUT);
+    TTY_FPUTS("\033[?25l\033[H\033[0m", s);
 
     if (ts->term_code != TERM_CYGWIN) {
-        TTY_FPUTS("\033(B\033)0", s->STDOUT);
+        TTY_FPUTS("\033(B\033)0", s);
     }
+    ts->out_x = ts->out_y = 0;
+
+    if (ts->term_flags & USE_SCROLL_REGION)
+        tty_dpy_scroll(s);
 
     bgcolor = -1;
     fgcolor = -1;
@@ -1256,17 +1732,34 @@ static void tty_dpy_flush(QEditScreen *s)
             gotopos = 1;
             while (ptr1 < ptr4) {
                 cc = *ptr1;
+                if (cc == ptr1[shadow]
+                &&  (unsigned int)TTY_CHAR_GET_CH(cc) != TTY_CHAR_NONE) {
+                    /* skip unchanged cells if a cursor move is shorter,
+                     * stop on a glyph, not on a wide glyph placeholder */
+                    for (ptr5 = ptr1 + 1; ptr5 < ptr4 && *ptr5 == ptr5[shadow];)
+                        ptr5++;
+                    while (ptr5 < ptr4
+                       &&  (unsigned int)TTY_CHAR_GET_CH(*ptr5) == TTY_CHAR_NONE)
+                        ptr5--;
+                    if (ptr5 - ptr1 > 4) {
+                        ptr1 = ptr5;
+                        gotopos = 1;
+                        continue;
+                    }
+                }
                 ptr1[shadow] = cc;
                 ptr1++;
                 ch = TTY_CHAR_GET_CH(cc);
-                if ((unsigned int)ch == TTY_CHAR_NONE)
+                if ((unsigned int)ch == TTY_CHAR_NONE) {
+                    /* the cursor is past the wide glyph */
+                    if (ts->out_x == ptr1 - ptr - 1)
+                        ts->out_x++;
                     continue;
+                }
                 if (gotopos) {
-                    /* Move the cursor: row and col are 1 based
-                       but ptr1 has already been incremented */
+                    /* Move the cursor: ptr1 has already been incremented */
                     gotopos = 0;
-                    TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
-                                y + 1, (int)(ptr1 - ptr));
+                    tty_goto_xy(s, ptr1 - ptr - 1, y);
                 }
                 /* output attributes */
                 if (bgcolor != (int)TTY_CHAR_GET_BG(cc)) {
@@ -1276,26 +1769,26 @@ static void tty_dpy_flush(QEditScreen *s)
                     if (ts->term_bg_colors_count > 256 && bgcolor >= 256) {
                         /* XXX: should special case dynamic palette */
                         QEColor rgb = qe_unmap_color(bgcolor, ts->tty_bg_colors_count);
-                        TTY_FPRINTF(s->STDOUT, "\033[48;2;%d;%d;%dm",
+                        TTY_FPRINTF(s, "\033[48;2;%d;%d;%dm",
                                     (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
                     } else
 #endif
                     if (ts->term_bg_colors_count > 16 && bgcolor >= 16) {
-                        TTY_FPRINTF(s->STDOUT, "\033[48;5;%dm", bgcolor);
+                        TTY_FPRINTF(s, "\033[48;5;%dm", bgcolor);
                     } else
                     if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG) {
                         if (bgcolor > 7) {
                             if (lastbg <= 7) {
-                                TTY_FPUTS("\033[5m", s->STDOUT);
+                                TTY_FPUTS("\033[5m", s);
                             }
                         } else {
                             if (lastbg > 7) {
-                                TTY_FPUTS("\033[25m", s->STDOUT);
+                                TTY_FPUTS("\033[25m", s);
                             }
                         }
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm", 40 + (bgcolor & 7));
+                        TTY_FPRINTF(s, "\033[%dm", 40 + (bgcolor & 7));
                     } else {
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm",
+                        TTY_FPRINTF(s, "\033[%dm",
                                     bgcolor > 7 ? 100 + bgcolor - 8 :
                                     40 + bgcolor);
                     }
@@ -1308,26 +1801,26 @@ static void tty_dpy_flush(QEditScreen *s)
 #if TTY_STYLE_BITS == 32
                     if (ts->term_fg_colors_count > 256 && fgcolor >= 256) {
                         QEColor rgb = qe_unmap_color(fgcolor, ts->tty_fg_colors_count);
-                        TTY_FPRINTF(s->STDOUT, "\033[38;2;%d;%d;%dm",
+                        TTY_FPRINTF(s, "\033[38;2;%d;%d;%dm",
                                     (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
                     } else
 #endif
                     if (ts->term_fg_colors_count > 16 && fgcolor >= 16) {
-                        TTY_FPRINTF(s->STDOUT, "\033[38;5;%dm", fgcolor);
+                        TTY_FPRINTF(s, "\033[38;5;%dm", fgcolor);
                     } else
                     if (ts->term_flags & USE_BOLD_AS_BRIGHT_FG) {
                         if (fgcolor > 7) {
                             if (lastfg <= 7) {
-                                TTY_FPUTS("\033[1m", s->STDOUT);
+                                TTY_FPUTS("\033[1m", s);
                             }
                         } else {
                             if (lastfg > 7) {
-                                TTY_FPUTS("\033[22m", s->STDOUT);
+                                TTY_FPUTS("\033[22m", s);
                             }
                         }
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm", 30 + (fgcolor & 7));
+                        TTY_FPRINTF(s, "\033[%dm", 30 + (fgcolor & 7));
                     } else {
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm",
+                        TTY_FPRINTF(s, "\033[%dm",
                                     fgcolor > 8 ? 90 + fgcolor - 8 :
                                     30 + fgcolor);
                     }
@@ -1338,61 +1831,89 @@ static void tty_dpy_flush(QEditScreen *s)
 
                     if ((attr ^ lastattr) & TTY_BOLD) {
                         if (attr & TTY_BOLD) {
-                            TTY_FPUTS("\033[1m", s->STDOUT);
+                            TTY_FPUTS("\033[1m", s);
                         } else {
-                            TTY_FPUTS("\033[22m", s->STDOUT);
+                            TTY_FPUTS("\033[22m", s);
                         }
                     }
                     if ((attr ^ lastattr) & TTY_UNDERLINE) {
                         if (attr & TTY_UNDERLINE) {
-                            TTY_FPUTS("\033[4m", s->STDOUT);
+                            TTY_FPUTS("\033[4m", s);
                         } else {
-                            TTY_FPUTS("\033[24m", s->STDOUT);
+                            TTY_FPUTS("\033[24m", s);
                         }
                     }
                     if ((attr ^ lastattr) & TTY_BLINK) {
                         if (attr & TTY_BLINK) {
-                            TTY_FPUTS("\033[5m", s->STDOUT);
+                            TTY_FPUTS("\033[5m", s);
                         } else {
-                            TTY_FPUTS("\033[25m", s->STDOUT);
+                            TTY_FPUTS("\033[25m", s);
                         }
                     }
                     if ((attr ^ lastattr) & TTY_ITALIC) {
                         if (attr & TTY_ITALIC) {
-                            TTY_FPUTS("\033[3m", s->STDOUT);
+                            TTY_FPUTS("\033[3m", s);
                         } else {
-                            TTY_FPUTS("\033[23m", s->STDOUT);
+                            TTY_FPUTS("\033[23m", s);
                         }
                     }
                 }
                 if (shifted) {
                     /* Kludge for linedrawing chars */
                     if (ch < 128 || ch >= 128 + 32) {
-                        TTY_FPUTS("\033(B", s->STDOUT);
+                        TTY_FPUTS("\033(B", s);
                         shifted = 0;
                     }
                 }
 
                 /* do not display escape codes or invalid codes */
                 if (ch < 32 || ch == 127) {
-                    TTY_PUTC('.', s->STDOUT);
+                    TTY_PUTC('.', s);
                 } else
                 if (ch < 127) {
-                    TTY_PUTC(ch, s->STDOUT);
+                    if (ch == ' ' && (ts->term_flags & USE_ERASE_CHARS)
+                    &&  !(ts->term_flags & USE_REPEAT_CHAR)
+                    &&  !(attr & TTY_UNDERLINE)
+                    &&  !(bgcolor > 7 && (ts->term_flags & USE_BLINK_AS_BRIGHT_BG))) {
+                        /* erase a run of spaces and move the cursor */
+                        for (ptr5 = ptr1; ptr5 < ptr4 && *ptr5 == cc; ptr5++)
+                            continue;
+                        if (ptr5 - ptr1 >= 10) {
+                            TTY_FPRINTF(s, "\033[%dX", (int)(ptr5 - ptr1 + 1));
+                            while (ptr1 < ptr5) {
+                                ptr1[shadow] = cc;
+                                ptr1++;
+                            }
+                            gotopos = 1;
+                            continue;
+                        }
+                    }
+                    TTY_PUTC(ch, s);
+                    if (ts->term_flags & USE_REPEAT_CHAR) {
+                        /* repeat the glyph for a run of identical cells */
+                        for (ptr5 = ptr1; ptr5 < ptr4 && *ptr5 == cc; ptr5++)
+                            continue;
+                        if (ptr5 - ptr1 > 4) {
+                            TTY_FPRINTF(s, "\033[%db", (int)(ptr5 - ptr1));
+                            while (ptr1 < ptr5) {
+                                ptr1[shadow] = cc;
+                                ptr1++;
+                            }
+                        }
+                    }
                 } else
                 if (ch < 128 + 32) {
                     /* Kludges for linedrawing chars */
                     if (ts->term_code == TERM_CYGWIN) {
                         static const char unitab_xterm_poorman[32] =
                         "*#****o~**+++++-----++++|****L. ";
-                        TTY_PUTC(unitab_xterm_poorman[ch - 128],
-                                 s->STDOUT);
+                        TTY_PUTC(unitab_xterm_poorman[ch - 128], s);
                     } else {
                         if (!shifted) {
-                            TTY_FPUTS("\033(0", s->STDOUT);
+                            TTY_FPUTS("\033(0", s);
                             shifted = 1;
                         }
-                        TTY_PUTC(ch - 32, s->STDOUT);
+                        TTY_PUTC(ch - 32, s);
                     }
                 } else
 #if COMB_CACHE_SIZE > 1
@@ -1409,7 +1930,7 @@ static void tty_dpy_flush(QEditScreen *s)
                         while (ncc-- > 1) {
                             q = s->charset->encode_func(s->charset, buf, *ip++);
                             if (q) {
-                                TTY_FWRITE(buf, 1, q - buf, s->STDOUT);
+                                TTY_FWRITE(buf, q - buf, s);
                                 // XXX: should check s->unicode_version for
                                 //      terminal support of non ASCII codepoint
                                 //      and force GOTOPOS if unsupported
@@ -1454,28 +1975,32 @@ static void tty_dpy_flush(QEditScreen *s)
                     }
                     nc = q - buf;
                     if (nc == 1) {
-                        TTY_PUTC(*buf, s->STDOUT);
+                        TTY_PUTC(*buf, s);
                     } else {
-                        TTY_FWRITE(buf, 1, nc, s->STDOUT);
+                        TTY_FWRITE(buf, nc, s);
                     }
                 }
+                ts->out_x = ptr1 - ptr;
+                if (gotopos || ch >= 0x300) {
+                    /* glyph width is uncertain: terminals may disagree
+                     * on combining and wide glyphs, do not move the
+                     * cursor relative to them */
+                    ts->out_y = -1;
+                }
             }
             if (shifted) {
-                TTY_FPUTS("\033(B", s->STDOUT);
+                TTY_FPUTS("\033(B", s);
                 shifted = 0;
             }
             if (ptr1 < ptr2) {
                 /* More differences to synch in shadow, erase eol */
                 cc = *ptr1;
                 if (gotopos) {
-                    /* Move the cursor: row and col are 1 based
-                       but ptr1 has already been incremented */
                     gotopos = 0;
-                    TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
-                                y + 1, (int)(ptr1 - ptr));
+                    tty_goto_xy(s, ptr1 - ptr, y);
                 }
                 /* the current attribute is already set correctly */
-                TTY_FPUTS("\033[K", s->STDOUT);
+                TTY_FPUTS("\033[K", s);
                 while (ptr1 < ptr2) {
                     ptr1[shadow] = cc;
                     ptr1++;
@@ -1485,7 +2010,7 @@ static void tty_dpy_flush(QEditScreen *s)
             //if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG)
             {
                 if (bgcolor > 7) {
-                    TTY_FPUTS("\033[0m", s->STDOUT);
+                    TTY_FPUTS("\033[0m", s);
                     fgcolor = bgcolor = -1;
                     attr = 0;
                 }
@@ -1494,12 +2019,14 @@ static void tty_dpy_flush(QEditScreen *s)
     }
 
     // XXX: should check if needed
-    TTY_FPUTS("\033[0m", s->STDOUT);
+    TTY_FPUTS("\033[0m", s);
     if (ts->cursor_y + 1 >= 0 && ts->cursor_x + 1 >= 0) {
-        TTY_FPRINTF(s->STDOUT, "\033[?25h\033[%d;%dH",
+        TTY_FPRINTF(s, "\033[?25h\033[%d;%dH",
                     ts->cursor_y + 1, ts->cursor_x + 1);
     }
-    fflush(s->STDOUT);
+    if (ts->term_flags & USE_SYNC_UPDATE)
+        TTY_FPUTS("\033[?2026l", s);
+    tty_flush_output(s);
 
     /* Update combination cache from screen.
      * Shadow is identical to screen so no need to scan it.
@@ -28,21 +28,36 @@
 typedef u_int fdesc_t;
 #else
 #include <sys/wait.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#define CONFIG_EPOLL  1
+#ifdef SYS_pidfd_open
+#define CONFIG_PIDFD  1
+#endif
+#endif
 typedef int fdesc_t;
 #endif
 
 /* NOTE: it is strongly inspirated from the 'links' browser API */
 
+#define URL_READ   1
+#define URL_WRITE  2
+
 typedef struct URLHandler {
     void *read_opaque;
     void (*read_cb)(void *opaque);
     void *write_opaque;
     void (*write_cb)(void *opaque);
+    int events;     /* events registered with the poller */
 } URLHandler;
 
 typedef struct PidHandler {
     struct PidHandler *next, *prev;
     int pid;
+    int fd;         /* process file descriptor or -1 */
+    int ready;      /* process descriptor became readable */
     void (*cb)(void *opaque, int status);
     void *opaque;
 } PidHandler;
@@ -53,49 +68,438 @@ typedef struct BottomHalfEntry {
     void *opaque;
 } BottomHalfEntry;
 
+/* Timers are kept in a hierarchical timing wheel: TIMER_LEVELS levels
+ * of TIMER_SLOTS lists. Level 0 has one slot per millisecond and each
+ * slot of an upper level covers a whole turn of the level below. A
+ * timer is stored at the lowest level that reaches its deadline and
+ * moves down when the level below wraps around: adding and killing a
+ * timer is O(1) and the wheel only advances when check_timers() is
+ * called, skipping empty slots with the timer_used bitmaps.
+ */
+#define TIMER_BITS     6
+#define TIMER_SLOTS    (1 << TIMER_BITS)
+#define TIMER_MASK     (TIMER_SLOTS - 1)
+#define TIMER_LEVELS   4    /* 2^24 ms: about 4.6 hours */
+#define TIMER_SPAN     (1 << (TIMER_BITS * TIMER_LEVELS))
+
+#define TIMER_RUNNING  1    /* the callback is being called */
+#define TIMER_KILLED   2    /* killed from its own callback */
+
 struct QETimer {
+    struct QETimer *next, *prev;
     void *opaque;
     void (*cb)(void *opaque);
-    int timeout;
-    struct QETimer *next;
+    int timeout;    /* deadline in ms */
+    int period;     /* repeat interval, 0 for one shot timers */
+    int slack;      /* how late the timer may expire */
+    short level;    /* position in the wheel, level < 0 if not in a slot */
+    short slot;
+    int flags;
 };
 
-static fd_set url_rfds, url_wfds;
-static int url_fdmax;
-static URLHandler url_handlers[256];
+/* The poller waits for events on the file descriptors that have
+ * handlers and calls url_dispatch() for each ready descriptor.
+ */
+typedef struct URLPoller {
+    const char *name;
+    int (*init)(void);
+    /* change the events watched on fd, events is 0 to stop */
+    void (*update)(int fd, int events);
+    /* wait for events for at most delay ms, or forever if delay < 0 */
+    void (*wait)(int delay);
+} URLPoller;
+
+static URLHandler *url_handlers;
+static int url_handlers_size;
+static const URLPoller *url_poller;
 static int url_exit_request;
 static int url_display_request;
 static LIST_HEAD(pid_handlers);
 static LIST_HEAD(bottom_halves);
-static QETimer *first_timer;
+static struct list_head timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t timer_used[TIMER_LEVELS];   /* bitmaps of non empty slots */
+static LIST_HEAD(timer_due);    /* timers already expired when added */
+static int timer_clock;         /* next millisecond to expire */
+static int timer_count;         /* pending timers */
 
+static void url_dispatch(int fd, int events);
+static inline void call_bottom_halves(void);
 
-void set_read_handler(int fd, void (*cb)(void *opaque), void *opaque)
+#ifdef CONFIG_WIN32
+
+static fd_set url_rfds, url_wfds;
+static int url_fdmax = -1;
+
+static int select_init(void)
 {
-    url_handlers[fd].read_cb = cb;
-    url_handlers[fd].read_opaque = opaque;
-    if (cb) {
-        if (fd >= url_fdmax)
-            url_fdmax = fd;
+    FD_ZERO(&url_rfds);
+    FD_ZERO(&url_wfds);
+    url_fdmax = -1;
+    return 0;
+}
+
+static void select_update(int fd, int events)
+{
+    if (events && fd > url_fdmax)
+        url_fdmax = fd;
+    if (events & URL_READ)
         FD_SET((fdesc_t)fd, &url_rfds);
-    } else {
+    else
         FD_CLR((fdesc_t)fd, &url_rfds);
+    if (events & URL_WRITE)
+        FD_SET((fdesc_t)fd, &url_wfds);
+    else
+        FD_CLR((fdesc_t)fd, &url_wfds);
+}
+
+static void select_wait(int delay)
+{
+    fd_set rfds, wfds;
+    struct timeval tv, *tvp = NULL;
+    int i, events;
+
+    if (delay >= 0) {
+        tv.tv_sec = delay / 1000;
+        tv.tv_usec = (delay % 1000) * 1000;
+        tvp = &tv;
+    }
+    rfds = url_rfds;
+    wfds = url_wfds;
+    if (select(url_fdmax + 1, &rfds, &wfds, NULL, tvp) <= 0)
+        return;
+    for (i = 0; i <= url_fdmax; i++) {
+        events = 0;
+        if (FD_ISSET(i, &rfds))
+            events |= URL_READ;
+        if (FD_ISSET(i, &wfds))
+            events |= URL_WRITE;
+        if (events)
+            url_dispatch(i, events);
+    }
+}
+
+static const URLPoller select_poller = {
+    "select", select_init, select_update, select_wait,
+};
+
+#else  /* CONFIG_WIN32 */
+
+/* poll() backend: the pollfd array is rebuilt when handlers change */
+static struct pollfd *url_pollfds;
+static int url_pollfds_size, url_pollfds_count;
+static int url_pollfds_dirty;
+
+static int poll_init(void)
+{
+    url_pollfds_dirty = 1;
+    return 0;
+}
+
+static void poll_update(qe__unused__ int fd, qe__unused__ int events)
+{
+    url_pollfds_dirty = 1;
+}
+
+static void poll_rebuild(void)
+{
+    int fd, n = 0;
+
+    for (fd = 0; fd < url_handlers_size; fd++) {
+        if (url_handlers[fd].events) {
+            if (n >= url_pollfds_size) {
+                int size = max(16, url_pollfds_size * 2);
+                if (!qe_realloc(&url_pollfds, size * sizeof(*url_pollfds)))
+                    break;
+                url_pollfds_size = size;
+            }
+            url_pollfds[n].fd = fd;
+            url_pollfds[n].events =
+                ((url_handlers[fd].events & URL_READ) ? POLLIN : 0) |
+                ((url_handlers[fd].events & URL_WRITE) ? POLLOUT : 0);
+            n++;
+        }
+    }
+    url_pollfds_count = n;
+    url_pollfds_dirty = 0;
+}
+
+static void poll_wait(int delay)
+{
+    int i, n, events, revents;
+
+    if (url_pollfds_dirty)
+        poll_rebuild();
+    n = poll(url_pollfds, url_pollfds_count, delay);
+    /* handlers may change the array: stop after it is rebuilt */
+    for (i = 0; n > 0 && i < url_pollfds_count && !url_pollfds_dirty; i++) {
+        revents = url_pollfds[i].revents;
+        if (!revents)
+            continue;
+        n--;
+        events = 0;
+        /* report errors and hangups as readable, like select() */
+        if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+            events |= URL_READ;
+        if (revents & (POLLOUT | POLLERR))
+            events |= URL_WRITE;
+        url_dispatch(url_pollfds[i].fd, events);
+    }
+}
+
+static const URLPoller poll_poller = {
+    "poll", poll_init, poll_update, poll_wait,
+};
+
+#ifdef CONFIG_EPOLL
+static int url_epoll_fd = -1;
+
+static int epoll_init(void)
+{
+    if (url_epoll_fd < 0)
+        url_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return url_epoll_fd < 0 ? -1 : 0;
+}
+
+static void epoll_update(int fd, int events)
+{
+    struct epoll_event ev;
+    int op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    ev.events = ((events & URL_READ) ? EPOLLIN : 0) |
+                ((events & URL_WRITE) ? EPOLLOUT : 0);
+    if (!events)
+        op = EPOLL_CTL_DEL;
+    else
+    if (!url_handlers[fd].events)
+        op = EPOLL_CTL_ADD;
+    if (epoll_ctl(url_epoll_fd, op, fd, &ev) < 0) {
+        /* the descriptor may have been closed and reused without
+         * removing its handlers */
+        if (op == EPOLL_CTL_MOD && errno == ENOENT)
+            epoll_ctl(url_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        else
+        if (op == EPOLL_CTL_ADD && errno == EEXIST)
+            epoll_ctl(url_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+}
+
+static void epoll_wait_events(int delay)
+{
+    struct epoll_event evs[64];
+    int i, n, events;
+
+    n = epoll_wait(url_epoll_fd, evs, countof(evs), delay);
+    for (i = 0; i < n; i++) {
+        events = 0;
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            events |= URL_READ;
+        if (evs[i].events & (EPOLLOUT | EPOLLERR))
+            events |= URL_WRITE;
+        url_dispatch(evs[i].data.fd, events);
+    }
+}
+
+static const URLPoller epoll_poller = {
+    "epoll", epoll_init, epoll_update, epoll_wait_events,
+};
+#endif  /* CONFIG_EPOLL */
+
+#endif  /* CONFIG_WIN32 */
+
+/* available pollers by order of preference */
+static const URLPoller * const url_pollers[] = {
+#ifdef CONFIG_WIN32
+    &select_poller,
+#else
+#ifdef CONFIG_EPOLL
+    &epoll_poller,
+#endif
+    &poll_poller,
+#endif
+};
+
+static void url_poller_init(void)
+{
+    int i;
+
+    for (i = 0; i < countof(url_pollers); i++) {
+        if (url_pollers[i]->init() == 0) {
+            url_poller = url_pollers[i];
+            break;
+        }
+    }
+}
+
+/* call the handlers of a ready file descriptor */
+static void url_dispatch(int fd, int events)
+{
+    /* extra checks on callback function pointers because a callback
+     * may unregister another callback.  This was causing crash bugs
+     * when deleting a running shell output buffer such as a buffer
+     * with a huge compressed file while it decompresses.
+     */
+    if (fd < 0 || fd >= url_handlers_size)
+        return;
+    if ((events & URL_READ) && url_handlers[fd].read_cb) {
+        url_handlers[fd].read_cb(url_handlers[fd].read_opaque);
+        call_bottom_halves();
+    }
+    /* the handler table may have been reallocated by the callback */
+    if (fd < url_handlers_size
+    &&  (events & URL_WRITE) && url_handlers[fd].write_cb) {
+        url_handlers[fd].write_cb(url_handlers[fd].write_opaque);
+        call_bottom_halves();
+    }
+}
+
+static URLHandler *url_get_handler(int fd)
+{
+    if (fd < 0)
+        return NULL;
+    if (fd >= url_handlers_size) {
+        int size = max(fd + 1, max(64, url_handlers_size * 2));
+        if (!qe_realloc(&url_handlers, size * sizeof(*url_handlers)))
+            return NULL;
+        memset(url_handlers + url_handlers_size, 0,
+               (size - url_handlers_size) * sizeof(*url_handlers));
+        url_handlers_size = size;
+    }
+    return &url_handlers[fd];
+}
+
+static void url_update_events(int fd, URLHandler *uh)
+{
+    int events = (uh->read_cb ? URL_READ : 0) | (uh->write_cb ? URL_WRITE : 0);
+
+    if (events != uh->events) {
+        if (!url_poller)
+            url_poller_init();
+        if (url_poller)
+            url_poller->update(fd, events);
+        uh->events = events;
+    }
+}
+
+void set_read_handler(int fd, void (*cb)(void *opaque), void *opaque)
+{
+    URLHandler *uh = url_get_handler(fd);
+
+    if (uh) {
+        uh->read_cb = cb;
+        uh->read_opaque = opaque;
+        url_update_events(fd, uh);
     }
 }
 
 void set_write_handler(int fd, void (*cb)(void *opaque), void *opaque)
 {
-    url_handlers[fd].write_cb = cb;
-    url_handlers[fd].write_opaque = opaque;
-    if (cb) {
-        if (fd >= url_fdmax)
-            url_fdmax = fd;
-        FD_SET((fdesc_t)fd, &url_wfds);
-    } else {
-        FD_CLR((fdesc_t)fd, &url_wfds);
+    URLHandler *uh = url_get_handler(fd);
+
+    if (uh) {
+        uh->write_cb = cb;
+        uh->write_opaque = opaque;
+        url_update_events(fd, uh);
+    }
+}
+
+#ifndef CONFIG_WIN32
+/* The wakeup pipe interrupts the poller from signal handlers:
+ * SIGCHLD when process descriptors are not available and SIGWINCH
+ * through url_redisplay().
+ */
+static int url_wakeup_fds[2] = { -1, -1 };
+static volatile sig_atomic_t url_child_request;
+
+static void url_wakeup(void)
+{
+    int save_errno = errno;
+
+    if (url_wakeup_fds[1] >= 0) {
+        /* the pipe is non blocking: a full pipe is awake already */
+        if (write(url_wakeup_fds[1], "", 1) < 0) {
+            /* ignore */
+        }
+    }
+    errno = save_errno;
+}
+
+static void url_wakeup_read(qe__unused__ void *opaque)
+{
+    char buf[64];
+
+    while (read(url_wakeup_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+}
+
+static void url_wakeup_init(void)
+{
+    int i;
+
+    if (url_wakeup_fds[0] >= 0 || pipe(url_wakeup_fds) < 0)
+        return;
+    for (i = 0; i < 2; i++) {
+        fcntl(url_wakeup_fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(url_wakeup_fds[i], F_SETFD, FD_CLOEXEC);
     }
+    set_read_handler(url_wakeup_fds[0], url_wakeup_read, NULL);
 }
 
+static void url_sigchld(qe__unused__ int sig)
+{
+    url_child_request = 1;
+    url_wakeup();
+}
+
+static void url_sigchld_init(void)
+{
+    static int done;
+    struct sigaction sig;
+
+    if (done++)
+        return;
+    url_wakeup_init();
+    sig.sa_handler = url_sigchld;
+    sigemptyset(&sig.sa_mask);
+    sig.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sig, NULL);
+}
+
+
+static void url_pid_close(PidHandler *p)
+{
+    if (p->fd >= 0) {
+        set_read_handler(p->fd, NULL, NULL);
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+#ifdef CONFIG_PIDFD
+/* a process descriptor is readable when the process terminates */
+static void url_pid_ready(void *opaque)
+{
+    PidHandler *p = opaque;
+
+    p->ready = 1;
+    url_child_request = 1;
+}
+#endif
+
+static int url_pid_open(PidHandler *p)
+{
+#ifdef CONFIG_PIDFD
+    p->fd = syscall(SYS_pidfd_open, p->pid, 0);
+    if (p->fd >= 0) {
+        fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+        set_read_handler(p->fd, url_pid_ready, p);
+    }
+#endif
+    return p->fd;
+}
+#endif
+
 /* register a callback which is called when process 'pid'
    terminates. When the callback is set to NULL, it is deleted */
 /* XXX: add consistency check ? */
@@ -108,6 +512,9 @@ int set_pid_handler(int pid,
         list_for_each(p, &pid_handlers) {
             if (p->pid == pid) {
                 list_del(p);
+#ifndef CONFIG_WIN32
+                url_pid_close(p);
+#endif
                 qe_free(&p);
                 break;
             }
@@ -119,6 +526,16 @@ int set_pid_handler(int pid,
         p->pid = pid;
         p->cb = cb;
         p->opaque = opaque;
+        p->fd = -1;
+#ifndef CONFIG_WIN32
+        if (url_pid_open(p) < 0) {
+            /* no process descriptor: track terminations with SIGCHLD
+             * and check for a process that exited already */
+            url_sigchld_init();
+            url_child_request = 1;
+            url_wakeup();
+        }
+#endif
         list_add(p, &pid_handlers);
     }
     return 0;
@@ -153,36 +570,206 @@ void unregister_bottom_half(void (*cb)(void *opaque), void *opaque)
     }
 }
 
-QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque))
+#define TIMER_BIT(n)  ((uint64_t)1 << (n))
+
+/* index of the first non empty slot from idx on, wrapping around */
+static int timer_find_slot(uint64_t used, int idx)
 {
+    if (!used)
+        return -1;
+    used = (used >> idx) | (idx ? used << (TIMER_SLOTS - idx) : 0);
+#ifdef __GNUC__
+    return (idx + __builtin_ctzll(used)) & TIMER_MASK;
+#else
+    while (!(used & 1)) {
+        used >>= 1;
+        idx++;
+    }
+    return idx & TIMER_MASK;
+#endif
+}
+
+static void timer_insert(QETimer *ti)
+{
+    struct list_head *head;
+    unsigned int t = ti->timeout;
+    int delta = ti->timeout - timer_clock;
+    int level;
+
+    if (delta < 0) {
+        ti->level = -1;
+        list_add_tail(ti, &timer_due);
+        return;
+    }
+    if (delta >= TIMER_SPAN) {
+        /* out of reach: park it in the last level until it comes down */
+        delta = TIMER_SPAN - 1;
+        t = timer_clock + delta;
+    }
+    for (level = 0; delta >> (TIMER_BITS * (level + 1)); level++)
+        continue;
+    ti->level = level;
+    ti->slot = (t >> (TIMER_BITS * level)) & TIMER_MASK;
+    head = &timer_wheel[level][ti->slot];
+    if (!(timer_used[level] & TIMER_BIT(ti->slot))) {
+        timer_used[level] |= TIMER_BIT(ti->slot);
+        head->next = head->prev = head;
+    }
+    list_add_tail(ti, head);
+}
+
+static void timer_unlink(QETimer *ti)
+{
+    list_del(ti);
+    if (ti->level >= 0 && list_empty(&timer_wheel[ti->level][ti->slot]))
+        timer_used[ti->level] &= ~TIMER_BIT(ti->slot);
+}
+
+/* append the timers of a slot to list and empty the slot */
+static void timer_take_slot(int level, int slot, struct list_head *list)
+{
+    struct list_head *head = &timer_wheel[level][slot];
+    QETimer *ti;
+
+    list_for_each(ti, head) {
+        ti->level = -1;
+    }
+    head->next->prev = list->prev;
+    list->prev->next = head->next;
+    head->prev->next = list;
+    list->prev = head->prev;
+    timer_used[level] &= ~TIMER_BIT(slot);
+}
+
+/* move the timers of the current slot of a level to the levels below */
+static void timer_cascade(int level)
+{
+    LIST_HEAD(list);
     QETimer *ti;
+    int idx = ((unsigned int)timer_clock >> (TIMER_BITS * level)) & TIMER_MASK;
+
+    if (idx == 0 && level + 1 < TIMER_LEVELS)
+        timer_cascade(level + 1);
+    if (timer_used[level] & TIMER_BIT(idx)) {
+        timer_take_slot(level, idx, &list);
+        while (!list_empty(&list)) {
+            ti = (QETimer *)list.next;
+            list_del(ti);
+            timer_insert(ti);
+        }
+    }
+}
+
+/* advance the wheel up to now and move the expired timers to list */
+static void timer_expire(int now, struct list_head *list)
+{
+    uint64_t used;
+    int level, idx, step;
+
+    while (now - timer_clock >= 0) {
+        for (level = 0; level < TIMER_LEVELS && !timer_used[level]; level++)
+            continue;
+        if (level == TIMER_LEVELS) {
+            /* the wheel is empty */
+            timer_clock = now + 1;
+            break;
+        }
+        idx = timer_clock & TIMER_MASK;
+        if (idx == 0)
+            timer_cascade(1);
+        used = timer_used[0] >> idx;
+        if (used & 1)
+            timer_take_slot(0, idx, list);
+        /* skip to the next timer of level 0 or the next cascade */
+        used >>= 1;
+        step = TIMER_SLOTS - idx;
+        if (used) {
+#ifdef __GNUC__
+            step = __builtin_ctzll(used) + 1;
+#else
+            for (step = 1; !(used & 1); step++)
+                used >>= 1;
+#endif
+        }
+        if (step > now - timer_clock + 1)
+            step = now - timer_clock + 1;
+        timer_clock += step;
+    }
+}
+
+/* round the deadline up to a multiple of the largest power of 2 within
+   slack so that unrelated timers expire at the same time */
+static int timer_round(int timeout, int slack)
+{
+    unsigned int grain = 1;
+
+    while (grain <= (unsigned int)slack / 2)
+        grain *= 2;
+    return (timeout + grain - 1) & ~(grain - 1);
+}
+
+static QETimer *qe_add_timer1(int delay, int period, int slack,
+                              void *opaque, void (*cb)(void *opaque))
+{
+    QETimer *ti;
+    int cur_time;
 
     ti = qe_mallocz(QETimer);
     if (!ti)
         return NULL;
-    ti->timeout = get_clock_ms() + delay;
+    cur_time = get_clock_ms();
+    if (timer_count == 0)
+        timer_clock = cur_time;
+    ti->timeout = timer_round(cur_time + delay, slack);
+    ti->period = period;
+    ti->slack = slack;
     ti->opaque = opaque;
     ti->cb = cb;
-    ti->next = first_timer;
-    first_timer = ti;
+    timer_insert(ti);
+    timer_count++;
     return ti;
 }
 
+/* call cb once after delay ms */
+QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque))
+{
+    return qe_add_timer1(delay, 0, 0, opaque, cb);
+}
+
+/* call cb once after delay ms, or up to slack ms later to share the
+   wakeup with other timers */
+QETimer *qe_add_timer_slack(int delay, int slack,
+                            void *opaque, void (*cb)(void *opaque))
+{
+    return qe_add_timer1(delay, 0, slack, opaque, cb);
+}
+
+/* call cb every period ms until the timer is killed */
+QETimer *qe_add_repeat_timer(int period, int slack,
+                             void *opaque, void (*cb)(void *opaque))
+{
+    if (period <= 0)
+        return NULL;
+    return qe_add_timer1(period, period, slack, opaque, cb);
+}
+
+/* Kill a pending timer and clear its handle. One shot timers are freed
+   after their callback returns: the callback must clear the handle it
+   was stored in, or store a new timer in it. */
 void qe_kill_timer(QETimer **tip)
 {
-    if (*tip) {
-        QETimer **pt;
+    QETimer *ti = *tip;
 
-        /* remove timer from list of active timers and free it */
-        for (pt = &first_timer; *pt != NULL; pt = &(*pt)->next) {
-            if (*pt == (*tip)) {
-                *pt = (*tip)->next;
-                qe_free(tip);
-                return;
-            }
-        }
-        /* timer not found, was probably alread freed */
+    if (ti) {
         *tip = NULL;
+        if (ti->flags & TIMER_RUNNING) {
+            /* freed when the callback returns */
+            ti->flags |= TIMER_KILLED;
+            return;
+        }
+        timer_unlink(ti);
+        timer_count--;
+        qe_free(&ti);
     }
 }
 
@@ -205,55 +792,104 @@ static inline void call_bottom_halves(void)
         qe__call_bottom_halves();
 }
 
-/* call timer callbacks and compute maximum next call time to
-   check_timers() */
-static inline int check_timers(int max_delay)
+/* delay until the next timer, -1 if there are no timers */
+static int timer_next_delay(void)
+{
+    QETimer *ti;
+    int level, idx, slot, timeout = 0, found = 0, delay;
+
+    if (!list_empty(&timer_due))
+        return 0;
+    if (timer_count == 0)
+        return -1;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        if (!timer_used[level])
+            continue;
+        /* the current slot may hold the timers of the next turn, so
+           look at it and at the next non empty slot. The last level
+           also holds the parked timers: look at all its slots. */
+        idx = ((unsigned int)timer_clock >> (TIMER_BITS * level)) & TIMER_MASK;
+        slot = timer_find_slot(timer_used[level], (idx + 1) & TIMER_MASK);
+        for (;;) {
+            if (timer_used[level] & TIMER_BIT(slot)) {
+                list_for_each(ti, &timer_wheel[level][slot]) {
+                    if (!found || ti->timeout - timeout < 0) {
+                        timeout = ti->timeout;
+                        found = 1;
+                    }
+                }
+            }
+            if (slot == idx)
+                break;
+            if (level == TIMER_LEVELS - 1)
+                slot = (slot + 1) & TIMER_MASK;
+            else
+                slot = idx;
+        }
+    }
+    delay = timeout - get_clock_ms();
+    return delay < 0 ? 0 : delay;
+}
+
+/* call timer callbacks and compute the delay until the next timer,
+   -1 if there are no timers */
+static int check_timers(void)
 {
-    QETimer *ti, **pt;
-    int timeout, cur_time;
+    LIST_HEAD(expired);
+    QETimer *ti;
+    int cur_time;
 
+    if (timer_count == 0)
+        return -1;
     cur_time = get_clock_ms();
-    timeout = cur_time + max_delay;
-    pt = &first_timer;
-    for (;;) {
-        ti = *pt;
-        if (ti == NULL)
-            break;
-        if ((ti->timeout - cur_time) <= 0) {
-            /* timer expired : suppress it from timer list and call callback */
-            *pt = ti->next;
-            /* warning: a new timer can be added in the callback */
-            ti->cb(ti->opaque);
-            qe_free(&ti);
-            call_bottom_halves();
+    /* timers added by the previous callbacks run first */
+    while (!list_empty(&timer_due)) {
+        ti = (QETimer *)timer_due.next;
+        list_del(ti);
+        list_add_tail(ti, &expired);
+    }
+    timer_expire(cur_time, &expired);
+    /* timers added by the callbacks wait for the next call: the main
+       loop polls the events between two calls */
+    while (!list_empty(&expired)) {
+        ti = (QETimer *)expired.next;
+        list_del(ti);
+        timer_count--;
+        ti->flags |= TIMER_RUNNING;
+        ti->cb(ti->opaque);
+        ti->flags &= ~TIMER_RUNNING;
+        if (ti->period && !(ti->flags & TIMER_KILLED)) {
+            /* skip the periods missed while busy */
+            ti->timeout += ti->period;
+            if (ti->timeout - cur_time <= 0)
+                ti->timeout = cur_time + ti->period;
+            ti->timeout = timer_round(ti->timeout, ti->slack);
+            timer_insert(ti);
+            timer_count++;
         } else {
-            if ((ti->timeout - timeout) < 0)
-                timeout = ti->timeout;
-            pt = &ti->next;
+            qe_free(&ti);
         }
+        call_bottom_halves();
     }
-    return timeout - cur_time;
+    return timer_next_delay();
 }
 
 static void url_block_reset(void)
 {
-    FD_ZERO(&url_rfds);
-    FD_ZERO(&url_wfds);
-    url_fdmax = -1;
+    if (!url_poller)
+        url_poller_init();
+#ifndef CONFIG_WIN32
+    url_wakeup_init();
+#endif
     url_exit_request = 0;
 }
 
-#define MAX_DELAY 500  /* milliseconds */
-
-/* block until one event */
+/* block until one event: without timers, the wait has no time limit */
 static void url_block(void)
 {
-    URLHandler *uh;
-    int ret, i, delay;
-    fd_set rfds, wfds;
-    struct timeval tv;
+    int delay;
 
-    delay = check_timers(MAX_DELAY);
+    delay = check_timers();
 #if 0
     {
         static int count;
@@ -261,54 +897,37 @@ static void url_block(void)
         printf("%5d: delay=%d\n", count++, delay);
     }
 #endif
-    tv.tv_sec = delay / 1000;
-    tv.tv_usec = (delay % 1000) * 1000;
-
-    rfds = url_rfds;
-    wfds = url_wfds;
-    ret = select(url_fdmax + 1, &rfds, &wfds, NULL, &tv);
-
-    /* call each handler */
-    /* extra checks on callback function pointers because a callback
-     * may unregister another callback.  This was causing crash bugs
-     * when deleting a running shell output buffer such as a buffer
-     * with a huge compressed file while it decompresses.
-     * XXX: should break from the loop if callback changed the
-     *      structures but need further investigation.
-     */
-    if (ret > 0) {
-        uh = url_handlers;
-        for (i = 0;i <= url_fdmax; i++) {
-            if (FD_ISSET(i, &rfds) && uh->read_cb) {
-                uh->read_cb(uh->read_opaque);
-                call_bottom_halves();
-            }
-            if (FD_ISSET(i, &wfds) && uh->write_cb) {
-                uh->write_cb(uh->write_opaque);
-                call_bottom_halves();
-            }
-            uh++;
-        }
-    }
+    if (url_poller)
+        url_poller->wait(delay);
 
 #ifndef CONFIG_WIN32
-    /* handle terminated children */
-    for (;;) {
+    /* handle terminated children, after the handlers have read their
+     * remaining output */
+    while (url_child_request) {
         int pid, status;
         PidHandler *ph, *ph1;
 
-        if (list_empty(&pid_handlers))
-            break;
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid <= 0)
-            break;
-        list_for_each_safe(ph, ph1, &pid_handlers) {
-            if (ph->pid == pid && ph->cb) {
-                ph->cb(ph->opaque, status);
-                call_bottom_halves();
+        url_child_request = 0;
+        for (;;) {
+            if (list_empty(&pid_handlers))
+                break;
+            pid = waitpid(-1, &status, WNOHANG);
+            if (pid <= 0)
                 break;
+            list_for_each_safe(ph, ph1, &pid_handlers) {
+                if (ph->pid == pid && ph->cb) {
+                    url_pid_close(ph);
+                    ph->cb(ph->opaque, status);
+                    call_bottom_halves();
+                    break;
+                }
             }
         }
+        /* a process reaped elsewhere would keep its descriptor ready */
+        list_for_each(ph, &pid_handlers) {
+            if (ph->ready && waitpid(ph->pid, &status, WNOHANG) < 0)
+                url_pid_close(ph);
+        }
     }
 #endif
 }
@@ -339,10 +958,19 @@ void url_exit(void)
     url_exit_request = 1;
 }
 
+/* check if the url loop is exiting: queued input should be dropped */
+int url_exit_pending(void)
+{
+    return url_exit_request;
+}
+
 /* asynchronous redisplay signal received */
 void url_redisplay(void)
 {
     url_display_request = 1;
+#ifndef CONFIG_WIN32
+    url_wakeup();
+#endif
 }
 
 int get_clock_ms(void) {
@@ -66,6 +66,8 @@ static VarDef var_table[] = {
            "Size from which files are mmapped instead of loaded in memory." )
     S_VAR( "max-load-size", max_load_size, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Maximum size for files to be loaded or mmapped into a buffer." )
+    S_VAR( "undo-limit", undo_limit, VAR_NUMBER, VAR_RW_SAVE,
+           "Maximum size in bytes of the undo information of a buffer." )
     S_VAR( "show-unicode", show_unicode, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Set to show non-ASCII characters as unicode escape sequences." )
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function